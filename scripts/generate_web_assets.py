@@ -0,0 +1,76 @@
+# Generates src/web_assets.h, the table of pre-compressed UI pages served by app_httpd.cpp.
+#
+# Every `index_<sensor>_html_gz` array in src/camera_index.h becomes one entry, keyed by
+# that sensor's <SENSOR>_PID and tagged with a content hash used as its HTTP ETag, so a
+# new page only needs to be added to camera_index.h.
+#
+# Runs before every PlatformIO build (extra_scripts in platformio.ini) and can also be run
+# by hand: python scripts/generate_web_assets.py
+import os
+import re
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO/SCons
+    PROJECT_DIR = env["PROJECT_DIR"]  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+SOURCE = os.path.join(PROJECT_DIR, "src", "camera_index.h")
+OUTPUT = os.path.join(PROJECT_DIR, "src", "web_assets.h")
+
+ARRAY_RE = re.compile(r"const\s+unsigned\s+char\s+(index_(\w+?)_html_gz)\s*\[\s*\]\s*=\s*\{([^}]*)\}", re.S)
+
+
+def fnv1a32(data):
+    h = 0x811C9DC5
+    for b in data:
+        h ^= b
+        h = (h * 0x01000193) & 0xFFFFFFFF
+    return h
+
+
+def main():
+    with open(SOURCE) as f:
+        text = f.read()
+
+    entries = []
+    for symbol, sensor, body in ARRAY_RE.findall(text):
+        data = bytes(int(tok, 16) for tok in re.findall(r"0x[0-9A-Fa-f]{1,2}", body))
+        entries.append((sensor.upper() + "_PID", symbol, len(data), fnv1a32(data)))
+
+    lines = [
+        "// Generated by scripts/generate_web_assets.py from camera_index.h. Do not edit.",
+        "#ifndef WEB_ASSETS",
+        "#define WEB_ASSETS",
+        "",
+        "// camera_index.h has no include guard, so include this after it and esp_camera.h.",
+        "",
+        "typedef struct {",
+        "  uint16_t pid;              // Sensor the page is written for.",
+        "  const unsigned char *data; // Gzip-compressed page, in flash.",
+        "  size_t len;                // Compressed length.",
+        "  const char *etag;          // Content hash of data.",
+        "} web_asset_t;",
+        "",
+        "static const web_asset_t web_assets[] = {",
+    ]
+    for pid, symbol, length, digest in entries:
+        lines.append('  {%s, %s, %d, "\\"%08x\\""},' % (pid, symbol, length, digest))
+    lines += [
+        "};",
+        "static const size_t web_assets_len = sizeof(web_assets) / sizeof(web_assets[0]);",
+        "",
+        "#endif /* web_assets.h */",
+        "",
+    ]
+    generated = "\n".join(lines)
+
+    # Only touch the file when it changes so incremental builds stay incremental.
+    current = open(OUTPUT).read() if os.path.exists(OUTPUT) else None
+    if generated != current:
+        with open(OUTPUT, "w") as f:
+            f.write(generated)
+        print("Generated %s (%d assets)" % (os.path.relpath(OUTPUT, PROJECT_DIR), len(entries)))
+
+
+main()
@@ -0,0 +1,357 @@
+#!/usr/bin/env python3
+"""Load the camera's HTTP server with many clients at once.
+
+Opens --streams concurrent MJPEG viewers on /stream and --pollers snapshot
+clients on /capture, runs them for --seconds and reports, per client and per
+kind: frame rate, latency percentiles, bytes per second and the error rate.
+Clients that are refused or dropped reconnect after a short pause, so a
+saturated server shows up as errors and lost frames rather than a stalled run.
+Errors are counted by kind, so a 503 for too many streams and a 429 from the
+per-client rate limiter show up separately.
+
+Stream latency is relative, as in stream_bench.py: each frame's arrival time
+minus its X-Timestamp, above the smallest value that client saw. Poller latency
+is the full request round trip. Pollers ask at --poll-hz each, or back to back
+with --poll-hz 0; with --etag they send If-None-Match and count 304s.
+
+Results can be kept as a baseline and later runs checked against it. A kind
+regresses when its mean fps drops, its p95 latency grows, or its error rate
+rises by more than --tolerance. The exit status is 1 on a regression.
+
+    python3 scripts/loadgen.py 192.168.1.50 --streams 3 --pollers 4 --seconds 30
+    python3 scripts/loadgen.py 127.0.0.1 --port 8080 --streams 2 --pollers 2 --save-baseline base.json
+    python3 scripts/loadgen.py 127.0.0.1 --port 8080 --streams 2 --pollers 2 --baseline base.json --json
+
+Against the host build: .pio/build/native/program --port 8080 --scene walk
+"""
+
+import argparse
+import json
+import socket
+import sys
+import threading
+import time
+
+from stream_bench import Reader, percentile
+
+RECONNECT_S = 0.5       # Pause before a refused or dropped client tries again.
+LATENCY_SLACK_MS = 2.0  # Latency changes below this are noise, whatever the tolerance.
+ERROR_SLACK = 0.01      # Likewise for the error rate.
+
+
+class Client:
+    """One load client's counters. Every field is touched only by its own thread until the run ends."""
+
+    def __init__(self, kind, index):
+        self.name = "%s-%d" % (kind, index)
+        self.kind = kind
+        self.frames = 0
+        self.latency = []
+        self.offsets = []
+        self.payload = 0
+        self.wire = 0
+        self.attempts = 0
+        self.errors = {}
+        self.status = {}
+        self.not_modified = 0
+        self.started = self.ended = None
+
+    @property
+    def seconds(self):
+        return max(self.ended - self.started, 1e-3) if self.started else 1e-3
+
+    def error(self, what):
+        self.errors[what] = self.errors.get(what, 0) + 1
+
+    def response(self, code):
+        key = str(code)
+        self.status[key] = self.status.get(key, 0) + 1
+
+    def frame(self, size):
+        self.frames += 1
+        self.payload += size
+
+    def latencies(self):
+        if self.offsets:
+            base = min(self.offsets)
+            return sorted((o - base) * 1000 for o in self.offsets)
+        return sorted(self.latency)
+
+    def summary(self):
+        seconds = self.seconds
+        errors = sum(self.errors.values())
+        lat = self.latencies()
+        out = {
+            "client": self.name,
+            "frames": self.frames,
+            "fps": round(self.frames / seconds, 2),
+            "bytes_per_s": round(self.wire / seconds),
+            "payload_bytes_per_frame": self.payload // self.frames if self.frames else 0,
+            "latency_ms_p50": round(percentile(lat, 50), 2),
+            "latency_ms_p95": round(percentile(lat, 95), 2),
+            "latency_ms_p99": round(percentile(lat, 99), 2),
+            "attempts": self.attempts,
+            "errors": dict(self.errors),
+            "error_rate": round(errors / self.attempts, 4) if self.attempts else 0,
+            "status": dict(self.status),
+        }
+        if self.kind == "capture":
+            out["not_modified"] = self.not_modified
+        return out
+
+
+def status_of(head):
+    line = head.split(b"\r\n", 1)[0].split()
+    return int(line[1]) if len(line) > 1 and line[1].isdigit() else 0
+
+
+def parse_headers(block):
+    headers = {}
+    for line in block.split(b"\r\n"):
+        if b":" in line:
+            k, v = line.split(b":", 1)
+            headers[k.strip().lower()] = v.strip()
+    return headers
+
+
+def connect(host, port, bind, path):
+    # --bind picks the source address, so clients on one host can stand in for several.
+    sock = socket.create_connection((host, port), timeout=10, source_address=(bind, 0) if bind else None)
+    if path:
+        sock.sendall(("GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" % (path, host)).encode())
+    return sock
+
+
+def classify(exc):
+    if isinstance(exc, socket.timeout):
+        return "timeout"
+    if isinstance(exc, ConnectionRefusedError):
+        return "refused"
+    if isinstance(exc, (ConnectionError, OSError)):
+        return "closed"
+    return "protocol"
+
+
+def run_stream(client, host, port, bind, query, deadline, stop):
+    while not stop.is_set() and time.monotonic() < deadline:
+        client.attempts += 1
+        sock = None
+        try:
+            sock = connect(host, port, bind, "/stream" + query)
+            sock.settimeout(5)
+            rd = Reader(sock, client)
+            head = rd.until(b"\r\n\r\n")
+            code = status_of(head)
+            client.response(code)
+            if code != 200:
+                client.error("http_%d" % code)
+                time.sleep(RECONNECT_S)
+                continue
+            while not stop.is_set() and time.monotonic() < deadline:
+                headers = parse_headers(rd.until(b"\r\n\r\n"))
+                size = int(headers[b"content-length"])
+                capture = float(headers.get(b"x-timestamp", b"0"))
+                rd.exactly(size)
+                client.frame(size)
+                client.offsets.append(time.time() - capture)
+        except (OSError, ValueError, KeyError) as exc:
+            if time.monotonic() < deadline:
+                client.error(classify(exc))
+                time.sleep(RECONNECT_S)
+        finally:
+            if sock:
+                sock.close()
+
+
+def run_poller(client, host, port, bind, hz, etag, deadline, stop):
+    period = 1.0 / hz if hz > 0 else 0
+    sock = rd = None
+    tag = None
+    next_at = time.monotonic()
+    while not stop.is_set() and time.monotonic() < deadline:
+        if period:
+            delay = next_at - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            next_at = max(next_at + period, time.monotonic() - period)
+        client.attempts += 1
+        started = time.monotonic()
+        try:
+            # One keep-alive connection per poller, as a browser or NVR would hold.
+            if sock is None:
+                sock = connect(host, port, bind, None)
+                rd = Reader(sock, client)
+            extra = "If-None-Match: %s\r\n" % tag.decode() if etag and tag else ""
+            sock.sendall(("GET /capture HTTP/1.1\r\nHost: %s\r\n%s\r\n" % (host, extra)).encode())
+            head = rd.until(b"\r\n\r\n")
+            code = status_of(head)
+            headers = parse_headers(head)
+            size = int(headers.get(b"content-length", b"0"))
+            rd.exactly(size)
+            client.response(code)
+            if code == 200:
+                client.frame(size)
+                client.latency.append((time.monotonic() - started) * 1000)
+                tag = headers.get(b"etag")
+            elif code == 304:
+                client.not_modified += 1
+                client.latency.append((time.monotonic() - started) * 1000)
+            else:
+                client.error("http_%d" % code)
+            if headers.get(b"connection", b"").lower() == b"close":
+                sock.close()
+                sock = None
+        except (OSError, ValueError) as exc:
+            if sock:
+                sock.close()
+            sock = None
+            if time.monotonic() < deadline:
+                client.error(classify(exc))
+                time.sleep(RECONNECT_S)
+    if sock:
+        sock.close()
+
+
+def timed(client, target, *args):
+    client.started = time.monotonic()
+    try:
+        target(client, *args)
+    finally:
+        client.ended = time.monotonic()
+
+
+def aggregate(clients):
+    """Totals for one kind of client. Latency percentiles are over every sample of every client."""
+    if not clients:
+        return None
+    fps = [c.frames / c.seconds for c in clients]
+    lat = sorted(v for c in clients for v in c.latencies())
+    attempts = sum(c.attempts for c in clients)
+    errors = sum(sum(c.errors.values()) for c in clients)
+    return {
+        "clients": len(clients),
+        "frames": sum(c.frames for c in clients),
+        "fps_mean": round(sum(fps) / len(fps), 2),
+        "fps_min": round(min(fps), 2),
+        "bytes_per_s": round(sum(c.wire / c.seconds for c in clients)),
+        "latency_ms_p50": round(percentile(lat, 50), 2),
+        "latency_ms_p95": round(percentile(lat, 95), 2),
+        "latency_ms_p99": round(percentile(lat, 99), 2),
+        "error_rate": round(errors / attempts, 4) if attempts else 0,
+    }
+
+
+def compare(result, baseline, tolerance):
+    """Lines describing each checked metric, and whether any of them regressed."""
+    lines = []
+    regressed = False
+    for kind, now in result["summary"].items():
+        then = baseline.get("summary", {}).get(kind)
+        if not now or not then:
+            continue
+        checks = [
+            ("fps_mean", now["fps_mean"] < then["fps_mean"] * (1 - tolerance)),
+            ("latency_ms_p95", now["latency_ms_p95"] > then["latency_ms_p95"] * (1 + tolerance) + LATENCY_SLACK_MS),
+            ("error_rate", now["error_rate"] > then["error_rate"] + max(tolerance * then["error_rate"], ERROR_SLACK)),
+        ]
+        for key, bad in checks:
+            regressed |= bad
+            lines.append("%-8s %-16s %12s %12s  %s" % (kind, key, then[key], now[key], "REGRESSED" if bad else "ok"))
+    return lines, regressed
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("host")
+    ap.add_argument("--port", type=int, default=80)
+    ap.add_argument("--bind", metavar="ADDR", help="source address for every client, e.g. 127.0.0.2 against the host build")
+    ap.add_argument("--seconds", type=float, default=20)
+    ap.add_argument("--streams", type=int, default=2, help="concurrent MJPEG viewers")
+    ap.add_argument("--pollers", type=int, default=2, help="concurrent /capture clients")
+    ap.add_argument("--poll-hz", type=float, default=5, help="requests per second per poller, 0 for back to back")
+    ap.add_argument("--etag", action="store_true", help="pollers send If-None-Match with the last ETag")
+    ap.add_argument("--ramp", type=float, default=0, help="seconds over which to stagger client start-up")
+    ap.add_argument("--no-dedup", action="store_true", help="ask streams for every frame, even when the scene is unchanged")
+    ap.add_argument("--json", action="store_true", help="print results as JSON")
+    ap.add_argument("--save-baseline", metavar="FILE", help="write the results to FILE")
+    ap.add_argument("--baseline", metavar="FILE", help="compare against results saved with --save-baseline")
+    ap.add_argument("--tolerance", type=float, default=10, help="allowed change against the baseline, in percent")
+    args = ap.parse_args()
+    query = "?dedup=0" if args.no_dedup else ""
+
+    clients = [Client("mjpeg", i) for i in range(args.streams)] + [Client("capture", i) for i in range(args.pollers)]
+    stop = threading.Event()
+    deadline = time.monotonic() + args.ramp + args.seconds
+    threads = []
+    for i, c in enumerate(clients):
+        if c.kind == "mjpeg":
+            target, extra = run_stream, (query,)
+        else:
+            target, extra = run_poller, (args.poll_hz, args.etag)
+        t = threading.Thread(target=timed, args=(c, target, args.host, args.port, args.bind) + extra + (deadline, stop), daemon=True)
+        threads.append(t)
+        if args.ramp and i:
+            time.sleep(args.ramp / len(clients))
+        t.start()
+    try:
+        for t in threads:
+            t.join(max(0, deadline - time.monotonic()) + 15)
+    except KeyboardInterrupt:
+        stop.set()
+    for c in clients:
+        if c.started and c.ended is None:
+            c.ended = time.monotonic()
+
+    result = {
+        "target": "%s:%d" % (args.host, args.port),
+        "config": {
+            "seconds": args.seconds,
+            "streams": args.streams,
+            "pollers": args.pollers,
+            "poll_hz": args.poll_hz,
+            "etag": args.etag,
+            "dedup": not args.no_dedup,
+        },
+        "summary": {
+            "mjpeg": aggregate([c for c in clients if c.kind == "mjpeg"]),
+            "capture": aggregate([c for c in clients if c.kind == "capture"]),
+        },
+        "clients": [c.summary() for c in clients],
+    }
+    result["summary"] = {k: v for k, v in result["summary"].items() if v}
+
+    if args.save_baseline:
+        with open(args.save_baseline, "w") as f:
+            json.dump(result, f, indent=2)
+
+    regressed = False
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        if baseline.get("config") != result["config"]:
+            print("warning: baseline was run with %s" % json.dumps(baseline.get("config")), file=sys.stderr)
+        lines, regressed = compare(result, baseline, args.tolerance / 100)
+        result["regressed"] = regressed
+
+    if args.json:
+        print(json.dumps(result, indent=2))
+    else:
+        keys = ["frames", "fps", "bytes_per_s", "latency_ms_p50", "latency_ms_p95", "latency_ms_p99", "error_rate"]
+        print("%-12s" % "" + "".join("%16s" % k for k in keys))
+        for c in result["clients"]:
+            print("%-12s" % c["client"] + "".join("%16s" % c[k] for k in keys))
+        for kind, s in result["summary"].items():
+            row = dict(s, fps=s["fps_mean"])
+            print("%-12s" % ("all " + kind) + "".join("%16s" % row[k] for k in keys))
+        errors = ["%s %s" % (c["client"], c["errors"]) for c in result["clients"] if c["errors"]]
+        if errors:
+            print("errors: " + "; ".join(errors))
+        if args.baseline:
+            print()
+            print("%-8s %-16s %12s %12s" % ("", "", "baseline", "now"))
+            print("\n".join(lines))
+    sys.exit(1 if regressed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+"""Compare the multipart MJPEG stream with the WebSocket stream.
+
+Connects to /stream and /ws in turn for the same duration and reports frame
+rate, inter-frame jitter, relative latency and framing overhead per frame.
+Streams hold back frames of an unchanged scene by default. Over WebSocket each
+one arrives as a header with no JPEG and is counted as "unchanged". Pass
+--no-dedup to have every frame sent.
+
+Latency is relative: the camera and host clocks are not synchronised, so each
+frame's arrival time minus its capture timestamp is reported above the
+smallest value seen in the run. It shows queueing delay, not absolute delay.
+
+    python3 scripts/stream_bench.py 192.168.1.50 --seconds 20
+    python3 scripts/stream_bench.py 192.168.1.50 --mode ws --window 4 --json
+"""
+
+import argparse
+import base64
+import json
+import os
+import socket
+import statistics
+import struct
+import time
+
+WS_FRAME_HEADER = struct.Struct("<IIII")  # seq, seconds, micros, size
+
+
+class Recorder:
+    def __init__(self, name):
+        self.name = name
+        self.start = time.monotonic()
+        self.first_frame = None
+        self.arrivals = []
+        self.offsets = []
+        self.payload = 0
+        self.wire = 0
+        self.seq_gaps = 0
+        self.last_seq = None
+        self.unchanged = 0
+
+    def frame(self, size, capture_s, seq=None):
+        now = time.monotonic()
+        if self.first_frame is None:
+            self.first_frame = now - self.start
+        self.arrivals.append(now)
+        self.offsets.append(time.time() - capture_s)
+        self.payload += size
+        if seq is not None:
+            if self.last_seq is not None and seq > self.last_seq + 1:
+                self.seq_gaps += seq - self.last_seq - 1
+            self.last_seq = seq
+
+    def summary(self):
+        n = len(self.arrivals)
+        out = {"mode": self.name, "frames": n}
+        if n < 2:
+            return out
+        span = self.arrivals[-1] - self.arrivals[0]
+        gaps = [(b - a) * 1000 for a, b in zip(self.arrivals, self.arrivals[1:])]
+        base = min(self.offsets)
+        lat = sorted((o - base) * 1000 for o in self.offsets)
+        out.update({
+            "fps": round((n - 1) / span, 2) if span else 0,
+            "first_frame_ms": round(self.first_frame * 1000, 1),
+            "interval_ms_mean": round(statistics.mean(gaps), 2),
+            "interval_ms_p95": round(percentile(sorted(gaps), 95), 2),
+            "jitter_ms": round(statistics.pstdev(gaps), 2),
+            "latency_ms_p50": round(percentile(lat, 50), 2),
+            "latency_ms_p95": round(percentile(lat, 95), 2),
+            "payload_bytes_per_frame": self.payload // n,
+            "overhead_bytes_per_frame": round((self.wire - self.payload) / n, 1),
+            "seq_gaps": self.seq_gaps,
+            "unchanged": self.unchanged,
+        })
+        return out
+
+
+def percentile(values, pct):
+    if not values:
+        return 0
+    k = (len(values) - 1) * pct / 100
+    lo = int(k)
+    hi = min(lo + 1, len(values) - 1)
+    return values[lo] + (values[hi] - values[lo]) * (k - lo)
+
+
+class Reader:
+    """Buffered socket reader that counts every byte taken off the wire."""
+
+    def __init__(self, sock, recorder):
+        self.sock = sock
+        self.rec = recorder
+        self.buf = b""
+
+    def _fill(self):
+        data = self.sock.recv(65536)
+        if not data:
+            raise ConnectionError("connection closed")
+        self.rec.wire += len(data)
+        self.buf += data
+
+    def exactly(self, n):
+        while len(self.buf) < n:
+            self._fill()
+        out, self.buf = self.buf[:n], self.buf[n:]
+        return out
+
+    def until(self, marker):
+        while marker not in self.buf:
+            self._fill()
+        i = self.buf.index(marker) + len(marker)
+        out, self.buf = self.buf[:i], self.buf[i:]
+        return out
+
+
+def http_head(host, port, path, extra=""):
+    sock = socket.create_connection((host, port), timeout=10)
+    sock.sendall(("GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n" % (path, host, extra)).encode())
+    return sock
+
+
+def bench_mjpeg(host, port, seconds, query):
+    rec = Recorder("mjpeg")
+    sock = http_head(host, port, "/stream" + query)
+    rd = Reader(sock, rec)
+    head = rd.until(b"\r\n\r\n")
+    if b" 200 " not in head.split(b"\r\n", 1)[0]:
+        raise RuntimeError("unexpected response: %r" % head.split(b"\r\n", 1)[0])
+    rec.wire -= len(head)
+
+    deadline = time.monotonic() + seconds
+    while time.monotonic() < deadline:
+        part = rd.until(b"\r\n\r\n")
+        headers = {}
+        for line in part.split(b"\r\n"):
+            if b":" in line:
+                k, v = line.split(b":", 1)
+                headers[k.strip().lower()] = v.strip()
+        size = int(headers[b"content-length"])
+        capture = float(headers.get(b"x-timestamp", b"0"))
+        rd.exactly(size)
+        rec.frame(size, capture)
+    sock.close()
+    return rec.summary()
+
+
+def ws_send(sock, opcode, payload):
+    # Client frames must be masked.
+    mask = os.urandom(4)
+    head = bytes([0x80 | opcode])
+    n = len(payload)
+    if n < 126:
+        head += bytes([0x80 | n])
+    else:
+        head += bytes([0x80 | 126]) + struct.pack(">H", n)
+    masked = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+    sock.sendall(head + mask + masked)
+
+
+def bench_ws(host, port, seconds, window, query):
+    rec = Recorder("ws")
+    key = base64.b64encode(os.urandom(16)).decode()
+    sock = http_head(host, port, "/ws" + query,
+                     "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                     "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n" % key)
+    rd = Reader(sock, rec)
+    head = rd.until(b"\r\n\r\n")
+    if b" 101 " not in head.split(b"\r\n", 1)[0]:
+        raise RuntimeError("unexpected response: %r" % head.split(b"\r\n", 1)[0])
+    rec.wire -= len(head)
+
+    # The camera grants two frames up front. Top the window up, then return one credit per frame.
+    if window > 2:
+        ws_send(sock, 0x1, str(window - 2).encode())
+
+    deadline = time.monotonic() + seconds
+    while time.monotonic() < deadline:
+        b0, b1 = rd.exactly(2)
+        n = b1 & 0x7F
+        if n == 126:
+            n = struct.unpack(">H", rd.exactly(2))[0]
+        elif n == 127:
+            n = struct.unpack(">Q", rd.exactly(8))[0]
+        payload = rd.exactly(n)
+        opcode = b0 & 0x0F
+        if opcode == 0x8:
+            break
+        if opcode != 0x2:
+            continue
+        seq, sec, usec, size = WS_FRAME_HEADER.unpack_from(payload)
+        if size:
+            rec.frame(size, sec + usec / 1e6, seq)
+        else:
+            rec.unchanged += 1
+        ws_send(sock, 0x2, struct.pack("<I", 1))
+    ws_send(sock, 0x8, b"")
+    sock.close()
+    return rec.summary()
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("host")
+    ap.add_argument("--port", type=int, default=80)
+    ap.add_argument("--seconds", type=float, default=10)
+    ap.add_argument("--mode", choices=["both", "mjpeg", "ws"], default="both")
+    ap.add_argument("--window", type=int, default=2, help="WebSocket credits kept outstanding")
+    ap.add_argument("--no-dedup", action="store_true", help="ask for every frame, even when the scene is unchanged")
+    ap.add_argument("--json", action="store_true", help="print results as JSON")
+    args = ap.parse_args()
+    query = "?dedup=0" if args.no_dedup else ""
+
+    results = []
+    if args.mode in ("both", "mjpeg"):
+        results.append(bench_mjpeg(args.host, args.port, args.seconds, query))
+    if args.mode in ("both", "ws"):
+        results.append(bench_ws(args.host, args.port, args.seconds, args.window, query))
+
+    if args.json:
+        print(json.dumps(results, indent=2))
+        return
+    keys = [k for k in results[0] if k != "mode"]
+    print("%-26s" % "" + "".join("%14s" % r["mode"] for r in results))
+    for k in keys:
+        print("%-26s" % k + "".join("%14s" % r.get(k, "-") for r in results))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,214 @@
+// Run the frame buffer tuner sweep on a host against a simulated OV2640 and ESP32 camera driver.
+//
+// The sweep, the selection and the result store are the ones in src/TunerSweep.cpp. Only the
+// measurement is simulated: a sensor producing frames at a rate set by its clock and output window,
+// a driver with fb_count buffers and either grab mode, DMA overruns when the clock outpaces PSRAM
+// writes, and a capture task that copies each frame out and now and then stalls behind WiFi.
+//
+//     g++ -std=c++17 -O2 -Isrc scripts/tuner_sim.cpp src/TunerSweep.cpp -o tuner_sim
+//     ./tuner_sim                       # CIF, the default frame size
+//     ./tuner_sim 5 6 8 9 --store tuner.bin --all
+//
+// Frame sizes are framesize_t values: 5 QVGA, 6 CIF, 7 HVGA, 8 VGA, 9 SVGA, 10 XGA, 11 HD, 12 SXGA, 13 UXGA.
+
+#include "TunerSweep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <random>
+
+struct SensorMode {
+    uint16_t width;
+    uint16_t height;
+    float fpsAt24Mhz;               // The OV2640 reads out a CIF, SVGA or UXGA window and scales from it.
+};
+
+static const SensorMode MODES[] = {
+    { 96, 96, 50 }, { 160, 120, 50 }, { 176, 144, 50 }, { 240, 176, 50 }, { 240, 240, 50 },
+    { 320, 240, 50 }, { 400, 296, 50 }, { 480, 320, 25 }, { 640, 480, 25 }, { 800, 600, 25 },
+    { 1024, 768, 12.5f }, { 1280, 720, 12.5f }, { 1280, 1024, 12.5f }, { 1600, 1200, 12.5f },
+};
+
+// Board model.
+static const uint32_t INTERNAL_HEAP = 210000;       // Free internal heap before the driver starts.
+static const uint32_t DMA_RESERVE = 16384;          // Line buffers the driver always takes from internal RAM.
+static const uint32_t LARGEST_BLOCK = 110000;       // Largest internal block, which caps a DRAM frame buffer.
+static const uint32_t PSRAM_HEAP = 4128768;
+static const float JPEG_BYTES_PER_PIXEL = 0.15f;
+static const float COPY_BYTES_PER_US = 12.0f;       // PSRAM to PSRAM memcpy.
+static const float STALL_CHANCE = 0.08f;            // Chance the capture task is held up after a frame.
+static const float STALL_MIN_US = 20000;
+static const float STALL_MAX_US = 80000;
+
+struct Filled {
+    double startUs;                 // Readout of the frame began.
+    double endUs;
+    uint32_t len;
+};
+
+static bool simulate(void *ctx, const TunerConfig &config, uint8_t frameSize, TunerResult *result) {
+    if(frameSize >= sizeof(MODES) / sizeof(MODES[0])) return false;
+    const SensorMode &mode = MODES[frameSize];
+
+    // The driver sizes JPEG buffers at a fifth of the raw frame.
+    uint32_t fbSize = (uint32_t)mode.width * mode.height / 5;
+    uint32_t dram = config.fbInPsram ? 0 : fbSize * config.fbCount;
+    if(!config.fbInPsram && (fbSize > LARGEST_BLOCK || dram + DMA_RESERVE > INTERNAL_HEAP)) return false;
+    result->heapFree = INTERNAL_HEAP - DMA_RESERVE - dram;
+    result->psramFree = PSRAM_HEAP - (config.fbInPsram ? fbSize * config.fbCount : 0);
+
+    // Writes to PSRAM fall behind the DMA above 20 MHz and the frame is lost. DRAM keeps up.
+    float overrun = (config.xclkMhz > 20) ? (config.xclkMhz - 20) * (config.fbInPsram ? 0.06f : 0.005f) : 0;
+    double periodUs = 1e6 / (mode.fpsAt24Mhz * config.xclkMhz / 24.0f);
+    double jpegMean = mode.width * mode.height * JPEG_BYTES_PER_PIXEL;
+
+    std::mt19937 rng(frameSize * 7919 + config.fbCount * 131 + config.grabLatest * 17 + config.fbInPsram * 5 + config.xclkMhz);
+    std::uniform_real_distribution<float> unit(0, 1);
+
+    uint8_t freeBuffers = config.fbCount;
+    std::deque<Filled> queue;
+    bool holding = false;
+    double doneUs = 0;
+    double consumerUs = 0;
+    double warmupUs = TUNER_WARMUP_FRAMES * periodUs;
+    double stopUs = warmupUs + TUNER_MEASURE_US;
+    uint16_t samples[TUNER_MAX_SAMPLES];
+    uint16_t sampleCount = 0;
+    uint32_t frames = 0;
+
+    // Let the capture task take and give back frames up to a point in time.
+    auto advance = [&](double untilUs) {
+        for(;;) {
+            if(holding && doneUs <= untilUs) {
+                holding = false;
+                freeBuffers++;
+                consumerUs = doneUs;
+            }
+            if(holding || queue.empty()) return;
+            double readyUs = queue.front().endUs;
+            double getUs = (consumerUs > readyUs) ? consumerUs : readyUs;
+            if(getUs > untilUs) return;
+
+            Filled frame = queue.front();
+            queue.pop_front();
+            holding = true;
+            double holdUs = 1000 + frame.len / COPY_BYTES_PER_US;
+            if(unit(rng) < STALL_CHANCE) holdUs += STALL_MIN_US + unit(rng) * (STALL_MAX_US - STALL_MIN_US);
+            doneUs = getUs + holdUs;
+            if(getUs >= warmupUs && getUs < stopUs) {
+                frames++;
+                // A frame's age counts from the start of its readout, as the driver's timestamp does, not from when
+                // the last line landed. Otherwise a capture task that keeps up sees every frame at 0 ms.
+                if(sampleCount < TUNER_MAX_SAMPLES) samples[sampleCount++] = (uint16_t)((getUs - frame.startUs) / 1000);
+            }
+        }
+    };
+
+    for(uint32_t k = 0; k * periodUs < stopUs; k++) {
+        double startUs = k * periodUs;
+        double endUs = startUs + periodUs;
+        advance(startUs);
+
+        // A frame only starts into a free buffer. In latest mode a waiting frame is given up for it.
+        if(freeBuffers == 0 && config.grabLatest && config.fbCount > 1 && !queue.empty()) {
+            queue.pop_front();
+            freeBuffers++;
+        }
+        if(freeBuffers == 0) continue;
+        freeBuffers--;
+
+        advance(endUs);
+        if(unit(rng) < overrun) {
+            freeBuffers++;
+            continue;
+        }
+        uint32_t len = (uint32_t)(jpegMean * (0.85f + 0.3f * unit(rng)));
+        // Latest mode keeps only the newest finished frame waiting.
+        if(config.grabLatest) {
+            while(!queue.empty()) {
+                queue.pop_front();
+                freeBuffers++;
+            }
+        }
+        queue.push_back({ startUs, endUs, len });
+    }
+
+    result->frames = frames;
+    result->fpsX10 = (uint16_t)((uint64_t)frames * 10000000 / TUNER_MEASURE_US);
+    result->latencyP50Ms = tuner_percentile(samples, sampleCount, 50);
+    result->latencyP95Ms = tuner_percentile(samples, sampleCount, 95);
+    (void)ctx;
+    return true;
+}
+
+static void print_result(const TunerResult *r) {
+    printf("  size %2u  fb %u  %-10s  %-5s  %2u MHz  %5.1f fps  p50 %3u ms  p95 %3u ms  heap %6u  %s\n",
+        r->frameSize, r->config.fbCount, r->config.grabLatest ? "latest" : "when_empty", r->config.fbInPsram ? "psram" : "dram",
+        r->config.xclkMhz, r->fpsX10 / 10.0, r->latencyP50Ms, r->latencyP95Ms, (unsigned)r->heapFree, r->valid ? "" : "(did not start)");
+}
+
+int main(int argc, char **argv) {
+    uint8_t sizes[TUNER_MAX_FRAME_SIZES];
+    uint8_t count = 0;
+    const char *storePath = NULL;
+    bool all = false;
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--store") && i + 1 < argc) storePath = argv[++i];
+        else if(!strcmp(argv[i], "--all")) all = true;
+        else if(count < TUNER_MAX_FRAME_SIZES) sizes[count++] = atoi(argv[i]);
+    }
+    if(count == 0) sizes[count++] = 6;
+
+    // Starts from what the firmware ships with, and sweeps one frame size at a time like repeated POST /tune calls.
+    const TunerConfig start = { 3, true, true, 24 };
+    static TunerResult results[TUNER_MAX_FRAME_SIZES * TUNER_MAX_CANDIDATES];
+    size_t n = 0;
+    for(uint8_t s = 0; s < count; s++) {
+        n += tuner_sweep(&sizes[s], 1, start, simulate, NULL, results + n, TUNER_MAX_CANDIDATES);
+    }
+
+    TunerStore store;
+    for(uint8_t s = 0; s < count; s++) {
+        printf("frame size %u:\n", sizes[s]);
+        if(all) {
+            for(size_t i = 0; i < n; i++) {
+                if(results[i].frameSize == sizes[s]) print_result(&results[i]);
+            }
+        }
+        // What the firmware ships with today, for comparison.
+        for(size_t i = 0; i < n; i++) {
+            const TunerResult *r = &results[i];
+            if(r->frameSize == sizes[s] && r->config.fbCount == 3 && r->config.grabLatest && r->config.fbInPsram && r->config.xclkMhz == 24) {
+                printf(" default:\n");
+                print_result(r);
+            }
+        }
+        const TunerResult *best = tuner_best(results, n, sizes[s]);
+        printf(" best:\n");
+        if(best) {
+            print_result(best);
+            store.set(*best);
+        }
+        else printf("  nothing usable\n");
+    }
+
+    // The blob the firmware keeps in NVS, checked by reading it back.
+    uint8_t blob[TUNER_STORE_BYTES];
+    size_t len = store.pack(blob, sizeof(blob));
+    TunerStore reloaded;
+    if(!reloaded.unpack(blob, len) || reloaded.getCount() != store.getCount()) {
+        fprintf(stderr, "store round trip failed\n");
+        return 1;
+    }
+    printf("store: %zu bytes, %u frame sizes\n", len, reloaded.getCount());
+    if(storePath) {
+        FILE *f = fopen(storePath, "wb");
+        if(!f || fwrite(blob, 1, len, f) != len) {
+            fprintf(stderr, "could not write %s\n", storePath);
+            return 1;
+        }
+        fclose(f);
+    }
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef SIM
+#define SIM
+
+// Settings shared between the simulator's parts. SimMain.cpp fills them in from the command line.
+#include <stdint.h>
+
+extern uint16_t sim_httpd_port;     // Used by httpd_start() instead of the configured port, if not 0.
+
+// Keep NVS in this file: load it now and write it back on every change.
+bool sim_nvs_open(const char *path);
+// What ESP.restart() executes again.
+void sim_set_restart_args(char **argv);
+
+#endif /* Sim.h */
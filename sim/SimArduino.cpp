@@ -0,0 +1,168 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include "esp_heap_caps.h"
+#include "Sim.h"
+#include <stdarg.h>
+#include <unistd.h>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+
+const uint32_t SIM_CPU_FREQ_MHZ = 240;
+const uint8_t SIM_LEDC_PINS = 40;
+
+// Define the core's globals.
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+static char **restart_argv = NULL;
+static uint32_t ledc_duty[SIM_LEDC_PINS];
+static std::mutex output_lock;
+
+int64_t esp_timer_get_time() {
+    static const std::chrono::steady_clock::time_point boot = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+unsigned long millis() { return esp_timer_get_time() / 1000; }
+
+unsigned long micros() { return esp_timer_get_time(); }
+
+void delay(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+void digitalWrite(uint8_t pin, uint8_t val) {}
+
+int digitalRead(uint8_t pin) { return LOW; }
+
+uint32_t esp_random() {
+    static std::mutex lock;
+    static std::mt19937 rng(std::random_device{}());
+    std::lock_guard<std::mutex> guard(lock);
+    return rng();
+}
+
+char *itoa(int value, char *result, int base) {
+    if(base < 2 || base > 36) {
+        *result = 0;
+        return result;
+    }
+    char *p = result;
+    unsigned int v = (value < 0 && base == 10) ? -(unsigned int)value : (unsigned int)value;
+    do {
+        *p++ = "0123456789abcdefghijklmnopqrstuvwxyz"[v % base];
+        v /= base;
+    } while(v);
+    if(value < 0 && base == 10) *p++ = '-';
+    *p = 0;
+    std::reverse(result, p);
+    return result;
+}
+
+int log_printf(const char *format, ...) {
+    std::lock_guard<std::mutex> lock(output_lock);
+    va_list args;
+    va_start(args, format);
+    int n = vfprintf(stderr, format, args);
+    va_end(args);
+    return n;
+}
+
+const char *pathToFileName(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+bool ledcAttach(uint8_t pin, uint32_t freq, uint8_t resolution) { return pin < SIM_LEDC_PINS; }
+
+bool ledcWrite(uint8_t pin, uint32_t duty) {
+    if(pin >= SIM_LEDC_PINS) return false;
+    ledc_duty[pin] = duty;
+    return true;
+}
+
+uint32_t ledcRead(uint8_t pin) { return (pin < SIM_LEDC_PINS) ? ledc_duty[pin] : 0; }
+
+void HardwareSerial::begin(unsigned long baud) {}
+
+size_t HardwareSerial::printf(const char *format, ...) {
+    std::lock_guard<std::mutex> lock(output_lock);
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    fflush(stdout);
+    return (n > 0) ? n : 0;
+}
+
+size_t HardwareSerial::print(const char *str) { return printf("%s", str); }
+
+size_t HardwareSerial::print(const String &str) { return printf("%s", str.c_str()); }
+
+size_t HardwareSerial::print(long value) { return printf("%ld", value); }
+
+size_t HardwareSerial::println(const char *str) { return printf("%s\n", str); }
+
+size_t HardwareSerial::println(const String &str) { return printf("%s\n", str.c_str()); }
+
+size_t HardwareSerial::println(long value) { return printf("%ld\n", value); }
+
+void sim_set_restart_args(char **argv) { restart_argv = argv; }
+
+void EspClass::restart() {
+    // NVS is already on disk, so starting over from main() is as close to a reboot as it gets.
+    Serial.println("Restarting.");
+    if(restart_argv) execv("/proc/self/exe", restart_argv);
+    log_e("Restart failed, exiting instead.");
+    exit(1);
+}
+
+uint32_t EspClass::getHeapSize() { return heap_caps_get_total_size(MALLOC_CAP_INTERNAL); }
+
+uint32_t EspClass::getFreeHeap() { return heap_caps_get_free_size(MALLOC_CAP_INTERNAL); }
+
+uint32_t EspClass::getMinFreeHeap() { return heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL); }
+
+uint32_t EspClass::getMaxAllocHeap() { return heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL); }
+
+uint32_t EspClass::getPsramSize() { return heap_caps_get_total_size(MALLOC_CAP_SPIRAM); }
+
+uint32_t EspClass::getFreePsram() { return heap_caps_get_free_size(MALLOC_CAP_SPIRAM); }
+
+uint32_t EspClass::getMinFreePsram() { return heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM); }
+
+uint32_t EspClass::getMaxAllocPsram() { return heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM); }
+
+uint32_t EspClass::getCycleCount() {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    return (uint32_t)(ns * SIM_CPU_FREQ_MHZ / 1000);
+}
+
+uint32_t EspClass::getCpuFreqMHz() { return SIM_CPU_FREQ_MHZ; }
+
+String IPAddress::toString() const {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+    return String(buf);
+}
+
+bool WiFiClass::mode(int m) {
+    wifiMode = m;
+    return true;
+}
+
+int WiFiClass::getMode() { return wifiMode; }
+
+int WiFiClass::begin(const String &ssid, const String &password) {
+    started = true;
+    return WL_CONNECTED;
+}
+
+bool WiFiClass::setSleep(bool enabled) { return true; }
+
+int WiFiClass::status() { return started ? WL_CONNECTED : WL_IDLE_STATUS; }
+
+IPAddress WiFiClass::localIP() { return started ? IPAddress(127, 0, 0, 1) : IPAddress(); }
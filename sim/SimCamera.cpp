@@ -0,0 +1,534 @@
+#include "SimCamera.h"
+#include "SimJpeg.h"
+#include <Arduino.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include <dirent.h>
+#include <algorithm>
+#include <map>
+#include <string>
+
+// Define the simulated camera.
+SimCamera sim_camera;
+
+const resolution_info_t resolution[FRAMESIZE_INVALID] = {
+    {   96,   96, ASPECT_RATIO_1X1   },
+    {  160,  120, ASPECT_RATIO_4X3   },
+    {  176,  144, ASPECT_RATIO_5X4   },
+    {  240,  176, ASPECT_RATIO_3X2   },
+    {  240,  240, ASPECT_RATIO_1X1   },
+    {  320,  240, ASPECT_RATIO_4X3   },
+    {  400,  296, ASPECT_RATIO_4X3   },
+    {  480,  320, ASPECT_RATIO_3X2   },
+    {  640,  480, ASPECT_RATIO_4X3   },
+    {  800,  600, ASPECT_RATIO_4X3   },
+    { 1024,  768, ASPECT_RATIO_4X3   },
+    { 1280,  720, ASPECT_RATIO_16X9  },
+    { 1280, 1024, ASPECT_RATIO_5X4   },
+    { 1600, 1200, ASPECT_RATIO_4X3   },
+};
+
+const uint32_t WALK_PERIOD_MS = 4000;       // Time the walking block takes to cross the frame.
+
+// Guards the sensor's status and registers against the frame producer reading them mid-change.
+static std::mutex sensor_lock;
+static std::map<int, int> sensor_regs;
+
+static int sensor_store(uint8_t *field, int value, int lo, int hi) {
+    if(value < lo || value > hi) return -1;
+    std::lock_guard<std::mutex> lock(sensor_lock);
+    *field = value;
+    return 0;
+}
+
+static int sensor_store(int8_t *field, int value, int lo, int hi) {
+    if(value < lo || value > hi) return -1;
+    std::lock_guard<std::mutex> lock(sensor_lock);
+    *field = value;
+    return 0;
+}
+
+static int sensor_init_status(sensor_t *s) {
+    std::lock_guard<std::mutex> lock(sensor_lock);
+    framesize_t framesize = s->status.framesize;
+    uint8_t quality = s->status.quality;
+    memset(&s->status, 0, sizeof(s->status));
+    s->status.framesize = framesize;
+    s->status.quality = quality;
+    s->status.awb = 1;
+    s->status.awb_gain = 1;
+    s->status.aec = 1;
+    s->status.agc = 1;
+    s->status.aec_value = 300;
+    s->status.bpc = 0;
+    s->status.wpc = 1;
+    s->status.raw_gma = 1;
+    s->status.lenc = 1;
+    s->status.dcw = 1;
+    return 0;
+}
+
+static int sensor_reset(sensor_t *s) {
+    {
+        std::lock_guard<std::mutex> lock(sensor_lock);
+        sensor_regs.clear();
+    }
+    return sensor_init_status(s);
+}
+
+static int sensor_set_pixformat(sensor_t *s, pixformat_t pixformat) {
+    if(pixformat != PIXFORMAT_JPEG && sim_raw_bytes_per_pixel(pixformat) == 0) return -1;
+    std::lock_guard<std::mutex> lock(sensor_lock);
+    s->pixformat = pixformat;
+    return 0;
+}
+
+static int sensor_set_framesize(sensor_t *s, framesize_t framesize) {
+    if(framesize >= FRAMESIZE_INVALID) return -1;
+    std::lock_guard<std::mutex> lock(sensor_lock);
+    s->status.framesize = framesize;
+    return 0;
+}
+
+static int sensor_set_quality(sensor_t *s, int quality) { return sensor_store(&s->status.quality, quality, 0, 63); }
+static int sensor_set_contrast(sensor_t *s, int level) { return sensor_store(&s->status.contrast, level, -2, 2); }
+static int sensor_set_brightness(sensor_t *s, int level) { return sensor_store(&s->status.brightness, level, -2, 2); }
+static int sensor_set_saturation(sensor_t *s, int level) { return sensor_store(&s->status.saturation, level, -2, 2); }
+static int sensor_set_sharpness(sensor_t *s, int level) { return sensor_store(&s->status.sharpness, level, -2, 2); }
+static int sensor_set_denoise(sensor_t *s, int level) { return sensor_store(&s->status.denoise, level, 0, 8); }
+static int sensor_set_gainceiling(sensor_t *s, gainceiling_t gain) { return sensor_store(&s->status.gainceiling, gain, 0, GAINCEILING_128X); }
+static int sensor_set_colorbar(sensor_t *s, int enable) { return sensor_store(&s->status.colorbar, enable != 0, 0, 1); }
+static int sensor_set_whitebal(sensor_t *s, int enable) { return sensor_store(&s->status.awb, enable != 0, 0, 1); }
+static int sensor_set_gain_ctrl(sensor_t *s, int enable) { return sensor_store(&s->status.agc, enable != 0, 0, 1); }
+static int sensor_set_exposure_ctrl(sensor_t *s, int enable) { return sensor_store(&s->status.aec, enable != 0, 0, 1); }
+static int sensor_set_hmirror(sensor_t *s, int enable) { return sensor_store(&s->status.hmirror, enable != 0, 0, 1); }
+static int sensor_set_vflip(sensor_t *s, int enable) { return sensor_store(&s->status.vflip, enable != 0, 0, 1); }
+static int sensor_set_aec2(sensor_t *s, int enable) { return sensor_store(&s->status.aec2, enable != 0, 0, 1); }
+static int sensor_set_awb_gain(sensor_t *s, int enable) { return sensor_store(&s->status.awb_gain, enable != 0, 0, 1); }
+static int sensor_set_agc_gain(sensor_t *s, int gain) { return sensor_store(&s->status.agc_gain, gain, 0, 30); }
+static int sensor_set_special_effect(sensor_t *s, int effect) { return sensor_store(&s->status.special_effect, effect, 0, 6); }
+static int sensor_set_wb_mode(sensor_t *s, int mode) { return sensor_store(&s->status.wb_mode, mode, 0, 4); }
+static int sensor_set_ae_level(sensor_t *s, int level) { return sensor_store(&s->status.ae_level, level, -2, 2); }
+static int sensor_set_dcw(sensor_t *s, int enable) { return sensor_store(&s->status.dcw, enable != 0, 0, 1); }
+static int sensor_set_bpc(sensor_t *s, int enable) { return sensor_store(&s->status.bpc, enable != 0, 0, 1); }
+static int sensor_set_wpc(sensor_t *s, int enable) { return sensor_store(&s->status.wpc, enable != 0, 0, 1); }
+static int sensor_set_raw_gma(sensor_t *s, int enable) { return sensor_store(&s->status.raw_gma, enable != 0, 0, 1); }
+static int sensor_set_lenc(sensor_t *s, int enable) { return sensor_store(&s->status.lenc, enable != 0, 0, 1); }
+
+static int sensor_set_aec_value(sensor_t *s, int value) {
+    if(value < 0 || value > 1200) return -1;
+    std::lock_guard<std::mutex> lock(sensor_lock);
+    s->status.aec_value = value;
+    return 0;
+}
+
+// Registers read back what was written, and 0 before that.
+static int sensor_get_reg(sensor_t *s, int reg, int mask) {
+    std::lock_guard<std::mutex> lock(sensor_lock);
+    auto it = sensor_regs.find(reg);
+    return (it != sensor_regs.end()) ? (it->second & mask) : 0;
+}
+
+static int sensor_set_reg(sensor_t *s, int reg, int mask, int value) {
+    std::lock_guard<std::mutex> lock(sensor_lock);
+    int &current = sensor_regs[reg];
+    current = (current & ~mask) | (value & mask);
+    return 0;
+}
+
+static int sensor_set_res_raw(sensor_t *s, int startX, int startY, int endX, int endY, int offsetX, int offsetY,
+    int totalX, int totalY, int outputX, int outputY, bool scale, bool binning) {
+    return 0;
+}
+
+static int sensor_set_pll(sensor_t *s, int bypass, int mul, int sys, int root, int pre, int seld5, int pclken, int pclk) { return 0; }
+
+// The frame rate follows XCLK, so this is how a slower clock shows up.
+static int sensor_set_xclk(sensor_t *s, int timer, int xclk) {
+    if(xclk <= 0 || xclk > 48) return -1;
+    std::lock_guard<std::mutex> lock(sensor_lock);
+    s->xclk_freq_hz = xclk * 1000000;
+    return 0;
+}
+
+static bool has_jpeg_extension(const std::string &name) {
+    size_t dot = name.rfind('.');
+    if(dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for(char &c : ext) c = tolower(c);
+    return ext == "jpg" || ext == "jpeg";
+}
+
+bool SimCamera::loadFrames(const char *dir) {
+    DIR *d = opendir(dir);
+    if(d == NULL) {
+        log_e("Cannot open frames directory %s", dir);
+        return false;
+    }
+    std::vector<std::string> names;
+    for(struct dirent *entry; (entry = readdir(d)) != NULL;) {
+        if(has_jpeg_extension(entry->d_name)) names.push_back(entry->d_name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+
+    // Decode everything now so producing a frame costs the same whatever the source.
+    images.clear();
+    for(const std::string &name : names) {
+        std::string path = std::string(dir) + "/" + name;
+        FILE *f = fopen(path.c_str(), "rb");
+        if(f == NULL) continue;
+        std::vector<uint8_t> jpg;
+        uint8_t chunk[4096];
+        for(size_t n; (n = fread(chunk, 1, sizeof(chunk), f)) > 0;) jpg.insert(jpg.end(), chunk, chunk + n);
+        fclose(f);
+
+        SimImage image;
+        if(sim_jpeg_decode(jpg.data(), jpg.size(), &image.rgb, &image.width, &image.height)) images.push_back(std::move(image));
+        else log_w("Skipping %s, not a JPEG libjpeg can read.", path.c_str());
+    }
+    log_i("Loaded %lu frames from %s", (unsigned long)images.size(), dir);
+    return !images.empty();
+}
+
+void SimCamera::setScene(sim_scene_t scene, uint8_t noise) {
+    images.clear();
+    this->scene = scene;
+    this->noise = noise;
+}
+
+void SimCamera::setFrameRate(float fps, uint16_t jitterMs) {
+    this->fps = fps;
+    this->jitterMs = jitterMs;
+}
+
+void SimCamera::setSensorPid(uint16_t pid) { this->pid = pid; }
+
+esp_err_t SimCamera::init(const camera_config_t *config) {
+    if(running) return ESP_ERR_INVALID_STATE;
+    if(config->frame_size >= FRAMESIZE_INVALID || config->fb_count == 0) return ESP_ERR_INVALID_ARG;
+    if(config->pixel_format != PIXFORMAT_JPEG && sim_raw_bytes_per_pixel(config->pixel_format) == 0) return ESP_ERR_CAMERA_FAILED_TO_SET_OUT_FORMAT;
+    this->config = *config;
+
+    // Buffers are sized once for the frame size at init, JPEG at a fifth of the pixel count as
+    // the driver does. Asking for a larger frame size later overflows them.
+    size_t pixels = (size_t)resolution[config->frame_size].width * resolution[config->frame_size].height;
+    size_t size = (config->pixel_format == PIXFORMAT_JPEG) ? pixels / 5 : pixels * sim_raw_bytes_per_pixel(config->pixel_format);
+    uint32_t caps = (config->fb_location == CAMERA_FB_IN_PSRAM) ? MALLOC_CAP_SPIRAM : MALLOC_CAP_INTERNAL;
+    dma = heap_caps_malloc(SIM_CAMERA_DMA_BYTES, MALLOC_CAP_DMA);
+    buffers.assign(config->fb_count, SimFrameBuffer());
+    bool allocated = dma != NULL;
+    for(SimFrameBuffer &slot : buffers) {
+        slot.fb.buf = allocated ? (uint8_t *)heap_caps_malloc(size, caps) : NULL;
+        slot.size = size;
+        slot.held = false;
+        allocated = allocated && slot.fb.buf;
+    }
+    if(!allocated) {
+        log_e("Allocating %lu frame buffers of %lu bytes failed", (unsigned long)config->fb_count, (unsigned long)size);
+        for(SimFrameBuffer &slot : buffers) heap_caps_free(slot.fb.buf);
+        buffers.clear();
+        heap_caps_free(dma);
+        dma = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    memset(&sensor, 0, sizeof(sensor));
+    sensor.id.MIDH = 0x7F;
+    sensor.id.MIDL = 0xA2;
+    sensor.id.PID = pid;
+    sensor.slv_addr = 0x30;
+    sensor.pixformat = config->pixel_format;
+    sensor.xclk_freq_hz = config->xclk_freq_hz;
+    sensor.status.framesize = config->frame_size;
+    sensor.status.quality = config->jpeg_quality;
+    sensor.init_status = sensor_init_status;
+    sensor.reset = sensor_reset;
+    sensor.set_pixformat = sensor_set_pixformat;
+    sensor.set_framesize = sensor_set_framesize;
+    sensor.set_contrast = sensor_set_contrast;
+    sensor.set_brightness = sensor_set_brightness;
+    sensor.set_saturation = sensor_set_saturation;
+    sensor.set_sharpness = sensor_set_sharpness;
+    sensor.set_denoise = sensor_set_denoise;
+    sensor.set_gainceiling = sensor_set_gainceiling;
+    sensor.set_quality = sensor_set_quality;
+    sensor.set_colorbar = sensor_set_colorbar;
+    sensor.set_whitebal = sensor_set_whitebal;
+    sensor.set_gain_ctrl = sensor_set_gain_ctrl;
+    sensor.set_exposure_ctrl = sensor_set_exposure_ctrl;
+    sensor.set_hmirror = sensor_set_hmirror;
+    sensor.set_vflip = sensor_set_vflip;
+    sensor.set_aec2 = sensor_set_aec2;
+    sensor.set_awb_gain = sensor_set_awb_gain;
+    sensor.set_agc_gain = sensor_set_agc_gain;
+    sensor.set_aec_value = sensor_set_aec_value;
+    sensor.set_special_effect = sensor_set_special_effect;
+    sensor.set_wb_mode = sensor_set_wb_mode;
+    sensor.set_ae_level = sensor_set_ae_level;
+    sensor.set_dcw = sensor_set_dcw;
+    sensor.set_bpc = sensor_set_bpc;
+    sensor.set_wpc = sensor_set_wpc;
+    sensor.set_raw_gma = sensor_set_raw_gma;
+    sensor.set_lenc = sensor_set_lenc;
+    sensor.get_reg = sensor_get_reg;
+    sensor.set_reg = sensor_set_reg;
+    sensor.set_res_raw = sensor_set_res_raw;
+    sensor.set_pll = sensor_set_pll;
+    sensor.set_xclk = sensor_set_xclk;
+    sensor_reset(&sensor);
+
+    ready.clear();
+    running = true;
+    producer = std::thread(&SimCamera::produce, this);
+    return ESP_OK;
+}
+
+esp_err_t SimCamera::deinit() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!running) return ESP_ERR_INVALID_STATE;
+        running = false;
+        changed.notify_all();
+    }
+    producer.join();
+
+    // Like the driver, this frees buffers even if someone still holds one.
+    std::lock_guard<std::mutex> guard(lock);
+    ready.clear();
+    for(SimFrameBuffer &slot : buffers) heap_caps_free(slot.fb.buf);
+    buffers.clear();
+    heap_caps_free(dma);
+    dma = NULL;
+    return ESP_OK;
+}
+
+camera_fb_t *SimCamera::get() {
+    std::unique_lock<std::mutex> guard(lock);
+    if(!running) return NULL;
+    if(!changed.wait_for(guard, std::chrono::milliseconds(SIM_FB_TIMEOUT_MS), [this] { return !ready.empty() || !running; }) || ready.empty()) {
+        log_w("Failed to get the frame on time!");
+        return NULL;
+    }
+    SimFrameBuffer *slot = ready.front();
+    ready.pop_front();
+    slot->held = true;
+    return &slot->fb;
+}
+
+void SimCamera::giveBack(camera_fb_t *fb) {
+    std::lock_guard<std::mutex> guard(lock);
+    for(SimFrameBuffer &slot : buffers) {
+        if(&slot.fb != fb) continue;
+        slot.held = false;
+        changed.notify_all();
+        return;
+    }
+}
+
+sensor_t *SimCamera::getSensor() { return running ? &sensor : NULL; }
+
+uint32_t SimCamera::getFrameCount() { return frames; }
+
+uint32_t SimCamera::getDroppedCount() { return dropped; }
+
+uint32_t SimCamera::getOverflowCount() { return overflows; }
+
+int64_t SimCamera::framePeriodUs(framesize_t framesize, int xclk) {
+    // The OV2640 runs UXGA timing above SVGA, SVGA timing down to HVGA and CIF timing below,
+    // each at twice the rate of the one above.
+    float rate = fps;
+    if(rate <= 0) {
+        rate = (framesize > FRAMESIZE_SVGA) ? 15 : (framesize > FRAMESIZE_CIF) ? 30 : 60;
+        rate = rate * xclk / SIM_REFERENCE_XCLK;
+    }
+    return (int64_t)(1000000 / max(rate, 0.1f));
+}
+
+void SimCamera::produce() {
+    std::vector<uint8_t> rgb, frame;
+    int64_t next = esp_timer_get_time();
+    uint32_t count = 0;
+
+    for(;;) {
+        sensor_lock.lock();
+        camera_status_t status = sensor.status;
+        pixformat_t format = sensor.pixformat;
+        int xclk = sensor.xclk_freq_hz;
+        sensor_lock.unlock();
+
+        // Wait for the end of the next frame, a little early or late if asked to jitter.
+        int64_t period = framePeriodUs(status.framesize, xclk);
+        int64_t jitter = jitterMs ? ((int64_t)(esp_random() % (2 * jitterMs * 1000 + 1)) - jitterMs * 1000) : 0;
+        next += period;
+        int64_t due = max(next + jitter, esp_timer_get_time());
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait_for(guard, std::chrono::microseconds(due - esp_timer_get_time()), [this] { return !running; });
+            if(!running) return;
+        }
+        // A host that could not keep up skips frames rather than bursting to catch up.
+        int64_t now = esp_timer_get_time();
+        if(now - next > period) next = now;
+
+        uint16_t width = resolution[status.framesize].width;
+        uint16_t height = resolution[status.framesize].height;
+        render(status, count++, now, width, height, &rgb);
+        uint8_t quality = (uint8_t)constrain(100 - status.quality * 3 / 2, 1, 100);
+        if(encode(rgb, width, height, format, quality, &frame)) deliver(frame, width, height, format);
+    }
+}
+
+void SimCamera::render(const camera_status_t &status, uint32_t frame, int64_t nowUs, uint16_t width, uint16_t height, std::vector<uint8_t> *rgb) {
+    rgb->resize((size_t)width * height * 3);
+    uint8_t *out = rgb->data();
+    static const uint8_t bars[8][3] = { {255, 255, 255}, {255, 255, 0}, {0, 255, 255}, {0, 255, 0}, {255, 0, 255}, {255, 0, 0}, {0, 0, 255}, {0, 0, 0} };
+    const SimImage *image = images.empty() ? NULL : &images[frame % images.size()];
+    uint32_t seed = esp_random() | 1;
+
+    // The walker is a dark block a sixth of the frame wide crossing the middle half.
+    int walkW = width / 6;
+    int walkX = (int)((nowUs / 1000) % WALK_PERIOD_MS * (width + walkW) / WALK_PERIOD_MS) - walkW;
+
+    for(uint16_t y = 0; y < height; y++) {
+        uint16_t sy = status.vflip ? height - 1 - y : y;
+        for(uint16_t x = 0; x < width; x++, out += 3) {
+            uint16_t sx = status.hmirror ? width - 1 - x : x;
+            if(status.colorbar) {
+                memcpy(out, bars[sx * 8 / width], 3);
+                continue;
+            }
+
+            if(image) {
+                memcpy(out, &image->rgb[((size_t)(sy * image->height / height) * image->width + sx * image->width / width) * 3], 3);
+            } else if(scene == SIM_SCENE_NOISE) {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                out[0] = seed;
+                out[1] = seed >> 8;
+                out[2] = seed >> 16;
+            } else if(scene == SIM_SCENE_WALK && (int)sx >= walkX && (int)sx < walkX + walkW && sy >= height / 4 && sy < height * 3 / 4) {
+                out[0] = 40;
+                out[1] = 30;
+                out[2] = 30;
+            } else {
+                // Test card: a diagonal gradient with a checker of coloured tiles.
+                bool tile = ((sx * 8 / width) + (sy * 6 / height)) & 1;
+                out[0] = tile ? 200 : sx * 255 / width;
+                out[1] = tile ? 120 : sy * 255 / height;
+                out[2] = tile ? 60 : 128;
+            }
+
+            for(int c = 0; c < 3; c++) {
+                int v = out[c] + status.brightness * 20;
+                if(noise && !images.size() && scene != SIM_SCENE_NOISE) {
+                    seed ^= seed << 13;
+                    seed ^= seed >> 17;
+                    seed ^= seed << 5;
+                    v += (int)(seed % (2 * noise + 1)) - noise;
+                }
+                out[c] = (v < 0) ? 0 : (v > 255) ? 255 : v;
+            }
+            if(status.special_effect == 1) {
+                for(int c = 0; c < 3; c++) out[c] = 255 - out[c];
+            } else if(status.special_effect == 2) {
+                out[0] = out[1] = out[2] = (77 * out[0] + 150 * out[1] + 29 * out[2]) >> 8;
+            }
+        }
+    }
+}
+
+static size_t append_jpeg(void *arg, size_t index, const void *data, size_t len) {
+    std::vector<uint8_t> *out = static_cast<std::vector<uint8_t> *>(arg);
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    out->insert(out->end(), p, p + len);
+    return len;
+}
+
+bool SimCamera::encode(const std::vector<uint8_t> &rgb, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, std::vector<uint8_t> *out) {
+    out->clear();
+    if(format == PIXFORMAT_JPEG) return sim_jpeg_encode(rgb.data(), width, height, false, quality, append_jpeg, out);
+
+    size_t pixels = (size_t)width * height;
+    out->resize(pixels * sim_raw_bytes_per_pixel(format));
+    uint8_t *p = out->data();
+    for(size_t i = 0; i < pixels; i++) {
+        const uint8_t *px = &rgb[i * 3];
+        uint8_t luma = (77 * px[0] + 150 * px[1] + 29 * px[2]) >> 8;
+        switch(format) {
+            case PIXFORMAT_GRAYSCALE:
+                *p++ = luma;
+                break;
+            case PIXFORMAT_RGB565: {
+                uint16_t v = ((px[0] & 0xF8) << 8) | ((px[1] & 0xFC) << 3) | (px[2] >> 3);
+                *p++ = v >> 8;
+                *p++ = v;
+                break;
+            }
+            case PIXFORMAT_RGB888:
+                *p++ = px[2];
+                *p++ = px[1];
+                *p++ = px[0];
+                break;
+            default:
+                // YUYV, with U on even pixels and V on odd ones.
+                *p++ = luma;
+                if(i & 1) *p++ = constrain(((128 * px[0] - 107 * px[1] - 21 * px[2]) >> 8) + 128, 0, 255);
+                else *p++ = constrain(((-43 * px[0] - 85 * px[1] + 128 * px[2]) >> 8) + 128, 0, 255);
+                break;
+        }
+    }
+    return true;
+}
+
+void SimCamera::deliver(const std::vector<uint8_t> &frame, uint16_t width, uint16_t height, pixformat_t format) {
+    std::lock_guard<std::mutex> guard(lock);
+    SimFrameBuffer *slot = NULL;
+    for(SimFrameBuffer &candidate : buffers) {
+        if(!candidate.held && std::find(ready.begin(), ready.end(), &candidate) == ready.end()) {
+            slot = &candidate;
+            break;
+        }
+    }
+    // With every buffer full, GRAB_LATEST recycles the oldest waiting frame and GRAB_WHEN_EMPTY
+    // loses the new one.
+    if(slot == NULL && config.grab_mode == CAMERA_GRAB_LATEST && !ready.empty()) {
+        slot = ready.front();
+        ready.pop_front();
+        dropped++;
+    }
+    if(slot == NULL) {
+        dropped++;
+        return;
+    }
+    if(frame.size() > slot->size) {
+        overflows++;
+        log_w("FB-OVF: %lu byte frame, %lu byte buffer", (unsigned long)frame.size(), (unsigned long)slot->size);
+        return;
+    }
+
+    memcpy(slot->fb.buf, frame.data(), frame.size());
+    slot->fb.len = frame.size();
+    slot->fb.width = width;
+    slot->fb.height = height;
+    slot->fb.format = format;
+    int64_t now = esp_timer_get_time();
+    slot->fb.timestamp.tv_sec = now / 1000000;
+    slot->fb.timestamp.tv_usec = now % 1000000;
+    ready.push_back(slot);
+    frames++;
+    changed.notify_all();
+}
+
+esp_err_t esp_camera_init(const camera_config_t *config) { return sim_camera.init(config); }
+
+esp_err_t esp_camera_deinit() { return sim_camera.deinit(); }
+
+camera_fb_t *esp_camera_fb_get() { return sim_camera.get(); }
+
+void esp_camera_fb_return(camera_fb_t *fb) {
+    if(fb) sim_camera.giveBack(fb);
+}
+
+sensor_t *esp_camera_sensor_get() { return sim_camera.getSensor(); }
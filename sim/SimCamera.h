@@ -0,0 +1,87 @@
+#ifndef SIM_CAMERA
+#define SIM_CAMERA
+
+// A simulated OV2640 behind the esp32-camera API. Frames come from a directory of JPEGs or a
+// synthetic scene, at the frame rate the sensor would run at, into the frame buffers the driver
+// would allocate. Grab modes, buffer overflows and the sensor's settings behave as on the board.
+#include "esp_camera.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+const uint32_t SIM_FB_TIMEOUT_MS = 4000;        // esp_camera_fb_get() gives up after this, as the driver does.
+const size_t SIM_CAMERA_DMA_BYTES = 16 * 1024;  // Internal DMA buffers the driver holds on to while running.
+const uint32_t SIM_REFERENCE_XCLK = 20000000;   // XCLK the frame rates below are for.
+
+typedef enum {
+    SIM_SCENE_STATIC,       // A still test card.
+    SIM_SCENE_WALK,         // The test card with a block walking across it.
+    SIM_SCENE_NOISE,        // Every pixel random, the worst case for the encoder.
+} sim_scene_t;
+
+// A decoded frame from the frames directory, RGB888 with red first.
+struct SimImage {
+    uint16_t width;
+    uint16_t height;
+    std::vector<uint8_t> rgb;
+};
+
+struct SimFrameBuffer {
+    camera_fb_t fb;
+    size_t size;            // What the buffer holds, fixed at init from the frame size.
+    bool held;              // Handed out by esp_camera_fb_get().
+};
+
+class SimCamera {
+    private:
+        camera_config_t config;
+        sensor_t sensor;
+        bool running = false;
+        std::thread producer;
+        std::mutex lock;
+        std::condition_variable changed;
+        std::vector<SimFrameBuffer> buffers;
+        std::deque<SimFrameBuffer *> ready;     // Finished frames, oldest first.
+        void *dma = NULL;
+
+        std::vector<SimImage> images;
+        sim_scene_t scene = SIM_SCENE_WALK;
+        uint8_t noise = 2;
+        float fps = 0;                          // 0 runs at the sensor's rate for the frame size.
+        uint16_t jitterMs = 0;
+        uint16_t pid = OV2640_PID;
+
+        uint32_t frames = 0;
+        uint32_t dropped = 0;
+        uint32_t overflows = 0;
+
+        void produce();
+        int64_t framePeriodUs(framesize_t framesize, int xclk);
+        void render(const camera_status_t &status, uint32_t frame, int64_t nowUs, uint16_t width, uint16_t height, std::vector<uint8_t> *rgb);
+        bool encode(const std::vector<uint8_t> &rgb, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, std::vector<uint8_t> *out);
+        void deliver(const std::vector<uint8_t> &frame, uint16_t width, uint16_t height, pixformat_t format);
+
+    public:
+        // Source settings, taken at the next init.
+        bool loadFrames(const char *dir);
+        void setScene(sim_scene_t scene, uint8_t noise);
+        void setFrameRate(float fps, uint16_t jitterMs);
+        void setSensorPid(uint16_t pid);
+
+        // The driver API.
+        esp_err_t init(const camera_config_t *config);
+        esp_err_t deinit();
+        camera_fb_t *get();
+        void giveBack(camera_fb_t *fb);
+        sensor_t *getSensor();
+
+        uint32_t getFrameCount();
+        uint32_t getDroppedCount();
+        uint32_t getOverflowCount();
+};
+
+extern SimCamera sim_camera;
+
+#endif /* SimCamera.h */
@@ -0,0 +1,270 @@
+#include "freertos/FreeRTOS.h"
+#include "esp_heap_caps.h"
+#include "esp32-hal-log.h"
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using sim_clock = std::chrono::steady_clock;
+
+const uint32_t SIM_MIN_STACK_BYTES = 512 * 1024;    // Host frames are wider than Xtensa ones, and libjpeg runs on task stacks.
+
+struct SimTask {
+    TaskFunction_t fn;
+    void *params;
+    std::string name;
+    void *stackCharge;          // Internal heap the stack would take on the board.
+    std::mutex m;
+    std::condition_variable cv;
+    uint32_t notify = 0;
+};
+
+struct SimSemaphore {
+    std::mutex m;
+    std::condition_variable cv;
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+struct SimQueue {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::vector<uint8_t>> items;
+    UBaseType_t length;
+    UBaseType_t itemSize;
+};
+
+struct SimEventGroup {
+    std::mutex m;
+    std::condition_variable cv;
+    EventBits_t bits = 0;
+};
+
+static thread_local SimTask *current_task = NULL;
+
+// Frees a task's bookkeeping when its thread ends, whether it returned or called vTaskDelete(NULL).
+struct SimTaskOwner {
+    SimTask *task = NULL;
+    ~SimTaskOwner() {
+        if(task == NULL) return;
+        heap_caps_free(task->stackCharge);
+        delete task;
+    }
+};
+static thread_local SimTaskOwner task_owner;
+
+// Wait on cv until ready() or the ticks run out. Ticks are milliseconds.
+template<typename Pred>
+static bool wait_ticks(std::condition_variable &cv, std::unique_lock<std::mutex> &lock, TickType_t ticks, Pred ready) {
+    if(ticks == portMAX_DELAY) {
+        cv.wait(lock, ready);
+        return true;
+    }
+    return cv.wait_until(lock, sim_clock::now() + std::chrono::milliseconds(ticks), ready);
+}
+
+static void *task_entry(void *arg) {
+    SimTask *task = static_cast<SimTask *>(arg);
+    current_task = task;
+    task_owner.task = task;
+    task->fn(task->params);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stackDepth, void *params,
+    UBaseType_t priority, TaskHandle_t *created, BaseType_t core) {
+    // The stack is charged to the internal heap so tasks show up in the free-heap figures.
+    void *charge = heap_caps_malloc(stackDepth, MALLOC_CAP_INTERNAL);
+    if(charge == NULL) return errCOULD_NOT_ALLOCATE_REQUIRED_MEMORY;
+
+    SimTask *task = new SimTask();
+    task->fn = fn;
+    task->params = params;
+    task->name = name ? name : "";
+    task->stackCharge = charge;
+    if(created) *created = task;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, std::max((size_t)stackDepth * 4, (size_t)SIM_MIN_STACK_BYTES));
+    pthread_t thread;
+    int res = pthread_create(&thread, &attr, task_entry, task);
+    pthread_attr_destroy(&attr);
+    if(res != 0) {
+        if(created) *created = NULL;
+        heap_caps_free(charge);
+        delete task;
+        return errCOULD_NOT_ALLOCATE_REQUIRED_MEMORY;
+    }
+    pthread_setname_np(thread, task->name.substr(0, 15).c_str());
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stackDepth, void *params, UBaseType_t priority, TaskHandle_t *created) {
+    return xTaskCreatePinnedToCore(fn, name, stackDepth, params, priority, created, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if(task != NULL && task != current_task) {
+        log_e("Deleting another task is not simulated (%s).", task->name.c_str());
+        return;
+    }
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+TickType_t xTaskGetTickCount() {
+    static const sim_clock::time_point boot = sim_clock::now();
+    return (TickType_t)std::chrono::duration_cast<std::chrono::milliseconds>(sim_clock::now() - boot).count();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    // The main thread and other threads the sim starts get a handle the first time they ask.
+    if(current_task == NULL) {
+        current_task = new SimTask();
+        current_task->fn = NULL;
+        current_task->params = NULL;
+        current_task->stackCharge = NULL;
+        task_owner.task = current_task;
+    }
+    return current_task;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks) {
+    SimTask *task = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(task->m);
+    wait_ticks(task->cv, lock, ticks, [task] { return task->notify > 0; });
+    uint32_t value = task->notify;
+    if(value) task->notify = clearOnExit ? 0 : value - 1;
+    return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    std::lock_guard<std::mutex> lock(task->m);
+    task->notify++;
+    task->cv.notify_all();
+    return pdPASS;
+}
+
+static SemaphoreHandle_t semaphore_create(UBaseType_t max, UBaseType_t initial) {
+    SimSemaphore *sem = new SimSemaphore();
+    sem->count = initial;
+    sem->max = max;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return semaphore_create(1, 1); }
+
+SemaphoreHandle_t xSemaphoreCreateBinary() { return semaphore_create(1, 0); }
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial) { return semaphore_create(max, initial); }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(sem->m);
+    if(!wait_ticks(sem->cv, lock, ticks, [sem] { return sem->count > 0; })) return pdFALSE;
+    sem->count--;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    std::lock_guard<std::mutex> lock(sem->m);
+    if(sem->count >= sem->max) return pdFALSE;
+    sem->count++;
+    sem->cv.notify_one();
+    return pdTRUE;
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t sem) {
+    std::lock_guard<std::mutex> lock(sem->m);
+    return sem->count;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) { delete sem; }
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+    if(length == 0) return NULL;
+    SimQueue *queue = new SimQueue();
+    queue->length = length;
+    queue->itemSize = itemSize;
+    return queue;
+}
+
+static BaseType_t queue_send(QueueHandle_t queue, const void *item, TickType_t ticks, bool front) {
+    std::unique_lock<std::mutex> lock(queue->m);
+    if(!wait_ticks(queue->cv, lock, ticks, [queue] { return queue->items.size() < queue->length; })) return errQUEUE_FULL;
+    const uint8_t *p = static_cast<const uint8_t *>(item);
+    std::vector<uint8_t> copy(p, p + queue->itemSize);
+    if(front) queue->items.push_front(std::move(copy));
+    else queue->items.push_back(std::move(copy));
+    queue->cv.notify_all();
+    return pdPASS;
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t ticks) { return queue_send(queue, item, ticks, false); }
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks) { return queue_send(queue, item, ticks, true); }
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(queue->m);
+    if(!wait_ticks(queue->cv, lock, ticks, [queue] { return !queue->items.empty(); })) return errQUEUE_EMPTY;
+    memcpy(item, queue->items.front().data(), queue->itemSize);
+    queue->items.pop_front();
+    queue->cv.notify_all();
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    std::lock_guard<std::mutex> lock(queue->m);
+    return queue->items.size();
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+    std::lock_guard<std::mutex> lock(queue->m);
+    return queue->length - queue->items.size();
+}
+
+void vQueueDelete(QueueHandle_t queue) { delete queue; }
+
+EventGroupHandle_t xEventGroupCreate() { return new SimEventGroup(); }
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock(group->m);
+    group->bits |= bits;
+    group->cv.notify_all();
+    return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock(group->m);
+    EventBits_t before = group->bits;
+    group->bits &= ~bits;
+    return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+    std::lock_guard<std::mutex> lock(group->m);
+    return group->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clearOnExit, BaseType_t waitForAll, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(group->m);
+    auto ready = [group, bits, waitForAll] { return waitForAll ? (group->bits & bits) == bits : (group->bits & bits) != 0; };
+    bool met = wait_ticks(group->cv, lock, ticks, ready);
+    // Like FreeRTOS, the value returned is from before the bits are cleared.
+    EventBits_t value = group->bits;
+    if(met && clearOnExit) group->bits &= ~bits;
+    return value;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) { delete group; }
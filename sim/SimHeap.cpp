@@ -0,0 +1,129 @@
+#include "esp_heap_caps.h"
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <unordered_map>
+
+// What an ESP32-CAM has free once WiFi is up and before the camera starts, matching the board model
+// in scripts/tuner_sim.cpp.
+const size_t SIM_INTERNAL_HEAP_BYTES = 210000;
+const size_t SIM_PSRAM_HEAP_BYTES = 4128768;
+
+enum SimHeapRegion { SIM_HEAP_INTERNAL, SIM_HEAP_PSRAM, SIM_HEAP_REGIONS };
+
+struct SimHeapBlock {
+    size_t size;
+    SimHeapRegion region;
+};
+
+static const size_t heap_total[SIM_HEAP_REGIONS] = { SIM_INTERNAL_HEAP_BYTES, SIM_PSRAM_HEAP_BYTES };
+static size_t heap_used[SIM_HEAP_REGIONS] = { 0, 0 };
+static size_t heap_peak[SIM_HEAP_REGIONS] = { 0, 0 };
+static std::unordered_map<void *, SimHeapBlock> heap_blocks;
+static std::mutex heap_lock;
+
+// Pick the region for an allocation, internal RAM first unless PSRAM is asked for. The caller holds the lock.
+static bool heap_region(size_t size, uint32_t caps, size_t reclaim, SimHeapRegion reclaimRegion, SimHeapRegion *region) {
+    bool psramOnly = caps & MALLOC_CAP_SPIRAM;
+    bool internalOnly = caps & (MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA | MALLOC_CAP_EXEC);
+    for(int r = psramOnly ? SIM_HEAP_PSRAM : SIM_HEAP_INTERNAL; r <= (internalOnly ? SIM_HEAP_INTERNAL : SIM_HEAP_PSRAM); r++) {
+        size_t freeBytes = heap_total[r] - heap_used[r] + ((r == reclaimRegion) ? reclaim : 0);
+        if(size <= freeBytes) {
+            *region = (SimHeapRegion)r;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void heap_charge(SimHeapRegion region, size_t size) {
+    heap_used[region] += size;
+    if(heap_used[region] > heap_peak[region]) heap_peak[region] = heap_used[region];
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    if(size == 0) return NULL;
+
+    std::lock_guard<std::mutex> lock(heap_lock);
+    SimHeapRegion region;
+    if(!heap_region(size, caps, 0, SIM_HEAP_REGIONS, &region)) return NULL;
+    void *ptr = malloc(size);
+    if(ptr == NULL) return NULL;
+    heap_blocks[ptr] = { size, region };
+    heap_charge(region, size);
+    return ptr;
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps) {
+    if(size && n > SIZE_MAX / size) return NULL;
+    void *ptr = heap_caps_malloc(n * size, caps);
+    if(ptr) memset(ptr, 0, n * size);
+    return ptr;
+}
+
+void *heap_caps_realloc(void *ptr, size_t size, uint32_t caps) {
+    if(ptr == NULL) return heap_caps_malloc(size, caps);
+    if(size == 0) {
+        heap_caps_free(ptr);
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(heap_lock);
+    auto it = heap_blocks.find(ptr);
+    SimHeapBlock old = (it != heap_blocks.end()) ? it->second : SimHeapBlock{ 0, SIM_HEAP_REGIONS };
+    SimHeapRegion region;
+    if(!heap_region(size, caps, old.size, old.region, &region)) return NULL;
+    void *grown = realloc(ptr, size);
+    if(grown == NULL) return NULL;
+    if(it != heap_blocks.end()) {
+        heap_used[old.region] -= old.size;
+        heap_blocks.erase(it);
+    }
+    heap_blocks[grown] = { size, region };
+    heap_charge(region, size);
+    return grown;
+}
+
+void heap_caps_free(void *ptr) {
+    if(ptr == NULL) return;
+    {
+        // Memory from plain malloc() can be given back here too, as on the board.
+        std::lock_guard<std::mutex> lock(heap_lock);
+        auto it = heap_blocks.find(ptr);
+        if(it != heap_blocks.end()) {
+            heap_used[it->second.region] -= it->second.size;
+            heap_blocks.erase(it);
+        }
+    }
+    free(ptr);
+}
+
+// Sum a statistic over the regions the caps select.
+static size_t heap_stat(uint32_t caps, size_t (*stat)(int region)) {
+    std::lock_guard<std::mutex> lock(heap_lock);
+    if(caps & MALLOC_CAP_SPIRAM) return stat(SIM_HEAP_PSRAM);
+    if(caps & (MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA | MALLOC_CAP_EXEC)) return stat(SIM_HEAP_INTERNAL);
+    return stat(SIM_HEAP_INTERNAL) + stat(SIM_HEAP_PSRAM);
+}
+
+size_t heap_caps_get_total_size(uint32_t caps) {
+    return heap_stat(caps, [](int r) { return heap_total[r]; });
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+    return heap_stat(caps, [](int r) { return heap_total[r] - heap_used[r]; });
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+    return heap_stat(caps, [](int r) { return heap_total[r] - heap_peak[r]; });
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    // Fragmentation is not modelled. The largest block is whatever is free in the biggest region.
+    std::lock_guard<std::mutex> lock(heap_lock);
+    size_t internal = heap_total[SIM_HEAP_INTERNAL] - heap_used[SIM_HEAP_INTERNAL];
+    size_t psram = heap_total[SIM_HEAP_PSRAM] - heap_used[SIM_HEAP_PSRAM];
+    if(caps & MALLOC_CAP_SPIRAM) return psram;
+    if(caps & (MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA | MALLOC_CAP_EXEC)) return internal;
+    return (internal > psram) ? internal : psram;
+}
@@ -0,0 +1,869 @@
+#include "esp_http_server.h"
+#include "esp32-hal-log.h"
+#include "lwip/sockets.h"
+#include "Sim.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+const size_t HTTPD_SCRATCH_LEN = HTTPD_MAX_REQ_HDR_LEN + HTTPD_MAX_URI_LEN;    // Most a request head may take.
+const size_t HTTPD_RECV_CHUNK = 1024;
+const char *WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// Define the port override.
+uint16_t sim_httpd_port = 0;
+
+struct SimSession {
+    int fd;
+    std::string pending;            // Bytes read past the request being handled.
+    bool webSocket = false;
+    const httpd_uri_t *wsHandler = NULL;
+    std::string wsUri;
+    bool forAsync = false;          // Held by an async handler, so the server leaves it alone.
+    uint64_t lru = 0;
+    void *ctx = NULL;
+    httpd_free_ctx_fn_t freeCtx = NULL;
+};
+
+struct SimHttpd;
+
+struct SimReqAux {
+    SimHttpd *server;
+    int fd;
+    std::string headers;            // The request's header lines, CRLF separated.
+    size_t remaining = 0;           // Body bytes not read yet.
+    std::string status = HTTPD_200;
+    std::string type = HTTPD_TYPE_TEXT;
+    std::vector<std::pair<std::string, std::string>> respHeaders;
+    bool chunked = false;           // Chunked response head sent.
+    bool detached = false;          // Handed to httpd_req_async_handler_begin().
+
+    // The WebSocket frame being handled.
+    bool wsFinal = false;
+    httpd_ws_type_t wsType = HTTPD_WS_TYPE_TEXT;
+    size_t wsLen = 0;
+    size_t wsRead = 0;
+    bool wsMasked = false;
+    uint8_t wsMask[4];
+};
+
+struct SimHttpd {
+    httpd_config_t config;
+    int listenFd = -1;
+    int wake[2] = { -1, -1 };
+    std::vector<httpd_uri_t> handlers;
+    std::map<int, SimSession> sessions;
+    std::mutex lock;
+    std::deque<std::function<void()>> work;     // Run on the server task, like httpd_queue_work().
+    bool stopping = false;
+    SemaphoreHandle_t stopped = NULL;
+    uint64_t lruCounter = 0;
+};
+
+// SHA-1, for the WebSocket handshake only.
+static void sha1(const uint8_t *data, size_t len, uint8_t digest[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    std::vector<uint8_t> msg(data, data + len);
+    msg.push_back(0x80);
+    while(msg.size() % 64 != 56) msg.push_back(0);
+    uint64_t bits = (uint64_t)len * 8;
+    for(int i = 7; i >= 0; i--) msg.push_back(bits >> (i * 8));
+
+    auto rol = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+    for(size_t block = 0; block < msg.size(); block += 64) {
+        uint32_t w[80];
+        for(int i = 0; i < 16; i++) w[i] = (msg[block + i * 4] << 24) | (msg[block + i * 4 + 1] << 16) | (msg[block + i * 4 + 2] << 8) | msg[block + i * 4 + 3];
+        for(int i = 16; i < 80; i++) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for(int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if(i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if(i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if(i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for(int i = 0; i < 20; i++) digest[i] = h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+static std::string base64(const uint8_t *data, size_t len) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for(size_t i = 0; i < len; i += 3) {
+        uint32_t v = data[i] << 16;
+        if(i + 1 < len) v |= data[i + 1] << 8;
+        if(i + 2 < len) v |= data[i + 2];
+        out += table[(v >> 18) & 63];
+        out += table[(v >> 12) & 63];
+        out += (i + 1 < len) ? table[(v >> 6) & 63] : '=';
+        out += (i + 2 < len) ? table[v & 63] : '=';
+    }
+    return out;
+}
+
+// httpd_req_t has a const URI array, so C++ cannot default construct one. Requests live in zeroed storage instead.
+struct SimReqStorage {
+    alignas(httpd_req_t) uint8_t bytes[sizeof(httpd_req_t)] = {};
+    httpd_req_t *get() { return reinterpret_cast<httpd_req_t *>(bytes); }
+};
+
+static SimReqAux *aux_of(httpd_req_t *r) { return static_cast<SimReqAux *>(r->aux); }
+
+static SimSession *find_session(SimHttpd *server, int fd) {
+    std::lock_guard<std::mutex> lock(server->lock);
+    auto it = server->sessions.find(fd);
+    return (it != server->sessions.end()) ? &it->second : NULL;
+}
+
+static void queue_work(SimHttpd *server, std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(server->lock);
+        server->work.push_back(std::move(fn));
+    }
+    char c = 0;
+    if(write(server->wake[1], &c, 1) < 0) log_e("httpd wake failed");
+}
+
+static void wake_server(SimHttpd *server) { queue_work(server, [] {}); }
+
+static int sock_send(int fd, const char *buf, size_t len) {
+    ssize_t n;
+    do {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+    } while(n < 0 && errno == EINTR);
+    if(n >= 0) return n;
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
+}
+
+static esp_err_t send_all(int fd, const char *buf, size_t len) {
+    while(len) {
+        int n = sock_send(fd, buf, len);
+        if(n <= 0) return ESP_ERR_HTTPD_RESP_SEND;
+        buf += n;
+        len -= n;
+    }
+    return ESP_OK;
+}
+
+// Reads from what is already buffered first, then one recv().
+static int session_recv(SimSession *sess, char *buf, size_t len) {
+    if(!sess->pending.empty()) {
+        size_t n = std::min(len, sess->pending.size());
+        memcpy(buf, sess->pending.data(), n);
+        sess->pending.erase(0, n);
+        return n;
+    }
+    ssize_t n;
+    do {
+        n = recv(sess->fd, buf, len, 0);
+    } while(n < 0 && errno == EINTR);
+    if(n >= 0) return n;
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
+}
+
+static bool session_recv_exact(SimSession *sess, uint8_t *buf, size_t len) {
+    while(len) {
+        int n = session_recv(sess, (char *)buf, len);
+        if(n <= 0) return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool session_skip(SimSession *sess, size_t len) {
+    char scratch[HTTPD_RECV_CHUNK];
+    while(len) {
+        int n = session_recv(sess, scratch, std::min(len, sizeof(scratch)));
+        if(n <= 0) return false;
+        len -= n;
+    }
+    return true;
+}
+
+static void close_session(SimHttpd *server, int fd) {
+    SimSession sess;
+    {
+        std::lock_guard<std::mutex> lock(server->lock);
+        auto it = server->sessions.find(fd);
+        if(it == server->sessions.end()) return;
+        sess = std::move(it->second);
+        server->sessions.erase(it);
+    }
+    if(server->config.close_fn) server->config.close_fn(server, fd);
+    else close(fd);
+    if(sess.ctx) {
+        if(sess.freeCtx) sess.freeCtx(sess.ctx);
+        else free(sess.ctx);
+    }
+}
+
+static bool header_value(const std::string &headers, const char *field, std::string *value) {
+    size_t fieldLen = strlen(field);
+    for(size_t start = 0; start < headers.size();) {
+        size_t end = headers.find("\r\n", start);
+        if(end == std::string::npos) end = headers.size();
+        if(end - start > fieldLen && headers[start + fieldLen] == ':' && strncasecmp(headers.c_str() + start, field, fieldLen) == 0) {
+            size_t v = start + fieldLen + 1;
+            while(v < end && (headers[v] == ' ' || headers[v] == '\t')) v++;
+            size_t e = end;
+            while(e > v && (headers[e - 1] == ' ' || headers[e - 1] == '\t')) e--;
+            *value = headers.substr(v, e - v);
+            return true;
+        }
+        start = end + 2;
+    }
+    return false;
+}
+
+static const httpd_uri_t *find_handler(SimHttpd *server, const char *uri, int method, bool *pathMatched) {
+    size_t pathLen = strcspn(uri, "?#");
+    *pathMatched = false;
+    for(const httpd_uri_t &h : server->handlers) {
+        bool match = server->config.uri_match_fn ? server->config.uri_match_fn(h.uri, uri, pathLen)
+            : (strlen(h.uri) == pathLen && strncmp(h.uri, uri, pathLen) == 0);
+        if(!match) continue;
+        *pathMatched = true;
+        if(h.method == method) return &h;
+    }
+    return NULL;
+}
+
+// Sends an error straight to the socket, for requests that never got as far as a handler.
+static void send_early_error(int fd, const char *status, const char *msg) {
+    char head[160];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: text/html\r\nContent-Length: %u\r\n\r\n", status, (unsigned)strlen(msg));
+    send_all(fd, head, len);
+    send_all(fd, msg, strlen(msg));
+}
+
+static esp_err_t ws_send(int fd, const httpd_ws_frame_t *frame) {
+    uint8_t head[10];
+    size_t headLen = 2;
+    head[0] = (frame->final || !frame->fragmented ? 0x80 : 0) | frame->type;
+    if(frame->len < 126) head[1] = frame->len;
+    else if(frame->len < 65536) {
+        head[1] = 126;
+        head[2] = frame->len >> 8;
+        head[3] = frame->len;
+        headLen = 4;
+    } else {
+        head[1] = 127;
+        for(int i = 0; i < 8; i++) head[2 + i] = (uint64_t)frame->len >> (56 - i * 8);
+        headLen = 10;
+    }
+    if(send_all(fd, (const char *)head, headLen) != ESP_OK) return ESP_FAIL;
+    if(frame->len && send_all(fd, (const char *)frame->payload, frame->len) != ESP_OK) return ESP_FAIL;
+    return ESP_OK;
+}
+
+static void ws_reply(int fd, httpd_ws_type_t type, uint8_t *payload, size_t len) {
+    httpd_ws_frame_t frame = { true, false, type, payload, len };
+    ws_send(fd, &frame);
+}
+
+static void run_handler(SimHttpd *server, SimSession *sess, const httpd_uri_t *handler, httpd_req_t *req, SimReqAux *aux) {
+    int fd = sess->fd;
+    req->handle = server;
+    req->aux = aux;
+    req->user_ctx = handler->user_ctx;
+    req->sess_ctx = sess->ctx;
+    req->free_ctx = sess->freeCtx;
+    req->ignore_sess_ctx_changes = false;
+
+    esp_err_t res = handler->handler(req);
+
+    // A detached request's session belongs to its async handler until it completes.
+    if(aux->detached) return;
+    sess = find_session(server, fd);
+    if(sess == NULL) return;
+    if(!req->ignore_sess_ctx_changes) {
+        sess->ctx = req->sess_ctx;
+        sess->freeCtx = req->free_ctx;
+    }
+    if(res != ESP_OK) {
+        close_session(server, fd);
+        return;
+    }
+    // Leftover body or frame payload is dropped so the next read starts at a message boundary.
+    bool skipped = sess->webSocket ? session_skip(sess, aux->wsLen - aux->wsRead) : session_skip(sess, aux->remaining);
+    if(!skipped) close_session(server, fd);
+}
+
+static void handle_ws_frame(SimHttpd *server, SimSession *sess) {
+    int fd = sess->fd;
+    uint8_t head[2];
+    if(!session_recv_exact(sess, head, 2)) {
+        close_session(server, fd);
+        return;
+    }
+
+    SimReqAux aux;
+    aux.server = server;
+    aux.fd = fd;
+    aux.wsFinal = head[0] & 0x80;
+    aux.wsType = (httpd_ws_type_t)(head[0] & 0x0F);
+    aux.wsMasked = head[1] & 0x80;
+    uint64_t len = head[1] & 0x7F;
+    uint8_t ext[8];
+    if(len == 126) {
+        if(!session_recv_exact(sess, ext, 2)) return close_session(server, fd);
+        len = (ext[0] << 8) | ext[1];
+    } else if(len == 127) {
+        if(!session_recv_exact(sess, ext, 8)) return close_session(server, fd);
+        len = 0;
+        for(int i = 0; i < 8; i++) len = (len << 8) | ext[i];
+    }
+    if(aux.wsMasked && !session_recv_exact(sess, aux.wsMask, 4)) return close_session(server, fd);
+    aux.wsLen = len;
+
+    // Control frames are answered here unless the handler asked to see them.
+    bool control = aux.wsType & 0x08;
+    if(control && !sess->wsHandler->handle_ws_control_frames) {
+        uint8_t payload[125];
+        if(len > sizeof(payload) || !session_recv_exact(sess, payload, len)) return close_session(server, fd);
+        for(size_t i = 0; aux.wsMasked && i < len; i++) payload[i] ^= aux.wsMask[i % 4];
+        if(aux.wsType == HTTPD_WS_TYPE_CLOSE) {
+            ws_reply(fd, HTTPD_WS_TYPE_CLOSE, payload, std::min((size_t)len, (size_t)2));
+            close_session(server, fd);
+        } else if(aux.wsType == HTTPD_WS_TYPE_PING) {
+            ws_reply(fd, HTTPD_WS_TYPE_PONG, payload, len);
+        }
+        return;
+    }
+
+    SimReqStorage storage;
+    httpd_req_t &req = *storage.get();
+    req.method = 0;
+    strncpy((char *)req.uri, sess->wsUri.c_str(), HTTPD_MAX_URI_LEN);
+    req.content_len = len;
+    run_handler(server, sess, sess->wsHandler, &req, &aux);
+}
+
+static bool ws_handshake(SimSession *sess, const httpd_uri_t *handler, SimReqAux *aux) {
+    std::string key;
+    if(!header_value(aux->headers, "Sec-WebSocket-Key", &key)) return false;
+    std::string accept = key + WS_GUID;
+    uint8_t digest[20];
+    sha1((const uint8_t *)accept.data(), accept.size(), digest);
+
+    std::string resp = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + base64(digest, sizeof(digest)) + "\r\n";
+    if(handler->supported_subprotocol) resp += std::string("Sec-WebSocket-Protocol: ") + handler->supported_subprotocol + "\r\n";
+    resp += "\r\n";
+    if(send_all(sess->fd, resp.data(), resp.size()) != ESP_OK) return false;
+    sess->webSocket = true;
+    sess->wsHandler = handler;
+    return true;
+}
+
+static int parse_method(const std::string &name) {
+    static const char *names[] = { "DELETE", "GET", "HEAD", "POST", "PUT" };
+    for(int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if(name == names[i]) return i;
+    }
+    return -1;
+}
+
+static void handle_request(SimHttpd *server, SimSession *sess) {
+    int fd = sess->fd;
+
+    // Read the request head.
+    size_t end;
+    while((end = sess->pending.find("\r\n\r\n")) == std::string::npos) {
+        if(sess->pending.size() > HTTPD_SCRATCH_LEN) {
+            send_early_error(fd, "431 Request Header Fields Too Large", "Header fields are too long");
+            return close_session(server, fd);
+        }
+        char buf[HTTPD_RECV_CHUNK];
+        ssize_t n;
+        do {
+            n = recv(fd, buf, sizeof(buf), 0);
+        } while(n < 0 && errno == EINTR);
+        if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) return close_session(server, fd);
+        if(n < 0) {
+            send_early_error(fd, HTTPD_408, "Server closed this connection");
+            return close_session(server, fd);
+        }
+        sess->pending.append(buf, n);
+    }
+    std::string head = sess->pending.substr(0, end + 2);
+    sess->pending.erase(0, end + 4);
+
+    size_t lineEnd = head.find("\r\n");
+    std::string line = head.substr(0, lineEnd);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = (sp1 == std::string::npos) ? std::string::npos : line.find(' ', sp1 + 1);
+    if(sp2 == std::string::npos || line.compare(sp2 + 1, 5, "HTTP/") != 0) {
+        send_early_error(fd, HTTPD_400, "Bad request syntax");
+        return close_session(server, fd);
+    }
+    std::string uri = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    if(uri.size() > HTTPD_MAX_URI_LEN) {
+        send_early_error(fd, "414 URI Too Long", "URI is too long");
+        return close_session(server, fd);
+    }
+    if(head.size() - lineEnd - 2 > HTTPD_MAX_REQ_HDR_LEN) {
+        send_early_error(fd, "431 Request Header Fields Too Large", "Header fields are too long");
+        return close_session(server, fd);
+    }
+    int method = parse_method(line.substr(0, sp1));
+
+    SimReqAux aux;
+    aux.server = server;
+    aux.fd = fd;
+    aux.headers = head.substr(lineEnd + 2);
+    std::string contentLength;
+    if(header_value(aux.headers, "Content-Length", &contentLength)) aux.remaining = strtoul(contentLength.c_str(), NULL, 10);
+
+    SimReqStorage storage;
+    httpd_req_t &req = *storage.get();
+    req.method = method;
+    memcpy((char *)req.uri, uri.c_str(), uri.size() + 1);
+    req.content_len = aux.remaining;
+    req.handle = server;
+    req.aux = &aux;
+
+    if(method < 0) {
+        httpd_resp_send_err(&req, HTTPD_501_METHOD_NOT_IMPLEMENTED, NULL);
+        return close_session(server, fd);
+    }
+    bool pathMatched;
+    const httpd_uri_t *handler = find_handler(server, req.uri, method, &pathMatched);
+    if(handler == NULL) {
+        httpd_resp_send_err(&req, pathMatched ? HTTPD_405_METHOD_NOT_ALLOWED : HTTPD_404_NOT_FOUND, NULL);
+        return close_session(server, fd);
+    }
+
+    std::string upgrade;
+    if(handler->is_websocket && method == HTTP_GET && header_value(aux.headers, "Upgrade", &upgrade) && strcasecmp(upgrade.c_str(), "websocket") == 0) {
+        if(!ws_handshake(sess, handler, &aux)) {
+            httpd_resp_send_err(&req, HTTPD_400_BAD_REQUEST, NULL);
+            return close_session(server, fd);
+        }
+        sess->wsUri = uri;
+    }
+    run_handler(server, sess, handler, &req, &aux);
+}
+
+static void accept_session(SimHttpd *server) {
+    int fd = accept4(server->listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if(fd < 0) return;
+
+    size_t open;
+    {
+        std::lock_guard<std::mutex> lock(server->lock);
+        open = server->sessions.size();
+    }
+    if(open >= server->config.max_open_sockets) {
+        if(!server->config.lru_purge_enable) {
+            log_w("httpd: no free sessions, closing new connection");
+            close(fd);
+            return;
+        }
+        int oldest = -1;
+        {
+            std::lock_guard<std::mutex> lock(server->lock);
+            uint64_t lru = UINT64_MAX;
+            for(auto &entry : server->sessions) {
+                if(entry.second.lru < lru) {
+                    lru = entry.second.lru;
+                    oldest = entry.first;
+                }
+            }
+        }
+        if(oldest >= 0) close_session(server, oldest);
+    }
+
+    struct timeval recvTimeout = { .tv_sec = server->config.recv_wait_timeout, .tv_usec = 0 };
+    struct timeval sendTimeout = { .tv_sec = server->config.send_wait_timeout, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &recvTimeout, sizeof(recvTimeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+    {
+        std::lock_guard<std::mutex> lock(server->lock);
+        SimSession &sess = server->sessions[fd];
+        sess.fd = fd;
+        sess.lru = ++server->lruCounter;
+    }
+    if(server->config.open_fn && server->config.open_fn(server, fd) != ESP_OK) close_session(server, fd);
+}
+
+static void server_task(void *pvParams) {
+    SimHttpd *server = static_cast<SimHttpd *>(pvParams);
+    std::vector<struct pollfd> fds;
+
+    while(!server->stopping) {
+        // Poll the listener, the wake pipe and every session not held by an async handler.
+        // Sessions with buffered bytes are ready already.
+        bool buffered = false;
+        fds.clear();
+        fds.push_back({ server->listenFd, POLLIN, 0 });
+        fds.push_back({ server->wake[0], POLLIN, 0 });
+        {
+            std::lock_guard<std::mutex> lock(server->lock);
+            for(auto &entry : server->sessions) {
+                if(entry.second.forAsync) continue;
+                fds.push_back({ entry.first, POLLIN, 0 });
+                buffered = buffered || !entry.second.pending.empty();
+            }
+        }
+        if(poll(fds.data(), fds.size(), buffered ? 0 : -1) < 0 && errno != EINTR) {
+            log_e("httpd: poll failed (%d)", errno);
+            break;
+        }
+
+        if(fds[1].revents & POLLIN) {
+            char drain[64];
+            while(read(server->wake[0], drain, sizeof(drain)) == sizeof(drain));
+        }
+        for(;;) {
+            std::function<void()> fn;
+            {
+                std::lock_guard<std::mutex> lock(server->lock);
+                if(server->work.empty()) break;
+                fn = std::move(server->work.front());
+                server->work.pop_front();
+            }
+            fn();
+        }
+
+        for(size_t i = 2; i < fds.size() && !server->stopping; i++) {
+            SimSession *sess = find_session(server, fds[i].fd);
+            if(sess == NULL || sess->forAsync) continue;
+            if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && sess->pending.empty()) continue;
+            {
+                std::lock_guard<std::mutex> lock(server->lock);
+                sess->lru = ++server->lruCounter;
+            }
+            if(sess->webSocket) handle_ws_frame(server, sess);
+            else handle_request(server, sess);
+        }
+        if(fds[0].revents & POLLIN) accept_session(server);
+    }
+
+    std::vector<int> open;
+    {
+        std::lock_guard<std::mutex> lock(server->lock);
+        for(auto &entry : server->sessions) open.push_back(entry.first);
+    }
+    for(int fd : open) close_session(server, fd);
+    close(server->listenFd);
+    xSemaphoreGive(server->stopped);
+    vTaskDelete(NULL);
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config) {
+    if(handle == NULL || config == NULL) return ESP_ERR_INVALID_ARG;
+    SimHttpd *server = new SimHttpd();
+    server->config = *config;
+    if(sim_httpd_port) server->config.server_port = sim_httpd_port;
+
+    // Sockets are close-on-exec so ESP.restart() can bind the port again straight away.
+    server->listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(server->listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(server->config.server_port);
+    if(server->listenFd < 0 || bind(server->listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(server->listenFd, server->config.backlog_conn) < 0 || pipe2(server->wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+        log_e("httpd: cannot listen on port %u (%d)", server->config.server_port, errno);
+        if(server->listenFd >= 0) close(server->listenFd);
+        delete server;
+        return ESP_FAIL;
+    }
+    server->stopped = xSemaphoreCreateBinary();
+
+    if(xTaskCreatePinnedToCore(server_task, "httpd", server->config.stack_size, server, server->config.task_priority, NULL, server->config.core_id) != pdPASS) {
+        close(server->listenFd);
+        close(server->wake[0]);
+        close(server->wake[1]);
+        vSemaphoreDelete(server->stopped);
+        delete server;
+        return ESP_ERR_HTTPD_TASK;
+    }
+    log_i("httpd: listening on port %u", server->config.server_port);
+    *handle = server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle) {
+    SimHttpd *server = static_cast<SimHttpd *>(handle);
+    if(server == NULL) return ESP_ERR_INVALID_ARG;
+    queue_work(server, [server] { server->stopping = true; });
+    xSemaphoreTake(server->stopped, portMAX_DELAY);
+    close(server->wake[0]);
+    close(server->wake[1]);
+    vSemaphoreDelete(server->stopped);
+    if(server->config.global_user_ctx) {
+        if(server->config.global_user_ctx_free_fn) server->config.global_user_ctx_free_fn(server->config.global_user_ctx);
+        else free(server->config.global_user_ctx);
+    }
+    delete server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler) {
+    SimHttpd *server = static_cast<SimHttpd *>(handle);
+    if(server == NULL || uri_handler == NULL || uri_handler->uri == NULL) return ESP_ERR_INVALID_ARG;
+
+    std::lock_guard<std::mutex> lock(server->lock);
+    for(const httpd_uri_t &h : server->handlers) {
+        if(h.method == uri_handler->method && strcmp(h.uri, uri_handler->uri) == 0) return ESP_ERR_HTTPD_HANDLER_EXISTS;
+    }
+    if(server->handlers.size() >= server->config.max_uri_handlers) {
+        log_w("httpd: no slot left for URI %s", uri_handler->uri);
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+    }
+    // Handlers are only registered before requests come in, so growing the vector is safe here.
+    server->handlers.push_back(*uri_handler);
+    server->handlers.back().uri = strdup(uri_handler->uri);
+    return ESP_OK;
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r) {
+    if(r == NULL) return 0;
+    const char *q = strchr(r->uri, '?');
+    return q ? strcspn(q + 1, "#") : 0;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len) {
+    if(r == NULL || buf == NULL) return ESP_ERR_INVALID_ARG;
+    const char *q = strchr(r->uri, '?');
+    if(q == NULL) return ESP_ERR_NOT_FOUND;
+    size_t len = strcspn(q + 1, "#");
+    if(buf_len == 0) return ESP_ERR_HTTPD_RESULT_TRUNC;
+    size_t copied = std::min(len, buf_len - 1);
+    memcpy(buf, q + 1, copied);
+    buf[copied] = 0;
+    return (buf_len < len + 1) ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size) {
+    if(qry == NULL || key == NULL || val == NULL) return ESP_ERR_INVALID_ARG;
+    size_t keyLen = strlen(key);
+    for(const char *p = qry; *p;) {
+        const char *end = p + strcspn(p, "&");
+        if((size_t)(end - p) > keyLen && p[keyLen] == '=' && strncmp(p, key, keyLen) == 0) {
+            const char *v = p + keyLen + 1;
+            size_t len = end - v;
+            if(val_size == 0) return ESP_ERR_HTTPD_RESULT_TRUNC;
+            size_t copied = std::min(len, val_size - 1);
+            memcpy(val, v, copied);
+            val[copied] = 0;
+            return (copied < len) ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field) {
+    std::string value;
+    if(r == NULL || field == NULL || !header_value(aux_of(r)->headers, field, &value)) return 0;
+    return value.size();
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size) {
+    if(r == NULL || field == NULL || val == NULL) return ESP_ERR_INVALID_ARG;
+    std::string value;
+    if(!header_value(aux_of(r)->headers, field, &value)) return ESP_ERR_NOT_FOUND;
+    if(val_size == 0) return ESP_ERR_HTTPD_RESULT_TRUNC;
+    size_t copied = std::min(value.size(), val_size - 1);
+    memcpy(val, value.data(), copied);
+    val[copied] = 0;
+    return (copied < value.size()) ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len) {
+    if(r == NULL || buf == NULL) return HTTPD_SOCK_ERR_INVALID;
+    SimReqAux *aux = aux_of(r);
+    SimSession *sess = find_session(aux->server, aux->fd);
+    if(sess == NULL) return HTTPD_SOCK_ERR_INVALID;
+    if(aux->remaining == 0) return 0;
+    int n = session_recv(sess, buf, std::min(buf_len, aux->remaining));
+    if(n > 0) aux->remaining -= n;
+    return (n == 0) ? HTTPD_SOCK_ERR_FAIL : n;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r) { return r ? aux_of(r)->fd : -1; }
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status) {
+    if(r == NULL || status == NULL) return ESP_ERR_INVALID_ARG;
+    aux_of(r)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type) {
+    if(r == NULL || type == NULL) return ESP_ERR_INVALID_ARG;
+    aux_of(r)->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value) {
+    if(r == NULL || field == NULL || value == NULL) return ESP_ERR_INVALID_ARG;
+    SimReqAux *aux = aux_of(r);
+    if(aux->respHeaders.size() >= aux->server->config.max_resp_headers) return ESP_ERR_HTTPD_RESP_HDR;
+    aux->respHeaders.push_back({ field, value });
+    return ESP_OK;
+}
+
+static esp_err_t send_head(httpd_req_t *r, const char *lengthField) {
+    SimReqAux *aux = aux_of(r);
+    std::string head = "HTTP/1.1 " + aux->status + "\r\nContent-Type: " + aux->type + "\r\n" + lengthField + "\r\n";
+    for(auto &h : aux->respHeaders) head += h.first + ": " + h.second + "\r\n";
+    head += "\r\n";
+    return send_all(aux->fd, head.data(), head.size());
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+    if(r == NULL) return ESP_ERR_INVALID_ARG;
+    if(buf == NULL) buf_len = 0;
+    else if(buf_len == HTTPD_RESP_USE_STRLEN) buf_len = strlen(buf);
+    char length[40];
+    snprintf(length, sizeof(length), "Content-Length: %u", (unsigned)buf_len);
+    if(send_head(r, length) != ESP_OK) return ESP_ERR_HTTPD_RESP_HDR;
+    if(buf_len && send_all(aux_of(r)->fd, buf, buf_len) != ESP_OK) return ESP_ERR_HTTPD_RESP_SEND;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+    if(r == NULL) return ESP_ERR_INVALID_ARG;
+    SimReqAux *aux = aux_of(r);
+    if(buf == NULL) buf_len = 0;
+    else if(buf_len == HTTPD_RESP_USE_STRLEN) buf_len = strlen(buf);
+    if(!aux->chunked) {
+        if(send_head(r, "Transfer-Encoding: chunked") != ESP_OK) return ESP_ERR_HTTPD_RESP_HDR;
+        aux->chunked = true;
+    }
+    // A zero length chunk ends the response.
+    char size[16];
+    int len = snprintf(size, sizeof(size), "%x\r\n", (unsigned)buf_len);
+    if(send_all(aux->fd, size, len) != ESP_OK) return ESP_ERR_HTTPD_RESP_SEND;
+    if(buf_len && send_all(aux->fd, buf, buf_len) != ESP_OK) return ESP_ERR_HTTPD_RESP_SEND;
+    return send_all(aux->fd, "\r\n", 2);
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg) {
+    const char *status;
+    const char *text;
+    switch(error) {
+        case HTTPD_501_METHOD_NOT_IMPLEMENTED: status = "501 Method Not Implemented"; text = "Server does not support this method"; break;
+        case HTTPD_505_VERSION_NOT_SUPPORTED: status = "505 Version Not Supported"; text = "HTTP version not supported by server"; break;
+        case HTTPD_400_BAD_REQUEST: status = HTTPD_400; text = "Bad request syntax"; break;
+        case HTTPD_401_UNAUTHORIZED: status = "401 Unauthorized"; text = "No permission -- see authorization schemes"; break;
+        case HTTPD_403_FORBIDDEN: status = "403 Forbidden"; text = "Request forbidden -- authorization will not help"; break;
+        case HTTPD_404_NOT_FOUND: status = HTTPD_404; text = "Nothing matches the given URI"; break;
+        case HTTPD_405_METHOD_NOT_ALLOWED: status = "405 Method Not Allowed"; text = "Specified method is invalid for this resource"; break;
+        case HTTPD_408_REQ_TIMEOUT: status = HTTPD_408; text = "Server closed this connection"; break;
+        case HTTPD_411_LENGTH_REQUIRED: status = "411 Length Required"; text = "Client must specify Content-Length"; break;
+        case HTTPD_414_URI_TOO_LONG: status = "414 URI Too Long"; text = "URI is too long"; break;
+        case HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE: status = "431 Request Header Fields Too Large"; text = "Header fields are too long"; break;
+        default: status = HTTPD_500; text = "Internal Server Error"; break;
+    }
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+    return httpd_resp_send(req, msg ? msg : text, HTTPD_RESP_USE_STRLEN);
+}
+
+int httpd_send(httpd_req_t *r, const char *buf, size_t buf_len) {
+    if(r == NULL || buf == NULL) return HTTPD_SOCK_ERR_INVALID;
+    return sock_send(aux_of(r)->fd, buf, buf_len);
+}
+
+esp_err_t httpd_req_async_handler_begin(httpd_req_t *r, httpd_req_t **out) {
+    if(r == NULL || out == NULL) return ESP_ERR_INVALID_ARG;
+    SimReqAux *aux = aux_of(r);
+    SimSession *sess = find_session(aux->server, aux->fd);
+    if(sess == NULL) return ESP_ERR_INVALID_ARG;
+
+    httpd_req_t *copy = (httpd_req_t *)malloc(sizeof(httpd_req_t));
+    if(copy == NULL) return ESP_ERR_NO_MEM;
+    memcpy((void *)copy, r, sizeof(httpd_req_t));
+    copy->aux = new SimReqAux(*aux);
+    aux->detached = true;
+    std::lock_guard<std::mutex> lock(aux->server->lock);
+    sess->forAsync = true;
+    *out = copy;
+    return ESP_OK;
+}
+
+esp_err_t httpd_req_async_handler_complete(httpd_req_t *r) {
+    if(r == NULL) return ESP_ERR_INVALID_ARG;
+    SimReqAux *aux = aux_of(r);
+    SimHttpd *server = aux->server;
+    {
+        std::lock_guard<std::mutex> lock(server->lock);
+        auto it = server->sessions.find(aux->fd);
+        if(it != server->sessions.end()) it->second.forAsync = false;
+    }
+    delete aux;
+    free(r);
+    // The session is back in the poll set once the server wakes up.
+    wake_server(server);
+    return ESP_OK;
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd) {
+    SimHttpd *server = static_cast<SimHttpd *>(handle);
+    if(server == NULL) return ESP_ERR_INVALID_ARG;
+    if(find_session(server, sockfd) == NULL) return ESP_ERR_NOT_FOUND;
+    queue_work(server, [server, sockfd] { close_session(server, sockfd); });
+    return ESP_OK;
+}
+
+esp_err_t httpd_ws_recv_frame(httpd_req_t *req, httpd_ws_frame_t *pkt, size_t max_len) {
+    if(req == NULL || pkt == NULL) return ESP_ERR_INVALID_ARG;
+    SimReqAux *aux = aux_of(req);
+    pkt->final = aux->wsFinal;
+    pkt->fragmented = !aux->wsFinal || aux->wsType == HTTPD_WS_TYPE_CONTINUE;
+    pkt->type = aux->wsType;
+    pkt->len = aux->wsLen;
+    if(max_len == 0) return ESP_OK;
+    if(pkt->payload == NULL) return ESP_ERR_INVALID_ARG;
+    if(aux->wsLen > max_len) return ESP_ERR_INVALID_SIZE;
+
+    SimSession *sess = find_session(aux->server, aux->fd);
+    if(sess == NULL) return ESP_FAIL;
+    size_t offset = aux->wsRead;
+    if(!session_recv_exact(sess, pkt->payload + offset, aux->wsLen - offset)) return ESP_FAIL;
+    aux->wsRead = aux->wsLen;
+    for(size_t i = 0; aux->wsMasked && i < aux->wsLen; i++) pkt->payload[i] ^= aux->wsMask[i % 4];
+    return ESP_OK;
+}
+
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd, httpd_ws_frame_t *frame) {
+    if(hd == NULL || frame == NULL) return ESP_ERR_INVALID_ARG;
+    if(httpd_ws_get_fd_info(hd, fd) != HTTPD_WS_CLIENT_WEBSOCKET) return ESP_ERR_INVALID_ARG;
+    return ws_send(fd, frame);
+}
+
+httpd_ws_client_info_t httpd_ws_get_fd_info(httpd_handle_t hd, int fd) {
+    SimHttpd *server = static_cast<SimHttpd *>(hd);
+    if(server == NULL) return HTTPD_WS_CLIENT_INVALID;
+    std::lock_guard<std::mutex> lock(server->lock);
+    auto it = server->sessions.find(fd);
+    if(it == server->sessions.end()) return HTTPD_WS_CLIENT_INVALID;
+    return it->second.webSocket ? HTTPD_WS_CLIENT_WEBSOCKET : HTTPD_WS_CLIENT_HTTP;
+}
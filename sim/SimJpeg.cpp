@@ -0,0 +1,331 @@
+#include "SimJpeg.h"
+#include <Arduino.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+const size_t SIM_JPEG_CHUNK = 4096;         // Encoder output handed to the callback at a time.
+
+struct sim_jpeg_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf escape;
+};
+
+static void sim_jpeg_error_exit(j_common_ptr cinfo) {
+    char message[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, message);
+    log_d("libjpeg: %s", message);
+    longjmp(((sim_jpeg_error *)cinfo->err)->escape, 1);
+}
+
+static void sim_jpeg_quiet(j_common_ptr cinfo) {}
+
+static void sim_jpeg_errors(sim_jpeg_error *err) {
+    jpeg_std_error(&err->mgr);
+    err->mgr.error_exit = sim_jpeg_error_exit;
+    err->mgr.output_message = sim_jpeg_quiet;
+}
+
+// Encoder destination that passes full chunks to a jpg_out_cb.
+struct sim_jpeg_dest {
+    struct jpeg_destination_mgr mgr;
+    jpg_out_cb cb;
+    void *arg;
+    size_t index;
+    bool failed;
+    JOCTET buf[SIM_JPEG_CHUNK];
+};
+
+static void sim_dest_emit(sim_jpeg_dest *dest, size_t len) {
+    if(!dest->failed && len) {
+        if(dest->cb(dest->arg, dest->index, dest->buf, len) != len) dest->failed = true;
+        dest->index += len;
+    }
+    dest->mgr.next_output_byte = dest->buf;
+    dest->mgr.free_in_buffer = SIM_JPEG_CHUNK;
+}
+
+static void sim_dest_init(j_compress_ptr cinfo) {
+    sim_jpeg_dest *dest = (sim_jpeg_dest *)cinfo->dest;
+    dest->mgr.next_output_byte = dest->buf;
+    dest->mgr.free_in_buffer = SIM_JPEG_CHUNK;
+}
+
+static boolean sim_dest_empty(j_compress_ptr cinfo) {
+    sim_jpeg_dest *dest = (sim_jpeg_dest *)cinfo->dest;
+    sim_dest_emit(dest, SIM_JPEG_CHUNK);
+    return TRUE;
+}
+
+static void sim_dest_term(j_compress_ptr cinfo) {
+    sim_jpeg_dest *dest = (sim_jpeg_dest *)cinfo->dest;
+    sim_dest_emit(dest, SIM_JPEG_CHUNK - dest->mgr.free_in_buffer);
+}
+
+bool sim_jpeg_encode(const uint8_t *pixels, uint16_t width, uint16_t height, bool gray, int quality, jpg_out_cb cb, void *arg) {
+    if(!pixels || !width || !height || !cb) return false;
+
+    struct jpeg_compress_struct cinfo;
+    sim_jpeg_error err;
+    sim_jpeg_dest *dest = (sim_jpeg_dest *)malloc(sizeof(sim_jpeg_dest));
+    if(dest == NULL) return false;
+    dest->mgr.init_destination = sim_dest_init;
+    dest->mgr.empty_output_buffer = sim_dest_empty;
+    dest->mgr.term_destination = sim_dest_term;
+    dest->cb = cb;
+    dest->arg = arg;
+    dest->index = 0;
+    dest->failed = false;
+
+    cinfo.err = NULL;
+    sim_jpeg_errors(&err);
+    cinfo.err = &err.mgr;
+    if(setjmp(err.escape)) {
+        jpeg_destroy_compress(&cinfo);
+        free(dest);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    cinfo.dest = &dest->mgr;
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = gray ? 1 : 3;
+    cinfo.in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, constrain(quality, 1, 100), TRUE);
+    if(!gray) {
+        cinfo.comp_info[0].h_samp_factor = 2;
+        cinfo.comp_info[0].v_samp_factor = 1;
+    }
+
+    jpeg_start_compress(&cinfo, TRUE);
+    size_t stride = (size_t)width * cinfo.input_components;
+    while(cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = (JSAMPROW)(pixels + cinfo.next_scanline * stride);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    bool ok = !dest->failed;
+    jpeg_destroy_compress(&cinfo);
+    free(dest);
+    return ok;
+}
+
+// Decoder state lives on the heap so it survives the longjmp out of libjpeg intact.
+struct sim_jpeg_decoder {
+    struct jpeg_decompress_struct cinfo;
+    sim_jpeg_error err;
+    uint8_t *band;
+    uint8_t *block;
+};
+
+// Decode at 1/2^scale, handing rows to emit in bands of bandRows. Returns false on a bad JPEG or when emit does.
+template<typename Start, typename Emit>
+static bool sim_jpeg_run(const uint8_t *jpg, size_t len, uint8_t scale, Start start, Emit emit) {
+    sim_jpeg_decoder *d = (sim_jpeg_decoder *)calloc(1, sizeof(sim_jpeg_decoder));
+    if(d == NULL) return false;
+    sim_jpeg_errors(&d->err);
+    d->cinfo.err = &d->err.mgr;
+    if(setjmp(d->err.escape)) {
+        jpeg_destroy_decompress(&d->cinfo);
+        free(d->band);
+        free(d->block);
+        free(d);
+        return false;
+    }
+    jpeg_create_decompress(&d->cinfo);
+    jpeg_mem_src(&d->cinfo, (unsigned char *)jpg, len);
+    jpeg_read_header(&d->cinfo, TRUE);
+    d->cinfo.out_color_space = JCS_RGB;
+    d->cinfo.scale_num = 1;
+    d->cinfo.scale_denom = 1 << scale;
+    jpeg_start_decompress(&d->cinfo);
+
+    // The on-chip decoder rounds the scaled size down and works in MCUs.
+    uint16_t outW = min((JDIMENSION)(d->cinfo.image_width >> scale), d->cinfo.output_width);
+    uint16_t outH = min((JDIMENSION)(d->cinfo.image_height >> scale), d->cinfo.output_height);
+    uint16_t mcuW = max(8 * d->cinfo.max_h_samp_factor >> scale, 1);
+    uint16_t mcuH = max(8 * d->cinfo.max_v_samp_factor >> scale, 1);
+    size_t stride = (size_t)d->cinfo.output_width * 3;
+    d->band = (uint8_t *)malloc(stride * mcuH);
+    d->block = (uint8_t *)malloc((size_t)mcuW * mcuH * 3);
+    bool ok = d->band && d->block && outW && outH && start(outW, outH);
+
+    for(uint16_t y = 0; ok && y < outH; y += mcuH) {
+        uint16_t rows = 0;
+        while(rows < mcuH && d->cinfo.output_scanline < d->cinfo.output_height) {
+            JSAMPROW row = d->band + rows * stride;
+            rows += jpeg_read_scanlines(&d->cinfo, &row, 1);
+        }
+        ok = emit(d->band, stride, y, min((uint16_t)(outH - y), rows), outW, mcuW, d->block);
+    }
+
+    jpeg_destroy_decompress(&d->cinfo);
+    free(d->band);
+    free(d->block);
+    free(d);
+    return ok;
+}
+
+bool sim_jpeg_decode(const uint8_t *jpg, size_t len, std::vector<uint8_t> *rgb, uint16_t *width, uint16_t *height) {
+    return sim_jpeg_run(jpg, len, 0,
+        [&](uint16_t w, uint16_t h) {
+            *width = w;
+            *height = h;
+            rgb->resize((size_t)w * h * 3);
+            return true;
+        },
+        [&](const uint8_t *band, size_t stride, uint16_t y, uint16_t rows, uint16_t w, uint16_t mcuW, uint8_t *block) {
+            for(uint16_t r = 0; r < rows; r++) memcpy(rgb->data() + (size_t)(y + r) * w * 3, band + r * stride, (size_t)w * 3);
+            return true;
+        });
+}
+
+esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void *arg) {
+    if(!reader || !writer || scale > JPG_SCALE_MAX) return ESP_FAIL;
+    uint8_t *jpg = (uint8_t *)malloc(len);
+    if(jpg == NULL) return ESP_FAIL;
+    if(reader(arg, 0, jpg, len) != len) {
+        free(jpg);
+        return ESP_FAIL;
+    }
+
+    uint16_t outW = 0, outH = 0;
+    bool ok = sim_jpeg_run(jpg, len, scale,
+        [&](uint16_t w, uint16_t h) {
+            outW = w;
+            outH = h;
+            return writer(arg, 0, 0, w, h, NULL);
+        },
+        [&](const uint8_t *band, size_t stride, uint16_t y, uint16_t rows, uint16_t w, uint16_t mcuW, uint8_t *block) {
+            // Blocks go out packed, one MCU at a time, left to right.
+            for(uint16_t x = 0; x < w; x += mcuW) {
+                uint16_t bw = min((uint16_t)(w - x), mcuW);
+                for(uint16_t r = 0; r < rows; r++) memcpy(block + (size_t)r * bw * 3, band + r * stride + (size_t)x * 3, (size_t)bw * 3);
+                if(!writer(arg, x, y, bw, rows, block)) return false;
+            }
+            return true;
+        });
+    free(jpg);
+    if(!ok || !writer(arg, outW, outH, outW, outH, NULL)) return ESP_FAIL;
+    return ESP_OK;
+}
+
+uint8_t sim_raw_bytes_per_pixel(pixformat_t format) {
+    switch(format) {
+        case PIXFORMAT_GRAYSCALE: return 1;
+        case PIXFORMAT_RGB565:
+        case PIXFORMAT_YUV422: return 2;
+        case PIXFORMAT_RGB888: return 3;
+        default: return 0;
+    }
+}
+
+static uint8_t clamp8(int v) { return (v < 0) ? 0 : (v > 255) ? 255 : v; }
+
+size_t sim_raw_to_rgb(const uint8_t *src, size_t srcLen, pixformat_t format, uint8_t *rgb) {
+    uint8_t bpp = sim_raw_bytes_per_pixel(format);
+    if(bpp == 0) return 0;
+    size_t pixels = srcLen / bpp;
+    if(format == PIXFORMAT_YUV422) pixels &= ~(size_t)1;
+
+    for(size_t i = 0; i < pixels; i++, rgb += 3) {
+        const uint8_t *p = src + i * bpp;
+        switch(format) {
+            case PIXFORMAT_GRAYSCALE:
+                rgb[0] = rgb[1] = rgb[2] = p[0];
+                break;
+            case PIXFORMAT_RGB565:
+                // Big endian, as the sensor sends it.
+                rgb[0] = p[0] & 0xF8;
+                rgb[1] = ((p[0] & 0x07) << 5) | ((p[1] & 0xE0) >> 3);
+                rgb[2] = (p[1] & 0x1F) << 3;
+                break;
+            case PIXFORMAT_RGB888:
+                rgb[0] = p[2];
+                rgb[1] = p[1];
+                rgb[2] = p[0];
+                break;
+            default: {
+                // YUYV: each pixel has its own Y and shares U and V with its pair.
+                const uint8_t *pair = src + (i & ~(size_t)1) * 2;
+                int y = p[0];
+                int u = pair[1] - 128;
+                int v = pair[3] - 128;
+                rgb[0] = clamp8(y + ((359 * v) >> 8));
+                rgb[1] = clamp8(y - ((88 * u + 183 * v) >> 8));
+                rgb[2] = clamp8(y + ((454 * u) >> 8));
+                break;
+            }
+        }
+    }
+    return pixels;
+}
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void *arg) {
+    uint8_t bpp = sim_raw_bytes_per_pixel(format);
+    size_t pixels = (size_t)width * height;
+    if(bpp == 0 || src_len < pixels * bpp) return false;
+    if(format == PIXFORMAT_GRAYSCALE) return sim_jpeg_encode(src, width, height, true, quality, cb, arg);
+
+    std::vector<uint8_t> rgb(pixels * 3);
+    sim_raw_to_rgb(src, pixels * bpp, format, rgb.data());
+    return sim_jpeg_encode(rgb.data(), width, height, false, quality, cb, arg);
+}
+
+bool frame2jpg_cb(camera_fb_t *fb, uint8_t quality, jpg_out_cb cb, void *arg) {
+    return fmt2jpg_cb(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, cb, arg);
+}
+
+struct sim_jpg_buffer {
+    uint8_t *buf;
+    size_t len;
+    size_t capacity;
+};
+
+static size_t sim_jpg_append(void *arg, size_t index, const void *data, size_t len) {
+    sim_jpg_buffer *out = (sim_jpg_buffer *)arg;
+    if(out->len + len > out->capacity) {
+        size_t grown = (out->len + len) * 2;
+        uint8_t *buf = (uint8_t *)realloc(out->buf, grown);
+        if(buf == NULL) return 0;
+        out->buf = buf;
+        out->capacity = grown;
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return len;
+}
+
+bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t **out, size_t *out_len) {
+    sim_jpg_buffer jpg = { NULL, 0, 0 };
+    if(!fmt2jpg_cb(src, src_len, width, height, format, quality, sim_jpg_append, &jpg)) {
+        free(jpg.buf);
+        return false;
+    }
+    *out = jpg.buf;
+    *out_len = jpg.len;
+    return true;
+}
+
+bool frame2jpg(camera_fb_t *fb, uint8_t quality, uint8_t **out, size_t *out_len) {
+    return fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len);
+}
+
+bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint8_t *rgb_buf) {
+    if(format != PIXFORMAT_JPEG) {
+        size_t pixels = sim_raw_to_rgb(src_buf, src_len, format, rgb_buf);
+        // The driver's RGB888 is blue first.
+        for(size_t i = 0; i < pixels; i++) std::swap(rgb_buf[i * 3], rgb_buf[i * 3 + 2]);
+        return pixels > 0;
+    }
+
+    std::vector<uint8_t> rgb;
+    uint16_t width, height;
+    if(!sim_jpeg_decode(src_buf, src_len, &rgb, &width, &height)) return false;
+    for(size_t i = 0; i < rgb.size(); i += 3) {
+        rgb_buf[i] = rgb[i + 2];
+        rgb_buf[i + 1] = rgb[i + 1];
+        rgb_buf[i + 2] = rgb[i];
+    }
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef SIM_JPEG
+#define SIM_JPEG
+
+// JPEG coding for the simulator, on libjpeg. The esp32-camera converters in img_converters.h and
+// esp_jpg_decode.h are built on these, and so are the simulated sensor's frames.
+#include "img_converters.h"
+#include <vector>
+
+// Encode 8 bit grey, or RGB888 with red first, as a baseline JPEG with the OV2640's 4:2:2
+// sampling, through the callback in 4 KB pieces. Quality is libjpeg's 1 - 100.
+bool sim_jpeg_encode(const uint8_t *pixels, uint16_t width, uint16_t height, bool gray, int quality, jpg_out_cb cb, void *arg);
+// Decode a JPEG to RGB888 with red first.
+bool sim_jpeg_decode(const uint8_t *jpg, size_t len, std::vector<uint8_t> *rgb, uint16_t *width, uint16_t *height);
+// Convert whole pixels of a raw camera format to RGB888 with red first. Returns the pixel count.
+size_t sim_raw_to_rgb(const uint8_t *src, size_t srcLen, pixformat_t format, uint8_t *rgb);
+// Bytes per pixel of a raw camera format, 0 for JPEG and formats the camera does not produce.
+uint8_t sim_raw_bytes_per_pixel(pixformat_t format);
+
+#endif /* SimJpeg.h */
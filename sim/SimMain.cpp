@@ -0,0 +1,147 @@
+// Host entry point: the camera, capture pipeline and web server as main.cpp starts them once
+// WiFi is up, with a simulated sensor behind esp_camera and the HTTP server on a local port.
+//
+//   .pio/build/native/program --port 8080 --scene walk --fps 25
+//   .pio/build/native/program --frames ./clips/yard --framesize 9 --quality 12 --jitter-ms 5
+#include "esp_camera.h"
+#include "SentryCamera.h"
+#include "FrameBroadcaster.h"
+#include "MotionDetector.h"
+#include "ClipRing.h"
+#include "ConversionPool.h"
+#include "SimCamera.h"
+#include "Sim.h"
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Test builds bring their own main() and start the same stages themselves.
+#ifndef PIO_UNIT_TESTING
+
+const uint16_t SIM_DEFAULT_PORT = 8080;
+
+// From app_httpd.cpp. Its header also declares the file's static handlers, so it stays out of here.
+void startCameraServer();
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --port N          HTTP port (default %u)\n"
+        "  --frames DIR      Serve the JPEGs in DIR, in name order, looping\n"
+        "  --scene NAME      Synthetic scene when no frames: static, walk or noise (default walk)\n"
+        "  --noise N         Sensor noise amplitude for static and walk (default 2)\n"
+        "  --fps F           Frame rate (default: the sensor's rate for the frame size and XCLK)\n"
+        "  --jitter-ms N     Move each frame up to N ms early or late\n"
+        "  --framesize N     framesize_t after init. Buffers keep the size init gave them, as on the board\n"
+        "  --quality N       JPEG quality 0-63 after init (default: the firmware's)\n"
+        "  --sensor NAME     ov2640, ov3660 or ov5640 (default ov2640)\n"
+        "  --nvs FILE        Keep NVS in FILE across runs and restarts\n"
+        "  --seconds N       Exit after N seconds\n",
+        name, SIM_DEFAULT_PORT);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "port", required_argument, NULL, 'p' },
+        { "frames", required_argument, NULL, 'f' },
+        { "scene", required_argument, NULL, 's' },
+        { "noise", required_argument, NULL, 'n' },
+        { "fps", required_argument, NULL, 'r' },
+        { "jitter-ms", required_argument, NULL, 'j' },
+        { "framesize", required_argument, NULL, 'z' },
+        { "quality", required_argument, NULL, 'q' },
+        { "sensor", required_argument, NULL, 'S' },
+        { "nvs", required_argument, NULL, 'N' },
+        { "seconds", required_argument, NULL, 't' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    uint16_t port = SIM_DEFAULT_PORT;
+    const char *frames = NULL;
+    const char *nvs = NULL;
+    sim_scene_t scene = SIM_SCENE_WALK;
+    uint8_t noise = 2;
+    float fps = 0;
+    uint16_t jitterMs = 0;
+    int framesize = -1;
+    int quality = -1;
+    uint16_t pid = OV2640_PID;
+    uint32_t seconds = 0;
+
+    for(int opt; (opt = getopt_long(argc, argv, "h", options, NULL)) != -1;) {
+        switch(opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'f': frames = optarg; break;
+            case 'n': noise = atoi(optarg); break;
+            case 'r': fps = atof(optarg); break;
+            case 'j': jitterMs = atoi(optarg); break;
+            case 'z': framesize = atoi(optarg); break;
+            case 'q': quality = atoi(optarg); break;
+            case 'N': nvs = optarg; break;
+            case 't': seconds = atoi(optarg); break;
+            case 's':
+                if(strcmp(optarg, "static") == 0) scene = SIM_SCENE_STATIC;
+                else if(strcmp(optarg, "walk") == 0) scene = SIM_SCENE_WALK;
+                else if(strcmp(optarg, "noise") == 0) scene = SIM_SCENE_NOISE;
+                else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'S':
+                if(strcmp(optarg, "ov2640") == 0) pid = OV2640_PID;
+                else if(strcmp(optarg, "ov3660") == 0) pid = OV3660_PID;
+                else if(strcmp(optarg, "ov5640") == 0) pid = OV5640_PID;
+                else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 2;
+        }
+    }
+    if(framesize >= FRAMESIZE_INVALID || quality > 63) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // Clients hanging up mid-send must fail the write, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+    sim_set_restart_args(argv);
+    if(nvs) sim_nvs_open(nvs);
+
+    sim_camera.setScene(scene, noise);
+    if(frames && !sim_camera.loadFrames(frames)) return 1;
+    sim_camera.setFrameRate(fps, jitterMs);
+    sim_camera.setSensorPid(pid);
+
+    // The same start-up as the watchdog task in main.cpp, minus ESP-NOW and WiFi.
+    Serial.begin(115200);
+    SentryCamera sc;
+    sc.initCamera();
+    sensor_t *s = esp_camera_sensor_get();
+    if(s == NULL) return 1;
+    if(quality >= 0) s->set_quality(s, quality);
+    if(framesize >= 0) {
+        s->set_framesize(s, (framesize_t)framesize);
+        conversion_pool.reset((framesize_t)framesize);
+    }
+
+    frame_broadcaster.start();
+    frame_broadcaster.setContinuous(true);
+    motion_detector.start();
+    clip_ring.begin(CLIP_RING_BYTES);
+    sim_httpd_port = port;
+    startCameraServer();
+    Serial.printf("SentryCam simulator on http://127.0.0.1:%u/\n", port);
+
+    for(uint32_t elapsed = 0; seconds == 0 || elapsed < seconds; elapsed++) delay(1000);
+    Serial.printf("%u frames, %u dropped, %u overflowed\n", sim_camera.getFrameCount(), sim_camera.getDroppedCount(), sim_camera.getOverflowCount());
+    // Tasks are still running, so leave without destroying the globals they use.
+    _exit(0);
+}
+
+#endif /* PIO_UNIT_TESTING */
@@ -0,0 +1,131 @@
+#include <Preferences.h>
+#include "Sim.h"
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+const size_t NVS_KEY_NAME_MAX = 15;     // Namespace and key names, as in ESP-IDF.
+
+typedef std::map<std::string, std::vector<uint8_t>> SimNvsNamespace;
+
+static std::map<std::string, SimNvsNamespace> nvs;
+static std::string nvs_path;
+static std::mutex nvs_lock;
+
+// File layout: per entry, namespace, key, then a 32 bit length and the value. The caller holds the lock.
+static bool nvs_save() {
+    if(nvs_path.empty()) return true;
+    std::string tmp = nvs_path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if(f == NULL) return false;
+    bool ok = true;
+    for(auto &ns : nvs) {
+        for(auto &entry : ns.second) {
+            uint32_t len = entry.second.size();
+            ok = ok && fwrite(ns.first.c_str(), 1, ns.first.size() + 1, f) == ns.first.size() + 1;
+            ok = ok && fwrite(entry.first.c_str(), 1, entry.first.size() + 1, f) == entry.first.size() + 1;
+            ok = ok && fwrite(&len, sizeof(len), 1, f) == 1;
+            ok = ok && (len == 0 || fwrite(entry.second.data(), 1, len, f) == len);
+        }
+    }
+    ok = (fclose(f) == 0) && ok;
+    return ok && rename(tmp.c_str(), nvs_path.c_str()) == 0;
+}
+
+static bool nvs_read_name(FILE *f, std::string *name) {
+    name->clear();
+    for(int c; (c = fgetc(f)) != EOF;) {
+        if(c == 0) return true;
+        if(name->size() == NVS_KEY_NAME_MAX) return false;
+        name->push_back((char)c);
+    }
+    return false;
+}
+
+bool sim_nvs_open(const char *path) {
+    std::lock_guard<std::mutex> lock(nvs_lock);
+    nvs_path = path;
+    nvs.clear();
+
+    // A missing file is an erased partition.
+    FILE *f = fopen(path, "rb");
+    if(f == NULL) return true;
+    std::string ns, key;
+    bool ok = true;
+    while(ok && nvs_read_name(f, &ns)) {
+        uint32_t len = 0;
+        ok = nvs_read_name(f, &key) && fread(&len, sizeof(len), 1, f) == 1;
+        if(!ok) break;
+        std::vector<uint8_t> value(len);
+        ok = len == 0 || fread(value.data(), 1, len, f) == len;
+        if(ok) nvs[ns][key] = std::move(value);
+    }
+    fclose(f);
+    if(!ok) log_e("NVS file %s is damaged. Kept what was readable.", path);
+    return ok;
+}
+
+bool Preferences::begin(const char *name, bool readOnly, const char *partition_label) {
+    if(opened || name == NULL || strlen(name) > NVS_KEY_NAME_MAX) return false;
+    ns = name;
+    opened = true;
+    this->readOnly = readOnly;
+    return true;
+}
+
+void Preferences::end() { opened = false; }
+
+bool Preferences::clear() {
+    if(!opened || readOnly) return false;
+    std::lock_guard<std::mutex> lock(nvs_lock);
+    nvs.erase(ns.c_str());
+    return nvs_save();
+}
+
+bool Preferences::remove(const char *key) {
+    if(!opened || readOnly || key == NULL) return false;
+    std::lock_guard<std::mutex> lock(nvs_lock);
+    if(nvs[ns.c_str()].erase(key) == 0) return false;
+    return nvs_save();
+}
+
+bool Preferences::isKey(const char *key) {
+    if(!opened || key == NULL) return false;
+    std::lock_guard<std::mutex> lock(nvs_lock);
+    return nvs[ns.c_str()].count(key) > 0;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len) {
+    if(!opened || readOnly || key == NULL || strlen(key) > NVS_KEY_NAME_MAX || (value == NULL && len)) return 0;
+    std::lock_guard<std::mutex> lock(nvs_lock);
+    const uint8_t *p = static_cast<const uint8_t *>(value);
+    nvs[ns.c_str()][key] = std::vector<uint8_t>(p, p + len);
+    return nvs_save() ? len : 0;
+}
+
+size_t Preferences::getBytesLength(const char *key) {
+    if(!opened || key == NULL) return 0;
+    std::lock_guard<std::mutex> lock(nvs_lock);
+    SimNvsNamespace &entries = nvs[ns.c_str()];
+    auto it = entries.find(key);
+    return (it != entries.end()) ? it->second.size() : 0;
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen) {
+    if(!opened || key == NULL || buf == NULL) return 0;
+    std::lock_guard<std::mutex> lock(nvs_lock);
+    SimNvsNamespace &entries = nvs[ns.c_str()];
+    auto it = entries.find(key);
+    // Like nvs_get_blob(), a buffer too small for the value gets nothing.
+    if(it == entries.end() || it->second.size() > maxLen) return 0;
+    memcpy(buf, it->second.data(), it->second.size());
+    return it->second.size();
+}
+
+size_t Preferences::putUInt(const char *key, uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+
+uint32_t Preferences::getUInt(const char *key, uint32_t defaultValue) {
+    uint32_t value;
+    return (getBytesLength(key) == sizeof(value) && getBytes(key, &value, sizeof(value)) == sizeof(value)) ? value : defaultValue;
+}
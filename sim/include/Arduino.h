@@ -0,0 +1,75 @@
+#ifndef SIM_ARDUINO
+#define SIM_ARDUINO
+
+// The parts of the Arduino-ESP32 core the firmware uses, for the host-native simulator build.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <cmath>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "esp32-hal-log.h"
+#include "esp32-hal-ledc.h"
+#include "WString.h"
+
+using std::min;
+using std::max;
+using std::abs;
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+#define LOW     0x0
+#define HIGH    0x1
+#define INPUT   0x01
+#define OUTPUT  0x03
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+uint32_t esp_random();
+char *itoa(int value, char *result, int base);
+
+// Writes to stdout.
+class HardwareSerial {
+    public:
+        void begin(unsigned long baud);
+        size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+        size_t print(const char *str);
+        size_t print(const String &str);
+        size_t print(long value);
+        size_t println(const char *str = "");
+        size_t println(const String &str);
+        size_t println(long value);
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+    public:
+        // Re-executes the simulator with the same arguments, after saving NVS.
+        void restart();
+        uint32_t getHeapSize();
+        uint32_t getFreeHeap();
+        uint32_t getMinFreeHeap();
+        uint32_t getMaxAllocHeap();
+        uint32_t getPsramSize();
+        uint32_t getFreePsram();
+        uint32_t getMinFreePsram();
+        uint32_t getMaxAllocPsram();
+        // Cycles of a 240 MHz core, from the host clock.
+        uint32_t getCycleCount();
+        uint32_t getCpuFreqMHz();
+};
+
+extern EspClass ESP;
+
+#endif /* Arduino.h */
@@ -0,0 +1,7 @@
+#ifndef SIM_ESP32_NOW
+#define SIM_ESP32_NOW
+
+// SentryCamera.h includes this. Pairing over ESP-NOW is left out of the simulated build: main.cpp and
+// EspNowNode.cpp are not compiled, and the simulator starts the camera and server itself.
+
+#endif /* ESP32_NOW.h */
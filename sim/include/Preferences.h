@@ -0,0 +1,29 @@
+#ifndef SIM_PREFERENCES
+#define SIM_PREFERENCES
+
+#include <Arduino.h>
+
+// NVS key-value storage. Kept in memory, and in a file when the simulator is given one, so settings
+// survive ESP.restart() and later runs like they survive a reboot.
+class Preferences {
+    private:
+        String ns;
+        bool opened = false;
+        bool readOnly = false;
+
+    public:
+        bool begin(const char *name, bool readOnly = false, const char *partition_label = NULL);
+        void end();
+
+        bool clear();
+        bool remove(const char *key);
+        bool isKey(const char *key);
+
+        size_t putBytes(const char *key, const void *value, size_t len);
+        size_t getBytesLength(const char *key);
+        size_t getBytes(const char *key, void *buf, size_t maxLen);
+        size_t putUInt(const char *key, uint32_t value);
+        uint32_t getUInt(const char *key, uint32_t defaultValue = 0);
+};
+
+#endif /* Preferences.h */
@@ -0,0 +1,40 @@
+#ifndef SIM_WSTRING
+#define SIM_WSTRING
+
+#include <stdlib.h>
+#include <string>
+
+// Enough of Arduino's String for the firmware, over std::string.
+class String {
+    private:
+        std::string s;
+
+    public:
+        String(const char *cstr = "") : s(cstr ? cstr : "") {}
+        String(const std::string &str) : s(str) {}
+        explicit String(char c) : s(1, c) {}
+        explicit String(int value) : s(std::to_string(value)) {}
+        explicit String(unsigned int value) : s(std::to_string(value)) {}
+        explicit String(long value) : s(std::to_string(value)) {}
+        explicit String(unsigned long value) : s(std::to_string(value)) {}
+
+        const char *c_str() const { return s.c_str(); }
+        unsigned int length() const { return s.length(); }
+        long toInt() const { return strtol(s.c_str(), NULL, 10); }
+        int indexOf(const char *str) const { size_t i = s.find(str); return (i == std::string::npos) ? -1 : (int)i; }
+        String substring(unsigned int from) const { return (from < s.length()) ? String(s.substr(from)) : String(); }
+        String substring(unsigned int from, unsigned int to) const { return (from < to && from < s.length()) ? String(s.substr(from, to - from)) : String(); }
+
+        String &operator+=(const String &other) { s += other.s; return *this; }
+        String &operator+=(const char *other) { s += other; return *this; }
+        String &operator+=(char c) { s += c; return *this; }
+        friend String operator+(const String &a, const String &b) { return String(a.s + b.s); }
+        friend String operator+(const String &a, const char *b) { return String(a.s + b); }
+        friend String operator+(const char *a, const String &b) { return String(a + b.s); }
+        bool operator==(const String &other) const { return s == other.s; }
+        bool operator!=(const String &other) const { return s != other.s; }
+        bool operator==(const char *other) const { return s == other; }
+        bool operator!=(const char *other) const { return s != other; }
+};
+
+#endif /* WString.h */
@@ -0,0 +1,39 @@
+#ifndef SIM_WIFI
+#define SIM_WIFI
+
+#include <Arduino.h>
+
+#define WIFI_MODE_NULL      0
+#define WIFI_MODE_STA       1
+#define WIFI_MODE_AP        2
+#define WIFI_MODE_APSTA     3
+#define WL_IDLE_STATUS      0
+#define WL_CONNECTED        3
+
+class IPAddress {
+    private:
+        uint8_t octets[4];
+
+    public:
+        IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) : octets{ a, b, c, d } {}
+        String toString() const;
+};
+
+// The host's network is already up, so the station connects at once and reports the loopback address.
+class WiFiClass {
+    private:
+        int wifiMode = WIFI_MODE_NULL;
+        bool started = false;
+
+    public:
+        bool mode(int m);
+        int getMode();
+        int begin(const String &ssid, const String &password);
+        bool setSleep(bool enabled);
+        int status();
+        IPAddress localIP();
+};
+
+extern WiFiClass WiFi;
+
+#endif /* WiFi.h */
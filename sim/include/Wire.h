@@ -0,0 +1,6 @@
+#ifndef SIM_WIRE
+#define SIM_WIRE
+
+// SentryCamera.h includes this. The camera's SCCB bus is part of the simulated sensor.
+
+#endif /* Wire.h */
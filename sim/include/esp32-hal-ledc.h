@@ -0,0 +1,11 @@
+#ifndef SIM_ESP32_HAL_LEDC
+#define SIM_ESP32_HAL_LEDC
+
+#include <stdint.h>
+
+// There is no LED. The duty is kept so it can be read back.
+bool ledcAttach(uint8_t pin, uint32_t freq, uint8_t resolution);
+bool ledcWrite(uint8_t pin, uint32_t duty);
+uint32_t ledcRead(uint8_t pin);
+
+#endif /* esp32-hal-ledc.h */
@@ -0,0 +1,53 @@
+#ifndef SIM_ESP32_HAL_LOG
+#define SIM_ESP32_HAL_LOG
+
+#include "esp_timer.h"
+
+#define ARDUHAL_LOG_LEVEL_NONE      (0)
+#define ARDUHAL_LOG_LEVEL_ERROR     (1)
+#define ARDUHAL_LOG_LEVEL_WARN      (2)
+#define ARDUHAL_LOG_LEVEL_INFO      (3)
+#define ARDUHAL_LOG_LEVEL_DEBUG     (4)
+#define ARDUHAL_LOG_LEVEL_VERBOSE   (5)
+
+// Set with -DCORE_DEBUG_LEVEL=n as on the board. Errors are shown by default.
+#ifndef CORE_DEBUG_LEVEL
+#define ARDUHAL_LOG_LEVEL ARDUHAL_LOG_LEVEL_ERROR
+#else
+#define ARDUHAL_LOG_LEVEL CORE_DEBUG_LEVEL
+#endif
+
+// Writes one line to stderr. Lines from different tasks do not interleave.
+int log_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+const char *pathToFileName(const char *path);
+
+#define ARDUHAL_LOG_FORMAT(letter, format) "[%6u][" #letter "][%s:%u] %s(): " format "\n", \
+    (unsigned)(esp_timer_get_time() / 1000), pathToFileName(__FILE__), __LINE__, __FUNCTION__
+
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_ERROR
+#define log_e(format, ...) log_printf(ARDUHAL_LOG_FORMAT(E, format), ##__VA_ARGS__)
+#else
+#define log_e(format, ...) do {} while(0)
+#endif
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_WARN
+#define log_w(format, ...) log_printf(ARDUHAL_LOG_FORMAT(W, format), ##__VA_ARGS__)
+#else
+#define log_w(format, ...) do {} while(0)
+#endif
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+#define log_i(format, ...) log_printf(ARDUHAL_LOG_FORMAT(I, format), ##__VA_ARGS__)
+#else
+#define log_i(format, ...) do {} while(0)
+#endif
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_DEBUG
+#define log_d(format, ...) log_printf(ARDUHAL_LOG_FORMAT(D, format), ##__VA_ARGS__)
+#else
+#define log_d(format, ...) do {} while(0)
+#endif
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_VERBOSE
+#define log_v(format, ...) log_printf(ARDUHAL_LOG_FORMAT(V, format), ##__VA_ARGS__)
+#else
+#define log_v(format, ...) do {} while(0)
+#endif
+
+#endif /* esp32-hal-log.h */
@@ -0,0 +1,6 @@
+#ifndef SIM_ESP_MAC
+#define SIM_ESP_MAC
+
+// SentryCamera.h includes this. Nothing in the simulated build reads the MAC address.
+
+#endif /* esp_mac.h */
@@ -0,0 +1,9 @@
+#ifndef SIM_ESP_TIMER
+#define SIM_ESP_TIMER
+
+#include <stdint.h>
+
+// Microseconds since the process started, from the monotonic clock.
+int64_t esp_timer_get_time();
+
+#endif /* esp_timer.h */
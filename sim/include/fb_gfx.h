@@ -0,0 +1,6 @@
+#ifndef SIM_FB_GFX
+#define SIM_FB_GFX
+
+// app_httpd.cpp includes this but draws nothing on frames.
+
+#endif /* fb_gfx.h */
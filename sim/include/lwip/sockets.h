@@ -0,0 +1,16 @@
+#ifndef SIM_LWIP_SOCKETS
+#define SIM_LWIP_SOCKETS
+
+// lwIP's BSD socket API is the host's.
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+static inline ssize_t lwip_writev(int s, const struct iovec *iov, int iovcnt) { return writev(s, iov, iovcnt); }
+
+#endif /* lwip/sockets.h */
@@ -0,0 +1,13 @@
+#ifndef SIM_SDKCONFIG
+#define SIM_SDKCONFIG
+
+// The subset of the ESP-IDF configuration the firmware and the shims read, with the values an
+// ESP32-CAM build of Arduino-ESP32 3.x uses.
+#define CONFIG_IDF_TARGET_ESP32 1
+#define CONFIG_SPIRAM 1
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_HTTPD_WS_SUPPORT 1
+#define CONFIG_HTTPD_MAX_REQ_HDR_LEN 1024
+#define CONFIG_HTTPD_MAX_URI_LEN 512
+
+#endif /* sdkconfig.h */
@@ -0,0 +1,177 @@
+#include "AdaptiveQuality.h"
+
+// Define the shared controller.
+AdaptiveQuality adaptive_quality;
+
+// Frame sizes the controller steps through, smallest first. Odd aspect ratios are skipped.
+static const framesize_t framesize_ladder[] = {
+    FRAMESIZE_QQVGA, FRAMESIZE_QVGA, FRAMESIZE_CIF, FRAMESIZE_VGA, FRAMESIZE_SVGA,
+    FRAMESIZE_XGA, FRAMESIZE_HD, FRAMESIZE_SXGA, FRAMESIZE_UXGA
+};
+static const int framesize_ladder_len = sizeof(framesize_ladder) / sizeof(framesize_ladder[0]);
+
+static framesize_t next_framesize(framesize_t current, bool larger) {
+    if(larger) {
+        for(int i = 0; i < framesize_ladder_len; i++) {
+            if(framesize_ladder[i] > current) return framesize_ladder[i];
+        }
+    }
+    else {
+        for(int i = framesize_ladder_len - 1; i >= 0; i--) {
+            if(framesize_ladder[i] < current) return framesize_ladder[i];
+        }
+    }
+    return current;
+}
+
+bool AdaptiveQuality::registerApplyCallBack(ApplyStreamSettingsCallback acb) {
+    if(lock == NULL) lock = xSemaphoreCreateMutex();
+    applyCallback = acb;
+    return lock != NULL;
+}
+
+void AdaptiveQuality::setCeiling(int quality, framesize_t framesize) {
+    if(lock == NULL) return;
+
+    // The operator's choice is the best we will ever step back up to.
+    xSemaphoreTake(lock, portMAX_DELAY);
+    ceilingQuality = quality;
+    ceilingFramesize = framesize;
+    this->quality = quality;
+    this->framesize = framesize;
+    congestedRun = 0;
+    clearRun = 0;
+    settle = AQ_SETTLE_SAMPLES;
+    xSemaphoreGive(lock);
+}
+
+void AdaptiveQuality::setEnabled(bool enabled) {
+    if(lock == NULL) return;
+
+    // Put the operator's settings back when turned off.
+    xSemaphoreTake(lock, portMAX_DELAY);
+    this->enabled = enabled;
+    if(!enabled && (quality != ceilingQuality || framesize != ceilingFramesize)) {
+        quality = ceilingQuality;
+        framesize = ceilingFramesize;
+        apply();
+    }
+    xSemaphoreGive(lock);
+}
+
+bool AdaptiveQuality::isEnabled() { return enabled; }
+
+void AdaptiveQuality::observe(int stream, uint32_t sendMs, uint32_t lagFrames, bool trusted) {
+    if(lock == NULL || stream < 0 || stream >= MAX_STREAM_CLIENTS) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    // Smooth send time with a 1/8 weight, kept in 1/8 ms to stay in integers.
+    if(!tracked[stream]) ewmaMs[stream] = sendMs << 3;
+    else ewmaMs[stream] += sendMs - (ewmaMs[stream] >> 3);
+    lag[stream] = lagFrames;
+    tracked[stream] = true;
+    trustedStream[stream] = trusted;
+
+    if(!enabled) {
+        xSemaphoreGive(lock);
+        return;
+    }
+    if(settle > 0) {
+        settle--;
+        xSemaphoreGive(lock);
+        return;
+    }
+
+    // Separate thresholds and run lengths give the hysteresis.
+    if(isCongested(false)) {
+        clearRun = 0;
+        if(++congestedRun >= AQ_DEGRADE_AFTER && degrade(!isCongested(true))) apply();
+    }
+    else if(isClear()) {
+        congestedRun = 0;
+        if(++clearRun >= AQ_UPGRADE_AFTER && upgrade()) apply();
+    }
+    else {
+        congestedRun = 0;
+        clearRun = 0;
+    }
+    xSemaphoreGive(lock);
+}
+
+void AdaptiveQuality::forget(int stream) {
+    if(lock == NULL || stream < 0 || stream >= MAX_STREAM_CLIENTS) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    tracked[stream] = false;
+    ewmaMs[stream] = 0;
+    lag[stream] = 0;
+    trustedStream[stream] = false;
+    xSemaphoreGive(lock);
+}
+
+// The slowest stream decides, or the slowest trusted one. Must be called with the lock held.
+bool AdaptiveQuality::isCongested(bool trustedOnly) {
+    uint32_t high = (AQ_FRAME_BUDGET_MS * AQ_HIGH_WATER_PCT / 100) << 3;
+    for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        if(!tracked[i] || (trustedOnly && !trustedStream[i])) continue;
+        if(ewmaMs[i] > high || lag[i] >= AQ_LAG_FRAMES) return true;
+    }
+    return false;
+}
+
+// Every stream must be comfortably inside budget. Must be called with the lock held.
+bool AdaptiveQuality::isClear() {
+    uint32_t low = (AQ_FRAME_BUDGET_MS * AQ_LOW_WATER_PCT / 100) << 3;
+    for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        if(!tracked[i]) continue;
+        if(ewmaMs[i] > low || lag[i] > 0) return false;
+    }
+    return true;
+}
+
+// Drop quality first, then frame size. A limited step stops at the untrusted floor and keeps the frame
+// size. Returns false when already at the floor.
+bool AdaptiveQuality::degrade(bool limited) {
+    int worst = limited ? AQ_UNTRUSTED_QUALITY_WORST : AQ_QUALITY_WORST;
+    if(quality < worst) {
+        quality = min(quality + AQ_QUALITY_STEP, worst);
+        return true;
+    }
+    if(limited) return false;
+    framesize_t smaller = next_framesize(framesize, false);
+    if(smaller < AQ_FRAMESIZE_FLOOR || smaller == framesize) return false;
+    framesize = smaller;
+    quality = ceilingQuality;
+    return true;
+}
+
+// Undo degrade() one step at a time, never beyond the operator's ceiling.
+bool AdaptiveQuality::upgrade() {
+    if(framesize < ceilingFramesize && quality <= ceilingQuality) {
+        framesize = min(next_framesize(framesize, true), ceilingFramesize);
+        quality = AQ_QUALITY_WORST;
+        return true;
+    }
+    if(quality > ceilingQuality) {
+        quality = max(quality - AQ_QUALITY_STEP, ceilingQuality);
+        return true;
+    }
+    return false;
+}
+
+// Must be called with the lock held.
+void AdaptiveQuality::apply() {
+    congestedRun = 0;
+    clearRun = 0;
+    settle = AQ_SETTLE_SAMPLES;
+    steps++;
+    log_i("Adaptive stream settings: quality %d, framesize %d", quality, framesize);
+    if(applyCallback) applyCallback(quality, framesize);
+}
+
+int AdaptiveQuality::getQuality() { return quality; }
+
+framesize_t AdaptiveQuality::getFramesize() { return framesize; }
+
+uint32_t AdaptiveQuality::getStepCount() { return steps; }
@@ -0,0 +1,76 @@
+#ifndef ADAPTIVE_QUALITY
+#define ADAPTIVE_QUALITY
+
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "FrameBroadcaster.h"
+
+typedef int (* ApplyStreamSettingsCallback)(int quality, framesize_t framesize);
+
+// Tuning for the congestion detector. Times are in milliseconds.
+const uint32_t AQ_FRAME_BUDGET_MS = 100;        // Send time we are willing to spend per frame.
+const uint8_t AQ_HIGH_WATER_PCT = 90;           // Congested above this share of the budget.
+const uint8_t AQ_LOW_WATER_PCT = 40;            // Clear below this share of the budget.
+const uint8_t AQ_LAG_FRAMES = 2;                // Congested when a stream falls this many frames behind.
+const uint8_t AQ_DEGRADE_AFTER = 5;             // Consecutive congested samples before stepping down.
+const uint8_t AQ_UPGRADE_AFTER = 50;            // Consecutive clear samples before stepping up.
+const uint8_t AQ_SETTLE_SAMPLES = 10;           // Samples ignored after a change while the sensor settles.
+const uint8_t AQ_QUALITY_STEP = 5;              // jpeg_quality change per step. Higher number is lower quality.
+const uint8_t AQ_QUALITY_WORST = 40;            // Lowest quality used before shrinking the frame.
+const uint8_t AQ_UNTRUSTED_QUALITY_WORST = 20;  // Lowest quality untrusted streams alone can push everyone to. They never shrink the frame.
+const framesize_t AQ_FRAMESIZE_FLOOR = FRAMESIZE_QQVGA;
+
+class AdaptiveQuality {
+    private:
+        SemaphoreHandle_t lock = NULL;
+        bool enabled = true;
+        uint32_t ewmaMs[MAX_STREAM_CLIENTS];    // Smoothed send time per stream, in 1/8 ms.
+        uint32_t lag[MAX_STREAM_CLIENTS];       // Last reported lag per stream.
+        bool tracked[MAX_STREAM_CLIENTS];       // Stream has reported at least once.
+        bool trustedStream[MAX_STREAM_CLIENTS]; // Stream goes to a trusted client, such as the NVR.
+        uint16_t congestedRun = 0;              // Consecutive congested samples.
+        uint16_t clearRun = 0;                  // Consecutive clear samples.
+        uint16_t settle = 0;                    // Samples left to ignore after a change.
+
+        int ceilingQuality = 10;                // Best quality the operator asked for.
+        framesize_t ceilingFramesize = FRAMESIZE_CIF;
+        int quality = 10;                       // Quality currently applied.
+        framesize_t framesize = FRAMESIZE_CIF;  // Frame size currently applied.
+        uint32_t steps = 0;                     // Changes made so far.
+
+        ApplyStreamSettingsCallback applyCallback = NULL;
+
+        bool isCongested(bool trustedOnly);
+        bool isClear();
+        bool degrade(bool limited);
+        bool upgrade();
+        void apply();
+
+    public:
+        AdaptiveQuality() {
+            for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+                ewmaMs[i] = 0;
+                lag[i] = 0;
+                tracked[i] = false;
+                trustedStream[i] = false;
+            }
+        }
+
+        bool registerApplyCallBack(ApplyStreamSettingsCallback acb);
+        void setCeiling(int quality, framesize_t framesize);
+        void setEnabled(bool enabled);
+        bool isEnabled();
+
+        // Sender interface. A slow untrusted viewer can only cost the other clients a little quality.
+        // Senders pass trusted for every stream until a rate policy says who is not.
+        void observe(int stream, uint32_t sendMs, uint32_t lagFrames, bool trusted);
+        void forget(int stream);
+
+        int getQuality();
+        framesize_t getFramesize();
+        uint32_t getStepCount();
+};
+
+extern AdaptiveQuality adaptive_quality;
+
+#endif /* AdaptiveQuality.h */
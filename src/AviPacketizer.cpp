@@ -0,0 +1,177 @@
+#include "AviPacketizer.h"
+#include "MjpegPacketizer.h"
+
+static const char *_AVI_RESPONSE =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: video/x-msvideo\r\n"
+    "Content-Length: %lu\r\n"
+    "Content-Disposition: attachment; filename=\"clip-%lu.avi\"\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static uint8_t *put_fourcc(uint8_t *p, const char *fourcc) {
+    memcpy(p, fourcc, 4);
+    return p + 4;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint32_t file_bytes(uint32_t frames, uint32_t moviBytes) {
+    return AVI_HEADER_BYTES + moviBytes + 8 + frames * AVI_INDEX_ENTRY_BYTES;
+}
+
+uint32_t AviPacketizer::chunkBytes(size_t len) {
+    // Chunks start on even offsets.
+    return AVI_CHUNK_HEADER_BYTES + len + (len & 1);
+}
+
+esp_err_t AviPacketizer::beginResponse(httpd_req_t *req, uint32_t frames, uint32_t moviBytes, uint32_t name) {
+    char head[256];
+    int len = snprintf(head, sizeof(head), _AVI_RESPONSE, (unsigned long)file_bytes(frames, moviBytes), (unsigned long)name);
+    return (httpd_send(req, head, len) == len) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t AviPacketizer::sendHeader(int fd, uint16_t width, uint16_t height, uint32_t frames, uint32_t usPerFrame, uint32_t moviBytes, uint32_t maxFrameBytes) {
+    uint32_t bytesPerSec = usPerFrame ? (uint32_t)((uint64_t)moviBytes * 1000000 / ((uint64_t)usPerFrame * max(frames, (uint32_t)1))) : 0;
+    uint8_t *p = header;
+
+    p = put_fourcc(p, "RIFF");
+    p = put_u32(p, file_bytes(frames, moviBytes) - 8);
+    p = put_fourcc(p, "AVI ");
+
+    p = put_fourcc(p, "LIST");
+    p = put_u32(p, 192);
+    p = put_fourcc(p, "hdrl");
+
+    // Main header.
+    p = put_fourcc(p, "avih");
+    p = put_u32(p, 56);
+    p = put_u32(p, usPerFrame);
+    p = put_u32(p, bytesPerSec);
+    p = put_u32(p, 0);                  // Padding granularity.
+    p = put_u32(p, 0x10);               // AVIF_HASINDEX.
+    p = put_u32(p, frames);
+    p = put_u32(p, 0);                  // Initial frames.
+    p = put_u32(p, 1);                  // Streams.
+    p = put_u32(p, maxFrameBytes);
+    p = put_u32(p, width);
+    p = put_u32(p, height);
+    memset(p, 0, 16);
+    p += 16;
+
+    p = put_fourcc(p, "LIST");
+    p = put_u32(p, 116);
+    p = put_fourcc(p, "strl");
+
+    // Stream header. Rate over scale is the frame rate.
+    p = put_fourcc(p, "strh");
+    p = put_u32(p, 56);
+    p = put_fourcc(p, "vids");
+    p = put_fourcc(p, "MJPG");
+    p = put_u32(p, 0);                  // Flags.
+    p = put_u16(p, 0);                  // Priority.
+    p = put_u16(p, 0);                  // Language.
+    p = put_u32(p, 0);                  // Initial frames.
+    p = put_u32(p, usPerFrame);
+    p = put_u32(p, 1000000);
+    p = put_u32(p, 0);                  // Start.
+    p = put_u32(p, frames);
+    p = put_u32(p, maxFrameBytes);
+    p = put_u32(p, 0xFFFFFFFF);         // Default quality.
+    p = put_u32(p, 0);                  // Sample size, 0 for variable.
+    p = put_u16(p, 0);
+    p = put_u16(p, 0);
+    p = put_u16(p, width);
+    p = put_u16(p, height);
+
+    // BITMAPINFOHEADER.
+    p = put_fourcc(p, "strf");
+    p = put_u32(p, 40);
+    p = put_u32(p, 40);
+    p = put_u32(p, width);
+    p = put_u32(p, height);
+    p = put_u16(p, 1);                  // Planes.
+    p = put_u16(p, 24);                 // Bits per pixel.
+    p = put_fourcc(p, "MJPG");
+    p = put_u32(p, (uint32_t)width * height * 3);
+    memset(p, 0, 16);
+    p += 16;
+
+    p = put_fourcc(p, "LIST");
+    p = put_u32(p, 4 + moviBytes);
+    p = put_fourcc(p, "movi");
+
+    indexCount = 0;
+    indexOffset = 4;
+
+    struct iovec iov[1];
+    iov[0].iov_base = header;
+    iov[0].iov_len = p - header;
+    return MjpegPacketizer::writeAll(fd, iov, 1, writes);
+}
+
+esp_err_t AviPacketizer::sendFrame(int fd, const uint8_t *buf, size_t len) {
+    static const uint8_t pad = 0;
+    uint8_t chunk[AVI_CHUNK_HEADER_BYTES];
+    put_u32(put_fourcc(chunk, "00dc"), len);
+
+    // Chunk header, payload and padding leave in a single vectored write.
+    struct iovec iov[3];
+    iov[0].iov_base = chunk;
+    iov[0].iov_len = sizeof(chunk);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+    iov[2].iov_base = (void *)&pad;
+    iov[2].iov_len = len & 1;
+    return MjpegPacketizer::writeAll(fd, iov, (len & 1) ? 3 : 2, writes);
+}
+
+esp_err_t AviPacketizer::flushIndex(int fd) {
+    if(!indexCount) return ESP_OK;
+
+    struct iovec iov[1];
+    iov[0].iov_base = index;
+    iov[0].iov_len = indexCount * AVI_INDEX_ENTRY_BYTES;
+    indexCount = 0;
+    return MjpegPacketizer::writeAll(fd, iov, 1, writes);
+}
+
+esp_err_t AviPacketizer::beginIndex(int fd, uint32_t frames) {
+    uint8_t head[8];
+    put_u32(put_fourcc(head, "idx1"), frames * AVI_INDEX_ENTRY_BYTES);
+
+    struct iovec iov[1];
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+    return MjpegPacketizer::writeAll(fd, iov, 1, writes);
+}
+
+esp_err_t AviPacketizer::addIndex(int fd, size_t len) {
+    // Every frame is a key frame. Offsets count from the movi fourcc.
+    uint8_t *p = index + indexCount * AVI_INDEX_ENTRY_BYTES;
+    p = put_fourcc(p, "00dc");
+    p = put_u32(p, 0x10);
+    p = put_u32(p, indexOffset);
+    put_u32(p, len);
+    indexOffset += chunkBytes(len);
+
+    if(++indexCount < AVI_INDEX_BATCH) return ESP_OK;
+    return flushIndex(fd);
+}
+
+esp_err_t AviPacketizer::endIndex(int fd) { return flushIndex(fd); }
+
+uint32_t AviPacketizer::getWriteCount() { return writes; }
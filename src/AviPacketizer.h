@@ -0,0 +1,41 @@
+#ifndef AVI_PACKETIZER
+#define AVI_PACKETIZER
+
+#include <Arduino.h>
+#include "esp_http_server.h"
+#include "lwip/sockets.h"
+
+const size_t AVI_HEADER_BYTES = 224;            // RIFF, hdrl and the start of movi.
+const size_t AVI_CHUNK_HEADER_BYTES = 8;
+const size_t AVI_INDEX_ENTRY_BYTES = 16;
+const uint8_t AVI_INDEX_BATCH = 32;             // idx1 entries per socket write.
+
+// Writes an MJPEG AVI straight to the socket. Frames go out from wherever they already are,
+// so the caller must know every frame's size up front to fill in the header and index.
+class AviPacketizer {
+    private:
+        uint8_t header[AVI_HEADER_BYTES];
+        uint8_t index[AVI_INDEX_BATCH * AVI_INDEX_ENTRY_BYTES];
+        uint8_t indexCount = 0;         // Entries waiting in index.
+        uint32_t indexOffset = 4;       // Offset of the next frame's chunk from the movi fourcc.
+        uint32_t writes = 0;            // Socket writes issued.
+
+        esp_err_t flushIndex(int fd);
+
+    public:
+        // Bytes a frame takes in the movi list, header and padding included.
+        static uint32_t chunkBytes(size_t len);
+        // Raw HTTP response head for a file of this many frames whose chunks add up to moviBytes.
+        static esp_err_t beginResponse(httpd_req_t *req, uint32_t frames, uint32_t moviBytes, uint32_t name);
+
+        esp_err_t sendHeader(int fd, uint16_t width, uint16_t height, uint32_t frames, uint32_t usPerFrame, uint32_t moviBytes, uint32_t maxFrameBytes);
+        esp_err_t sendFrame(int fd, const uint8_t *buf, size_t len);
+        // The index repeats every frame length, in the same order, after the last frame.
+        esp_err_t beginIndex(int fd, uint32_t frames);
+        esp_err_t addIndex(int fd, size_t len);
+        esp_err_t endIndex(int fd);
+
+        uint32_t getWriteCount();
+};
+
+#endif /* AviPacketizer.h */
@@ -0,0 +1,181 @@
+#include "BmpStream.h"
+#include "esp_jpg_decode.h"
+
+typedef struct {
+    jpg_out_cb cb;
+    void *arg;
+    size_t index;           // Bytes handed to cb so far.
+} bmp_out_t;
+
+typedef struct {
+    bmp_out_t *out;
+    const uint8_t *input;   // JPEG data.
+    uint16_t width;
+    uint16_t height;
+    uint8_t *band;          // One MCU row of BGR pixels.
+    uint16_t bandY;         // First image row held in band.
+} bmp_jpg_state_t;
+
+static bool bmp_emit(bmp_out_t *out, const void *data, size_t len) {
+    if(out->cb(out->arg, out->index, data, len) != len) return false;
+    out->index += len;
+    return true;
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// Same header frame2bmp writes: top-down rows, no row padding, 2835 px/m.
+static bool bmp_emit_header(bmp_out_t *out, uint16_t width, uint16_t height, bool grayscale) {
+    uint8_t bpp = grayscale ? 1 : 3;
+    size_t palette = grayscale ? BMP_PALETTE_LEN : 0;
+    uint32_t image = (uint32_t)width * height * bpp;
+
+    uint8_t header[BMP_HEADER_LEN];
+    memset(header, 0, sizeof(header));
+    header[0] = 'B';
+    header[1] = 'M';
+    put_u32(header + 2, image + BMP_HEADER_LEN + palette);     // File size.
+    put_u32(header + 10, BMP_HEADER_LEN + palette);            // Offset to pixels.
+    put_u32(header + 14, 40);                                   // DIB header size.
+    put_u32(header + 18, width);
+    put_u32(header + 22, (uint32_t)(-(int32_t)height));         // Negative for top to bottom.
+    put_u16(header + 26, 1);                                    // Planes.
+    put_u16(header + 28, bpp * 8);
+    put_u32(header + 34, image);
+    put_u32(header + 38, 2835);
+    put_u32(header + 42, 2835);
+    put_u32(header + 46, grayscale ? 256 : 0);                  // Colors.
+    put_u32(header + 50, grayscale ? 256 : 0);                  // Important colors.
+    return bmp_emit(out, header, sizeof(header));
+}
+
+static size_t bmp_jpg_read(void *arg, size_t index, uint8_t *buf, size_t len) {
+    bmp_jpg_state_t *st = (bmp_jpg_state_t *)arg;
+    if(buf) memcpy(buf, st->input + index, len);
+    return len;
+}
+
+// Send the finished rows of the band, up to but not including row end.
+static bool bmp_jpg_flush(bmp_jpg_state_t *st, uint16_t end) {
+    if(end <= st->bandY) return true;
+    if(!bmp_emit(st->out, st->band, (size_t)(end - st->bandY) * st->width * 3)) return false;
+    st->bandY = end;
+    return true;
+}
+
+static bool bmp_jpg_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+    bmp_jpg_state_t *st = (bmp_jpg_state_t *)arg;
+
+    if(!data) {
+        // Start: the decoder reports the output size.
+        if(x == 0 && y == 0) {
+            st->width = w;
+            st->height = h;
+            st->bandY = 0;
+            st->band = (uint8_t *)malloc((size_t)w * BMP_MAX_MCU_ROWS * 3);
+            if(!st->band) {
+                log_e("BMP band allocation of %u bytes failed", w * BMP_MAX_MCU_ROWS * 3);
+                return false;
+            }
+            return bmp_emit_header(st->out, w, h, false);
+        }
+        // End.
+        return bmp_jpg_flush(st, st->height);
+    }
+
+    // MCUs arrive left to right, top to bottom, so a new row of them means the band is complete.
+    if(y != st->bandY && !bmp_jpg_flush(st, y)) return false;
+    if(y + h > st->bandY + BMP_MAX_MCU_ROWS) return false;
+
+    // Decoder output is RGB. BMP wants BGR.
+    size_t stride = (size_t)st->width * 3;
+    uint8_t *row = st->band + (size_t)(y - st->bandY) * stride + (size_t)x * 3;
+    for(uint16_t iy = 0; iy < h; iy++, row += stride) {
+        for(size_t ix = 0; ix < (size_t)w * 3; ix += 3) {
+            row[ix] = data[ix + 2];
+            row[ix + 1] = data[ix + 1];
+            row[ix + 2] = data[ix];
+        }
+        data += w * 3;
+    }
+    return true;
+}
+
+static bool jpg2bmp_cb(const uint8_t *src, size_t src_len, bmp_out_t *out) {
+    bmp_jpg_state_t st;
+    memset(&st, 0, sizeof(st));
+    st.out = out;
+    st.input = src;
+
+    esp_err_t res = esp_jpg_decode(src_len, JPG_SCALE_NONE, bmp_jpg_read, bmp_jpg_write, &st);
+    free(st.band);
+    if(res != ESP_OK) log_e("JPG Decompression Failed!");
+    return res == ESP_OK;
+}
+
+static uint8_t bmp_src_bytes_per_pixel(pixformat_t format) {
+    switch(format) {
+        case PIXFORMAT_GRAYSCALE: return 1;
+        case PIXFORMAT_RGB565:
+        case PIXFORMAT_YUV422: return 2;
+        case PIXFORMAT_RGB888: return 3;
+        default: return 0;
+    }
+}
+
+bool fmt2bmp_cb(const uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, jpg_out_cb cb, void *arg) {
+    bmp_out_t out = { cb, arg, 0 };
+    if(format == PIXFORMAT_JPEG) return jpg2bmp_cb(src, src_len, &out);
+
+    uint8_t srcBpp = bmp_src_bytes_per_pixel(format);
+    size_t srcRow = (size_t)width * srcBpp;
+    if(!srcBpp || !width || src_len < srcRow * height) {
+        log_e("Unsupported BMP source: format %d, %lu bytes", format, (unsigned long)src_len);
+        return false;
+    }
+    bool grayscale = (format == PIXFORMAT_GRAYSCALE);
+    if(!bmp_emit_header(&out, width, height, grayscale)) return false;
+
+    // Grayscale rows are already BMP pixels. Only the palette needs building.
+    if(grayscale) {
+        uint8_t palette[64];
+        for(int i = 0; i < 256; i += 16) {
+            for(int j = 0; j < 16; j++) {
+                palette[j * 4] = palette[j * 4 + 1] = palette[j * 4 + 2] = i + j;
+                palette[j * 4 + 3] = 0;
+            }
+            if(!bmp_emit(&out, palette, sizeof(palette))) return false;
+        }
+        return bmp_emit(&out, src, srcRow * height);
+    }
+
+    // Convert as many whole rows as fit in one chunk, then hand them on.
+    size_t dstRow = (size_t)width * 3;
+    size_t rows = max((size_t)1, BMP_CHUNK_BYTES / dstRow);
+    uint8_t *chunk = (uint8_t *)malloc(rows * dstRow);
+    if(!chunk) {
+        log_e("BMP chunk allocation of %lu bytes failed", (unsigned long)(rows * dstRow));
+        return false;
+    }
+    bool ok = true;
+    for(uint16_t y = 0; ok && y < height; y += rows) {
+        size_t n = min(rows, (size_t)(height - y));
+        ok = fmt2rgb888(src + y * srcRow, n * srcRow, format, chunk) && bmp_emit(&out, chunk, n * dstRow);
+    }
+    free(chunk);
+    return ok;
+}
+
+bool frame2bmp_cb(camera_fb_t *fb, jpg_out_cb cb, void *arg) {
+    return fmt2bmp_cb(fb->buf, fb->len, fb->width, fb->height, fb->format, cb, arg);
+}
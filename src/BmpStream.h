@@ -0,0 +1,19 @@
+#ifndef BMP_STREAM
+#define BMP_STREAM
+
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "img_converters.h"
+
+const size_t BMP_HEADER_LEN = 54;
+const size_t BMP_PALETTE_LEN = 4 * 256;     // Grayscale palette.
+const size_t BMP_CHUNK_BYTES = 4096;        // Converted rows handed to the callback at a time.
+const uint8_t BMP_MAX_MCU_ROWS = 16;        // Tallest JPEG MCU, so one decoded band always fits.
+
+// Streaming counterparts of fmt2bmp() and frame2bmp(). The output is byte-identical, but it is
+// handed to cb as it is produced instead of being built in one full-frame allocation. Extra memory
+// is one chunk of rows for raw formats, or one MCU row of RGB888 for JPEG.
+bool fmt2bmp_cb(const uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, jpg_out_cb cb, void *arg);
+bool frame2bmp_cb(camera_fb_t *fb, jpg_out_cb cb, void *arg);
+
+#endif /* BmpStream.h */
@@ -0,0 +1,196 @@
+#include "CameraTuner.h"
+#include <Preferences.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+// Define the shared tuner.
+CameraTuner camera_tuner;
+
+bool CameraTuner::measure(void *ctx, const TunerConfig &tuned, uint8_t frameSize, TunerResult *result) {
+    CameraTuner *tuner = static_cast<CameraTuner *>(ctx);
+
+    camera_config_t config = tuner->base;
+    config.frame_size = (framesize_t)frameSize;
+    config.fb_count = tuned.fbCount;
+    config.grab_mode = tuned.grabLatest ? CAMERA_GRAB_LATEST : CAMERA_GRAB_WHEN_EMPTY;
+    config.fb_location = tuned.fbInPsram ? CAMERA_FB_IN_PSRAM : CAMERA_FB_IN_DRAM;
+    config.xclk_freq_hz = tuned.xclkMhz * 1000000;
+    tuner->runs++;
+    if(esp_camera_init(&config) != ESP_OK) {
+        log_w("Tuner: run %u of %u: size %u fb %u %s %s %uMHz did not start.", tuner->runs, tuner->plannedRuns, frameSize, tuned.fbCount,
+            tuned.grabLatest ? "latest" : "empty", tuned.fbInPsram ? "psram" : "dram", tuned.xclkMhz);
+        return false;
+    }
+
+    // Let exposure settle, and size the scratch copy from what this frame size really produces.
+    size_t largest = 0;
+    for(int i = 0; i < TUNER_WARMUP_FRAMES; i++) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        if(!fb) continue;
+        largest = max(largest, fb->len);
+        esp_camera_fb_return(fb);
+    }
+    if(largest * 2 > tuner->scratchLen) {
+        heap_caps_free(tuner->scratch);
+        tuner->scratch = (uint8_t *)heap_caps_malloc(largest * 2, MALLOC_CAP_SPIRAM);
+        tuner->scratchLen = tuner->scratch ? largest * 2 : 0;
+    }
+
+    // Pull frames the way the capture stage does, copying each out before giving it back.
+    uint16_t samples[TUNER_MAX_SAMPLES];
+    uint16_t sampleCount = 0;
+    uint32_t frames = 0;
+    int64_t start = esp_timer_get_time();
+    int64_t now = start;
+    while(now - start < TUNER_MEASURE_US) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        now = esp_timer_get_time();
+        if(!fb) continue;
+
+        int64_t capturedUs = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+        if(sampleCount < TUNER_MAX_SAMPLES) samples[sampleCount++] = (uint16_t)min((now - capturedUs) / 1000, (int64_t)UINT16_MAX);
+        if(tuner->scratch) memcpy(tuner->scratch, fb->buf, min(fb->len, tuner->scratchLen));
+        esp_camera_fb_return(fb);
+        frames++;
+    }
+
+    result->frames = min(frames, (uint32_t)UINT16_MAX);
+    result->fpsX10 = (uint16_t)((uint64_t)frames * 10000000 / (now - start));
+    result->latencyP50Ms = tuner_percentile(samples, sampleCount, 50);
+    result->latencyP95Ms = tuner_percentile(samples, sampleCount, 95);
+    result->heapFree = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    result->psramFree = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    esp_camera_deinit();
+
+    log_i("Tuner: run %u of %u: size %u fb %u %s %s %uMHz: %u.%u fps, p50 %ums, heap %lu", tuner->runs, tuner->plannedRuns, frameSize,
+        tuned.fbCount, tuned.grabLatest ? "latest" : "empty", tuned.fbInPsram ? "psram" : "dram", tuned.xclkMhz, result->fpsX10 / 10,
+        result->fpsX10 % 10, result->latencyP50Ms, (unsigned long)result->heapFree);
+    return true;
+}
+
+bool CameraTuner::load() {
+    loaded = true;
+    store.clear();
+
+    Preferences prefs;
+    if(!prefs.begin(TUNER_NAMESPACE, true)) return false;
+    uint8_t buf[TUNER_STORE_BYTES];
+    size_t len = prefs.getBytesLength(TUNER_BEST_KEY);
+    bool ok = len > 0 && len <= sizeof(buf) && prefs.getBytes(TUNER_BEST_KEY, buf, len) == len && store.unpack(buf, len);
+    prefs.end();
+    return ok;
+}
+
+bool CameraTuner::save() {
+    uint8_t buf[TUNER_STORE_BYTES];
+    size_t len = store.pack(buf, sizeof(buf));
+    if(len == 0) return false;
+
+    Preferences prefs;
+    if(!prefs.begin(TUNER_NAMESPACE, false)) return false;
+    bool ok = prefs.putBytes(TUNER_BEST_KEY, buf, len) == len;
+    prefs.end();
+    return ok;
+}
+
+bool CameraTuner::requestSweep(const uint8_t *frameSizes, uint8_t count) {
+    if(count == 0 || count > TUNER_MAX_SWEEP_SIZES) return false;
+
+    Preferences prefs;
+    if(!prefs.begin(TUNER_NAMESPACE, false)) return false;
+    bool ok = prefs.putBytes(TUNER_PENDING_KEY, frameSizes, count) == count;
+    prefs.end();
+    return ok;
+}
+
+bool CameraTuner::runPending(const camera_config_t &config) {
+    uint8_t sizes[TUNER_MAX_SWEEP_SIZES];
+    Preferences prefs;
+    if(!prefs.begin(TUNER_NAMESPACE, false)) return false;
+    size_t count = prefs.getBytesLength(TUNER_PENDING_KEY);
+    if(count == 0 || count > TUNER_MAX_SWEEP_SIZES || prefs.getBytes(TUNER_PENDING_KEY, sizes, count) != count) {
+        prefs.end();
+        return false;
+    }
+    // Cleared before running, so a configuration that hangs the board is not retried on every boot.
+    prefs.remove(TUNER_PENDING_KEY);
+    prefs.end();
+
+    if(results == NULL) results = (TunerResult *)heap_caps_malloc(TUNER_MAX_RESULTS * sizeof(TunerResult), MALLOC_CAP_SPIRAM);
+    if(results == NULL) {
+        log_e("Failed to allocate tuner results.");
+        return false;
+    }
+
+    // The first pass starts from the configuration the firmware would otherwise run with.
+    base = config;
+    TunerConfig start;
+    start.fbCount = config.fb_count;
+    start.grabLatest = config.grab_mode == CAMERA_GRAB_LATEST;
+    start.fbInPsram = config.fb_location == CAMERA_FB_IN_PSRAM;
+    start.xclkMhz = config.xclk_freq_hz / 1000000;
+    plannedRuns = tuner_sweep_runs(count);
+    runs = 0;
+    log_i("Tuner: sweeping %u frame sizes in at most %u runs.", (unsigned)count, plannedRuns);
+    resultCount = tuner_sweep(sizes, count, start, &CameraTuner::measure, this, results, TUNER_MAX_RESULTS);
+    heap_caps_free(scratch);
+    scratch = NULL;
+    scratchLen = 0;
+
+    // Keep what was known for other frame sizes.
+    if(!loaded) load();
+    for(size_t i = 0; i < count; i++) {
+        const TunerResult *best = tuner_best(results, resultCount, sizes[i]);
+        if(best) store.set(*best);
+        else log_e("Tuner: nothing usable at frame size %u.", sizes[i]);
+    }
+    return save();
+}
+
+bool CameraTuner::apply(camera_config_t *config) {
+    if(!loaded) load();
+
+    const TunerResult *best = store.find(config->frame_size);
+    if(best == NULL) return false;
+    config->fb_count = best->config.fbCount;
+    config->grab_mode = best->config.grabLatest ? CAMERA_GRAB_LATEST : CAMERA_GRAB_WHEN_EMPTY;
+    config->fb_location = best->config.fbInPsram ? CAMERA_FB_IN_PSRAM : CAMERA_FB_IN_DRAM;
+    config->xclk_freq_hz = best->config.xclkMhz * 1000000;
+    return true;
+}
+
+bool CameraTuner::clear() {
+    store.clear();
+    loaded = true;
+
+    Preferences prefs;
+    if(!prefs.begin(TUNER_NAMESPACE, false)) return false;
+    prefs.remove(TUNER_BEST_KEY);
+    prefs.remove(TUNER_PENDING_KEY);
+    prefs.end();
+    return true;
+}
+
+static size_t print_result(char *buf, size_t len, const TunerResult *r, bool first) {
+    return snprintf(buf, len,
+        "%s{\"frame_size\":%u,\"fb_count\":%u,\"grab\":\"%s\",\"fb_location\":\"%s\",\"xclk_mhz\":%u,\"valid\":%s,\"frames\":%u,\"fps\":%u.%u,\"latency_p50_ms\":%u,\"latency_p95_ms\":%u,\"heap_free\":%lu,\"psram_free\":%lu}",
+        first ? "" : ",", r->frameSize, r->config.fbCount, r->config.grabLatest ? "latest" : "when_empty", r->config.fbInPsram ? "psram" : "dram",
+        r->config.xclkMhz, r->valid ? "true" : "false", r->frames, r->fpsX10 / 10, r->fpsX10 % 10, r->latencyP50Ms, r->latencyP95Ms,
+        (unsigned long)r->heapFree, (unsigned long)r->psramFree);
+}
+
+size_t CameraTuner::jsonSize() {
+    // Generous per result, so the caller can allocate once.
+    return 64 + 256 * (TUNER_MAX_FRAME_SIZES + resultCount);
+}
+
+size_t CameraTuner::printJson(char *buf, size_t len) {
+    if(!loaded) load();
+
+    size_t used = snprintf(buf, len, "{\"best\":[");
+    for(uint8_t i = 0; i < store.getCount() && used < len; i++) used += print_result(buf + used, len - used, store.at(i), i == 0);
+    if(used < len) used += snprintf(buf + used, len - used, "],\"sweep\":[");
+    for(size_t i = 0; i < resultCount && used < len; i++) used += print_result(buf + used, len - used, &results[i], i == 0);
+    if(used < len) used += snprintf(buf + used, len - used, "]}");
+    return (used < len) ? used : len - 1;
+}
@@ -0,0 +1,47 @@
+#ifndef CAMERA_TUNER
+#define CAMERA_TUNER
+
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "TunerSweep.h"
+
+const char TUNER_NAMESPACE[] = "tuner";         // NVS namespace.
+const char TUNER_BEST_KEY[] = "best";           // Packed TunerStore.
+const char TUNER_PENDING_KEY[] = "pending";     // Frame sizes to sweep on the next boot.
+
+// Finds the driver buffer settings that suit each frame size. A sweep needs the driver to itself, so
+// POST /tune only schedules one and restarts. The next boot runs it before anything else starts the
+// camera, stores the best configuration per frame size in NVS and carries on with it. A sweep covers
+// at most TUNER_MAX_SWEEP_SIZES frame sizes at about 40 s each, and logs each run as it goes.
+class CameraTuner {
+    private:
+        TunerStore store;                   // Best known configuration per frame size.
+        bool loaded = false;
+        TunerResult *results = NULL;        // Every run of the last sweep, in PSRAM. Only on the boot that ran it.
+        size_t resultCount = 0;
+        uint16_t plannedRuns = 0;           // Progress of the sweep under way, for the log.
+        uint16_t runs = 0;
+        camera_config_t base;               // Configuration the sweep varies.
+        uint8_t *scratch = NULL;            // Stands in for the frame pool, so frames are held as long as in service.
+        size_t scratchLen = 0;
+
+        static bool measure(void *ctx, const TunerConfig &config, uint8_t frameSize, TunerResult *result);
+        bool save();
+
+    public:
+        bool load();
+        // Schedule a sweep of up to TUNER_MAX_SWEEP_SIZES frame sizes for the next boot.
+        bool requestSweep(const uint8_t *frameSizes, uint8_t count);
+        // Run the sweep scheduled on the last boot, if any. Must be called before the driver is started.
+        bool runPending(const camera_config_t &config);
+        // Replace the buffer settings with the best known for the config's frame size.
+        bool apply(camera_config_t *config);
+        bool clear();
+
+        size_t jsonSize();
+        size_t printJson(char *buf, size_t len);
+};
+
+extern CameraTuner camera_tuner;
+
+#endif /* CameraTuner.h */
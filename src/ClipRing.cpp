@@ -0,0 +1,196 @@
+#include "ClipRing.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "FrameBroadcaster.h"
+#include "Metrics.h"
+
+// Define task handle and the shared clip ring.
+TaskHandle_t clip_task_handle = NULL;
+ClipRing clip_ring;
+
+static int64_t frame_time_us(const struct timeval &timestamp) {
+    return (int64_t)timestamp.tv_sec * 1000000 + timestamp.tv_usec;
+}
+
+void clip_task(void *pvParams) {
+    // Setup.
+    ClipRing *ring = static_cast<ClipRing *>(pvParams);
+    uint32_t seq = 0;
+
+    // Task loop. Raw frames are too big to keep seconds of, so only JPEG is recorded.
+    for(;;) {
+        FrameHandle frame = frame_broadcaster.waitForFrameAfter(seq, FRAME_WAIT_TIMEOUT);
+        if(!frame) continue;
+        seq = frame.seq();
+        if(frame.format() == PIXFORMAT_JPEG) ring->append(frame);
+        frame.reset();
+        vTaskDelay(CLIP_FRAME_INTERVAL);
+    }
+}
+
+bool ClipRing::begin(size_t bytes) {
+    // Only start once.
+    if(clip_task_handle != NULL) return true;
+
+    lock = xSemaphoreCreateMutex();
+    events = xEventGroupCreate();
+    arena = (uint8_t *)heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM);
+    index = (ClipFrame *)heap_caps_malloc(CLIP_MAX_FRAMES * sizeof(ClipFrame), MALLOC_CAP_SPIRAM);
+    if(lock == NULL || events == NULL || arena == NULL || index == NULL) {
+        log_e("Failed to set up clip ring.");
+        return false;
+    }
+    budget = bytes;
+
+    BaseType_t res = xTaskCreatePinnedToCore(
+        &clip_task,             // Pointer to task function.
+        "clip_task",            // Task name.
+        CLIP_TASK_DEPTH,        // Size of stack allocated to the task (in bytes).
+        this,                   // Pointer to parameters used for task creation.
+        1,                      // Task priority level.
+        &clip_task_handle,      // Pointer to task handle.
+        1                       // Core that the task will run on.
+    );
+    if(res != pdPASS) log_e("Failed to create Clip Task.");
+    return res == pdPASS;
+}
+
+const ClipFrame *ClipRing::at(uint16_t i) { return &index[(first + i) % CLIP_MAX_FRAMES]; }
+
+uint32_t ClipRing::pinFloor() {
+    uint32_t floor = UINT32_MAX;
+    for(int i = 0; i < CLIP_MAX_READERS; i++) {
+        if(readers[i].active) floor = min(floor, readers[i].pin);
+    }
+    return floor;
+}
+
+bool ClipRing::evictOldest() {
+    if(!count || at(0)->seq >= pinFloor()) return false;
+    used -= at(0)->len;
+    first = (first + 1) % CLIP_MAX_FRAMES;
+    count--;
+    metric_clip_frames_evicted.inc();
+    return true;
+}
+
+uint16_t ClipRing::find(uint32_t seq) {
+    // Logical index of the oldest frame newer than seq. Sequence numbers only go up, so bisect.
+    uint16_t lo = 0, hi = count;
+    while(lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        if(at(mid)->seq <= seq) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+bool ClipRing::append(const FrameHandle &frame) {
+    if(arena == NULL) return false;
+    size_t len = frame.len();
+
+    // Make room. Frames sit back to back in arrival order, so walking forward from the write
+    // position only ever meets the oldest frames.
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool ok = (len <= budget);
+    if(ok && count == CLIP_MAX_FRAMES) ok = evictOldest();
+    size_t offset = count ? head : 0;
+    if(ok && offset + len > budget) {
+        // No room before the end. Whatever lies past the write position is older than anything
+        // before it, so it goes first, and the frame starts again from the front.
+        while(ok && count && at(0)->offset >= head) ok = evictOldest();
+        offset = 0;
+    }
+    while(ok && count && at(0)->offset < offset + len && at(0)->offset + at(0)->len > offset) ok = evictOldest();
+    if(!ok) {
+        xSemaphoreGive(lock);
+        metric_clip_frames_skipped.inc();
+        return false;
+    }
+    // Nothing indexes the space now, so readers cannot see it while it is filled.
+    head = min((offset + len + 3) & ~(size_t)3, budget);
+    xSemaphoreGive(lock);
+
+    memcpy(arena + offset, frame.buf(), len);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    ClipFrame *entry = &index[(first + count) % CLIP_MAX_FRAMES];
+    entry->seq = frame.seq();
+    entry->offset = offset;
+    entry->len = len;
+    entry->timestamp = frame.timestamp();
+    entry->width = frame.width();
+    entry->height = frame.height();
+    count++;
+    used += len;
+    metric_clip_bytes.set(used);
+    xSemaphoreGive(lock);
+
+    metric_clip_frames_stored.inc();
+    xEventGroupSetBits(events, CLIP_FRAME_BIT);
+    xEventGroupClearBits(events, CLIP_FRAME_BIT);
+    return true;
+}
+
+ClipReader *ClipRing::open(int64_t fromUs, int64_t untilUs, ClipFormat format, uint32_t name) {
+    if(lock == NULL) return NULL;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    ClipReader *reader = NULL;
+    for(int i = 0; i < CLIP_MAX_READERS && !reader; i++) {
+        if(!readers[i].active) reader = &readers[i];
+    }
+    if(reader) {
+        // Pin from the first frame of the window, or from the next one if the window has not started.
+        uint16_t i = 0;
+        while(i < count && frame_time_us(at(i)->timestamp) < fromUs) i++;
+        reader->pin = (i < count) ? at(i)->seq : (count ? at(count - 1)->seq + 1 : 0);
+        reader->active = true;
+        reader->fromUs = fromUs;
+        reader->untilUs = untilUs;
+        reader->format = format;
+        reader->name = name;
+        reader->req = NULL;
+        reader->fd = -1;
+        reader->task = NULL;
+    }
+    xSemaphoreGive(lock);
+    return reader;
+}
+
+void ClipRing::close(ClipReader *reader) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    reader->req = NULL;
+    reader->task = NULL;
+    reader->active = false;
+    xSemaphoreGive(lock);
+}
+
+void ClipRing::advance(ClipReader *reader, uint32_t seq) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    reader->pin = max(reader->pin, seq);
+    xSemaphoreGive(lock);
+}
+
+bool ClipRing::next(ClipReader *reader, uint32_t seq, ClipFrame *frame) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t after = max(seq + 1, reader->pin);
+    uint16_t i = find(after - 1);
+    while(i < count && frame_time_us(at(i)->timestamp) < reader->fromUs) i++;
+    bool found = (i < count);
+    if(found) *frame = *at(i);
+    xSemaphoreGive(lock);
+    return found;
+}
+
+bool ClipRing::waitForFrameAfter(uint32_t seq, TickType_t timeout) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool ready = count && at(count - 1)->seq > seq;
+    xSemaphoreGive(lock);
+    if(ready) return true;
+
+    // A pulse between the check above and this wait is missed, so callers wait in short slices.
+    return xEventGroupWaitBits(events, CLIP_FRAME_BIT, pdFALSE, pdTRUE, timeout) & CLIP_FRAME_BIT;
+}
+
+const uint8_t *ClipRing::data(const ClipFrame &frame) { return arena + frame.offset; }
@@ -0,0 +1,105 @@
+#ifndef CLIP_RING
+#define CLIP_RING
+
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "esp_http_server.h"
+#include "FramePool.h"
+
+const size_t CLIP_RING_BYTES = 1536 * 1024;     // Default PSRAM budget for recorded frames.
+const uint16_t CLIP_MAX_FRAMES = 512;           // Index entries, whatever the budget.
+const uint8_t CLIP_MAX_READERS = 2;             // Clips being exported at once.
+const int CLIP_TASK_DEPTH = 4096;
+const int CLIP_SENDER_TASK_DEPTH = 6144;
+const int CLIP_SEND_TIMEOUT_S = 5;
+const TickType_t CLIP_FRAME_INTERVAL = pdMS_TO_TICKS(100);  // Record at most ten frames a second.
+const uint8_t CLIP_DEFAULT_PRE_S = 5;
+const uint8_t CLIP_DEFAULT_POST_S = 5;
+const uint8_t CLIP_MAX_WINDOW_S = 30;           // Longest pre plus post window a request may ask for.
+const int64_t CLIP_SETTLE_US = 500000;          // Allowance for the last frame of a window to reach the ring.
+const EventBits_t CLIP_FRAME_BIT = BIT0;
+
+extern TaskHandle_t clip_task_handle;
+
+void clip_task(void *pvParams);
+
+struct _clip_frame {
+    uint32_t seq;                   // Capture sequence number.
+    uint32_t offset;                // Start of the JPEG in the arena.
+    uint32_t len;
+    struct timeval timestamp;       // Capture time reported by the driver.
+    uint16_t width;
+    uint16_t height;
+};
+typedef struct _clip_frame ClipFrame;
+
+enum _clip_format : uint8_t {
+    CLIP_MJPEG,
+    CLIP_AVI
+};
+typedef enum _clip_format ClipFormat;
+
+struct _clip_reader {
+    bool active;                    // Slot is owned by an export.
+    uint32_t pin;                   // Frames from this seq on are never evicted. Moves up as MJPEG is sent.
+    int64_t fromUs;                 // Window, in capture time.
+    int64_t untilUs;
+    ClipFormat format;
+    uint32_t name;                  // Event id, or uptime in seconds for a manual trigger.
+    httpd_req_t *req;               // Detached copy of the request, owned by the sender task.
+    int fd;
+    TaskHandle_t task;
+};
+typedef struct _clip_reader ClipReader;
+
+// Recent JPEG frames in one PSRAM arena with a byte budget, so the seconds before a trigger can
+// be exported as well as those after it. Frames are laid out back to back and evicted oldest
+// first. The arena is allocated once, so recording never fragments the heap. A reader pins the
+// oldest frame it still needs: if making room would evict it, the incoming frame is dropped instead.
+class ClipRing {
+    private:
+        SemaphoreHandle_t lock = NULL;          // Guards the index, the write position and the pins.
+        EventGroupHandle_t events = NULL;       // Pulses CLIP_FRAME_BIT when a frame is stored.
+        uint8_t *arena = NULL;                  // Frame data, in PSRAM.
+        size_t budget = 0;                      // Bytes in arena.
+        ClipFrame *index = NULL;                // Oldest first from first, in PSRAM.
+        uint16_t first = 0;                     // Index slot of the oldest frame.
+        uint16_t count = 0;                     // Frames stored.
+        size_t head = 0;                        // Arena offset the next frame goes to.
+        size_t used = 0;                        // Bytes held by stored frames.
+        ClipReader readers[CLIP_MAX_READERS];
+
+        const ClipFrame *at(uint16_t i);
+        uint32_t pinFloor();
+        bool evictOldest();
+        uint16_t find(uint32_t seq);
+
+    public:
+        ClipRing() {
+            for(int i = 0; i < CLIP_MAX_READERS; i++) {
+                readers[i].active = false;
+                readers[i].req = NULL;
+                readers[i].task = NULL;
+            }
+        }
+
+        // Allocate the arena and start recording the broadcaster's frames.
+        bool begin(size_t bytes);
+        // Copy a frame in, evicting the oldest as needed. False if it was dropped.
+        bool append(const FrameHandle &frame);
+
+        // Claim a reader for a window and pin its first stored frame. NULL if every reader is busy.
+        ClipReader *open(int64_t fromUs, int64_t untilUs, ClipFormat format, uint32_t name);
+        void close(ClipReader *reader);
+        // Release every frame before seq.
+        void advance(ClipReader *reader, uint32_t seq);
+        // Oldest stored frame newer than seq and not before the window. Its data stays put while the reader
+        // pins it. The caller stops at the first frame captured after untilUs.
+        bool next(ClipReader *reader, uint32_t seq, ClipFrame *frame);
+        bool waitForFrameAfter(uint32_t seq, TickType_t timeout);
+        const uint8_t *data(const ClipFrame &frame);
+};
+
+extern ClipRing clip_ring;
+
+#endif /* ClipRing.h */
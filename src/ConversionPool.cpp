@@ -0,0 +1,86 @@
+#include "ConversionPool.h"
+#include "esp_heap_caps.h"
+#include "img_converters.h"
+#include "Metrics.h"
+
+// Define the shared conversion pool.
+ConversionPool conversion_pool;
+
+// Rough size of a raw frame encoded at STREAM_JPEG_QUALITY.
+static size_t estimate_jpeg_bytes(size_t pixels) {
+    return max(pixels / 3, CONVERSION_MIN_BYTES);
+}
+
+void ConversionPool::reset(framesize_t framesize) {
+    capacity.store(estimate_jpeg_bytes((size_t)resolution[framesize].width * resolution[framesize].height));
+    generation.fetch_add(1);
+}
+
+// Bring a buffer up to the current generation's size. Must be called by the slot's owner.
+bool ConversionPool::prepare(ConversionBuffer *buffer, size_t pixels) {
+    uint32_t current = generation.load();
+    size_t wanted = capacity.load();
+    if(wanted == 0) wanted = estimate_jpeg_bytes(pixels);
+
+    if(buffer->buf != NULL && buffer->generation == current) return true;
+
+    // Frame size changed. Resize once instead of growing frame by frame.
+    if(buffer->capacity != wanted) {
+        heap_caps_free(buffer->buf);
+        buffer->buf = (uint8_t *)heap_caps_malloc(wanted, MALLOC_CAP_SPIRAM);
+        buffer->capacity = (buffer->buf) ? wanted : 0;
+        allocations.fetch_add(1);
+        metric_conversion_allocations.inc();
+    }
+    buffer->generation = current;
+    return buffer->buf != NULL;
+}
+
+size_t ConversionPool::writeChunk(void *arg, size_t index, const void *data, size_t len) {
+    ConversionBuffer *buffer = (ConversionBuffer *)arg;
+    if(!index) {
+        buffer->len = 0;
+        buffer->overflow = false;
+    }
+
+    // The estimate was short. Grow to fit, which the next frames of this size then reuse.
+    if(buffer->len + len > buffer->capacity) {
+        size_t grown = (buffer->len + len) + (buffer->len + len) / 4;
+        uint8_t *buf = (uint8_t *)heap_caps_realloc(buffer->buf, grown, MALLOC_CAP_SPIRAM);
+        buffer->owner->allocations.fetch_add(1);
+        metric_conversion_allocations.inc();
+        if(buf == NULL) {
+            buffer->overflow = true;
+            return 0;
+        }
+        buffer->buf = buf;
+        buffer->capacity = grown;
+    }
+    memcpy(buffer->buf + buffer->len, data, len);
+    buffer->len += len;
+    return len;
+}
+
+bool ConversionPool::encode(int id, const FrameHandle &frame, const uint8_t **out, size_t *len) {
+    if(id < 0 || id >= MAX_STREAM_CLIENTS || !frame) return false;
+
+    ConversionBuffer *buffer = &buffers[id];
+    if(!prepare(buffer, frame.width() * frame.height())) {
+        log_e("Failed to allocate conversion buffer.");
+        return false;
+    }
+
+    bool converted = fmt2jpg_cb((uint8_t *)frame.buf(), frame.len(), frame.width(), frame.height(), frame.format(),
+                                STREAM_JPEG_QUALITY, writeChunk, buffer);
+    if(!converted || buffer->overflow) return false;
+
+    conversions.fetch_add(1);
+    metric_frames_converted.inc();
+    *out = buffer->buf;
+    *len = buffer->len;
+    return true;
+}
+
+uint32_t ConversionPool::getConversionCount() { return conversions.load(); }
+
+uint32_t ConversionPool::getAllocationCount() { return allocations.load(); }
@@ -0,0 +1,67 @@
+#ifndef CONVERSION_POOL
+#define CONVERSION_POOL
+
+#include <Arduino.h>
+#include <atomic>
+#include "esp_camera.h"
+#include "FramePool.h"
+#include "FrameBroadcaster.h"
+
+const uint8_t STREAM_JPEG_QUALITY = 80;     // Quality raw frames are encoded at for streaming.
+const size_t CONVERSION_MIN_BYTES = 8192;   // Smallest buffer handed out, for tiny frame sizes.
+
+class ConversionPool;
+
+struct _conversion_buffer {
+    ConversionPool *owner;          // Pool whose counters the encoder callback updates.
+    uint8_t *buf;                   // Encoded JPEG, in PSRAM.
+    size_t len;                     // Bytes of buf in use.
+    size_t capacity;                // Bytes allocated for buf.
+    uint32_t generation;            // Pool generation buf was sized for.
+    bool overflow;                  // Encoder output did not fit and could not grow.
+};
+typedef struct _conversion_buffer ConversionBuffer;
+
+// One reusable JPEG buffer per stream slot, so raw pixel formats stream without a malloc/free of the
+// output per frame. Each buffer is only touched by the sender task owning its slot.
+//
+// That is not every allocation: fmt2jpg_cb sets up the encoder and its work buffers on the heap on
+// every call, and the driver gives no way to hand it memory instead. Allocations here are exported as
+// sentrycam_conversion_allocations_total against sentrycam_frames_converted_total, so a steady stream
+// shows the first staying flat while the second climbs.
+class ConversionPool {
+    private:
+        ConversionBuffer buffers[MAX_STREAM_CLIENTS];
+        std::atomic<uint32_t> generation{0};        // Bumped when the frame size changes.
+        std::atomic<size_t> capacity{0};            // Size buffers are allocated at for the current frame size.
+        std::atomic<uint32_t> conversions{0};       // Frames encoded.
+        std::atomic<uint32_t> allocations{0};       // Buffer allocations and growths.
+
+        static size_t writeChunk(void *arg, size_t index, const void *data, size_t len);
+        bool prepare(ConversionBuffer *buffer, size_t pixels);
+
+    public:
+        ConversionPool() {
+            for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+                buffers[i].owner = this;
+                buffers[i].buf = NULL;
+                buffers[i].len = 0;
+                buffers[i].capacity = 0;
+                buffers[i].generation = 0;
+                buffers[i].overflow = false;
+            }
+        }
+
+        // Resize every buffer for a new frame size. Buffers are reallocated by their owners on next use.
+        void reset(framesize_t framesize);
+        // Encode a raw frame into the slot's buffer. The output stays valid until the slot's next encode.
+        bool encode(int id, const FrameHandle &frame, const uint8_t **out, size_t *len);
+
+        uint32_t getConversionCount();
+        // Allocations and growths of this pool's buffers, not counting the encoder's own.
+        uint32_t getAllocationCount();
+};
+
+extern ConversionPool conversion_pool;
+
+#endif /* ConversionPool.h */
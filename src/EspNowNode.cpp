@@ -3,6 +3,7 @@
 #include <ESP32_NOW.h>
 #include <WiFi.h>
 #include <esp_mac.h>
+#include "Metrics.h"
 
 // Define task handles.
 TaskHandle_t esp_now_tx_rx_handle = NULL;
@@ -303,6 +304,8 @@ void EspNowNode::onReceive(const uint8_t *data, size_t len, bool broadcast) {
     Serial.printf("Data Received: %s\n", dataReceived->data);
     Serial.println("------------------------------------------------\n");
 
+    metric_espnow_rx.inc();
+
     // Save data received.
     incomingData.header = dataReceived->header;
     incomingData.ack = dataReceived->ack;
@@ -313,6 +316,8 @@ void EspNowNode::onReceive(const uint8_t *data, size_t len, bool broadcast) {
 }
 
 void EspNowNode::onSent(bool success) {
+    if(success) metric_espnow_tx.inc();
+    else metric_espnow_tx_failed.inc();
     this->waitingForData = true;
 }
 
@@ -0,0 +1,311 @@
+#include "FrameBroadcaster.h"
+#include <utility>
+#include "esp_timer.h"
+#include "Metrics.h"
+#include "FrameSignature.h"
+
+// Define task handles and the shared broadcaster.
+TaskHandle_t capture_task_handle = NULL;
+TaskHandle_t publish_task_handle = NULL;
+FrameBroadcaster frame_broadcaster;
+
+void capture_task(void *pvParams) {
+    // Setup.
+    FrameBroadcaster *broadcaster = static_cast<FrameBroadcaster *>(pvParams);
+
+    // Task loop. Never returns.
+    broadcaster->captureLoop();
+    vTaskDelete(NULL);
+}
+
+void publish_task(void *pvParams) {
+    // Setup.
+    FrameBroadcaster *broadcaster = static_cast<FrameBroadcaster *>(pvParams);
+
+    // Task loop. Never returns.
+    broadcaster->publishLoop();
+    vTaskDelete(NULL);
+}
+
+static int64_t capture_time_us(const FrameHandle &frame) {
+    return (int64_t)frame.timestamp().tv_sec * 1000000 + frame.timestamp().tv_usec;
+}
+
+bool FrameBroadcaster::start() {
+    // Only start once.
+    if(capture_task_handle != NULL) return true;
+
+    lock = xSemaphoreCreateMutex();
+    wake = xSemaphoreCreateBinary();
+    events = xEventGroupCreate();
+    captured = xQueueCreate(CAPTURE_QUEUE_DEPTH, sizeof(PooledFrame *));
+    if(lock == NULL || wake == NULL || events == NULL || captured == NULL) {
+        log_e("Failed to create frame broadcaster semaphores.");
+        return false;
+    }
+
+    for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        subscribers[i].frameReady = xSemaphoreCreateBinary();
+        if(subscribers[i].frameReady == NULL) {
+            log_e("Failed to create frame subscriber semaphore.");
+            return false;
+        }
+    }
+
+    // Streams share frame signatures, so set them up before the first subscriber can ask. Without
+    // them streams just send every frame.
+    if(!frame_signatures.begin()) log_e("Failed to set up frame signatures.");
+
+    BaseType_t res = xTaskCreatePinnedToCore(
+        &publish_task,          // Pointer to task function.
+        "publish_task",         // Task name.
+        PUBLISH_TASK_DEPTH,     // Size of stack allocated to the task (in bytes).
+        this,                   // Pointer to parameters used for task creation.
+        1,                      // Task priority level.
+        &publish_task_handle,   // Pointer to task handle.
+        1                       // Core that the task will run on.
+    );
+    if(res != pdPASS) {
+        log_e("Failed to create Publish Task.");
+        return false;
+    }
+
+    res = xTaskCreatePinnedToCore(
+        &capture_task,          // Pointer to task function.
+        "capture_task",         // Task name.
+        CAPTURE_TASK_DEPTH,     // Size of stack allocated to the task (in bytes).
+        this,                   // Pointer to parameters used for task creation.
+        CAPTURE_TASK_PRIORITY,  // Task priority level.
+        &capture_task_handle,   // Pointer to task handle.
+        CAPTURE_TASK_CORE       // Core that the task will run on.
+    );
+    if(res != pdPASS) log_e("Failed to create Capture Task.");
+    return res == pdPASS;
+}
+
+void FrameBroadcaster::captureLoop() {
+    int64_t lastCapturedUs = 0;
+    for(;;) {
+        // Sleep while nobody is watching so the sensor is only read on demand.
+        bool resumed = false;
+        while(getSubscriberCount() == 0 && !continuous && !requested) {
+            xSemaphoreTake(wake, portMAX_DELAY);
+            resumed = true;
+        }
+        requested = false;
+
+        // Grab exactly one frame for every subscriber.
+        int64_t start = esp_timer_get_time();
+        camera_fb_t *fb = esp_camera_fb_get();
+        if(!fb) {
+            log_e("Camera capture failed");
+            metric_capture_failures.inc();
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+
+        metric_capture_ms.observe((uint32_t)((esp_timer_get_time() - start) / 1000));
+        metric_frames_captured.inc();
+
+        // Move it into the pool and give the driver its buffer back straight away.
+        FrameHandle frame = frame_pool.ingest(fb);
+        esp_camera_fb_return(fb);
+        if(!frame) continue;
+
+        // How far this frame landed from where the sensor rate says it should have. Gaps after
+        // sleeping for want of viewers are not jitter.
+        int64_t capturedUs = capture_time_us(frame);
+        int64_t expectedUs = intervalUs;
+        if(!resumed && lastCapturedUs != 0 && expectedUs > 0) {
+            int64_t deviation = capturedUs - lastCapturedUs - expectedUs;
+            metric_capture_jitter_ms.observe((uint32_t)(llabs(deviation) / 1000));
+        }
+        lastCapturedUs = capturedUs;
+
+        // Hand over without waiting. If publishing has fallen behind, the oldest queued frame goes so
+        // viewers always get the newest one.
+        PooledFrame *queued = frame.detach();
+        if(xQueueSend(captured, &queued, 0) != pdTRUE) {
+            PooledFrame *stale = NULL;
+            if(xQueueReceive(captured, &stale, 0) == pdTRUE) {
+                FrameHandle dropped(stale);
+                metric_capture_queue_dropped.inc();
+            }
+            if(xQueueSend(captured, &queued, 0) != pdTRUE) {
+                FrameHandle dropped(queued);
+                metric_capture_queue_dropped.inc();
+            }
+        }
+    }
+}
+
+void FrameBroadcaster::publishLoop() {
+    for(;;) {
+        PooledFrame *queued = NULL;
+        if(xQueueReceive(captured, &queued, portMAX_DELAY) != pdTRUE) continue;
+        publish(FrameHandle(queued));
+    }
+}
+
+void FrameBroadcaster::publish(FrameHandle frame) {
+    if(lock == NULL || !frame) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    // The queue keeps capture order, but publish() is public. Never let an older frame replace a newer one.
+    if(latest && frame.seq() < latest.seq()) {
+        xSemaphoreGive(lock);
+        return;
+    }
+
+    // Track the sensor frame interval. Drop instantly to a shorter gap and drift up slowly,
+    // so gaps caused by nobody asking for frames do not inflate it.
+    int64_t captured = capture_time_us(frame);
+    int64_t gap = captured - lastCaptureUs;
+    if(lastCaptureUs != 0 && gap > 0) {
+        if(intervalUs == 0 || gap < intervalUs) intervalUs = gap;
+        else intervalUs += (gap - intervalUs) / 16;
+    }
+    lastCaptureUs = captured;
+
+    latest = std::move(frame);
+    published++;
+    for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        if(subscribers[i].active) xSemaphoreGive(subscribers[i].frameReady);
+    }
+    xSemaphoreGive(lock);
+
+    // Setting the bit releases every task already waiting on it. Clearing it straight away
+    // turns it into a pulse, so later waiters block until the next frame.
+    xEventGroupSetBits(events, FRAME_PUBLISHED_BIT);
+    xEventGroupClearBits(events, FRAME_PUBLISHED_BIT);
+}
+
+void FrameBroadcaster::setContinuous(bool continuous) {
+    this->continuous = continuous;
+    if(continuous && wake != NULL) xSemaphoreGive(wake);
+}
+
+FrameHandle FrameBroadcaster::getLatest() {
+    if(lock == NULL) return FrameHandle();
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    FrameHandle frame = latest;
+    xSemaphoreGive(lock);
+    return frame;
+}
+
+FrameHandle FrameBroadcaster::requestFrame(TickType_t timeout) {
+    if(wake == NULL) return FrameHandle();
+
+    uint32_t seq = getSequence();
+    requested = true;
+    xSemaphoreGive(wake);
+    return waitForFrameAfter(seq, timeout);
+}
+
+FrameHandle FrameBroadcaster::waitForFrameAfter(uint32_t seq, TickType_t timeout) {
+    if(events == NULL) return FrameHandle();
+
+    TickType_t start = xTaskGetTickCount();
+    for(;;) {
+        FrameHandle frame = getLatest();
+        if(frame && frame.seq() > seq) return frame;
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if(elapsed >= timeout) return FrameHandle();
+
+        // A pulse between the check above and this wait is missed, so re-check at least once a frame.
+        TickType_t slice = pdMS_TO_TICKS(intervalUs / 1000) + 1;
+        xEventGroupWaitBits(events, FRAME_PUBLISHED_BIT, pdFALSE, pdTRUE, min(slice, timeout - elapsed));
+    }
+}
+
+// True while the sensor could not have produced anything newer than this frame. In continuous
+// mode the next frame is already on its way, so allow a second interval of jitter.
+bool FrameBroadcaster::isFresh(const FrameHandle &frame) {
+    if(!frame || intervalUs == 0) return false;
+    int64_t window = (continuous) ? intervalUs * 2 : intervalUs;
+    return esp_timer_get_time() - capture_time_us(frame) < window;
+}
+
+int64_t FrameBroadcaster::getFrameIntervalUs() { return intervalUs; }
+
+int FrameBroadcaster::subscribe() {
+    if(lock == NULL) return -1;
+
+    // Claim a free slot.
+    int id = -1;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        if(subscribers[i].active) continue;
+        subscribers[i].active = true;
+        subscribers[i].lastPublished = published;
+        subscribers[i].dropped = 0;
+        xSemaphoreTake(subscribers[i].frameReady, 0);
+        subscriberCount++;
+        id = i;
+        break;
+    }
+    bool first = (subscriberCount == 1 && id >= 0);
+    xSemaphoreGive(lock);
+
+    // Wake the capture task for the first viewer.
+    if(first) xSemaphoreGive(wake);
+    return id;
+}
+
+void FrameBroadcaster::unsubscribe(int id) {
+    if(id < 0 || id >= MAX_STREAM_CLIENTS) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if(subscribers[id].active) {
+        subscribers[id].active = false;
+        subscriberCount--;
+    }
+
+    xSemaphoreGive(lock);
+}
+
+FrameHandle FrameBroadcaster::acquire(int id, TickType_t timeout) {
+    if(id < 0 || id >= MAX_STREAM_CLIENTS) return FrameHandle();
+
+    // Wait for a frame this subscriber has not seen yet. The binary semaphore collapses
+    // any number of publishes into one wake-up, so a slow subscriber never queues frames.
+    TickType_t start = xTaskGetTickCount();
+    for(;;) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if(elapsed >= timeout) return FrameHandle();
+        if(xSemaphoreTake(subscribers[id].frameReady, timeout - elapsed) != pdTRUE) return FrameHandle();
+
+        // Take a reference to the newest frame. The subscriber may keep it as long as it needs to.
+        xSemaphoreTake(lock, portMAX_DELAY);
+        FrameHandle frame = latest;
+        FrameSubscriber *sub = &subscribers[id];
+        if(frame && published != sub->lastPublished) {
+            if(sub->lastPublished != 0 && published - sub->lastPublished > 1) {
+                sub->dropped += published - sub->lastPublished - 1;
+                metric_frames_dropped.inc(published - sub->lastPublished - 1);
+            }
+            sub->lastPublished = published;
+            xSemaphoreGive(lock);
+            return frame;
+        }
+        xSemaphoreGive(lock);
+    }
+}
+
+uint32_t FrameBroadcaster::getDroppedCount(int id) {
+    if(id < 0 || id >= MAX_STREAM_CLIENTS) return 0;
+    return subscribers[id].dropped;
+}
+
+uint8_t FrameBroadcaster::getSubscriberCount() { return subscriberCount; }
+
+uint32_t FrameBroadcaster::getSequence() {
+    if(lock == NULL) return 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t seq = (latest) ? latest.seq() : 0;
+    xSemaphoreGive(lock);
+    return seq;
+}
@@ -0,0 +1,99 @@
+#ifndef FRAME_BROADCASTER
+#define FRAME_BROADCASTER
+
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "FramePool.h"
+
+// The capture stage pulls frames from the driver and nothing else, so it can sit on core 0 next to
+// WiFi instead of sharing core 1 with the httpd worker and the stream senders. Override with a build flag.
+#ifndef CAPTURE_TASK_CORE
+#define CAPTURE_TASK_CORE 0
+#endif
+
+const uint8_t MAX_STREAM_CLIENTS = 8;
+const int CAPTURE_TASK_DEPTH = 4096;
+const UBaseType_t CAPTURE_TASK_PRIORITY = 2;    // Above the stream senders so a busy socket never delays a grab.
+const int PUBLISH_TASK_DEPTH = 3072;
+const uint8_t CAPTURE_QUEUE_DEPTH = 2;          // Frames captured but not yet published. The oldest goes when it is full.
+
+// Pool frames that can be held at once besides one per stream sender. A new holder is counted here.
+const uint8_t PIPELINE_HELD_FRAMES = CAPTURE_QUEUE_DEPTH + 3;   // The queue, one in hand at each stage, and the latest frame.
+const uint8_t HANDLER_HELD_FRAMES = 2;                          // The httpd worker's handler, and /capture's last good frame.
+const uint8_t WORKER_HELD_FRAMES = 3;                           // The motion detector, the clip recorder and the long-poll task.
+const TickType_t FRAME_WAIT_TIMEOUT = pdMS_TO_TICKS(5000);
+const TickType_t LONG_POLL_TIMEOUT = pdMS_TO_TICKS(2000);
+const uint8_t LONG_POLL_MAX_WAITERS = 4;        // /capture?after= requests parked at once. More get a 503.
+const TickType_t LONG_POLL_SLICE = pdMS_TO_TICKS(50);   // Longest the long-poll task waits before checking deadlines again.
+const int LONG_POLL_TASK_DEPTH = 4096;
+const EventBits_t FRAME_PUBLISHED_BIT = BIT0;
+
+extern TaskHandle_t capture_task_handle;
+extern TaskHandle_t publish_task_handle;
+
+void capture_task(void *pvParams);
+void publish_task(void *pvParams);
+
+struct _frame_subscriber {
+    bool active;                    // Slot is owned by a stream connection.
+    SemaphoreHandle_t frameReady;   // Given by the capture task each time a frame is published.
+    uint32_t lastPublished;         // Publish count of the last frame handed to this subscriber.
+    uint32_t dropped;               // Frames published while the subscriber was busy and skipped.
+};
+typedef struct _frame_subscriber FrameSubscriber;
+
+class FrameBroadcaster {
+    private:
+        SemaphoreHandle_t lock = NULL;              // Guards the subscriber table and the latest frame.
+        SemaphoreHandle_t wake = NULL;              // Wakes the capture task when the first subscriber arrives.
+        EventGroupHandle_t events = NULL;           // Pulses FRAME_PUBLISHED_BIT for long-poll waiters.
+        QueueHandle_t captured = NULL;              // PooledFrame pointers from the capture stage, each holding a reference.
+        bool continuous = false;                    // Keep capturing with no subscribers so snapshots never wait.
+        volatile bool requested = false;            // A snapshot is waiting for a frame while capture is idle.
+        FrameSubscriber subscribers[MAX_STREAM_CLIENTS];
+        FrameHandle latest;                         // Most recently published frame.
+        uint32_t published = 0;                     // Frames published so far.
+        int64_t lastCaptureUs = 0;                  // Capture time of the latest frame.
+        int64_t intervalUs = 0;                     // Estimated sensor frame interval.
+        uint8_t subscriberCount = 0;                // Active subscribers.
+
+    public:
+        FrameBroadcaster() {
+            for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+                subscribers[i].active = false;
+                subscribers[i].frameReady = NULL;
+                subscribers[i].lastPublished = 0;
+                subscribers[i].dropped = 0;
+            }
+        }
+
+        bool start();
+        // Capture stage. Grabs frames at sensor rate and queues them without waiting on anyone.
+        void captureLoop();
+        // Publish stage. Hands queued frames to subscribers and snapshot waiters.
+        void publishLoop();
+        void publish(FrameHandle frame);
+
+        // Snapshot interface.
+        void setContinuous(bool continuous);
+        FrameHandle getLatest();
+        // A frame from the capture stage newer than the latest one, waking it if it is idle.
+        FrameHandle requestFrame(TickType_t timeout);
+        FrameHandle waitForFrameAfter(uint32_t seq, TickType_t timeout);
+        bool isFresh(const FrameHandle &frame);
+        int64_t getFrameIntervalUs();
+
+        // Stream connection interface.
+        int subscribe();
+        void unsubscribe(int id);
+        // Always the newest frame. Anything published in between is skipped and counted as dropped.
+        FrameHandle acquire(int id, TickType_t timeout);
+        uint32_t getDroppedCount(int id);
+
+        uint8_t getSubscriberCount();
+        uint32_t getSequence();
+};
+
+extern FrameBroadcaster frame_broadcaster;
+
+#endif /* FrameBroadcaster.h */
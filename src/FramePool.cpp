@@ -0,0 +1,115 @@
+#include "FramePool.h"
+#include <new>
+#include "esp_heap_caps.h"
+
+// Define the shared frame pool.
+FramePool frame_pool;
+
+// Rough upper bound for a frame, used to pre-size slots so steady state never reallocates.
+static size_t estimate_frame_bytes(framesize_t framesize, pixformat_t format) {
+    size_t pixels = (size_t)resolution[framesize].width * resolution[framesize].height;
+    switch(format) {
+        case PIXFORMAT_JPEG:      return pixels / 5;
+        case PIXFORMAT_GRAYSCALE: return pixels;
+        case PIXFORMAT_RGB888:    return pixels * 3;
+        default:                  return pixels * 2;
+    }
+}
+
+FrameHandle &FrameHandle::operator=(const FrameHandle &other) {
+    if(other.frame) other.frame->refs.fetch_add(1);
+    reset();
+    frame = other.frame;
+    return *this;
+}
+
+FrameHandle &FrameHandle::operator=(FrameHandle &&other) {
+    if(this != &other) {
+        reset();
+        frame = other.frame;
+        other.frame = NULL;
+    }
+    return *this;
+}
+
+void FrameHandle::reset() {
+    // Dropping the last reference hands the slot back to the pool.
+    if(frame) frame->refs.fetch_sub(1);
+    frame = NULL;
+}
+
+bool FramePool::begin(uint8_t slots, framesize_t framesize, pixformat_t format) {
+    // Only allocate once.
+    if(frames != NULL) return true;
+
+    frames = (PooledFrame *)heap_caps_calloc(slots, sizeof(PooledFrame), MALLOC_CAP_SPIRAM);
+    if(frames == NULL) {
+        log_e("Failed to allocate frame pool.");
+        return false;
+    }
+
+    size_t capacity = estimate_frame_bytes(framesize, format);
+    for(uint8_t i = 0; i < slots; i++) {
+        PooledFrame *frame = new (&frames[i]) PooledFrame();
+        frame->refs.store(0);
+        frame->buf = (uint8_t *)heap_caps_malloc(capacity, MALLOC_CAP_SPIRAM);
+        frame->capacity = (frame->buf) ? capacity : 0;
+        frame->len = 0;
+    }
+    count = slots;
+    return true;
+}
+
+// Take ownership of a free slot, lock-free.
+PooledFrame *FramePool::claim() {
+    for(uint8_t i = 0; i < count; i++) {
+        uint16_t expected = 0;
+        if(frames[i].refs.compare_exchange_strong(expected, 1)) return &frames[i];
+    }
+    return NULL;
+}
+
+FrameHandle FramePool::ingest(camera_fb_t *fb) {
+    if(fb == NULL) return FrameHandle();
+
+    // Never wait on readers. If every slot is held the frame is dropped.
+    PooledFrame *frame = claim();
+    if(frame == NULL) {
+        exhausted.fetch_add(1);
+        return FrameHandle();
+    }
+
+    // Grow the slot if this frame does not fit. Only happens after a frame size change.
+    if(fb->len > frame->capacity) {
+        uint8_t *grown = (uint8_t *)heap_caps_realloc(frame->buf, fb->len, MALLOC_CAP_SPIRAM);
+        if(grown == NULL) {
+            log_e("Failed to grow frame pool slot to %luB.", (unsigned long)fb->len);
+            frame->refs.store(0);
+            return FrameHandle();
+        }
+        frame->buf = grown;
+        frame->capacity = fb->len;
+    }
+
+    // One copy out of the driver buffer so the driver gets it back immediately.
+    memcpy(frame->buf, fb->buf, fb->len);
+    frame->len = fb->len;
+    frame->width = fb->width;
+    frame->height = fb->height;
+    frame->format = fb->format;
+    frame->timestamp = fb->timestamp;
+    frame->seq = sequence.fetch_add(1) + 1;
+    return FrameHandle(frame);
+}
+
+uint8_t FramePool::getSlotCount() { return count; }
+
+uint8_t FramePool::getFreeCount() {
+    uint8_t free = 0;
+    for(uint8_t i = 0; i < count; i++) {
+        if(frames[i].refs.load() == 0) free++;
+    }
+    return free;
+}
+
+uint32_t FramePool::getExhaustedCount() { return exhausted.load(); }
@@ -0,0 +1,69 @@
+#ifndef FRAME_POOL
+#define FRAME_POOL
+
+#include <Arduino.h>
+#include <atomic>
+#include "esp_camera.h"
+
+struct _pooled_frame {
+    uint8_t *buf;                   // Frame data, in PSRAM.
+    size_t len;                     // Bytes of buf in use.
+    size_t capacity;                // Bytes allocated for buf.
+    size_t width;                   // Width in pixels.
+    size_t height;                  // Height in pixels.
+    pixformat_t format;             // Pixel format of buf.
+    struct timeval timestamp;       // Capture time reported by the driver.
+    uint32_t seq;                   // Monotonic capture sequence number.
+    std::atomic<uint16_t> refs;     // Outstanding handles. Zero means the slot is free.
+};
+typedef struct _pooled_frame PooledFrame;
+
+// Counted reference to a pooled frame. The slot is recycled when the last handle goes away.
+class FrameHandle {
+    private:
+        PooledFrame *frame = NULL;
+
+    public:
+        FrameHandle() {}
+        explicit FrameHandle(PooledFrame *adopted) : frame(adopted) {}
+        FrameHandle(const FrameHandle &other) : frame(other.frame) { if(frame) frame->refs.fetch_add(1); }
+        FrameHandle(FrameHandle &&other) : frame(other.frame) { other.frame = NULL; }
+        ~FrameHandle() { reset(); }
+
+        FrameHandle &operator=(const FrameHandle &other);
+        FrameHandle &operator=(FrameHandle &&other);
+        void reset();
+        // Give up the reference without dropping it, to pass it through a queue. FrameHandle(PooledFrame *) takes it back.
+        PooledFrame *detach() { PooledFrame *detached = frame; frame = NULL; return detached; }
+
+        explicit operator bool() const { return frame != NULL; }
+        const uint8_t *buf() const { return frame->buf; }
+        size_t len() const { return frame->len; }
+        size_t width() const { return frame->width; }
+        size_t height() const { return frame->height; }
+        pixformat_t format() const { return frame->format; }
+        const struct timeval &timestamp() const { return frame->timestamp; }
+        uint32_t seq() const { return frame->seq; }
+};
+
+class FramePool {
+    private:
+        PooledFrame *frames = NULL;         // Slot table, in PSRAM.
+        uint8_t count = 0;                  // Number of slots.
+        std::atomic<uint32_t> sequence{0};  // Last sequence number handed out.
+        std::atomic<uint32_t> exhausted{0}; // Frames dropped because every slot was held.
+
+        PooledFrame *claim();
+
+    public:
+        bool begin(uint8_t slots, framesize_t framesize, pixformat_t format);
+        FrameHandle ingest(camera_fb_t *fb);
+
+        uint8_t getSlotCount();
+        uint8_t getFreeCount();
+        uint32_t getExhaustedCount();
+};
+
+extern FramePool frame_pool;
+
+#endif /* FramePool.h */
@@ -0,0 +1,83 @@
+#include "FrameSignature.h"
+#include <new>
+#include "esp_heap_caps.h"
+#include "MotionDetector.h"
+
+// Define the shared signature cache.
+FrameSignatureCache frame_signatures;
+
+bool FrameSignatureCache::compute(const FrameHandle &frame, uint8_t *cells) {
+    uint16_t width, height;
+    if(!luma_grid_size(parser, frame, &width, &height)) return false;
+    uint16_t gridWidth = (width + 7) / 8;
+    uint16_t gridHeight = (height + 7) / 8;
+
+    size_t needed = (size_t)gridWidth * gridHeight;
+    if(needed > gridCapacity) {
+        heap_caps_free(grid);
+        grid = (uint8_t *)heap_caps_malloc(needed, MALLOC_CAP_SPIRAM);
+        gridCapacity = grid ? needed : 0;
+        if(grid == NULL) return false;
+    }
+    if(!luma_grid(parser, frame, grid, gridCapacity)) return false;
+
+    // Average the grid down. Every signature cell covers at least one grid cell, even for tiny frames.
+    for(uint8_t sy = 0; sy < SIGNATURE_HEIGHT; sy++) {
+        uint16_t y0 = sy * gridHeight / SIGNATURE_HEIGHT;
+        uint16_t y1 = max((uint16_t)((sy + 1) * gridHeight / SIGNATURE_HEIGHT), (uint16_t)(y0 + 1));
+        for(uint8_t sx = 0; sx < SIGNATURE_WIDTH; sx++) {
+            uint16_t x0 = sx * gridWidth / SIGNATURE_WIDTH;
+            uint16_t x1 = max((uint16_t)((sx + 1) * gridWidth / SIGNATURE_WIDTH), (uint16_t)(x0 + 1));
+            uint32_t sum = 0;
+            for(uint16_t y = y0; y < y1 && y < gridHeight; y++) {
+                for(uint16_t x = x0; x < x1 && x < gridWidth; x++) sum += grid[(size_t)y * gridWidth + x];
+            }
+            *cells++ = sum / ((y1 - y0) * (x1 - x0));
+        }
+    }
+    computed++;
+    return true;
+}
+
+bool FrameSignatureCache::begin() {
+    if(lock == NULL) lock = xSemaphoreCreateMutex();
+    if(parser == NULL) {
+        void *mem = heap_caps_malloc(sizeof(JpegCrop), MALLOC_CAP_SPIRAM);
+        parser = mem ? new (mem) JpegCrop() : NULL;
+    }
+    return lock != NULL && parser != NULL;
+}
+
+bool FrameSignatureCache::get(const FrameHandle &frame, uint8_t *cells) {
+    if(lock == NULL || parser == NULL) return false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for(int i = 0; i < SIGNATURE_CACHE; i++) {
+        if(entries[i].seq == frame.seq()) {
+            memcpy(cells, entries[i].cells, SIGNATURE_BYTES);
+            xSemaphoreGive(lock);
+            return true;
+        }
+    }
+
+    // First stream to see this frame works it out for the rest.
+    FrameSignature *entry = &entries[nextEntry];
+    bool ok = compute(frame, entry->cells);
+    if(ok) {
+        entry->seq = frame.seq();
+        nextEntry = (nextEntry + 1) % SIGNATURE_CACHE;
+        memcpy(cells, entry->cells, SIGNATURE_BYTES);
+    }
+    else entry->seq = 0;
+    xSemaphoreGive(lock);
+    return ok;
+}
+
+bool FrameSignatureCache::matches(const uint8_t *a, const uint8_t *b) {
+    for(size_t i = 0; i < SIGNATURE_BYTES; i++) {
+        uint8_t delta = (a[i] > b[i]) ? a[i] - b[i] : b[i] - a[i];
+        if(delta > SIGNATURE_TOLERANCE) return false;
+    }
+    return true;
+}
+
+uint32_t FrameSignatureCache::getComputedCount() { return computed; }
@@ -0,0 +1,53 @@
+#ifndef FRAME_SIGNATURE
+#define FRAME_SIGNATURE
+
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "FramePool.h"
+#include "JpegCrop.h"
+
+const uint8_t SIGNATURE_WIDTH = 16;
+const uint8_t SIGNATURE_HEIGHT = 12;
+const size_t SIGNATURE_BYTES = SIGNATURE_WIDTH * SIGNATURE_HEIGHT;
+const uint8_t SIGNATURE_TOLERANCE = 4;          // Largest cell change, in luma levels, that still counts as the same scene.
+const uint8_t SIGNATURE_CACHE = 4;              // Recent frames whose signature is kept.
+
+struct _frame_signature {
+    uint32_t seq;                   // Frame it belongs to. 0 when empty.
+    uint8_t cells[SIGNATURE_BYTES];
+};
+typedef struct _frame_signature FrameSignature;
+
+// A 16x12 grid of mean luma per frame, averaged from the 1/8 scale DC grid, so sensor and
+// quantisation noise wash out and anything big enough to see moves at least one cell. It is
+// worked out once per frame and shared by every stream that asks for it.
+class FrameSignatureCache {
+    private:
+        SemaphoreHandle_t lock = NULL;      // Guards the parser, the grid and the entries.
+        JpegCrop *parser = NULL;            // DC walker, in PSRAM.
+        uint8_t *grid = NULL;               // 1/8 scale luma, in PSRAM.
+        size_t gridCapacity = 0;
+        FrameSignature entries[SIGNATURE_CACHE];
+        uint8_t nextEntry = 0;
+        uint32_t computed = 0;
+
+        bool compute(const FrameHandle &frame, uint8_t *cells);
+
+    public:
+        FrameSignatureCache() {
+            for(int i = 0; i < SIGNATURE_CACHE; i++) entries[i].seq = 0;
+        }
+
+        // Create the lock and the parser. Called once by the frame broadcaster before any stream can ask.
+        bool begin();
+        // Signature of a frame. False for formats without a cheap luma, or before begin().
+        bool get(const FrameHandle &frame, uint8_t *cells);
+        // True if no cell moved by more than SIGNATURE_TOLERANCE.
+        static bool matches(const uint8_t *a, const uint8_t *b);
+
+        uint32_t getComputedCount();
+};
+
+extern FrameSignatureCache frame_signatures;
+
+#endif /* FrameSignature.h */
@@ -0,0 +1,435 @@
+#include "JpegCrop.h"
+
+static uint16_t read_u16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+bool JpegCrop::buildHuffman(JpegHuffman *table, const uint8_t *counts, const uint8_t *symbols) {
+    // Canonical code assignment from JPEG Annex C.
+    memset(table, 0, sizeof(JpegHuffman));
+    uint32_t code = 0;
+    int k = 0;
+    for(int len = 1; len <= 16; len++) {
+        table->valptr[len] = k;
+        table->mincode[len] = code;
+        for(int i = 0; i < counts[len - 1]; i++, k++, code++) {
+            if(k > 255 || code >= (1u << len)) return false;
+            uint8_t sym = symbols[k];
+            table->values[k] = sym;
+            table->code[sym] = code;
+            table->size[sym] = len;
+            if(len <= JPEG_LOOKAHEAD_BITS) {
+                uint8_t spare = JPEG_LOOKAHEAD_BITS - len;
+                for(uint32_t j = 0; j < (1u << spare); j++) table->lookup[(code << spare) | j] = (len << 8) | sym;
+            }
+        }
+        table->maxcode[len] = counts[len - 1] ? (int32_t)code - 1 : -1;
+        code <<= 1;
+    }
+    table->maxcode[17] = 0x7FFFFFFF;
+    table->defined = true;
+    return true;
+}
+
+bool JpegCrop::parseDHT(const uint8_t *p, size_t len) {
+    // One segment may hold several tables.
+    while(len >= 17) {
+        uint8_t tc = p[0] >> 4;
+        uint8_t th = p[0] & 0x0F;
+        size_t total = 0;
+        for(int i = 1; i <= 16; i++) total += p[i];
+        if(th > 1 || tc > 1 || len < 17 + total) return false;
+        if(!buildHuffman(tc ? &ac[th] : &dc[th], p + 1, p + 17)) return false;
+        p += 17 + total;
+        len -= 17 + total;
+    }
+    return len == 0;
+}
+
+bool JpegCrop::parseDQT(const uint8_t *p, size_t len) {
+    // Only the first entry of each table, the DC step, is kept.
+    while(len >= 65) {
+        uint8_t pq = p[0] >> 4;
+        uint8_t tq = p[0] & 0x0F;
+        size_t size = pq ? 129 : 65;
+        if(pq > 1 || tq > 3 || len < size) return false;
+        quantDC[tq] = pq ? read_u16(p + 1) : p[1];
+        p += size;
+        len -= size;
+    }
+    return len == 0;
+}
+
+bool JpegCrop::parseSOF(const uint8_t *p, size_t len) {
+    if(len < 6 || p[0] != 8) return false;
+    height = read_u16(p + 1);
+    width = read_u16(p + 3);
+    componentCount = p[5];
+    if(componentCount != 1 && componentCount != 3) return false;
+    if(len < 6 + 3 * (size_t)componentCount || !width || !height) return false;
+
+    uint8_t hmax = 1, vmax = 1;
+    for(int i = 0; i < componentCount; i++) {
+        components[i].id = p[6 + i * 3];
+        components[i].h = p[7 + i * 3] >> 4;
+        components[i].v = p[7 + i * 3] & 0x0F;
+        components[i].quantTable = p[8 + i * 3];
+        if(components[i].h < 1 || components[i].h > 2 || components[i].v < 1 || components[i].v > 2) return false;
+        if(components[i].quantTable > 3) return false;
+        hmax = max(hmax, components[i].h);
+        vmax = max(vmax, components[i].v);
+    }
+
+    // A single component scan is never interleaved, so its MCU is one block.
+    if(componentCount == 1) components[0].h = components[0].v = hmax = vmax = 1;
+    mcuWidth = 8 * hmax;
+    mcuHeight = 8 * vmax;
+    return true;
+}
+
+bool JpegCrop::parseSOS(const uint8_t *p, size_t len) {
+    // Only a single interleaved scan of every component is supported, which is all baseline encoders write.
+    if(len < 1 || p[0] != componentCount || len < 4 + 2 * (size_t)componentCount) return false;
+    for(int i = 0; i < componentCount; i++) {
+        if(p[1 + i * 2] != components[i].id) return false;
+        components[i].dcTable = p[2 + i * 2] >> 4;
+        components[i].acTable = p[2 + i * 2] & 0x0F;
+        if(components[i].dcTable > 1 || components[i].acTable > 1) return false;
+        if(!dc[components[i].dcTable].defined || !ac[components[i].acTable].defined) return false;
+    }
+    const uint8_t *spectral = p + 1 + 2 * componentCount;
+    return spectral[0] == 0 && spectral[1] == 63 && spectral[2] == 0;
+}
+
+bool JpegCrop::parse(const uint8_t *jpg, size_t len) {
+    src = jpg;
+    srcLen = len;
+    componentCount = 0;
+    restartInterval = 0;
+    sofOffset = driOffset = scanOffset = 0;
+    dc[0].defined = dc[1].defined = ac[0].defined = ac[1].defined = false;
+    memset(quantDC, 0, sizeof(quantDC));
+
+    if(len < 4 || jpg[0] != 0xFF || jpg[1] != 0xD8) return false;
+
+    size_t pos = 2;
+    while(pos + 4 <= len) {
+        if(jpg[pos] != 0xFF) return false;
+        uint8_t marker = jpg[pos + 1];
+        if(marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        size_t segLen = read_u16(jpg + pos + 2);
+        if(segLen < 2 || pos + 2 + segLen > len) return false;
+        const uint8_t *body = jpg + pos + 4;
+        size_t bodyLen = segLen - 2;
+
+        switch(marker) {
+            case 0xC0:
+            case 0xC1:
+                sofOffset = pos;
+                if(!parseSOF(body, bodyLen)) return false;
+                break;
+            case 0xC4:
+                if(!parseDHT(body, bodyLen)) return false;
+                break;
+            case 0xDB:
+                if(!parseDQT(body, bodyLen)) return false;
+                break;
+            case 0xDD:
+                if(bodyLen < 2) return false;
+                driOffset = pos;
+                restartInterval = read_u16(body);
+                break;
+            case 0xDA:
+                if(!componentCount || !parseSOS(body, bodyLen)) return false;
+                scanOffset = pos + 2 + segLen;
+                return true;
+            default:
+                // Progressive, lossless and arithmetic coded frames are not supported.
+                if(marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) return false;
+                break;
+        }
+        pos += 2 + segLen;
+    }
+    return false;
+}
+
+void JpegCrop::fill() {
+    while(inCount <= 24) {
+        uint8_t b = 0;
+        if(!inMarker && in < src + srcLen) {
+            b = *in++;
+            if(b == 0xFF) {
+                // A stuffed zero follows a literal 0xFF. Anything else is a marker, which ends the data.
+                if(in < src + srcLen && *in == 0x00) in++;
+                else {
+                    in--;
+                    inMarker = true;
+                    b = 0;
+                }
+            }
+        }
+        inBits |= (uint32_t)b << (24 - inCount);
+        inCount += 8;
+    }
+}
+
+uint32_t JpegCrop::peek(uint8_t n) {
+    fill();
+    return n ? inBits >> (32 - n) : 0;
+}
+
+void JpegCrop::skip(uint8_t n) {
+    inBits <<= n;
+    inCount -= n;
+}
+
+int JpegCrop::decode(const JpegHuffman *table, uint16_t *code, uint8_t *len) {
+    uint32_t look = peek(JPEG_LOOKAHEAD_BITS);
+    uint16_t entry = table->lookup[look];
+    if(entry) {
+        *len = entry >> 8;
+        *code = look >> (JPEG_LOOKAHEAD_BITS - *len);
+        skip(*len);
+        return entry & 0xFF;
+    }
+
+    // Longer codes.
+    uint32_t bits = peek(16);
+    for(uint8_t l = JPEG_LOOKAHEAD_BITS + 1; l <= 16; l++) {
+        int32_t c = bits >> (16 - l);
+        if(c <= table->maxcode[l]) {
+            *len = l;
+            *code = c;
+            skip(l);
+            return table->values[table->valptr[l] + c - table->mincode[l]];
+        }
+    }
+    return -1;
+}
+
+bool JpegCrop::restart() {
+    // Drop the padding bits and step over the RSTn marker, which the reader always stops in front of.
+    inBits = 0;
+    inCount = 0;
+    if(in + 1 >= src + srcLen || in[0] != 0xFF || (in[1] & 0xF8) != 0xD0) return false;
+    in += 2;
+    inMarker = false;
+    return true;
+}
+
+void JpegCrop::put(uint8_t b) {
+    if(outLen < outCap) out[outLen] = b;
+    outLen++;
+}
+
+void JpegCrop::write(uint32_t value, uint8_t len) {
+    if(!len) return;
+    outBits = (outBits << len) | (value & ((1u << len) - 1));
+    outCount += len;
+    while(outCount >= 8) {
+        uint8_t b = outBits >> (outCount - 8);
+        put(b);
+        if(b == 0xFF) put(0x00);
+        outCount -= 8;
+    }
+}
+
+void JpegCrop::flush() {
+    // Pad the last byte with ones.
+    if(outCount) write(0xFF, 8 - outCount);
+}
+
+bool JpegCrop::copy(const uint8_t *p, size_t len) {
+    if(outLen + len > outCap) return false;
+    memcpy(out + outLen, p, len);
+    outLen += len;
+    return true;
+}
+
+bool JpegCrop::block(const JpegComponent *c, int *pred, int *outPred, bool emit) {
+    uint16_t code;
+    uint8_t len;
+
+    // DC: decode the difference, recover the absolute value, and re-base it on the crop's own chain.
+    const JpegHuffman *dcTable = &dc[c->dcTable];
+    int s = decode(dcTable, &code, &len);
+    if(s < 0 || s > 11) return false;
+    int diff = 0;
+    if(s) {
+        diff = peek(s);
+        skip(s);
+        if(diff < (1 << (s - 1))) diff += 1 - (1 << s);
+    }
+    *pred += diff;
+    if(emit) {
+        int rebased = *pred - *outPred;
+        *outPred = *pred;
+        uint32_t magnitude = (rebased < 0) ? -rebased : rebased;
+        uint8_t category = 0;
+        while(magnitude) {
+            category++;
+            magnitude >>= 1;
+        }
+        if(!dcTable->size[category]) return false;
+        write(dcTable->code[category], dcTable->size[category]);
+        write((rebased < 0) ? rebased - 1 : rebased, category);
+    }
+
+    // AC: walk the codes to find the end of the block, echoing them unchanged.
+    const JpegHuffman *acTable = &ac[c->acTable];
+    for(int k = 1; k < 64; ) {
+        int sym = decode(acTable, &code, &len);
+        if(sym < 0) return false;
+        if(emit) write(code, len);
+        uint8_t run = sym >> 4;
+        uint8_t size = sym & 0x0F;
+        if(size) {
+            k += run;
+            if(emit) write(peek(size), size);
+            skip(size);
+            k++;
+        }
+        else if(run == 15) k += 16;
+        else break;
+        if(k > 64) return false;
+    }
+    return true;
+}
+
+size_t JpegCrop::crop(const JpegRect &requested, uint8_t *dst, size_t dstLen, JpegRect *actual) {
+    if(!scanOffset || requested.x >= width || requested.y >= height || !requested.w || !requested.h) return 0;
+
+    // Round out to whole MCUs.
+    uint16_t mcusX = (width + mcuWidth - 1) / mcuWidth;
+    uint16_t right = min((uint32_t)width, (uint32_t)requested.x + requested.w);
+    uint16_t bottom = min((uint32_t)height, (uint32_t)requested.y + requested.h);
+    uint16_t x0 = requested.x / mcuWidth;
+    uint16_t y0 = requested.y / mcuHeight;
+    uint16_t x1 = (right + mcuWidth - 1) / mcuWidth;
+    uint16_t y1 = (bottom + mcuHeight - 1) / mcuHeight;
+
+    JpegRect region;
+    region.x = x0 * mcuWidth;
+    region.y = y0 * mcuHeight;
+    region.w = min((uint32_t)width, (uint32_t)x1 * mcuWidth) - region.x;
+    region.h = min((uint32_t)height, (uint32_t)y1 * mcuHeight) - region.y;
+
+    out = dst;
+    outCap = dstLen;
+    outLen = 0;
+    outBits = 0;
+    outCount = 0;
+
+    // Headers are copied as they are, with the new size in SOF and without DRI since the crop has no restarts.
+    put(0xFF);
+    put(0xD8);
+    size_t pos = 2;
+    while(pos < scanOffset) {
+        size_t segLen = 2 + read_u16(src + pos + 2);
+        if(pos == driOffset && driOffset) {
+            pos += segLen;
+            continue;
+        }
+        if(!copy(src + pos, segLen)) return 0;
+        if(pos == sofOffset) {
+            uint8_t *sof = out + outLen - segLen;
+            sof[5] = region.h >> 8;
+            sof[6] = region.h;
+            sof[7] = region.w >> 8;
+            sof[8] = region.w;
+        }
+        pos += segLen;
+    }
+
+    in = src + scanOffset;
+    inBits = 0;
+    inCount = 0;
+    inMarker = false;
+
+    int pred[JPEG_MAX_COMPONENTS] = {0};
+    int outPred[JPEG_MAX_COMPONENTS] = {0};
+    uint32_t mcu = 0;
+
+    // Walk the scan up to the last MCU row of the crop. Everything after it is never read.
+    for(uint16_t my = 0; my < y1; my++) {
+        for(uint16_t mx = 0; mx < mcusX; mx++, mcu++) {
+            if(restartInterval && mcu && mcu % restartInterval == 0) {
+                if(!restart()) return 0;
+                memset(pred, 0, sizeof(pred));
+            }
+            bool emit = (my >= y0 && mx >= x0 && mx < x1);
+            for(int i = 0; i < componentCount; i++) {
+                const JpegComponent *c = &components[i];
+                for(int b = 0; b < c->h * c->v; b++) {
+                    if(!block(c, &pred[i], &outPred[i], emit)) return 0;
+                }
+            }
+        }
+    }
+
+    flush();
+    put(0xFF);
+    put(0xD9);
+    if(outLen > outCap) return 0;
+
+    if(actual) *actual = region;
+    return outLen;
+}
+
+bool JpegCrop::dcLuma(uint8_t *dst, size_t dstLen) {
+    uint16_t dcWidth = getDcWidth();
+    uint16_t dcHeight = getDcHeight();
+    const JpegComponent *y = &components[0];
+    uint16_t step = quantDC[y->quantTable];
+    if(!scanOffset || !step || (size_t)dcWidth * dcHeight > dstLen) return false;
+
+    uint16_t mcusX = (width + mcuWidth - 1) / mcuWidth;
+    uint16_t mcusY = (height + mcuHeight - 1) / mcuHeight;
+
+    in = src + scanOffset;
+    inBits = 0;
+    inCount = 0;
+    inMarker = false;
+
+    int pred[JPEG_MAX_COMPONENTS] = {0};
+    int unused[JPEG_MAX_COMPONENTS] = {0};
+    uint32_t mcu = 0;
+
+    // Every block still has to be walked to find the next one, but nothing is dequantized or transformed.
+    for(uint16_t my = 0; my < mcusY; my++) {
+        for(uint16_t mx = 0; mx < mcusX; mx++, mcu++) {
+            if(restartInterval && mcu && mcu % restartInterval == 0) {
+                if(!restart()) return false;
+                memset(pred, 0, sizeof(pred));
+            }
+            for(int i = 0; i < componentCount; i++) {
+                const JpegComponent *c = &components[i];
+                for(int b = 0; b < c->h * c->v; b++) {
+                    if(!block(c, &pred[i], &unused[i], false)) return false;
+                    if(i != 0) continue;
+
+                    // The DC coefficient is eight times the mean of the level-shifted block.
+                    uint16_t bx = mx * c->h + b % c->h;
+                    uint16_t by = my * c->v + b / c->h;
+                    if(bx >= dcWidth || by >= dcHeight) continue;
+                    int mean = pred[0] * step / 8 + 128;
+                    dst[(size_t)by * dcWidth + bx] = constrain(mean, 0, 255);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+uint16_t JpegCrop::getWidth() { return width; }
+
+uint16_t JpegCrop::getHeight() { return height; }
+
+uint8_t JpegCrop::getMcuWidth() { return mcuWidth; }
+
+uint8_t JpegCrop::getMcuHeight() { return mcuHeight; }
+
+uint16_t JpegCrop::getDcWidth() { return (width + 7) / 8; }
+
+uint16_t JpegCrop::getDcHeight() { return (height + 7) / 8; }
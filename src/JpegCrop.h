@@ -0,0 +1,113 @@
+#ifndef JPEG_CROP
+#define JPEG_CROP
+
+#include <Arduino.h>
+
+const uint8_t JPEG_MAX_COMPONENTS = 3;
+const uint8_t JPEG_LOOKAHEAD_BITS = 9;          // Codes up to this long decode with one table lookup.
+const size_t JPEG_CROP_HEADROOM = 1024;         // Output slack over the source size for re-based DC codes.
+
+struct _jpeg_huffman {
+    bool defined;
+    uint16_t lookup[1 << JPEG_LOOKAHEAD_BITS];  // (length << 8) | symbol, 0 for codes longer than the lookahead.
+    int32_t maxcode[18];                        // Largest code of each length, -1 if there is none.
+    uint16_t mincode[17];                       // Smallest code of each length.
+    uint8_t valptr[17];                         // Index in values of the smallest code of each length.
+    uint8_t values[256];                        // Symbols in code order.
+    uint16_t code[256];                         // Encoder side: code of each symbol.
+    uint8_t size[256];                          // Encoder side: code length of each symbol, 0 if absent.
+};
+typedef struct _jpeg_huffman JpegHuffman;
+
+struct _jpeg_component {
+    uint8_t id;
+    uint8_t h;                      // Horizontal sampling factor.
+    uint8_t v;                      // Vertical sampling factor.
+    uint8_t dcTable;
+    uint8_t acTable;
+    uint8_t quantTable;
+};
+typedef struct _jpeg_component JpegComponent;
+
+struct _jpeg_rect {
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+};
+typedef struct _jpeg_rect JpegRect;
+
+// Cuts an MCU-aligned region out of a baseline JPEG without decoding pixels. The entropy-coded data is
+// Huffman-decoded only to find block boundaries. AC codes are copied bit for bit and only the DC codes
+// are re-encoded, since DC is predicted from the previous block and the first block of the crop
+// starts a new prediction chain. Quality is untouched. The same walk gives a 1/8 scale luma image
+// for free, since each block's DC term is its mean brightness.
+class JpegCrop {
+    private:
+        JpegHuffman dc[2];
+        JpegHuffman ac[2];
+        JpegComponent components[JPEG_MAX_COMPONENTS];
+        uint16_t quantDC[4];        // DC step of each quantization table.
+        uint8_t componentCount = 0;
+        uint16_t width = 0;
+        uint16_t height = 0;
+        uint16_t restartInterval = 0;
+        uint8_t mcuWidth = 0;
+        uint8_t mcuHeight = 0;
+
+        // Source layout, as offsets into the JPEG.
+        const uint8_t *src = NULL;
+        size_t srcLen = 0;
+        size_t sofOffset = 0;       // Start of the SOF segment, marker included.
+        size_t driOffset = 0;       // Start of the DRI segment, 0 if there is none.
+        size_t scanOffset = 0;      // First byte of entropy-coded data.
+
+        // Bit reader over the entropy-coded data.
+        const uint8_t *in = NULL;
+        uint32_t inBits = 0;
+        int8_t inCount = 0;
+        bool inMarker = false;
+
+        // Bit writer for the output scan.
+        uint8_t *out = NULL;
+        size_t outLen = 0;
+        size_t outCap = 0;
+        uint32_t outBits = 0;
+        uint8_t outCount = 0;
+
+        bool buildHuffman(JpegHuffman *table, const uint8_t *counts, const uint8_t *symbols);
+        bool parseDHT(const uint8_t *p, size_t len);
+        bool parseDQT(const uint8_t *p, size_t len);
+        bool parseSOF(const uint8_t *p, size_t len);
+        bool parseSOS(const uint8_t *p, size_t len);
+
+        void fill();
+        uint32_t peek(uint8_t n);
+        void skip(uint8_t n);
+        int decode(const JpegHuffman *table, uint16_t *code, uint8_t *len);
+        bool restart();
+
+        void put(uint8_t b);
+        void write(uint32_t value, uint8_t len);
+        void flush();
+        bool copy(const uint8_t *p, size_t len);
+
+        bool block(const JpegComponent *c, int *pred, int *outPred, bool emit);
+
+    public:
+        // Read the headers. Must succeed before crop() is called.
+        bool parse(const uint8_t *jpg, size_t len);
+        // Write a JPEG of the MCU-aligned region covering the requested one. Returns its length, 0 on failure.
+        size_t crop(const JpegRect &requested, uint8_t *dst, size_t dstLen, JpegRect *actual);
+        // Write a 1/8 scale luma image from the DC terms alone, one byte per 8x8 block, getDcWidth() bytes per row.
+        bool dcLuma(uint8_t *dst, size_t dstLen);
+
+        uint16_t getWidth();
+        uint16_t getHeight();
+        uint8_t getMcuWidth();
+        uint8_t getMcuHeight();
+        uint16_t getDcWidth();
+        uint16_t getDcHeight();
+};
+
+#endif /* JpegCrop.h */
@@ -0,0 +1,55 @@
+#include "JsonWriter.h"
+#include <stdarg.h>
+
+void JsonWriter::append(const char *fmt, ...) {
+    if(overflow) return;
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + len, capacity - len, fmt, args);
+    va_end(args);
+
+    // Roll back a partial write so the buffer always ends on a complete member.
+    if(n < 0 || (size_t)n >= capacity - len) {
+        buf[len] = 0;
+        overflow = true;
+        return;
+    }
+    len += n;
+}
+
+void JsonWriter::beginObject() {
+    append("%s{", needComma ? "," : "");
+    needComma = false;
+}
+
+void JsonWriter::endObject() {
+    append("}");
+    needComma = true;
+}
+
+void JsonWriter::addInt(const char *key, int32_t value) {
+    append("%s\"%s\":%ld", needComma ? "," : "", key, (long)value);
+    needComma = true;
+}
+
+void JsonWriter::addUInt(const char *key, uint32_t value) {
+    append("%s\"%s\":%lu", needComma ? "," : "", key, (unsigned long)value);
+    needComma = true;
+}
+
+void JsonWriter::addString(const char *key, const char *value) {
+    append("%s\"%s\":\"%s\"", needComma ? "," : "", key, value);
+    needComma = true;
+}
+
+void JsonWriter::addRegister(uint16_t reg, uint32_t value) {
+    append("%s\"0x%x\":%lu", needComma ? "," : "", reg, (unsigned long)value);
+    needComma = true;
+}
+
+const char *JsonWriter::c_str() { return buf; }
+
+size_t JsonWriter::length() { return len; }
+
+bool JsonWriter::overflowed() { return overflow; }
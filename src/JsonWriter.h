@@ -0,0 +1,35 @@
+#ifndef JSON_WRITER
+#define JSON_WRITER
+
+#include <Arduino.h>
+
+// Bounded JSON object writer over a caller-owned buffer. Never writes past capacity;
+// once something does not fit, the writer stops and reports overflow.
+class JsonWriter {
+    private:
+        char *buf;                  // Output buffer.
+        size_t capacity;            // Size of buf, including the terminator.
+        size_t len = 0;             // Bytes written so far.
+        bool overflow = false;      // Set once anything failed to fit.
+        bool needComma = false;     // Next member needs a separator.
+
+        void append(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    public:
+        JsonWriter(char *buf, size_t capacity) : buf(buf), capacity(capacity) {
+            if(capacity > 0) buf[0] = 0;
+        }
+
+        void beginObject();
+        void endObject();
+        void addInt(const char *key, int32_t value);
+        void addUInt(const char *key, uint32_t value);
+        void addString(const char *key, const char *value);
+        void addRegister(uint16_t reg, uint32_t value);
+
+        const char *c_str();
+        size_t length();
+        bool overflowed();
+};
+
+#endif /* JsonWriter.h */
@@ -0,0 +1,118 @@
+#include "Metrics.h"
+
+// Define the registry before the metrics so it is constructed first.
+MetricsRegistry metrics;
+
+static const uint32_t latency_ms_bounds[] = { 5, 10, 20, 30, 50, 75, 100, 150, 250, 500, 1000 };
+static const uint32_t jitter_ms_bounds[] = { 1, 2, 5, 10, 20, 35, 50, 100, 250 };
+static const uint32_t frame_bytes_bounds[] = { 4096, 8192, 16384, 24576, 32768, 49152, 65536, 98304, 131072, 262144 };
+#define BOUNDS(b) b, sizeof(b) / sizeof(b[0])
+
+MetricHistogram metric_capture_ms("sentrycam_capture_ms", "Time to get a frame from the camera driver.", BOUNDS(latency_ms_bounds));
+MetricHistogram metric_capture_jitter_ms("sentrycam_capture_jitter_ms", "Distance of each capture from one sensor frame interval after the last.", BOUNDS(jitter_ms_bounds));
+MetricHistogram metric_send_ms("sentrycam_send_ms", "Time to write one frame to a stream client.", BOUNDS(latency_ms_bounds));
+MetricHistogram metric_frame_bytes("sentrycam_frame_bytes", "Size of frames sent to stream clients.", BOUNDS(frame_bytes_bounds));
+MetricCounter metric_frames_captured("sentrycam_frames_captured_total", "Frames taken from the camera driver.");
+MetricCounter metric_frames_sent("sentrycam_frames_sent_total", "Frames written to stream clients.");
+MetricCounter metric_frames_dropped("sentrycam_frames_dropped_total", "Frames skipped because a stream client was still busy.");
+MetricCounter metric_capture_failures("sentrycam_capture_failures_total", "Camera driver capture errors.");
+MetricCounter metric_capture_queue_dropped("sentrycam_capture_queue_dropped_total", "Captured frames dropped because publishing fell behind.");
+MetricCounter metric_frames_deduped("sentrycam_frames_deduped_total", "Frames not sent because they matched the last frame the client got.");
+MetricCounter metric_dedup_bytes_saved("sentrycam_dedup_bytes_saved_total", "Frame bytes not sent to stream clients because the scene was unchanged.");
+MetricCounter metric_rate_limited("sentrycam_rate_limited_total", "Image requests refused because the client was over its request or byte budget.");
+MetricCounter metric_stream_throttle_ms("sentrycam_stream_throttle_ms_total", "Time streams were held back to keep their client within its byte budget.");
+MetricCounter metric_frames_converted("sentrycam_frames_converted_total", "Raw frames encoded to JPEG for stream clients.");
+MetricCounter metric_conversion_allocations("sentrycam_conversion_allocations_total", "Stream encode buffers allocated or grown. The encoder's own per-frame work memory is not counted.");
+
+MetricHistogram metric_motion_ms("sentrycam_motion_ms", "Time for the motion detector to process one frame.", BOUNDS(latency_ms_bounds));
+MetricCounter metric_motion_events("sentrycam_motion_events_total", "Motion events started.");
+
+MetricCounter metric_clip_frames_stored("sentrycam_clip_frames_stored_total", "Frames copied into the clip ring.");
+MetricCounter metric_clip_frames_evicted("sentrycam_clip_frames_evicted_total", "Frames evicted from the clip ring to make room.");
+MetricCounter metric_clip_frames_skipped("sentrycam_clip_frames_skipped_total", "Frames not recorded because a clip export pinned the space.");
+MetricGauge metric_clip_bytes("sentrycam_clip_bytes", "Bytes of frames held by the clip ring.");
+
+MetricCounter metric_espnow_rx("sentrycam_espnow_rx_total", "ESP-NOW packets received.");
+MetricCounter metric_espnow_tx("sentrycam_espnow_tx_total", "ESP-NOW packets sent.");
+MetricCounter metric_espnow_tx_failed("sentrycam_espnow_tx_failed_total", "ESP-NOW packets that failed to send.");
+
+MetricGauge metric_stream_clients("sentrycam_stream_clients", "Open stream connections.");
+MetricGauge metric_pool_free("sentrycam_pool_free_slots", "Frame pool slots not held by anyone.");
+MetricGauge metric_heap_free("sentrycam_heap_free_bytes", "Free internal heap.");
+MetricGauge metric_heap_min_free("sentrycam_heap_min_free_bytes", "Internal heap low-water mark since boot.");
+MetricGauge metric_psram_min_free("sentrycam_psram_min_free_bytes", "PSRAM low-water mark since boot.");
+MetricGauge metric_record_cycles("sentrycam_metrics_record_cycles", "CPU cycles to record one histogram sample, measured at boot.");
+
+static const char *type_names[] = { "counter", "gauge", "histogram" };
+
+Metric::Metric(const char *name, const char *help, MetricType type, bool exported) : name(name), help(help), type(type) {
+    if(exported) metrics.add(this);
+}
+
+size_t MetricCounter::printValues(char *buf, size_t len) {
+    return snprintf(buf, len, "%s %lu\n", name, (unsigned long)get());
+}
+
+size_t MetricGauge::printValues(char *buf, size_t len) {
+    return snprintf(buf, len, "%s %ld\n", name, (long)get());
+}
+
+MetricHistogram::MetricHistogram(const char *name, const char *help, const uint32_t *bounds, uint8_t boundCount, bool exported)
+    : Metric(name, help, METRIC_HISTOGRAM, exported), bounds(bounds), boundCount(min(boundCount, METRIC_MAX_BUCKETS)) {
+    for(int i = 0; i <= METRIC_MAX_BUCKETS; i++) buckets[i].store(0);
+}
+
+void MetricHistogram::observe(uint32_t v) {
+    // Buckets are stored non-cumulative so a sample costs one increment. The export adds them up.
+    uint8_t i = 0;
+    while(i < boundCount && v > bounds[i]) i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(v, std::memory_order_relaxed);
+}
+
+size_t MetricHistogram::printValues(char *buf, size_t len) {
+    size_t used = 0;
+    uint32_t cumulative = 0;
+    for(uint8_t i = 0; i <= boundCount && used < len; i++) {
+        cumulative += buckets[i].load(std::memory_order_relaxed);
+        if(i < boundCount) used += snprintf(buf + used, len - used, "%s_bucket{le=\"%lu\"} %lu\n", name, (unsigned long)bounds[i], (unsigned long)cumulative);
+        else used += snprintf(buf + used, len - used, "%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)cumulative);
+    }
+    if(used < len) used += snprintf(buf + used, len - used, "%s_sum %lu\n%s_count %lu\n", name, (unsigned long)sum.load(std::memory_order_relaxed), name, (unsigned long)cumulative);
+    return used;
+}
+
+void MetricsRegistry::add(Metric *metric) {
+    // Keep definition order so the export is stable.
+    if(tail) tail->next = metric;
+    else head = metric;
+    tail = metric;
+}
+
+size_t MetricsRegistry::printPrometheus(char *buf, size_t len) {
+    size_t used = 0;
+    for(Metric *m = head; m != NULL; m = m->next) {
+        size_t start = used;
+        used += snprintf(buf + used, len - used, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, type_names[m->type]);
+        if(used < len) used += m->printValues(buf + used, len - used);
+
+        // Never hand out half a metric.
+        if(used >= len) {
+            buf[start] = 0;
+            return start;
+        }
+    }
+    return used;
+}
+
+uint32_t MetricsRegistry::benchmark() {
+    // Time the most expensive record path on a histogram that is not exported. Includes loop overhead.
+    static const uint32_t bench_bounds[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024 };
+    static MetricHistogram bench("bench", "", BOUNDS(bench_bounds), false);
+
+    uint32_t start = ESP.getCycleCount();
+    for(uint16_t i = 0; i < METRIC_BENCH_ITERATIONS; i++) bench.observe(i);
+    uint32_t cycles = (ESP.getCycleCount() - start) / METRIC_BENCH_ITERATIONS;
+    metric_record_cycles.set(cycles);
+    return cycles;
+}
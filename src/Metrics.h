@@ -0,0 +1,134 @@
+#ifndef METRICS
+#define METRICS
+
+#include <Arduino.h>
+#include <atomic>
+
+// All values are 32-bit so every update is a single lock-free atomic on the ESP32.
+// Totals wrap, which Prometheus rate() treats like a counter reset.
+const uint8_t METRIC_MAX_BUCKETS = 12;
+const uint16_t METRIC_BENCH_ITERATIONS = 1000;
+
+enum _metric_type : uint8_t {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+};
+typedef enum _metric_type MetricType;
+
+// Metrics link themselves into the registry when constructed, so defining one is enough to export it.
+class Metric {
+    private:
+        Metric *next = NULL;
+
+    protected:
+        const char *name;
+        const char *help;
+        MetricType type;
+
+        Metric(const char *name, const char *help, MetricType type, bool exported = true);
+        virtual size_t printValues(char *buf, size_t len) = 0;
+
+    public:
+        friend class MetricsRegistry;
+};
+
+class MetricCounter : public Metric {
+    private:
+        std::atomic<uint32_t> value{0};
+
+    protected:
+        size_t printValues(char *buf, size_t len) override;
+
+    public:
+        MetricCounter(const char *name, const char *help) : Metric(name, help, METRIC_COUNTER) {}
+        void inc(uint32_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+        uint32_t get() { return value.load(std::memory_order_relaxed); }
+};
+
+class MetricGauge : public Metric {
+    private:
+        std::atomic<int32_t> value{0};
+
+    protected:
+        size_t printValues(char *buf, size_t len) override;
+
+    public:
+        MetricGauge(const char *name, const char *help) : Metric(name, help, METRIC_GAUGE) {}
+        void set(int32_t v) { value.store(v, std::memory_order_relaxed); }
+        void add(int32_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+        int32_t get() { return value.load(std::memory_order_relaxed); }
+};
+
+// Fixed upper bounds, ascending. Values above the last bound only land in +Inf.
+class MetricHistogram : public Metric {
+    private:
+        const uint32_t *bounds;
+        uint8_t boundCount;
+        std::atomic<uint32_t> buckets[METRIC_MAX_BUCKETS + 1];
+        std::atomic<uint32_t> sum{0};
+
+    protected:
+        size_t printValues(char *buf, size_t len) override;
+
+    public:
+        MetricHistogram(const char *name, const char *help, const uint32_t *bounds, uint8_t boundCount, bool exported = true);
+        void observe(uint32_t v);
+};
+
+class MetricsRegistry {
+    private:
+        Metric *head = NULL;
+        Metric *tail = NULL;
+
+    public:
+        void add(Metric *metric);
+        // Prometheus text exposition format. Returns bytes written, truncated at a metric boundary.
+        size_t printPrometheus(char *buf, size_t len);
+        // Average CPU cycles to record a histogram sample, measured on this device.
+        uint32_t benchmark();
+};
+
+extern MetricsRegistry metrics;
+
+// Frame pipeline.
+extern MetricHistogram metric_capture_ms;
+extern MetricHistogram metric_capture_jitter_ms;
+extern MetricHistogram metric_send_ms;
+extern MetricHistogram metric_frame_bytes;
+extern MetricCounter metric_frames_captured;
+extern MetricCounter metric_frames_sent;
+extern MetricCounter metric_frames_dropped;
+extern MetricCounter metric_capture_failures;
+extern MetricCounter metric_capture_queue_dropped;
+extern MetricCounter metric_frames_deduped;
+extern MetricCounter metric_dedup_bytes_saved;
+extern MetricCounter metric_rate_limited;
+extern MetricCounter metric_stream_throttle_ms;
+extern MetricCounter metric_frames_converted;
+extern MetricCounter metric_conversion_allocations;
+
+// Motion detection.
+extern MetricHistogram metric_motion_ms;
+extern MetricCounter metric_motion_events;
+
+// Clip ring.
+extern MetricCounter metric_clip_frames_stored;
+extern MetricCounter metric_clip_frames_evicted;
+extern MetricCounter metric_clip_frames_skipped;
+extern MetricGauge metric_clip_bytes;
+
+// ESP-NOW.
+extern MetricCounter metric_espnow_rx;
+extern MetricCounter metric_espnow_tx;
+extern MetricCounter metric_espnow_tx_failed;
+
+// Sampled when /metrics is scraped.
+extern MetricGauge metric_stream_clients;
+extern MetricGauge metric_pool_free;
+extern MetricGauge metric_heap_free;
+extern MetricGauge metric_heap_min_free;
+extern MetricGauge metric_psram_min_free;
+extern MetricGauge metric_record_cycles;
+
+#endif /* Metrics.h */
@@ -0,0 +1,86 @@
+#include "MjpegPacketizer.h"
+#include <errno.h>
+
+static const char *_MJPEG_RESPONSE =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace;boundary=" MJPEG_BOUNDARY "\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Cache-Control: no-cache\r\n"
+    "X-Framerate: 60\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char *_MJPEG_PART_PREFIX = "\r\n--" MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: ";
+static const char *_MJPEG_TIMESTAMP = "\r\nX-Timestamp: ";
+
+MjpegPacketizer::MjpegPacketizer() {
+    // Build the template once. Numbers are right-aligned in fixed-width fields, padded with
+    // optional whitespace, so every frame reuses the same bytes and only the digits change.
+    char *p = header;
+    p += sprintf(p, "%s", _MJPEG_PART_PREFIX);
+    lengthOffset = p - header;
+    p += sprintf(p, "%*s", MJPEG_LENGTH_DIGITS, "0");
+    p += sprintf(p, "%s", _MJPEG_TIMESTAMP);
+    secondsOffset = p - header;
+    p += sprintf(p, "%*s.", MJPEG_SECONDS_DIGITS, "0");
+    microsOffset = p - header;
+    p += sprintf(p, "%0*d\r\n\r\n", MJPEG_MICROS_DIGITS, 0);
+    headerLen = p - header;
+}
+
+void MjpegPacketizer::patch(size_t offset, uint8_t width, uint32_t value, char pad) {
+    char *field = header + offset;
+    int i = width - 1;
+    do {
+        field[i--] = '0' + (value % 10);
+        value /= 10;
+    } while(value && i >= 0);
+    while(i >= 0) field[i--] = pad;
+}
+
+esp_err_t MjpegPacketizer::beginResponse(httpd_req_t *req) {
+    int len = strlen(_MJPEG_RESPONSE);
+    return (httpd_send(req, _MJPEG_RESPONSE, len) == len) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t MjpegPacketizer::sendFrame(int fd, const uint8_t *buf, size_t len, const struct timeval &timestamp) {
+    patch(lengthOffset, MJPEG_LENGTH_DIGITS, len, ' ');
+    patch(secondsOffset, MJPEG_SECONDS_DIGITS, timestamp.tv_sec, ' ');
+    patch(microsOffset, MJPEG_MICROS_DIGITS, timestamp.tv_usec, '0');
+
+    // Boundary, part headers and payload leave in a single vectored write.
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = headerLen;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+
+    return writeAll(fd, iov, 2, writes);
+}
+
+esp_err_t MjpegPacketizer::writeAll(int fd, struct iovec *iov, int count, uint32_t &writes) {
+    int first = 0;
+    while(first < count) {
+        ssize_t sent = lwip_writev(fd, &iov[first], count - first);
+        writes++;
+        if(sent < 0) {
+            if(errno == EINTR) continue;
+            return ESP_FAIL;
+        }
+
+        // Short write: skip what went out and resume.
+        while(first < count && (size_t)sent >= iov[first].iov_len) {
+            sent -= iov[first].iov_len;
+            first++;
+        }
+        if(first < count) {
+            iov[first].iov_base = (uint8_t *)iov[first].iov_base + sent;
+            iov[first].iov_len -= sent;
+        }
+    }
+    return ESP_OK;
+}
+
+size_t MjpegPacketizer::getHeaderLength() { return headerLen; }
+
+uint32_t MjpegPacketizer::getWriteCount() { return writes; }
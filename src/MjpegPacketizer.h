@@ -0,0 +1,40 @@
+#ifndef MJPEG_PACKETIZER
+#define MJPEG_PACKETIZER
+
+#include <Arduino.h>
+#include "esp_http_server.h"
+#include "lwip/sockets.h"
+
+#define MJPEG_BOUNDARY "123456789000000000000987654321"
+
+// Widths of the fixed-size numeric fields in the part header template.
+const uint8_t MJPEG_LENGTH_DIGITS = 8;
+const uint8_t MJPEG_SECONDS_DIGITS = 10;
+const uint8_t MJPEG_MICROS_DIGITS = 6;
+
+// Writes multipart/x-mixed-replace frames straight to the socket, one vectored write per frame.
+class MjpegPacketizer {
+    private:
+        char header[160];               // Boundary and part headers, with numeric fields patched in place.
+        size_t headerLen = 0;           // Bytes of header in use.
+        size_t lengthOffset = 0;        // Where Content-Length digits start.
+        size_t secondsOffset = 0;       // Where X-Timestamp seconds start.
+        size_t microsOffset = 0;        // Where X-Timestamp microseconds start.
+        uint32_t writes = 0;            // Socket writes issued.
+
+        void patch(size_t offset, uint8_t width, uint32_t value, char pad);
+
+    public:
+        MjpegPacketizer();
+
+        // Raw HTTP response head. The body is not chunk-encoded, so the connection closes when the stream ends.
+        static esp_err_t beginResponse(httpd_req_t *req);
+        // Write every iovec, resuming after short writes. Shared with the WebSocket packetizer.
+        static esp_err_t writeAll(int fd, struct iovec *iov, int count, uint32_t &writes);
+        esp_err_t sendFrame(int fd, const uint8_t *buf, size_t len, const struct timeval &timestamp);
+
+        size_t getHeaderLength();
+        uint32_t getWriteCount();
+};
+
+#endif /* MjpegPacketizer.h */
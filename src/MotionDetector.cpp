@@ -0,0 +1,293 @@
+#include "MotionDetector.h"
+#include <new>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "FrameBroadcaster.h"
+#include "MotionKernels.h"
+#include "Metrics.h"
+
+// Define task handle and the shared detector.
+TaskHandle_t motion_task_handle = NULL;
+MotionDetector motion_detector;
+
+void motion_task(void *pvParams) {
+    // Setup.
+    MotionDetector *detector = static_cast<MotionDetector *>(pvParams);
+    uint32_t seq = 0;
+
+    // Task loop. Takes whatever frame is newest, so a slow frame never builds a backlog.
+    for(;;) {
+        FrameHandle frame = frame_broadcaster.waitForFrameAfter(seq, FRAME_WAIT_TIMEOUT);
+        if(!frame) continue;
+        seq = frame.seq();
+        detector->process(frame);
+        frame.reset();
+        vTaskDelay(MOTION_INTERVAL);
+    }
+}
+
+bool MotionDetector::start() {
+    // Only start once.
+    if(motion_task_handle != NULL) return true;
+
+    lock = xSemaphoreCreateMutex();
+    void *mem = heap_caps_malloc(sizeof(JpegCrop), MALLOC_CAP_SPIRAM);
+    parser = mem ? new (mem) JpegCrop() : NULL;
+    if(lock == NULL || parser == NULL) {
+        log_e("Failed to set up motion detector.");
+        return false;
+    }
+
+    BaseType_t res = xTaskCreatePinnedToCore(
+        &motion_task,           // Pointer to task function.
+        "motion_task",          // Task name.
+        MOTION_TASK_DEPTH,      // Size of stack allocated to the task (in bytes).
+        this,                   // Pointer to parameters used for task creation.
+        1,                      // Task priority level.
+        &motion_task_handle,    // Pointer to task handle.
+        1                       // Core that the task will run on.
+    );
+    if(res != pdPASS) log_e("Failed to create Motion Task.");
+    return res == pdPASS;
+}
+
+bool MotionDetector::resize(uint16_t width, uint16_t height) {
+    uint16_t cellsX = (width + 7) / 8;
+    uint16_t cellsY = (height + 7) / 8;
+    if(cellsX == gridWidth && cellsY == gridHeight && luma != NULL) return true;
+
+    size_t cells = (size_t)cellsX * cellsY;
+    size_t blocks = (size_t)((cellsX + MOTION_BLOCK_CELLS - 1) / MOTION_BLOCK_CELLS) * ((cellsY + MOTION_BLOCK_CELLS - 1) / MOTION_BLOCK_CELLS);
+    if(cells > cellCapacity) {
+        heap_caps_free(luma);
+        heap_caps_free(background);
+        heap_caps_free(backgroundFixed);
+        luma = (uint8_t *)heap_caps_malloc(cells, MALLOC_CAP_SPIRAM);
+        background = (uint8_t *)heap_caps_malloc(cells, MALLOC_CAP_SPIRAM);
+        backgroundFixed = (uint16_t *)heap_caps_malloc(cells * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+        cellCapacity = (luma && background && backgroundFixed) ? cells : 0;
+    }
+    if(blocks > blockCapacity) {
+        heap_caps_free(noiseMean);
+        heap_caps_free(noiseDev);
+        heap_caps_free(movingFrames);
+        noiseMean = (uint16_t *)heap_caps_malloc(blocks * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+        noiseDev = (uint16_t *)heap_caps_malloc(blocks * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+        movingFrames = (uint8_t *)heap_caps_malloc(blocks, MALLOC_CAP_SPIRAM);
+        blockCapacity = (noiseMean && noiseDev && movingFrames) ? blocks : 0;
+    }
+    if(!cellCapacity || !blockCapacity) {
+        gridWidth = gridHeight = 0;
+        return false;
+    }
+
+    // A new frame size means a new scene as far as the background is concerned.
+    gridWidth = cellsX;
+    gridHeight = cellsY;
+    frameWidth = width;
+    frameHeight = height;
+    learned = 0;
+    return true;
+}
+
+bool luma_grid_size(JpegCrop *parser, const FrameHandle &frame, uint16_t *width, uint16_t *height) {
+    switch(frame.format()) {
+        case PIXFORMAT_JPEG:
+            if(!parser->parse(frame.buf(), frame.len())) return false;
+            *width = parser->getWidth();
+            *height = parser->getHeight();
+            return true;
+        case PIXFORMAT_GRAYSCALE:
+        case PIXFORMAT_YUV422:
+            *width = frame.width();
+            *height = frame.height();
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool luma_grid(JpegCrop *parser, const FrameHandle &frame, uint8_t *dst, size_t dstLen) {
+    size_t cells = (size_t)((frame.width() + 7) / 8) * ((frame.height() + 7) / 8);
+    switch(frame.format()) {
+        case PIXFORMAT_JPEG:
+            return parser->dcLuma(dst, dstLen);
+        case PIXFORMAT_GRAYSCALE:
+            if(cells > dstLen) return false;
+            motion_downscale(frame.buf(), frame.width(), 1, frame.width(), frame.height(), dst);
+            return true;
+        case PIXFORMAT_YUV422:
+            if(cells > dstLen) return false;
+            motion_downscale(frame.buf(), frame.width() * 2, 2, frame.width(), frame.height(), dst);
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool MotionDetector::extract(const FrameHandle &frame) {
+    uint16_t width, height;
+    if(!luma_grid_size(parser, frame, &width, &height)) return false;
+    if(!resize(width, height)) return false;
+    return luma_grid(parser, frame, luma, (size_t)gridWidth * gridHeight);
+}
+
+void MotionDetector::process(const FrameHandle &frame) {
+    int64_t start = esp_timer_get_time();
+    if(!extract(frame)) return;
+
+    // First frame at this size: it is the background.
+    size_t cells = (size_t)gridWidth * gridHeight;
+    uint16_t blocksX = (gridWidth + MOTION_BLOCK_CELLS - 1) / MOTION_BLOCK_CELLS;
+    uint16_t blocksY = (gridHeight + MOTION_BLOCK_CELLS - 1) / MOTION_BLOCK_CELLS;
+    if(learned == 0) {
+        for(size_t i = 0; i < cells; i++) backgroundFixed[i] = luma[i] << 8;
+        memcpy(background, luma, cells);
+        memset(noiseMean, 0, (size_t)blocksX * blocksY * sizeof(uint16_t));
+        memset(noiseDev, 0, (size_t)blocksX * blocksY * sizeof(uint16_t));
+        memset(movingFrames, 0, (size_t)blocksX * blocksY);
+        learned = 1;
+        return;
+    }
+
+    bool reporting = learned >= MOTION_WARMUP_FRAMES;
+    uint16_t active = 0;
+    uint32_t activeSad = 0;
+    uint32_t activeCells = 0;
+    uint16_t left = gridWidth, top = gridHeight, right = 0, bottom = 0;
+
+    for(uint16_t by = 0; by < blocksY; by++) {
+        for(uint16_t bx = 0; bx < blocksX; bx++) {
+            size_t block = (size_t)by * blocksX + bx;
+            uint16_t cx = bx * MOTION_BLOCK_CELLS;
+            uint16_t cy = by * MOTION_BLOCK_CELLS;
+            uint16_t bw = min((uint16_t)MOTION_BLOCK_CELLS, (uint16_t)(gridWidth - cx));
+            uint16_t bh = min((uint16_t)MOTION_BLOCK_CELLS, (uint16_t)(gridHeight - cy));
+            size_t offset = (size_t)cy * gridWidth + cx;
+
+            uint32_t sad = motion_sad(luma + offset, background + offset, gridWidth, bw, bh);
+            uint32_t mean = noiseMean[block] >> MOTION_NOISE_SHIFT;
+            uint32_t dev = noiseDev[block] >> MOTION_NOISE_SHIFT;
+            uint32_t threshold = max(mean + MOTION_NOISE_K * dev, (uint32_t)MOTION_MIN_CHANGE * bw * bh);
+            bool moving = reporting && sad > threshold;
+
+            if(moving) {
+                active++;
+                activeSad += sad;
+                activeCells += bw * bh;
+                left = min(left, cx);
+                top = min(top, cy);
+                right = max(right, (uint16_t)(cx + bw));
+                bottom = max(bottom, (uint16_t)(cy + bh));
+            }
+            else {
+                // Only quiet frames teach the block what its noise looks like.
+                uint32_t deviation = (sad > mean) ? sad - mean : mean - sad;
+                noiseMean[block] += (int32_t)sad - (int32_t)mean;
+                noiseDev[block] += (int32_t)deviation - (int32_t)dev;
+            }
+
+            // Keep whatever is moving out of the background until it has been there long enough to count as scenery.
+            movingFrames[block] = moving ? min(movingFrames[block] + 1, (int)MOTION_ABSORB_FRAMES) : 0;
+            if(moving && movingFrames[block] < MOTION_ABSORB_FRAMES) continue;
+            for(uint16_t row = 0; row < bh; row++) {
+                size_t at = offset + (size_t)row * gridWidth;
+                motion_blend(backgroundFixed + at, background + at, luma + at, bw, MOTION_BACKGROUND_SHIFT);
+            }
+        }
+    }
+    if(!reporting) learned++;
+
+    JpegRect box = { 0, 0, 0, 0 };
+    uint8_t score = 0;
+    if(active >= MOTION_MIN_BLOCKS) {
+        box.x = left * 8;
+        box.y = top * 8;
+        box.w = min((uint32_t)frameWidth, (uint32_t)right * 8) - box.x;
+        box.h = min((uint32_t)frameHeight, (uint32_t)bottom * 8) - box.y;
+        score = activeSad / activeCells;
+    }
+    else active = 0;
+
+    lastUs = esp_timer_get_time() - start;
+    metric_motion_ms.observe(lastUs / 1000);
+    record(frame, active, box, score);
+}
+
+void MotionDetector::record(const FrameHandle &frame, uint16_t active, const JpegRect &box, uint8_t score) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    processed++;
+    lastSeq = frame.seq();
+    lastActive = active;
+
+    MotionEvent *event = &events[(nextId - 1) % MOTION_EVENT_HISTORY];
+    if(event->id != nextId - 1 || !event->open) event = NULL;
+
+    if(active) {
+        quietFrames = 0;
+        if(event == NULL) {
+            event = &events[nextId % MOTION_EVENT_HISTORY];
+            event->id = nextId++;
+            event->startSeq = frame.seq();
+            event->started = frame.timestamp();
+            event->x = box.x;
+            event->y = box.y;
+            event->w = box.w;
+            event->h = box.h;
+            event->score = 0;
+            event->frames = 0;
+            event->open = true;
+            metric_motion_events.inc();
+        }
+        else {
+            // Grow the box to cover everywhere the event has moved.
+            uint16_t right = max(event->x + event->w, box.x + box.w);
+            uint16_t bottom = max(event->y + event->h, box.y + box.h);
+            event->x = min(event->x, box.x);
+            event->y = min(event->y, box.y);
+            event->w = right - event->x;
+            event->h = bottom - event->y;
+        }
+        event->endSeq = frame.seq();
+        event->ended = frame.timestamp();
+        event->score = max(event->score, score);
+        event->frames++;
+    }
+    else if(event != NULL && ++quietFrames >= MOTION_EVENT_HOLD) {
+        event->open = false;
+    }
+    xSemaphoreGive(lock);
+}
+
+bool MotionDetector::getEvent(uint32_t id, MotionEvent *event) {
+    if(lock == NULL || id == 0) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    const MotionEvent *slot = &events[id % MOTION_EVENT_HISTORY];
+    bool found = (slot->id == id);
+    if(found) *event = *slot;
+    xSemaphoreGive(lock);
+    return found;
+}
+
+size_t MotionDetector::printJson(char *buf, size_t len, uint32_t since) {
+    if(lock == NULL) return snprintf(buf, len, "{\"running\":false,\"events\":[]}");
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    size_t used = snprintf(buf, len, "{\"running\":true,\"learning\":%s,\"frames\":%lu,\"seq\":%lu,\"grid\":[%u,%u],\"active_blocks\":%u,\"process_us\":%lu,\"last_id\":%lu,\"events\":[",
+        (learned < MOTION_WARMUP_FRAMES) ? "true" : "false", (unsigned long)processed, (unsigned long)lastSeq, gridWidth, gridHeight, lastActive,
+        (unsigned long)lastUs, (unsigned long)(nextId - 1));
+
+    // Oldest first, from whatever of since's successors is still in the history.
+    uint32_t first = max(since + 1, (nextId > MOTION_EVENT_HISTORY) ? nextId - MOTION_EVENT_HISTORY : 1);
+    for(uint32_t id = first; id < nextId && used < len; id++) {
+        const MotionEvent *e = &events[id % MOTION_EVENT_HISTORY];
+        used += snprintf(buf + used, len - used,
+            "%s{\"id\":%lu,\"start_seq\":%lu,\"end_seq\":%lu,\"start\":%ld.%06ld,\"end\":%ld.%06ld,\"x\":%u,\"y\":%u,\"w\":%u,\"h\":%u,\"score\":%u,\"frames\":%u,\"open\":%s}",
+            (id == first) ? "" : ",", (unsigned long)e->id, (unsigned long)e->startSeq, (unsigned long)e->endSeq, (long)e->started.tv_sec, (long)e->started.tv_usec,
+            (long)e->ended.tv_sec, (long)e->ended.tv_usec, e->x, e->y, e->w, e->h, e->score, e->frames, e->open ? "true" : "false");
+    }
+    xSemaphoreGive(lock);
+    if(used < len) used += snprintf(buf + used, len - used, "]}");
+    return (used < len) ? used : len - 1;
+}
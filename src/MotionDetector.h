@@ -0,0 +1,101 @@
+#ifndef MOTION_DETECTOR
+#define MOTION_DETECTOR
+
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "FramePool.h"
+#include "JpegCrop.h"
+
+const int MOTION_TASK_DEPTH = 4096;
+const TickType_t MOTION_INTERVAL = pdMS_TO_TICKS(200);  // Rest between frames so the detector stays a background job.
+const uint8_t MOTION_BLOCK_CELLS = 4;           // Blocks are 4x4 grid cells, 32x32 pixels.
+const uint8_t MOTION_MIN_CHANGE = 6;            // Smallest mean luma change per cell that counts, whatever the noise.
+const uint8_t MOTION_NOISE_K = 4;               // Threshold is the block's noise mean plus this many mean deviations.
+const uint8_t MOTION_NOISE_SHIFT = 4;           // Noise statistics follow quiet blocks by 1/16 per frame.
+const uint8_t MOTION_BACKGROUND_SHIFT = 3;      // Background follows quiet blocks by 1/8 per frame.
+const uint8_t MOTION_ABSORB_FRAMES = 50;        // Moving blocks are left alone until they have moved this long, then
+                                                // taken in, so passers-by leave no ghost and parked cars become scenery.
+const uint8_t MOTION_MIN_BLOCKS = 2;            // Active blocks needed to call it motion.
+const uint8_t MOTION_WARMUP_FRAMES = 16;        // Frames to learn the noise before reporting anything.
+const uint8_t MOTION_EVENT_HOLD = 5;            // Quiet frames before an event is closed.
+const uint8_t MOTION_EVENT_HISTORY = 16;
+
+extern TaskHandle_t motion_task_handle;
+
+void motion_task(void *pvParams);
+
+// 1/8 scale luma of a frame, one byte per 8x8 block: from the DC terms for JPEG, box filtered for
+// grayscale and YUV422. Other formats have no cheap luma and fail. luma_grid_size parses the JPEG
+// headers into parser, which luma_grid then relies on.
+bool luma_grid_size(JpegCrop *parser, const FrameHandle &frame, uint16_t *width, uint16_t *height);
+bool luma_grid(JpegCrop *parser, const FrameHandle &frame, uint8_t *dst, size_t dstLen);
+
+struct _motion_event {
+    uint32_t id;                    // Increases by one per event. 0 for an unused slot.
+    uint32_t startSeq;              // First frame with motion.
+    uint32_t endSeq;                // Latest frame with motion.
+    struct timeval started;         // Capture time of startSeq.
+    struct timeval ended;           // Capture time of endSeq.
+    uint16_t x;                     // Union of the moving area over the event, in pixels.
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+    uint8_t score;                  // Peak mean luma change over the moving blocks.
+    uint16_t frames;                // Frames with motion.
+    bool open;                      // Still in progress.
+};
+typedef struct _motion_event MotionEvent;
+
+// Background subtraction on a 1/8 scale luma grid. JPEG frames give the grid from their DC terms
+// without an IDCT, raw frames are box filtered. Each block's SAD against the background is compared
+// with a threshold learned from that block's own noise, so flicker and sensor noise in one part of
+// the scene do not desensitise the rest.
+class MotionDetector {
+    private:
+        SemaphoreHandle_t lock = NULL;          // Guards the event history.
+        JpegCrop *parser = NULL;                // DC walker, in PSRAM.
+
+        // Grid state, in PSRAM and grown when the frame size goes up.
+        uint8_t *luma = NULL;                   // Current frame.
+        uint8_t *background = NULL;             // Running background the SAD is taken against.
+        uint16_t *backgroundFixed = NULL;       // Same in 8.8 fixed point.
+        uint16_t *noiseMean = NULL;             // Per block quiet SAD, << MOTION_NOISE_SHIFT.
+        uint16_t *noiseDev = NULL;              // Per block mean deviation of it, << MOTION_NOISE_SHIFT.
+        uint8_t *movingFrames = NULL;           // Per block frames in a row with motion, up to MOTION_ABSORB_FRAMES.
+        size_t cellCapacity = 0;
+        size_t blockCapacity = 0;
+        uint16_t gridWidth = 0;
+        uint16_t gridHeight = 0;
+        uint16_t frameWidth = 0;
+        uint16_t frameHeight = 0;
+        uint32_t learned = 0;                   // Frames since the background was reset.
+
+        MotionEvent events[MOTION_EVENT_HISTORY];
+        uint32_t nextId = 1;
+        uint8_t quietFrames = 0;                // Frames without motion since the open event last moved.
+        uint32_t processed = 0;
+        uint32_t lastSeq = 0;
+        uint32_t lastUs = 0;                    // Time the last frame took.
+        uint16_t lastActive = 0;                // Active blocks in the last frame.
+
+        bool extract(const FrameHandle &frame);
+        bool resize(uint16_t width, uint16_t height);
+        void record(const FrameHandle &frame, uint16_t active, const JpegRect &box, uint8_t score);
+
+    public:
+        MotionDetector() {
+            for(int i = 0; i < MOTION_EVENT_HISTORY; i++) events[i].id = 0;
+        }
+
+        bool start();
+        void process(const FrameHandle &frame);
+
+        // Copy of an event still in the history. False once it has been overwritten.
+        bool getEvent(uint32_t id, MotionEvent *event);
+        // State and every event with an id above since.
+        size_t printJson(char *buf, size_t len, uint32_t since);
+};
+
+extern MotionDetector motion_detector;
+
+#endif /* MotionDetector.h */
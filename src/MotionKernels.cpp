@@ -0,0 +1,85 @@
+#include "MotionKernels.h"
+#include <string.h>
+
+// Native register width: four pixels per word on the ESP32, eight on a 64-bit host.
+#if UINTPTR_MAX > 0xFFFFFFFFu
+typedef uint64_t motion_word_t;
+#else
+typedef uint32_t motion_word_t;
+#endif
+
+static const motion_word_t LANE_LOW = (motion_word_t)0x00FF00FF00FF00FFull;   // Low byte of each 16-bit lane.
+static const motion_word_t LANE_BIAS = (motion_word_t)0x0100010001000100ull;  // 256 in each lane.
+static const motion_word_t LANE_ONE = (motion_word_t)0x0001000100010001ull;   // 1 in each lane.
+
+// Words summed into the 16-bit lanes before they are folded. Each word adds at most 510 to a lane.
+static const uint16_t SAD_FOLD_WORDS = 64;
+
+static inline motion_word_t load_word(const uint8_t *p) {
+    // Rows of the grid are not word aligned. memcpy compiles to a plain load where that is allowed.
+    motion_word_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static inline motion_word_t absdiff_lanes(motion_word_t a, motion_word_t b) {
+    // a and b hold one byte in the low half of each 16-bit lane. Adding 256 to every lane of a keeps
+    // the subtraction positive in every lane, so it never borrows across.
+    motion_word_t t = (a | LANE_BIAS) - b;
+    // Bit 8 is clear where a < b. Those lanes hold 256 - |a - b| and are negated with xor and add one.
+    motion_word_t neg = ((~t >> 8) & LANE_ONE) * 0xFF;
+    return ((t & LANE_LOW) ^ neg) + (neg & LANE_ONE);
+}
+
+uint32_t motion_sad(const uint8_t *a, const uint8_t *b, size_t stride, uint16_t w, uint16_t h) {
+    const uint8_t step = sizeof(motion_word_t);
+    uint32_t total = 0;
+    for(uint16_t y = 0; y < h; y++, a += stride, b += stride) {
+        uint16_t x = 0;
+        while(x + step <= w) {
+            motion_word_t lanes = 0;
+            for(uint16_t n = 0; n < SAD_FOLD_WORDS && x + step <= w; n++, x += step) {
+                motion_word_t wa = load_word(a + x);
+                motion_word_t wb = load_word(b + x);
+                lanes += absdiff_lanes(wa & LANE_LOW, wb & LANE_LOW);
+                lanes += absdiff_lanes((wa >> 8) & LANE_LOW, (wb >> 8) & LANE_LOW);
+            }
+            for(; lanes; lanes >>= 16) total += lanes & 0xFFFF;
+        }
+        for(; x < w; x++) total += (a[x] > b[x]) ? a[x] - b[x] : b[x] - a[x];
+    }
+    return total;
+}
+
+uint32_t motion_sad_scalar(const uint8_t *a, const uint8_t *b, size_t stride, uint16_t w, uint16_t h) {
+    uint32_t total = 0;
+    for(uint16_t y = 0; y < h; y++, a += stride, b += stride) {
+        for(uint16_t x = 0; x < w; x++) total += (a[x] > b[x]) ? a[x] - b[x] : b[x] - a[x];
+    }
+    return total;
+}
+
+void motion_downscale(const uint8_t *src, size_t stride, uint8_t step, uint16_t width, uint16_t height, uint8_t *dst) {
+    uint16_t cellsX = (width + 7) / 8;
+    uint16_t cellsY = (height + 7) / 8;
+    for(uint16_t cy = 0; cy < cellsY; cy++) {
+        uint16_t rows = (cy * 8 + 8 <= height) ? 8 : height - cy * 8;
+        for(uint16_t cx = 0; cx < cellsX; cx++) {
+            uint16_t cols = (cx * 8 + 8 <= width) ? 8 : width - cx * 8;
+            const uint8_t *p = src + (size_t)cy * 8 * stride + (size_t)cx * 8 * step;
+            uint32_t sum = 0;
+            for(uint16_t y = 0; y < rows; y++, p += stride) {
+                for(uint16_t x = 0; x < cols; x++) sum += p[x * step];
+            }
+            *dst++ = sum / (rows * cols);
+        }
+    }
+}
+
+void motion_blend(uint16_t *acc, uint8_t *bg, const uint8_t *cur, size_t n, uint8_t shift) {
+    for(size_t i = 0; i < n; i++) {
+        int32_t target = (int32_t)cur[i] << 8;
+        acc[i] += (target - acc[i]) >> shift;
+        bg[i] = acc[i] >> 8;
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef MOTION_KERNELS
+#define MOTION_KERNELS
+
+// Pixel kernels for the motion detector. Plain C++ with no Arduino or ESP-IDF headers,
+// so they build and can be benchmarked on a host as they are.
+#include <stdint.h>
+#include <stddef.h>
+
+// Sum of absolute differences over a w x h block of two images sharing a stride.
+// A register's worth of pixels at a time, split into 16-bit lanes so no lane can borrow from its neighbour.
+uint32_t motion_sad(const uint8_t *a, const uint8_t *b, size_t stride, uint16_t w, uint16_t h);
+// Byte at a time reference for motion_sad.
+uint32_t motion_sad_scalar(const uint8_t *a, const uint8_t *b, size_t stride, uint16_t w, uint16_t h);
+
+// Average each 8x8 block of an 8-bit plane into one byte. step is the distance between samples,
+// 1 for grayscale and 2 for the Y of YUV422. dst is (width + 7) / 8 wide.
+void motion_downscale(const uint8_t *src, size_t stride, uint8_t step, uint16_t width, uint16_t height, uint8_t *dst);
+
+// Move a running background towards the current image by 1 / 2^shift. acc holds it in 8.8 fixed point
+// so slow changes are not lost to rounding, bg the integer part the SAD is taken against.
+void motion_blend(uint16_t *acc, uint8_t *bg, const uint8_t *cur, size_t n, uint8_t shift);
+
+#endif /* MotionKernels.h */
@@ -0,0 +1,358 @@
+#include "RateLimiter.h"
+#include <Preferences.h>
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "Metrics.h"
+
+static_assert(sizeof(ADMIN_KEY) > 1, "ADMIN_KEY is empty, so nobody could change the limits or run a tuning sweep");
+static_assert(sizeof(ADMIN_KEY) - 1 <= ADMIN_KEY_MAX, "ADMIN_KEY is longer than the X-Admin-Key header read");
+
+// Define the shared limiter.
+RateLimiter rate_limiter;
+
+uint32_t rate_peer_address(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if(getpeername(fd, (struct sockaddr *)&addr, &len) != 0) return 0;
+    if(addr.ss_family == AF_INET) return ((struct sockaddr_in *)&addr)->sin_addr.s_addr;
+    if(addr.ss_family != AF_INET6) return 0;
+
+    // httpd listens on IPv6 when lwIP has it, so IPv4 clients show up as ::ffff:a.b.c.d.
+    uint32_t words[4];
+    memcpy(words, &((struct sockaddr_in6 *)&addr)->sin6_addr, sizeof(words));
+    if(words[0] == 0 && words[1] == 0 && words[2] == htonl(0xffff)) return words[3];
+    return words[0] ^ words[1] ^ words[2] ^ words[3];
+}
+
+bool RateLimiter::begin() {
+    if(lock == NULL) lock = xSemaphoreCreateMutex();
+    if(lock == NULL) return false;
+
+    // No policy saved means no budgets, so nobody is throttled before one is set.
+    Preferences prefs;
+    if(prefs.begin(RATE_NAMESPACE, true)) {
+        size_t len = prefs.getBytesLength(RATE_TRUSTED_KEY);
+        if(len > 0 && len <= sizeof(trusted) && len % sizeof(uint32_t) == 0 && prefs.getBytes(RATE_TRUSTED_KEY, trusted, len) == len) {
+            trustedCount = len / sizeof(uint32_t);
+        }
+        requestsPerS = min(prefs.getUInt(RATE_REQUESTS_KEY, 0), (uint32_t)UINT16_MAX);
+        bytesPerS = prefs.getUInt(RATE_BYTES_KEY, 0) * 1024;
+        sharedBytesPerS = prefs.getUInt(RATE_SHARED_KEY, 0) * 1024;
+        prefs.end();
+    }
+
+    sharedRefilledUs = esp_timer_get_time();
+    sharedTokens = (int64_t)sharedBytesPerS * RATE_BYTE_BURST_MS / 1000;
+    return true;
+}
+
+// Must be called with the lock held.
+bool RateLimiter::isListed(uint32_t addr) {
+    for(int i = 0; i < trustedCount; i++) {
+        if(trusted[i] == addr) return true;
+    }
+    return false;
+}
+
+// The client's slot, taking a free one or the one idle longest if it has none. NULL if every slot
+// has a stream open. Must be called with the lock held.
+RateClient *RateLimiter::find(uint32_t addr) {
+    RateClient *reuse = NULL;
+    for(int i = 0; i < RATE_MAX_CLIENTS; i++) {
+        RateClient *c = &clients[i];
+        if(c->addr == addr) return c;
+        if(c->streams > 0) continue;
+        if(reuse == NULL || c->addr == 0 || (reuse->addr != 0 && c->refilledUs < reuse->refilledUs)) reuse = c;
+    }
+    if(reuse == NULL) return NULL;
+
+    // A new client starts with full buckets.
+    reuse->addr = addr;
+    reuse->refilledUs = esp_timer_get_time();
+    reuse->requestTokens = (int32_t)requestsPerS * 1000 * RATE_REQUEST_BURST_S;
+    reuse->byteTokens = (int64_t)bytesPerS * RATE_BYTE_BURST_MS / 1000;
+    reuse->requestCarry = 0;
+    reuse->byteCarry = 0;
+    reuse->streams = 0;
+    reuse->requests = 0;
+    reuse->rejected = 0;
+    reuse->bytes = 0;
+    reuse->throttledMs = 0;
+    return reuse;
+}
+
+// Add what elapsedUs earns at perS tokens a second, in units of 1/scale of a token per microsecond,
+// keeping the fraction of a token left over for next time. A full bucket drops it.
+static void top_up(int32_t *tokens, int32_t *carry, int64_t elapsedUs, uint32_t perS, int64_t scale, int64_t cap) {
+    int64_t earned = elapsedUs * perS + *carry;
+    int64_t topped = *tokens + earned / scale;
+    *carry = (topped < cap) ? earned % scale : 0;
+    *tokens = min(topped, cap);
+}
+
+// Must be called with the lock held.
+void RateLimiter::refill(RateClient *client, int64_t now) {
+    int64_t elapsed = now - client->refilledUs;
+    client->refilledUs = now;
+    if(requestsPerS) {
+        top_up(&client->requestTokens, &client->requestCarry, elapsed, requestsPerS, 1000, (int64_t)requestsPerS * 1000 * RATE_REQUEST_BURST_S);
+    }
+    if(bytesPerS) {
+        top_up(&client->byteTokens, &client->byteCarry, elapsed, bytesPerS, 1000000, (int64_t)bytesPerS * RATE_BYTE_BURST_MS / 1000);
+    }
+}
+
+// Must be called with the lock held.
+void RateLimiter::refillShared(int64_t now) {
+    int64_t elapsed = now - sharedRefilledUs;
+    sharedRefilledUs = now;
+    if(sharedBytesPerS) {
+        top_up(&sharedTokens, &sharedCarry, elapsed, sharedBytesPerS, 1000000, (int64_t)sharedBytesPerS * RATE_BYTE_BURST_MS / 1000);
+    }
+}
+
+// Time until the client and the shared budget are both out of debt. Must be called with the lock held.
+uint32_t RateLimiter::waitMs(RateClient *client) {
+    uint32_t ms = 0;
+    if(bytesPerS && client->byteTokens < 0) ms = (uint64_t)-client->byteTokens * 1000 / bytesPerS + 1;
+    if(sharedBytesPerS && sharedTokens < 0) ms = max(ms, (uint32_t)((uint64_t)-sharedTokens * 1000 / sharedBytesPerS + 1));
+    return ms;
+}
+
+bool RateLimiter::admit(uint32_t addr, uint32_t *retryMs) {
+    *retryMs = 0;
+    if(lock == NULL || addr == 0) return true;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    RateClient *client = isListed(addr) ? NULL : find(addr);
+    if(client == NULL) {
+        xSemaphoreGive(lock);
+        return true;
+    }
+    int64_t now = esp_timer_get_time();
+    refill(client, now);
+    refillShared(now);
+
+    // A client still paying off its last frame is refused too, or a tight loop would go on at the request rate.
+    uint32_t wait = waitMs(client);
+    if(requestsPerS && client->requestTokens < 1000) wait = max(wait, (uint32_t)(1000 - client->requestTokens) / requestsPerS + 1);
+    if(wait) {
+        client->rejected++;
+        xSemaphoreGive(lock);
+        metric_rate_limited.inc();
+        *retryMs = wait;
+        return false;
+    }
+    if(requestsPerS) client->requestTokens -= 1000;
+    client->requests++;
+    xSemaphoreGive(lock);
+    return true;
+}
+
+uint32_t RateLimiter::charge(uint32_t addr, size_t bytes) {
+    if(lock == NULL || addr == 0) return 0;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    RateClient *client = isListed(addr) ? NULL : find(addr);
+    if(client == NULL) {
+        xSemaphoreGive(lock);
+        return 0;
+    }
+    int64_t now = esp_timer_get_time();
+    refill(client, now);
+    refillShared(now);
+
+    // Whatever was sent is paid for after the fact. The next request or frame waits off any debt.
+    client->bytes += bytes;
+    if(bytesPerS) client->byteTokens -= bytes;
+    if(sharedBytesPerS) sharedTokens -= bytes;
+    uint32_t wait = waitMs(client);
+    xSemaphoreGive(lock);
+    return wait;
+}
+
+void RateLimiter::throttled(uint32_t addr, uint32_t ms) {
+    if(lock == NULL || addr == 0) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    RateClient *client = find(addr);
+    if(client) client->throttledMs += ms;
+    xSemaphoreGive(lock);
+    metric_stream_throttle_ms.inc(ms);
+}
+
+void RateLimiter::streamOpened(uint32_t addr) {
+    if(lock == NULL || addr == 0) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    RateClient *client = find(addr);
+    if(client) client->streams++;
+    xSemaphoreGive(lock);
+}
+
+void RateLimiter::streamClosed(uint32_t addr) {
+    if(lock == NULL || addr == 0) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for(int i = 0; i < RATE_MAX_CLIENTS; i++) {
+        if(clients[i].addr == addr && clients[i].streams > 0) clients[i].streams--;
+    }
+    xSemaphoreGive(lock);
+}
+
+bool RateLimiter::setRequestRate(uint16_t perS) {
+    if(lock == NULL) return false;
+
+    // Everyone starts over with a full bucket at the new rate.
+    xSemaphoreTake(lock, portMAX_DELAY);
+    requestsPerS = perS;
+    for(int i = 0; i < RATE_MAX_CLIENTS; i++) {
+        clients[i].requestTokens = (int32_t)perS * 1000 * RATE_REQUEST_BURST_S;
+        clients[i].requestCarry = 0;
+    }
+    xSemaphoreGive(lock);
+    return savePolicy();
+}
+
+bool RateLimiter::setByteRate(uint32_t kbPerS) {
+    if(lock == NULL) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bytesPerS = kbPerS * 1024;
+    for(int i = 0; i < RATE_MAX_CLIENTS; i++) {
+        clients[i].byteTokens = (int64_t)bytesPerS * RATE_BYTE_BURST_MS / 1000;
+        clients[i].byteCarry = 0;
+    }
+    xSemaphoreGive(lock);
+    return savePolicy();
+}
+
+bool RateLimiter::setSharedByteRate(uint32_t kbPerS) {
+    if(lock == NULL) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    sharedBytesPerS = kbPerS * 1024;
+    sharedTokens = (int64_t)sharedBytesPerS * RATE_BYTE_BURST_MS / 1000;
+    sharedCarry = 0;
+    xSemaphoreGive(lock);
+    return savePolicy();
+}
+
+bool RateLimiter::trust(uint32_t addr) {
+    if(lock == NULL || addr == 0) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool ok = true;
+    if(!isListed(addr)) {
+        if(trustedCount < RATE_MAX_TRUSTED) trusted[trustedCount++] = addr;
+        else ok = false;
+    }
+    xSemaphoreGive(lock);
+    return ok && saveTrusted();
+}
+
+bool RateLimiter::untrust(uint32_t addr) {
+    if(lock == NULL) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for(int i = 0; i < trustedCount; i++) {
+        if(trusted[i] != addr) continue;
+        trusted[i] = trusted[--trustedCount];
+        break;
+    }
+    xSemaphoreGive(lock);
+    return saveTrusted();
+}
+
+bool RateLimiter::isTrusted(uint32_t addr) {
+    if(lock == NULL || addr == 0) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool found = isListed(addr);
+    xSemaphoreGive(lock);
+    return found;
+}
+
+bool RateLimiter::isLimited(uint32_t addr) {
+    if(lock == NULL || addr == 0) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool limited = (requestsPerS || bytesPerS || sharedBytesPerS || trustedCount) && !isListed(addr);
+    xSemaphoreGive(lock);
+    return limited;
+}
+
+bool RateLimiter::isAdmin(uint32_t addr, const char *key) {
+    if(isTrusted(addr)) return true;
+
+    // Compared in full whatever the mismatch, so the time taken gives nothing away.
+    size_t len = strlen(ADMIN_KEY);
+    if(key == NULL || strlen(key) != len) return false;
+    uint8_t diff = 0;
+    for(size_t i = 0; i < len; i++) diff |= key[i] ^ ADMIN_KEY[i];
+    return diff == 0;
+}
+
+bool RateLimiter::saveTrusted() {
+    // Copied out so streams are not held up behind the flash write.
+    uint32_t list[RATE_MAX_TRUSTED];
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint8_t count = trustedCount;
+    memcpy(list, trusted, count * sizeof(uint32_t));
+    xSemaphoreGive(lock);
+
+    Preferences prefs;
+    if(!prefs.begin(RATE_NAMESPACE, false)) return false;
+    bool ok = true;
+    if(count > 0) ok = prefs.putBytes(RATE_TRUSTED_KEY, list, count * sizeof(uint32_t)) == count * sizeof(uint32_t);
+    else prefs.remove(RATE_TRUSTED_KEY);
+    prefs.end();
+    return ok;
+}
+
+bool RateLimiter::savePolicy() {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t requests = requestsPerS;
+    uint32_t kb = bytesPerS / 1024;
+    uint32_t sharedKb = sharedBytesPerS / 1024;
+    xSemaphoreGive(lock);
+
+    Preferences prefs;
+    if(!prefs.begin(RATE_NAMESPACE, false)) return false;
+    bool ok = prefs.putUInt(RATE_REQUESTS_KEY, requests) && prefs.putUInt(RATE_BYTES_KEY, kb) && prefs.putUInt(RATE_SHARED_KEY, sharedKb);
+    prefs.end();
+    return ok;
+}
+
+static size_t print_address(char *buf, size_t len, uint32_t addr) {
+    const uint8_t *b = (const uint8_t *)&addr;
+    return snprintf(buf, len, "\"%u.%u.%u.%u\"", b[0], b[1], b[2], b[3]);
+}
+
+size_t RateLimiter::printJson(char *buf, size_t len) {
+    if(lock == NULL) return snprintf(buf, len, "{}");
+
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    size_t used = snprintf(buf, len, "{\"requests_per_s\":%u,\"bytes_per_s\":%lu,\"shared_bytes_per_s\":%lu,\"trusted\":[",
+        requestsPerS, (unsigned long)bytesPerS, (unsigned long)sharedBytesPerS);
+    for(int i = 0; i < trustedCount && used < len; i++) {
+        if(i && used < len) used += snprintf(buf + used, len - used, ",");
+        if(used < len) used += print_address(buf + used, len - used, trusted[i]);
+    }
+    if(used < len) used += snprintf(buf + used, len - used, "],\"clients\":[");
+    bool first = true;
+    for(int i = 0; i < RATE_MAX_CLIENTS && used < len; i++) {
+        RateClient *c = &clients[i];
+        if(c->addr == 0) continue;
+        used += snprintf(buf + used, len - used, "%s{\"addr\":", first ? "" : ",");
+        if(used < len) used += print_address(buf + used, len - used, c->addr);
+        if(used < len) used += snprintf(buf + used, len - used, ",\"trusted\":%s,\"streams\":%u,\"requests\":%lu,\"rejected\":%lu,\"bytes\":%lu,\"throttled_ms\":%lu,\"idle_s\":%lu}",
+            isListed(c->addr) ? "true" : "false", c->streams, (unsigned long)c->requests, (unsigned long)c->rejected, (unsigned long)c->bytes, (unsigned long)c->throttledMs,
+            (unsigned long)((now - c->refilledUs) / 1000000));
+        first = false;
+    }
+    xSemaphoreGive(lock);
+    if(used < len) used += snprintf(buf + used, len - used, "]}");
+    return (used < len) ? used : len - 1;
+}
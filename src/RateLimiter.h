@@ -0,0 +1,115 @@
+#ifndef RATE_LIMITER
+#define RATE_LIMITER
+
+#include <Arduino.h>
+
+// Admin requests change who is trusted and what everyone else gets. They must be POSTs, either from a
+// trusted address or carrying this key in an X-Admin-Key header. The trusted list starts empty, so the
+// key is the only way in on a fresh board and every build needs one: set it with a build flag, e.g.
+// -DADMIN_KEY=\"...\". platformio.ini takes it from the SENTRYCAM_ADMIN_KEY environment variable.
+#ifndef ADMIN_KEY
+#error "Set ADMIN_KEY, e.g. -DADMIN_KEY=\"...\", or nobody can change the limits or run a tuning sweep"
+#endif
+const size_t ADMIN_KEY_MAX = 64;        // Longest X-Admin-Key header read.
+
+// The budgets are off until a policy is set through /limits, and the policy is kept in NVS. These are
+// starting points for one. A VGA stream at 20 fps fits in the per-client byte rate.
+const uint16_t RATE_SUGGESTED_REQUESTS_PER_S = 10;      // Image requests and stream opens per client.
+const uint32_t RATE_SUGGESTED_KB_PER_S = 768;           // Image bytes per client.
+const uint32_t RATE_SUGGESTED_SHARED_KB_PER_S = 1024;   // Image bytes for all untrusted clients together.
+const uint8_t RATE_REQUEST_BURST_S = 2;                 // Seconds of requests a quiet client may save up.
+const uint16_t RATE_BYTE_BURST_MS = 500;                // Likewise for bytes.
+const uint32_t RATE_MAX_WAIT_MS = 1000;                 // Longest a throttled stream sleeps before checking its socket again.
+
+const uint8_t RATE_MAX_CLIENTS = 16;                    // Addresses tracked at once. The one idle longest makes way.
+const uint8_t RATE_MAX_TRUSTED = 4;
+const char RATE_NAMESPACE[] = "ratelimit";              // NVS namespace.
+const char RATE_TRUSTED_KEY[] = "trusted";              // Trusted addresses, packed.
+const char RATE_REQUESTS_KEY[] = "requests";            // Budgets of the policy, as set through /limits.
+const char RATE_BYTES_KEY[] = "kbytes";
+const char RATE_SHARED_KEY[] = "shared_kb";
+
+struct _rate_client {
+    uint32_t addr;                  // IPv4 address in network order. 0 for a free slot.
+    int64_t refilledUs;             // esp_timer time the buckets were last topped up.
+    int32_t requestTokens;          // In thousandths of a request.
+    int32_t byteTokens;             // Goes below zero when a frame bigger than what is left is sent.
+    int32_t requestCarry;           // What the last top-up earned short of a whole token, so slow callers are not shortchanged.
+    int32_t byteCarry;
+    uint8_t streams;                // Open streams. The slot is not reused while any are.
+    uint32_t requests;              // Requests admitted.
+    uint32_t rejected;              // Requests refused.
+    uint32_t bytes;                 // Bytes charged.
+    uint32_t throttledMs;           // Time streams were held back.
+};
+typedef struct _rate_client RateClient;
+
+// Token buckets per client address for image requests and image bytes, so one client polling
+// /capture in a tight loop or pulling a stream flat out cannot starve the others. Requests over
+// budget are refused, and streams over budget are slowed to the rate their bytes allow.
+//
+// Untrusted clients also share one byte budget, which caps what ad-hoc viewers take from the link
+// in total. Trusted addresses, such as the NVR's, skip every bucket, so whatever the shared budget
+// leaves is theirs. The trusted list and the budgets are kept in NVS.
+class RateLimiter {
+    private:
+        SemaphoreHandle_t lock = NULL;
+        RateClient clients[RATE_MAX_CLIENTS];
+        uint32_t trusted[RATE_MAX_TRUSTED];
+        uint8_t trustedCount = 0;
+        uint16_t requestsPerS = 0;
+        uint32_t bytesPerS = 0;
+        uint32_t sharedBytesPerS = 0;
+        int32_t sharedTokens = 0;
+        int32_t sharedCarry = 0;
+        int64_t sharedRefilledUs = 0;
+
+        bool isListed(uint32_t addr);
+        RateClient *find(uint32_t addr);
+        void refill(RateClient *client, int64_t now);
+        void refillShared(int64_t now);
+        uint32_t waitMs(RateClient *client);
+        bool saveTrusted();
+        bool savePolicy();
+
+    public:
+        RateLimiter() {
+            for(int i = 0; i < RATE_MAX_CLIENTS; i++) clients[i].addr = 0;
+        }
+
+        // Create the lock and load the trusted list and the policy. Until then every request is admitted.
+        bool begin();
+
+        // Request interface. admit() counts one request and says whether the client may have it,
+        // or how long to wait. charge() takes the bytes sent and returns how long to hold off the next frame.
+        bool admit(uint32_t addr, uint32_t *retryMs);
+        uint32_t charge(uint32_t addr, size_t bytes);
+        void throttled(uint32_t addr, uint32_t ms);
+
+        // Stream interface. Keeps the client's buckets in place while it is connected.
+        void streamOpened(uint32_t addr);
+        void streamClosed(uint32_t addr);
+
+        // Budgets, saved as the policy. 0 turns one off.
+        bool setRequestRate(uint16_t perS);
+        bool setByteRate(uint32_t kbPerS);
+        bool setSharedByteRate(uint32_t kbPerS);
+
+        bool trust(uint32_t addr);
+        bool untrust(uint32_t addr);
+        bool isTrusted(uint32_t addr);
+        // True if addr is held to a policy: budgets or a trusted list have been set and addr is not on the list.
+        bool isLimited(uint32_t addr);
+        // True if a request from addr carrying key may change the policy or the trusted list.
+        bool isAdmin(uint32_t addr, const char *key);
+
+        size_t printJson(char *buf, size_t len);
+};
+
+// The IPv4 address at the other end of a socket, unwrapped from an IPv4-mapped IPv6 one. Native IPv6
+// addresses are folded to 32 bits. 0 if unknown.
+uint32_t rate_peer_address(int fd);
+
+extern RateLimiter rate_limiter;
+
+#endif /* RateLimiter.h */
@@ -1,14 +1,34 @@
 #include <SentryCamera.h>
+#include "FramePool.h"
+#include "FrameBroadcaster.h"
+#include "ConversionPool.h"
+#include "CameraTuner.h"
 
 String globalSSID = "EMPTY";
 String globalPassword = "EMPTY";
 
 void SentryCamera::initCamera() {
+    // A sweep asked for over /tune runs now, while nothing else holds the driver. Then the best
+    // buffer settings found for this frame size replace the defaults.
+    camera_tuner.runPending(esp32_camera);
+    camera_tuner.apply(&esp32_camera);
+
     esp_err_t err = esp_camera_init(&esp32_camera);
     if (err != ESP_OK) {
         Serial.printf("Camera init failed with error 0x%x", err);
         return;
   }
+
+    // One pooled frame per driver buffer so consumers can hold frames without starving the driver,
+    // one per stream client so a slow viewer holding its frame never stalls capture, and one for
+    // everything else that can hold a frame at the same time.
+    uint8_t slots = esp32_camera.fb_count + MAX_STREAM_CLIENTS + PIPELINE_HELD_FRAMES + HANDLER_HELD_FRAMES + WORKER_HELD_FRAMES;
+    if(!frame_pool.begin(slots, esp32_camera.frame_size, esp32_camera.pixel_format)) {
+        Serial.println("Frame pool allocation failed");
+    }
+
+    // Size the stream encode buffers for raw pixel formats.
+    conversion_pool.reset(esp32_camera.frame_size);
 }
 
 void SentryCamera::setupWifi() {
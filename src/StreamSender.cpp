@@ -0,0 +1,304 @@
+#include "StreamSender.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "Metrics.h"
+#include "RateLimiter.h"
+#include <unistd.h>
+
+// Define the shared sender table.
+StreamSenderTable stream_senders;
+
+StreamSender *StreamSenderTable::open(httpd_req_t *req, TaskFunction_t sender_task, bool dedup) {
+    // Only the httpd worker opens streams, so lazy creation cannot race.
+    if(lock == NULL) lock = xSemaphoreCreateMutex();
+    if(lock == NULL) return NULL;
+
+    // The sender slot shares its index with the broadcaster subscription.
+    int id = frame_broadcaster.subscribe();
+    if(id < 0) return NULL;
+
+    // Detach the request so the worker can go back to serving other URIs.
+    httpd_req_t *detached = NULL;
+    if(httpd_req_async_handler_begin(req, &detached) != ESP_OK) {
+        frame_broadcaster.unsubscribe(id);
+        return NULL;
+    }
+
+    senders[id].webSocket = false;
+    senders[id].dedup = dedup;
+    return start(id, req, detached, sender_task);
+}
+
+StreamSender *StreamSenderTable::openWebSocket(httpd_req_t *req, TaskFunction_t sender_task, bool dedup) {
+    if(lock == NULL) lock = xSemaphoreCreateMutex();
+    if(lock == NULL) return NULL;
+
+    int id = frame_broadcaster.subscribe();
+    if(id < 0) return NULL;
+    StreamSender *sender = &senders[id];
+
+    if(sender->credits == NULL) sender->credits = xSemaphoreCreateCounting(WS_MAX_CREDITS, 0);
+    if(sender->credits == NULL) {
+        frame_broadcaster.unsubscribe(id);
+        return NULL;
+    }
+
+    // Start every client with a small window, dropping credits and replies left over from the slot's last owner.
+    while(xSemaphoreTake(sender->credits, 0) == pdTRUE);
+    sender->reply.opcode = 0;
+    sender->wakes = 0;
+    for(int i = 0; i < WS_INITIAL_CREDITS; i++) xSemaphoreGive(sender->credits);
+
+    // The session stays with httpd, which delivers client messages to the URI handler.
+    sender->webSocket = true;
+    sender->dedup = dedup;
+    return start(id, req, NULL, sender_task);
+}
+
+StreamSender *StreamSenderTable::start(int id, httpd_req_t *req, httpd_req_t *detached, TaskFunction_t sender_task) {
+    StreamSender *sender = &senders[id];
+
+    // A client that stops reading errors out instead of pinning its frame forever.
+    int fd = httpd_req_to_sockfd(req);
+    struct timeval timeout = { .tv_sec = STREAM_SEND_TIMEOUT_S, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    uint32_t peer = rate_peer_address(fd);
+    rate_limiter.streamOpened(peer);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    sender->active = true;
+    sender->fd = fd;
+    sender->writing = false;
+    sender->closeOwed = false;
+    sender->peer = peer;
+    sender->handle = req->handle;
+    sender->req = detached;
+    sender->startedUs = esp_timer_get_time();
+    sender->framesSent = 0;
+    sender->bytesSent = 0;
+    sender->lastSeq = 0;
+    sender->lag = 0;
+    sender->ageMs = 0;
+    sender->sendMs = 0;
+    sender->writes = 0;
+    sender->hasSignature = false;
+    sender->lastFullUs = 0;
+    sender->lastLen = 0;
+    sender->framesDeduped = 0;
+    sender->bytesSaved = 0;
+    activeCount++;
+    xSemaphoreGive(lock);
+
+    BaseType_t res = xTaskCreatePinnedToCore(
+        sender_task,                // Pointer to task function.
+        "stream_sender_task",       // Task name.
+        STREAM_SENDER_TASK_DEPTH,   // Size of stack allocated to the task (in bytes).
+        sender,                     // Pointer to parameters used for task creation.
+        1,                          // Task priority level.
+        &sender->task,              // Pointer to task handle.
+        1                           // Core that the task will run on.
+    );
+    if(res != pdPASS) {
+        log_e("Failed to create Stream Sender Task.");
+        close(sender);
+        return NULL;
+    }
+    return sender;
+}
+
+void StreamSenderTable::close(StreamSender *sender) {
+    // Hold the socket as for a write while giving it back, so httpd cannot close it and pass its number
+    // to a new connection before the close below is asked for.
+    xSemaphoreTake(lock, portMAX_DELAY);
+    httpd_req_t *req = sender->req;
+    httpd_handle_t handle = sender->handle;
+    int fd = (sender->closeOwed) ? -1 : sender->fd;
+    uint32_t peer = sender->peer;
+    sender->req = NULL;
+    sender->writing = (fd >= 0);
+    xSemaphoreGive(lock);
+
+    // Give the connection back to httpd and have it closed.
+    if(req) httpd_req_async_handler_complete(req);
+    if(fd >= 0) httpd_sess_trigger_close(handle, fd);
+    endWrite(sender);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    sender->fd = -1;
+    sender->task = NULL;
+    sender->active = false;
+    activeCount--;
+    xSemaphoreGive(lock);
+    rate_limiter.streamClosed(peer);
+
+    // Last, since this is what lets open() hand the slot to a new stream.
+    frame_broadcaster.unsubscribe(sender->id);
+}
+
+bool StreamSenderTable::socketClosed(int fd) {
+    if(lock == NULL) return true;
+
+    bool closeNow = true;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        StreamSender *s = &senders[i];
+        if(!s->active || s->fd != fd) continue;
+        if(s->writing) {
+            s->closeOwed = true;
+            closeNow = false;
+        }
+        else s->fd = -1;
+        // Wake a sender waiting for credits so it notices.
+        if(s->credits) xSemaphoreGive(s->credits);
+    }
+    xSemaphoreGive(lock);
+
+    // Stop the write in progress. The descriptor itself stays open until the sender lets go of it.
+    if(!closeNow) shutdown(fd, SHUT_RDWR);
+    return closeNow;
+}
+
+int StreamSenderTable::beginWrite(StreamSender *sender) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int fd = (sender->closeOwed) ? -1 : sender->fd;
+    sender->writing = (fd >= 0);
+    xSemaphoreGive(lock);
+    return fd;
+}
+
+void StreamSenderTable::endWrite(StreamSender *sender) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int owed = (sender->closeOwed) ? sender->fd : -1;
+    if(sender->closeOwed) sender->fd = -1;
+    sender->writing = false;
+    sender->closeOwed = false;
+    xSemaphoreGive(lock);
+    if(owed >= 0) ::close(owed);
+}
+
+StreamSender *StreamSenderTable::findBySocket(int fd) {
+    if(lock == NULL) return NULL;
+
+    StreamSender *found = NULL;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for(int i = 0; i < MAX_STREAM_CLIENTS && !found; i++) {
+        if(senders[i].active && senders[i].fd == fd) found = &senders[i];
+    }
+    xSemaphoreGive(lock);
+    return found;
+}
+
+void StreamSenderTable::addCredits(StreamSender *sender, uint32_t count) {
+    if(sender->credits == NULL) return;
+
+    // The semaphore saturates at WS_MAX_CREDITS, so extra credits are ignored.
+    for(uint32_t i = 0; i < count && i < WS_MAX_CREDITS; i++) {
+        if(xSemaphoreGive(sender->credits) != pdTRUE) break;
+    }
+}
+
+bool StreamSenderTable::takeCredit(StreamSender *sender, TickType_t timeout) {
+    if(sender->credits == NULL) return false;
+    return xSemaphoreTake(sender->credits, timeout) == pdTRUE;
+}
+
+void StreamSenderTable::queueReply(StreamSender *sender, uint8_t opcode, const uint8_t *payload, size_t len) {
+    if(sender->credits == NULL) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    // A CLOSE owed is never replaced, since it is the last thing the client should get.
+    if(sender->reply.opcode != HTTPD_WS_TYPE_CLOSE) {
+        sender->reply.opcode = opcode;
+        sender->reply.len = min(len, WS_MAX_CONTROL_PAYLOAD);
+        memcpy(sender->reply.payload, payload, sender->reply.len);
+    }
+    // Wake a sender waiting for credits. If the window is already full it is busy sending and will see the reply anyway.
+    if(xSemaphoreGive(sender->credits) == pdTRUE) sender->wakes++;
+    xSemaphoreGive(lock);
+}
+
+bool StreamSenderTable::takeReply(StreamSender *sender, WsControl *reply, bool *wake) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *wake = sender->wakes > 0;
+    if(*wake) sender->wakes--;
+    bool owed = sender->reply.opcode != 0;
+    if(owed) {
+        *reply = sender->reply;
+        sender->reply.opcode = 0;
+    }
+    xSemaphoreGive(lock);
+    return owed;
+}
+
+bool StreamSenderTable::isUnchanged(StreamSender *sender, const FrameHandle &frame) {
+    if(!sender->dedup) return false;
+
+    uint8_t cells[SIGNATURE_BYTES];
+    if(!frame_signatures.get(frame, cells)) {
+        sender->hasSignature = false;
+        return false;
+    }
+
+    // Compared against the last frame sent rather than the previous one, so a slow drift still gets through.
+    bool keepAliveDue = (esp_timer_get_time() - sender->lastFullUs) >= DEDUP_KEEPALIVE_US;
+    if(sender->hasSignature && !keepAliveDue && FrameSignatureCache::matches(cells, sender->signature)) return true;
+
+    memcpy(sender->signature, cells, SIGNATURE_BYTES);
+    sender->hasSignature = true;
+    return false;
+}
+
+void StreamSenderTable::recordUnchanged(StreamSender *sender, const FrameHandle &frame) {
+    // Raw frames are only sized once encoded, so the last full frame stands in for them.
+    uint32_t len = (frame.format() == PIXFORMAT_JPEG) ? frame.len() : sender->lastLen;
+    uint32_t latest = frame_broadcaster.getSequence();
+
+    sender->framesDeduped++;
+    sender->bytesSaved += len;
+    sender->lag = (latest > frame.seq()) ? latest - frame.seq() : 0;
+    sender->lastSeq = frame.seq();
+
+    metric_frames_deduped.inc();
+    metric_dedup_bytes_saved.inc(len);
+}
+
+void StreamSenderTable::recordFrame(StreamSender *sender, uint32_t seq, size_t len, int64_t sendStartUs, const struct timeval &captured, uint32_t writes) {
+    int64_t now = esp_timer_get_time();
+    int64_t capturedUs = (int64_t)captured.tv_sec * 1000000 + captured.tv_usec;
+    uint32_t latest = frame_broadcaster.getSequence();
+
+    sender->framesSent++;
+    sender->bytesSent += len;
+    sender->lag = (latest > seq) ? latest - seq : 0;
+    sender->lastSeq = seq;
+    sender->sendMs = (uint32_t)((now - sendStartUs) / 1000);
+    sender->ageMs = (uint32_t)((now - capturedUs) / 1000);
+    sender->writes = writes;
+    sender->lastFullUs = now;
+    sender->lastLen = len;
+
+    metric_frames_sent.inc();
+    metric_send_ms.observe(sender->sendMs);
+    metric_frame_bytes.observe(len);
+}
+
+uint8_t StreamSenderTable::getActiveCount() { return activeCount; }
+
+size_t StreamSenderTable::printJson(char *buf, size_t len) {
+    int64_t now = esp_timer_get_time();
+    size_t used = snprintf(buf, len, "{\"active\":%u,\"streams\":[", activeCount);
+    bool first = true;
+    for(int i = 0; i < MAX_STREAM_CLIENTS && used < len; i++) {
+        StreamSender *s = &senders[i];
+        if(!s->active) continue;
+        used += snprintf(buf + used, len - used,
+            "%s{\"id\":%d,\"proto\":\"%s\",\"fd\":%d,\"uptime_s\":%lu,\"frames\":%lu,\"bytes\":%lu,\"seq\":%lu,\"lag\":%lu,\"age_ms\":%lu,\"send_ms\":%lu,\"writes\":%lu,\"dropped\":%lu,\"dedup\":%s,\"deduped\":%lu,\"bytes_saved\":%lu}",
+            first ? "" : ",", s->id, s->webSocket ? "ws" : "mjpeg", s->fd, (unsigned long)((now - s->startedUs) / 1000000), (unsigned long)s->framesSent,
+            (unsigned long)s->bytesSent, (unsigned long)s->lastSeq, (unsigned long)s->lag, (unsigned long)s->ageMs, (unsigned long)s->sendMs,
+            (unsigned long)s->writes, (unsigned long)frame_broadcaster.getDroppedCount(s->id), s->dedup ? "true" : "false",
+            (unsigned long)s->framesDeduped, (unsigned long)s->bytesSaved);
+        first = false;
+    }
+    if(used < len) used += snprintf(buf + used, len - used, "]}");
+    return (used < len) ? used : len - 1;
+}
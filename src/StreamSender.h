@@ -0,0 +1,110 @@
+#ifndef STREAM_SENDER
+#define STREAM_SENDER
+
+#include <Arduino.h>
+#include "esp_http_server.h"
+#include "FrameBroadcaster.h"
+#include "FrameSignature.h"
+#include "WebSocketPacketizer.h"
+
+const int STREAM_SENDER_TASK_DEPTH = 8192;
+const int STREAM_SEND_TIMEOUT_S = 5;
+const int64_t DEDUP_KEEPALIVE_US = 2000000;     // A full frame goes out at least this often, even for a static scene.
+
+struct _stream_sender {
+    bool active;                    // Slot is owned by a live stream connection.
+    int id;                         // Slot index, also the broadcaster subscriber id.
+    bool webSocket;                 // Frames go out as WebSocket messages paced by client credits.
+    int fd;                         // Socket of the connection. -1 once httpd has closed it.
+    bool writing;                   // The sender task is using fd outside the lock. See beginWrite().
+    bool closeOwed;                 // httpd closed the session mid-write, so endWrite() closes fd.
+    uint32_t peer;                  // Client address the rate limiter charges frames to.
+    httpd_handle_t handle;          // Server owning the socket.
+    httpd_req_t *req;               // Detached copy of the request, owned by the sender task. NULL for WebSockets.
+    SemaphoreHandle_t credits;      // Frames the WebSocket client is ready to receive.
+    WsControl reply;                // Control frame the sender task owes the WebSocket client.
+    uint8_t wakes;                  // Credits given only to wake the sender task for the reply.
+    TaskHandle_t task;              // Sender task pushing frames to this connection.
+    int64_t startedUs;              // esp_timer time the stream was opened.
+    uint32_t framesSent;            // Frames written to the socket.
+    uint32_t bytesSent;             // Payload bytes written to the socket.
+    uint32_t lastSeq;               // Sequence number of the last frame sent.
+    uint32_t lag;                   // Frames published but not yet sent when the last frame went out.
+    uint32_t ageMs;                 // Age of the last frame when it finished sending.
+    uint32_t sendMs;                // Time spent writing the last frame.
+    uint32_t writes;                // Socket writes issued, to check writes per frame.
+    bool dedup;                     // Hold back frames whose signature matches the last one sent.
+    bool hasSignature;              // signature holds the last frame sent.
+    uint8_t signature[SIGNATURE_BYTES];
+    int64_t lastFullUs;             // esp_timer time the last full frame went out.
+    uint32_t lastLen;               // Size of the last full frame.
+    uint32_t framesDeduped;         // Frames held back as unchanged.
+    uint32_t bytesSaved;            // Frame bytes held back as unchanged.
+};
+typedef struct _stream_sender StreamSender;
+
+class StreamSenderTable {
+    private:
+        StreamSender senders[MAX_STREAM_CLIENTS];
+        SemaphoreHandle_t lock = NULL;      // Guards slot ownership.
+        uint8_t activeCount = 0;            // Live stream connections.
+
+        StreamSender *start(int id, httpd_req_t *req, httpd_req_t *detached, TaskFunction_t sender_task);
+
+    public:
+        StreamSenderTable() {
+            for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+                senders[i].active = false;
+                senders[i].id = i;
+                senders[i].webSocket = false;
+                senders[i].fd = -1;
+                senders[i].writing = false;
+                senders[i].closeOwed = false;
+                senders[i].peer = 0;
+                senders[i].handle = NULL;
+                senders[i].req = NULL;
+                senders[i].credits = NULL;
+                senders[i].reply.opcode = 0;
+                senders[i].wakes = 0;
+                senders[i].task = NULL;
+                senders[i].dedup = false;
+            }
+        }
+
+        // Detach the request from the httpd worker and start a sender task for it.
+        StreamSender *open(httpd_req_t *req, TaskFunction_t sender_task, bool dedup);
+        // Start a sender for a WebSocket that has just finished its handshake. httpd keeps reading the socket.
+        StreamSender *openWebSocket(httpd_req_t *req, TaskFunction_t sender_task, bool dedup);
+        // Called by the sender task when its connection is done. The socket is closed since raw streams end mid-body.
+        void close(StreamSender *sender);
+        // Called from the httpd close hook so a sender never writes to a recycled descriptor. Returns
+        // false if a sender is writing to fd, in which case the write is cut short and endWrite() closes it.
+        bool socketClosed(int fd);
+
+        // Sender task interface. Every write goes between these two, which keep fd open until the write is
+        // done so its number cannot pass to a new connection. beginWrite() returns -1 once httpd has closed it.
+        int beginWrite(StreamSender *sender);
+        void endWrite(StreamSender *sender);
+
+        // WebSocket flow control.
+        StreamSender *findBySocket(int fd);
+        void addCredits(StreamSender *sender, uint32_t count);
+        bool takeCredit(StreamSender *sender, TickType_t timeout);
+
+        // Control replies. httpd hands PINGs and CLOSEs to the URI handler, which queues the reply here,
+        // and the sender task writes it between frames so it never lands inside one. takeReply() also
+        // says whether the credit just taken was only a wake-up.
+        void queueReply(StreamSender *sender, uint8_t opcode, const uint8_t *payload, size_t len);
+        bool takeReply(StreamSender *sender, WsControl *reply, bool *wake);
+
+        // True if the frame looks the same as the last one sent and the keep-alive is not yet due.
+        bool isUnchanged(StreamSender *sender, const FrameHandle &frame);
+        void recordUnchanged(StreamSender *sender, const FrameHandle &frame);
+        void recordFrame(StreamSender *sender, uint32_t seq, size_t len, int64_t sendStartUs, const struct timeval &captured, uint32_t writes);
+        uint8_t getActiveCount();
+        size_t printJson(char *buf, size_t len);
+};
+
+extern StreamSenderTable stream_senders;
+
+#endif /* StreamSender.h */
@@ -0,0 +1,183 @@
+#include "ThumbnailCache.h"
+#include "esp_jpg_decode.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+// Define the shared thumbnail cache.
+ThumbnailCache thumbnail_cache;
+
+typedef struct {
+    const uint8_t *input;
+    uint8_t *pixels;        // Decoded thumbnail, BGR as fmt2jpg expects for RGB888.
+    size_t capacity;        // Bytes allocated for pixels.
+    uint16_t width;
+    uint16_t height;
+} thumb_decoder_t;
+
+static size_t thumb_read(void *arg, size_t index, uint8_t *buf, size_t len) {
+    thumb_decoder_t *d = (thumb_decoder_t *)arg;
+    if(buf) memcpy(buf, d->input + index, len);
+    return len;
+}
+
+static bool thumb_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+    thumb_decoder_t *d = (thumb_decoder_t *)arg;
+    if(!data) {
+        // Start: make sure the buffer holds the scaled size. It only grows. End: nothing to do.
+        if(x == 0 && y == 0) {
+            d->width = w;
+            d->height = h;
+            size_t needed = (size_t)w * h * 3;
+            if(needed > d->capacity) {
+                heap_caps_free(d->pixels);
+                d->pixels = (uint8_t *)heap_caps_malloc(needed, MALLOC_CAP_SPIRAM);
+                d->capacity = (d->pixels) ? needed : 0;
+            }
+            return d->pixels != NULL;
+        }
+        return true;
+    }
+
+    size_t stride = (size_t)d->width * 3;
+    uint8_t *row = d->pixels + (size_t)y * stride + (size_t)x * 3;
+    for(uint16_t iy = 0; iy < h; iy++, row += stride) {
+        for(size_t ix = 0; ix < (size_t)w * 3; ix += 3) {
+            row[ix] = data[ix + 2];
+            row[ix + 1] = data[ix + 1];
+            row[ix + 2] = data[ix];
+        }
+        data += w * 3;
+    }
+    return true;
+}
+
+static size_t thumb_encode(void *arg, size_t index, const void *data, size_t len) {
+    Thumbnail *thumb = (Thumbnail *)arg;
+    if(!index) thumb->len = 0;
+
+    // Entries keep their buffer, so after the first few frames this never allocates.
+    if(thumb->len + len > thumb->capacity) {
+        size_t grown = (thumb->len + len) * 2;
+        uint8_t *buf = (uint8_t *)heap_caps_realloc(thumb->buf, grown, MALLOC_CAP_SPIRAM);
+        if(buf == NULL) return 0;
+        thumb->buf = buf;
+        thumb->capacity = grown;
+    }
+    memcpy(thumb->buf + thumb->len, data, len);
+    thumb->len += len;
+    return len;
+}
+
+bool ThumbnailCache::begin() {
+    if(lock == NULL) lock = xSemaphoreCreateMutex();
+    if(buildLock == NULL) buildLock = xSemaphoreCreateMutex();
+    return lock != NULL && buildLock != NULL;
+}
+
+// The entry for a key, with a reference taken. Must be called with the lock held.
+Thumbnail *ThumbnailCache::find(uint32_t seq, uint8_t scale, uint8_t quality) {
+    for(int i = 0; i < THUMB_CACHE_ENTRIES; i++) {
+        Thumbnail *t = &thumbs[i];
+        if(t->seq != seq || t->scale != scale || t->quality != quality) continue;
+        t->refs++;
+        t->lastUsed = ++uses;
+        return t;
+    }
+    return NULL;
+}
+
+// The least recently used entry nobody is sending, emptied and with a reference taken so it can be
+// rebuilt outside the lock. NULL if every entry is in use. Must be called with the lock held.
+Thumbnail *ThumbnailCache::claim() {
+    Thumbnail *oldest = NULL;
+    for(int i = 0; i < THUMB_CACHE_ENTRIES; i++) {
+        Thumbnail *t = &thumbs[i];
+        if(t->refs > 0) continue;
+        if(oldest == NULL || t->lastUsed < oldest->lastUsed) oldest = t;
+    }
+    if(oldest) {
+        oldest->seq = 0;
+        oldest->refs = 1;
+    }
+    return oldest;
+}
+
+// Must be called with the build lock held.
+bool ThumbnailCache::build(Thumbnail *thumb, const FrameHandle &frame, jpg_scale_t scale, uint8_t quality) {
+    thumb_decoder_t d = { frame.buf(), pixels, pixelsCapacity, 0, 0 };
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t res = esp_jpg_decode(frame.len(), scale, thumb_read, thumb_write, &d);
+    int64_t decoded = esp_timer_get_time();
+    pixels = d.pixels;
+    pixelsCapacity = d.capacity;
+    if(res != ESP_OK || !fmt2jpg_cb(d.pixels, (size_t)d.width * d.height * 3, d.width, d.height, PIXFORMAT_RGB888, quality, thumb_encode, thumb)) {
+        return false;
+    }
+    thumb->width = d.width;
+    thumb->height = d.height;
+    thumb->decodeUs = (uint32_t)(decoded - start);
+    thumb->encodeUs = (uint32_t)(esp_timer_get_time() - decoded);
+    return true;
+}
+
+bool ThumbnailCache::acquire(const FrameHandle &frame, uint8_t scale, uint8_t quality, const Thumbnail **thumb, bool *hit) {
+    if(!frame || frame.format() != PIXFORMAT_JPEG) return false;
+    if(lock == NULL || buildLock == NULL) return false;
+
+    jpg_scale_t jpgScale;
+    switch(scale) {
+        case 2: jpgScale = JPG_SCALE_2X; break;
+        case 4: jpgScale = JPG_SCALE_4X; break;
+        case 8: jpgScale = JPG_SCALE_8X; break;
+        default: return false;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    Thumbnail *entry = find(frame.seq(), scale, quality);
+    if(entry) hits++;
+    xSemaphoreGive(lock);
+
+    // A miss waits for any build in progress, which may well be this same thumbnail.
+    Thumbnail *built = NULL;
+    if(entry == NULL) {
+        xSemaphoreTake(buildLock, portMAX_DELAY);
+        xSemaphoreTake(lock, portMAX_DELAY);
+        entry = find(frame.seq(), scale, quality);
+        if(entry) hits++;
+        else if((built = claim()) != NULL) misses++;
+        xSemaphoreGive(lock);
+
+        if(built) {
+            bool ok = build(built, frame, jpgScale, quality);
+            xSemaphoreTake(lock, portMAX_DELAY);
+            if(ok) {
+                built->seq = frame.seq();
+                built->scale = scale;
+                built->quality = quality;
+                built->lastUsed = ++uses;
+                entry = built;
+            }
+            else built->refs = 0;
+            xSemaphoreGive(lock);
+        }
+        xSemaphoreGive(buildLock);
+        if(entry == NULL) return false;
+    }
+
+    *hit = (entry != built);
+    *thumb = entry;
+    return true;
+}
+
+void ThumbnailCache::release(const Thumbnail *thumb) {
+    if(lock == NULL || thumb < thumbs || thumb >= thumbs + THUMB_CACHE_ENTRIES) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    thumbs[thumb - thumbs].refs--;
+    xSemaphoreGive(lock);
+}
+
+uint32_t ThumbnailCache::getHitCount() { return hits; }
+
+uint32_t ThumbnailCache::getMissCount() { return misses; }
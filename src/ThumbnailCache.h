@@ -0,0 +1,73 @@
+#ifndef THUMBNAIL_CACHE
+#define THUMBNAIL_CACHE
+
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "img_converters.h"
+#include "FramePool.h"
+
+const uint8_t THUMB_CACHE_ENTRIES = 6;          // Thumbnails kept, whatever their scale and quality. The least recently used goes.
+const uint8_t THUMB_DEFAULT_QUALITY = 40;
+
+struct _thumbnail {
+    uint32_t seq;                   // Frame the thumbnail was made from. 0 when empty or being built.
+    uint8_t scale;                  // 2, 4 or 8.
+    uint8_t quality;                // Encoder quality it was made with.
+    uint16_t refs;                  // Requests still sending it. Only rebuilt once this is 0.
+    uint32_t lastUsed;              // Use counter when it was last handed out.
+    uint16_t width;
+    uint16_t height;
+    uint8_t *buf;                   // Encoded JPEG, in PSRAM.
+    size_t len;                     // Bytes of buf in use.
+    size_t capacity;                // Bytes allocated for buf.
+    uint32_t decodeUs;              // Time the scaled decode took.
+    uint32_t encodeUs;              // Time the re-encode took.
+};
+typedef struct _thumbnail Thumbnail;
+
+// Scaled-down copies of the latest frame, keyed by scale and quality. The decoder works at the
+// reduced size (reduced IDCT at 1/2 and 1/4, DC only at 1/8) and the result is re-encoded at low
+// quality, so every viewer of the same frame after the first gets it from memory.
+//
+// Entries are reference counted, so the lock is only held to look one up and a slow client never
+// holds up the others. Builds take turns, sharing one decode buffer.
+class ThumbnailCache {
+    private:
+        Thumbnail thumbs[THUMB_CACHE_ENTRIES];
+        SemaphoreHandle_t lock = NULL;      // Guards the entry keys and counts.
+        SemaphoreHandle_t buildLock = NULL; // Held through a build, for the decode buffer.
+        uint8_t *pixels = NULL;             // Decoded thumbnail, kept for the next build.
+        size_t pixelsCapacity = 0;
+        uint32_t uses = 0;
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+
+        Thumbnail *find(uint32_t seq, uint8_t scale, uint8_t quality);
+        Thumbnail *claim();
+        bool build(Thumbnail *thumb, const FrameHandle &frame, jpg_scale_t scale, uint8_t quality);
+
+    public:
+        ThumbnailCache() {
+            for(int i = 0; i < THUMB_CACHE_ENTRIES; i++) {
+                thumbs[i].seq = 0;
+                thumbs[i].refs = 0;
+                thumbs[i].lastUsed = 0;
+                thumbs[i].buf = NULL;
+                thumbs[i].len = 0;
+                thumbs[i].capacity = 0;
+            }
+        }
+
+        bool begin();
+
+        // Scale is 2, 4 or 8. Sets thumb to the cached entry, which stays valid until it is passed to release().
+        bool acquire(const FrameHandle &frame, uint8_t scale, uint8_t quality, const Thumbnail **thumb, bool *hit);
+        void release(const Thumbnail *thumb);
+
+        uint32_t getHitCount();
+        uint32_t getMissCount();
+};
+
+extern ThumbnailCache thumbnail_cache;
+
+#endif /* ThumbnailCache.h */
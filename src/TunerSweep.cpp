@@ -0,0 +1,215 @@
+#include "TunerSweep.h"
+#include <string.h>
+
+static const uint8_t SWEEP_FB_COUNTS[] = { 1, 2, 3, 4 };
+static const uint8_t SWEEP_XCLK_MHZ[] = { 10, 16, 20, 24 };
+
+size_t tuner_buffer_candidates(const TunerConfig &start, TunerConfig *out, size_t max) {
+    size_t n = 0;
+    for(uint8_t fb : SWEEP_FB_COUNTS) {
+        for(int latest = 0; latest < 2; latest++) {
+            // With a single buffer there is nothing newer to skip to, so both grab modes behave the same.
+            if(fb == 1 && latest) continue;
+            if(n == max) return n;
+            out[n] = start;
+            out[n].fbCount = fb;
+            out[n].grabLatest = latest;
+            n++;
+        }
+    }
+    return n;
+}
+
+size_t tuner_clock_candidates(const TunerConfig &start, TunerConfig *out, size_t max) {
+    size_t n = 0;
+    for(int psram = 1; psram >= 0; psram--) {
+        for(uint8_t xclk : SWEEP_XCLK_MHZ) {
+            // Already measured in the first pass.
+            if((bool)psram == start.fbInPsram && xclk == start.xclkMhz) continue;
+            if(n == max) return n;
+            out[n] = start;
+            out[n].fbInPsram = psram;
+            out[n].xclkMhz = xclk;
+            n++;
+        }
+    }
+    return n;
+}
+
+size_t tuner_sweep_runs(uint8_t sizeCount) {
+    TunerConfig start = { 1, false, true, SWEEP_XCLK_MHZ[0] };
+    TunerConfig candidates[TUNER_MAX_CANDIDATES];
+    size_t perSize = tuner_buffer_candidates(start, candidates, TUNER_MAX_CANDIDATES);
+    perSize += tuner_clock_candidates(start, candidates, TUNER_MAX_CANDIDATES - perSize);
+    return perSize * sizeCount;
+}
+
+static size_t run_candidates(const TunerConfig *candidates, size_t count, uint8_t frameSize, tuner_measure_t measure, void *ctx,
+    TunerResult *results, size_t max) {
+    size_t n = 0;
+    for(size_t c = 0; c < count && n < max; c++) {
+        TunerResult *result = &results[n++];
+        memset(result, 0, sizeof(*result));
+        result->config = candidates[c];
+        result->frameSize = frameSize;
+        // A configuration that fails to start is kept as a result so the sweep shows it was tried.
+        result->valid = measure(ctx, candidates[c], frameSize, result) && result->frames > 0;
+    }
+    return n;
+}
+
+size_t tuner_sweep(const uint8_t *frameSizes, uint8_t sizeCount, const TunerConfig &start, tuner_measure_t measure, void *ctx,
+    TunerResult *results, size_t max) {
+    TunerConfig candidates[TUNER_MAX_CANDIDATES];
+
+    size_t n = 0;
+    for(uint8_t s = 0; s < sizeCount && s < TUNER_MAX_SWEEP_SIZES; s++) {
+        size_t first = n;
+        size_t count = tuner_buffer_candidates(start, candidates, TUNER_MAX_CANDIDATES);
+        n += run_candidates(candidates, count, frameSizes[s], measure, ctx, results + n, max - n);
+
+        // Nothing started with the starting location and clock, so there is nothing to build on.
+        const TunerResult *best = tuner_best(results + first, n - first, frameSizes[s]);
+        if(best == NULL) continue;
+        count = tuner_clock_candidates(best->config, candidates, TUNER_MAX_CANDIDATES);
+        n += run_candidates(candidates, count, frameSizes[s], measure, ctx, results + n, max - n);
+    }
+    return n;
+}
+
+static bool better(const TunerResult *a, const TunerResult *b) {
+    // Frame rates within the margin count as equal, so a slightly faster but laggier setup does not win.
+    uint32_t margin = (uint32_t)b->fpsX10 * TUNER_FPS_MARGIN / 100;
+    if(a->fpsX10 > b->fpsX10 + margin) return true;
+    if(a->fpsX10 + margin < b->fpsX10) return false;
+    if(a->latencyP50Ms != b->latencyP50Ms) return a->latencyP50Ms < b->latencyP50Ms;
+    if(a->latencyP95Ms != b->latencyP95Ms) return a->latencyP95Ms < b->latencyP95Ms;
+    return a->heapFree > b->heapFree;
+}
+
+const TunerResult *tuner_best(const TunerResult *results, size_t count, uint8_t frameSize) {
+    const TunerResult *best = NULL;
+    for(size_t i = 0; i < count; i++) {
+        const TunerResult *r = &results[i];
+        if(!r->valid || r->frameSize != frameSize || r->heapFree < TUNER_MIN_FREE_HEAP) continue;
+        if(best == NULL || better(r, best)) best = r;
+    }
+    return best;
+}
+
+uint16_t tuner_percentile(uint16_t *samples, uint16_t count, uint8_t pct) {
+    if(count == 0) return 0;
+
+    // Insertion sort. A run keeps at most TUNER_MAX_SAMPLES, so this is cheap enough.
+    for(uint16_t i = 1; i < count; i++) {
+        uint16_t v = samples[i];
+        uint16_t j = i;
+        while(j > 0 && samples[j - 1] > v) {
+            samples[j] = samples[j - 1];
+            j--;
+        }
+        samples[j] = v;
+    }
+    return samples[(uint32_t)(count - 1) * pct / 100];
+}
+
+bool TunerStore::set(const TunerResult &result) {
+    for(uint8_t i = 0; i < count; i++) {
+        if(entries[i].frameSize == result.frameSize) {
+            entries[i] = result;
+            return true;
+        }
+    }
+    if(count == TUNER_MAX_FRAME_SIZES) return false;
+    entries[count++] = result;
+    return true;
+}
+
+const TunerResult *TunerStore::find(uint8_t frameSize) const {
+    for(uint8_t i = 0; i < count; i++) {
+        if(entries[i].frameSize == frameSize) return &entries[i];
+    }
+    return NULL;
+}
+
+void TunerStore::clear() { count = 0; }
+
+static uint16_t fletcher16(const uint8_t *p, size_t len) {
+    uint16_t a = 0, b = 0;
+    while(len--) {
+        a = (a + *p++) % 255;
+        b = (b + a) % 255;
+    }
+    return (b << 8) | a;
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+    *p++ = v;
+    *p++ = v >> 8;
+    return p;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+    p = put16(p, v);
+    return put16(p, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+
+static uint32_t get32(const uint8_t *p) { return get16(p) | ((uint32_t)get16(p + 2) << 16); }
+
+size_t TunerStore::packedSize() const { return 2 + count * TUNER_STORE_ENTRY_BYTES + 2; }
+
+size_t TunerStore::pack(uint8_t *buf, size_t len) const {
+    if(len < packedSize()) return 0;
+
+    // Fields are written one by one so the blob does not depend on struct layout.
+    uint8_t *p = buf;
+    *p++ = TUNER_STORE_VERSION;
+    *p++ = count;
+    for(uint8_t i = 0; i < count; i++) {
+        const TunerResult *e = &entries[i];
+        *p++ = e->frameSize;
+        *p++ = e->config.fbCount;
+        *p++ = (e->config.grabLatest ? 1 : 0) | (e->config.fbInPsram ? 2 : 0);
+        *p++ = e->config.xclkMhz;
+        p = put16(p, e->frames);
+        p = put16(p, e->fpsX10);
+        p = put16(p, e->latencyP50Ms);
+        p = put16(p, e->latencyP95Ms);
+        p = put32(p, e->heapFree);
+        p = put32(p, e->psramFree);
+    }
+    p = put16(p, fletcher16(buf, p - buf));
+    return p - buf;
+}
+
+bool TunerStore::unpack(const uint8_t *buf, size_t len) {
+    // Anything from another version, cut short or damaged is ignored and the defaults stay.
+    if(len < 4 || buf[0] != TUNER_STORE_VERSION || buf[1] > TUNER_MAX_FRAME_SIZES) return false;
+    size_t body = 2 + buf[1] * TUNER_STORE_ENTRY_BYTES;
+    if(len < body + 2 || get16(buf + body) != fletcher16(buf, body)) return false;
+
+    const uint8_t *p = buf + 2;
+    for(uint8_t i = 0; i < buf[1]; i++, p += TUNER_STORE_ENTRY_BYTES) {
+        TunerResult *e = &entries[i];
+        e->frameSize = p[0];
+        e->config.fbCount = p[1];
+        e->config.grabLatest = p[2] & 1;
+        e->config.fbInPsram = p[2] & 2;
+        e->config.xclkMhz = p[3];
+        e->frames = get16(p + 4);
+        e->fpsX10 = get16(p + 6);
+        e->latencyP50Ms = get16(p + 8);
+        e->latencyP95Ms = get16(p + 10);
+        e->heapFree = get32(p + 12);
+        e->psramFree = get32(p + 16);
+        e->valid = true;
+    }
+    count = buf[1];
+    return true;
+}
+
+uint8_t TunerStore::getCount() const { return count; }
+
+const TunerResult *TunerStore::at(uint8_t i) const { return (i < count) ? &entries[i] : NULL; }
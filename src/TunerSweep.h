@@ -0,0 +1,83 @@
+#ifndef TUNER_SWEEP
+#define TUNER_SWEEP
+
+// Frame buffer configuration sweep and the store for its results. Plain C++ with no Arduino or
+// ESP-IDF headers, so the same sweep and selection run on a host against a simulated sensor.
+#include <stdint.h>
+#include <stddef.h>
+
+const uint8_t TUNER_MAX_FRAME_SIZES = 6;        // Frame sizes the store keeps a best configuration for.
+const uint8_t TUNER_MAX_SWEEP_SIZES = 2;        // Frame sizes one sweep covers. Each takes about 40 s with no camera or WiFi.
+const uint8_t TUNER_MAX_CANDIDATES = 16;        // Configurations tried per frame size, over both passes.
+const size_t TUNER_MAX_RESULTS = TUNER_MAX_SWEEP_SIZES * TUNER_MAX_CANDIDATES;
+const uint8_t TUNER_WARMUP_FRAMES = 4;          // Frames thrown away while exposure settles and the buffers fill.
+const int64_t TUNER_MEASURE_US = 2000000;       // Timed part of each run.
+const uint16_t TUNER_MAX_SAMPLES = 128;         // Capture latencies kept per run for percentiles.
+const uint32_t TUNER_MIN_FREE_HEAP = 98304;     // Internal heap a configuration must leave. WiFi and httpd are not up yet during a sweep.
+const uint8_t TUNER_FPS_MARGIN = 5;             // Percent of the best fps within which latency decides.
+const uint8_t TUNER_STORE_VERSION = 1;
+const size_t TUNER_STORE_ENTRY_BYTES = 20;
+const size_t TUNER_STORE_BYTES = 4 + TUNER_MAX_FRAME_SIZES * TUNER_STORE_ENTRY_BYTES;     // Largest packed store.
+
+struct _tuner_config {
+    uint8_t fbCount;                // Driver frame buffers.
+    bool grabLatest;                // CAMERA_GRAB_LATEST, otherwise CAMERA_GRAB_WHEN_EMPTY.
+    bool fbInPsram;                 // CAMERA_FB_IN_PSRAM, otherwise CAMERA_FB_IN_DRAM.
+    uint8_t xclkMhz;                // Sensor clock.
+};
+typedef struct _tuner_config TunerConfig;
+
+struct _tuner_result {
+    TunerConfig config;
+    uint8_t frameSize;              // framesize_t the run used.
+    bool valid;                     // The driver started and delivered frames.
+    uint16_t frames;                // Frames delivered during the run.
+    uint16_t fpsX10;                // Achieved frame rate, in tenths.
+    uint16_t latencyP50Ms;          // Age of frames when the driver handed them over.
+    uint16_t latencyP95Ms;
+    uint32_t heapFree;              // Internal heap left with the driver running.
+    uint32_t psramFree;             // PSRAM left with the driver running.
+};
+typedef struct _tuner_result TunerResult;
+
+// Runs one configuration at one frame size and fills in the result. Returns false if it could not run.
+typedef bool (*tuner_measure_t)(void *ctx, const TunerConfig &config, uint8_t frameSize, TunerResult *result);
+
+// First pass: every buffer count and grab mode, at the starting buffer location and clock.
+size_t tuner_buffer_candidates(const TunerConfig &start, TunerConfig *out, size_t max);
+// Second pass: every buffer location and clock, with the buffer count and grab mode of start. Leaves out start itself.
+size_t tuner_clock_candidates(const TunerConfig &start, TunerConfig *out, size_t max);
+// Runs a sweep of this many frame sizes makes at most.
+size_t tuner_sweep_runs(uint8_t sizeCount);
+// Measure each frame size in both passes, the second around the best of the first. Trying the four
+// settings one pass at a time instead of every combination keeps a frame size to 14 runs.
+// Returns the number of results written.
+size_t tuner_sweep(const uint8_t *frameSizes, uint8_t sizeCount, const TunerConfig &start, tuner_measure_t measure, void *ctx,
+    TunerResult *results, size_t max);
+// Best result for a frame size: the most fps that leaves enough heap, with latency then heap breaking near-ties.
+const TunerResult *tuner_best(const TunerResult *results, size_t count, uint8_t frameSize);
+// Percentile of up to TUNER_MAX_SAMPLES values. Reorders samples.
+uint16_t tuner_percentile(uint16_t *samples, uint16_t count, uint8_t pct);
+
+// Best configuration per frame size, kept across boots as one checksummed blob.
+class TunerStore {
+    private:
+        TunerResult entries[TUNER_MAX_FRAME_SIZES];
+        uint8_t count = 0;
+
+    public:
+        // Replace the entry for the result's frame size. False if the store is full.
+        bool set(const TunerResult &result);
+        const TunerResult *find(uint8_t frameSize) const;
+        void clear();
+
+        // Serialised form: version, count, entries, then a checksum over all of it.
+        size_t packedSize() const;
+        size_t pack(uint8_t *buf, size_t len) const;
+        bool unpack(const uint8_t *buf, size_t len);
+
+        uint8_t getCount() const;
+        const TunerResult *at(uint8_t i) const;
+};
+
+#endif /* TunerSweep.h */
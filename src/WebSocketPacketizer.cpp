@@ -0,0 +1,47 @@
+#include "WebSocketPacketizer.h"
+
+esp_err_t WebSocketPacketizer::sendFrame(int fd, const uint8_t *buf, size_t len, uint32_t seq, const struct timeval &timestamp) {
+    uint64_t payload = sizeof(WsFrameHeader) + len;
+
+    // FIN and binary opcode, then the shortest length encoding that fits. Server frames are never masked.
+    uint8_t *p = header;
+    *p++ = 0x82;
+    if(payload < 126) {
+        *p++ = payload;
+    }
+    else if(payload <= 0xFFFF) {
+        *p++ = 126;
+        *p++ = payload >> 8;
+        *p++ = payload;
+    }
+    else {
+        *p++ = 127;
+        for(int shift = 56; shift >= 0; shift -= 8) *p++ = payload >> shift;
+    }
+
+    WsFrameHeader frame = { seq, (uint32_t)timestamp.tv_sec, (uint32_t)timestamp.tv_usec, (uint32_t)len };
+    memcpy(p, &frame, sizeof(frame));
+    p += sizeof(frame);
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = p - header;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+
+    return MjpegPacketizer::writeAll(fd, iov, 2, writes);
+}
+
+esp_err_t WebSocketPacketizer::sendControl(int fd, const WsControl &control) {
+    uint8_t head[2] = { (uint8_t)(0x80 | control.opcode), control.len };
+
+    struct iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+    iov[1].iov_base = (void *)control.payload;
+    iov[1].iov_len = control.len;
+
+    return MjpegPacketizer::writeAll(fd, iov, 2, writes);
+}
+
+uint32_t WebSocketPacketizer::getWriteCount() { return writes; }
@@ -0,0 +1,44 @@
+#ifndef WEBSOCKET_PACKETIZER
+#define WEBSOCKET_PACKETIZER
+
+#include <Arduino.h>
+#include "MjpegPacketizer.h"
+
+// Flow control. A client starts with WS_INITIAL_CREDITS frames and sends more as it consumes them,
+// either as a text message holding a decimal count or a 4 byte little-endian binary message.
+const uint8_t WS_INITIAL_CREDITS = 2;
+const uint8_t WS_MAX_CREDITS = 32;
+const size_t WS_MAX_CLIENT_MESSAGE = 16;
+const size_t WS_MAX_CONTROL_PAYLOAD = 125;      // Longest payload a control frame may carry.
+
+// Precedes the JPEG in every binary message. Little-endian.
+struct __attribute__((packed)) _ws_frame_header {
+    uint32_t seq;                   // Frame sequence number.
+    uint32_t seconds;               // Capture timestamp.
+    uint32_t micros;
+    uint32_t size;                  // JPEG bytes that follow. 0 means the scene is unchanged since the last JPEG.
+};
+typedef struct _ws_frame_header WsFrameHeader;
+
+// A control frame owed to the client, such as the PONG for its PING.
+struct _ws_control {
+    uint8_t opcode;                 // WebSocket opcode. 0 when nothing is owed.
+    uint8_t len;
+    uint8_t payload[WS_MAX_CONTROL_PAYLOAD];
+};
+typedef struct _ws_control WsControl;
+
+// Writes each frame as one unmasked binary WebSocket message, framing and payload in one vectored write.
+class WebSocketPacketizer {
+    private:
+        uint8_t header[10 + sizeof(WsFrameHeader)];    // Largest WebSocket header plus the frame header.
+        uint32_t writes = 0;                            // Socket writes issued.
+
+    public:
+        esp_err_t sendFrame(int fd, const uint8_t *buf, size_t len, uint32_t seq, const struct timeval &timestamp);
+        esp_err_t sendControl(int fd, const WsControl &control);
+
+        uint32_t getWriteCount();
+};
+
+#endif /* WebSocketPacketizer.h */
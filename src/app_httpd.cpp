@@ -19,7 +19,28 @@
 #include "esp32-hal-ledc.h"
 #include "sdkconfig.h"
 #include "camera_index.h"
+#include "web_assets.h"
+#include "FrameBroadcaster.h"
+#include "StreamSender.h"
+#include "MjpegPacketizer.h"
+#include "WebSocketPacketizer.h"
+#include "AdaptiveQuality.h"
+#include "JsonWriter.h"
+#include "BmpStream.h"
+#include "ConversionPool.h"
+#include "Metrics.h"
+#include "JpegCrop.h"
+#include "ThumbnailCache.h"
+#include "MotionDetector.h"
+#include "ClipRing.h"
+#include "AviPacketizer.h"
+#include "CameraTuner.h"
+#include "RateLimiter.h"
+#include "esp_heap_caps.h"
+#include "lwip/sockets.h"
+#include <new>
 #include <Arduino.h>
+#include <unistd.h>
 
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
 #include "esp32-hal-log.h"
@@ -44,11 +65,6 @@ typedef struct {
   size_t len;
 } jpg_chunking_t;
 
-#define PART_BOUNDARY "123456789000000000000987654321"
-static const char *_STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
-static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\n\r\n";
-
 httpd_handle_t stream_httpd = NULL;
 httpd_handle_t camera_httpd = NULL;
 
@@ -105,14 +121,54 @@ void enable_led(bool en) {  // Turn LED On or Off
 }
 #endif
 
+static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_t len) {
+  jpg_chunking_t *j = (jpg_chunking_t *)arg;
+  if (!index) {
+    j->len = 0;
+  }
+  if (httpd_resp_send_chunk(j->req, (const char *)data, len) != ESP_OK) {
+    return 0;
+  }
+  j->len += len;
+  return len;
+}
+
+// The latest frame while the capture task keeps it current, otherwise a new one from the capture task.
+static FrameHandle snapshot_frame() {
+  FrameHandle frame = frame_broadcaster.getLatest();
+  if (frame_broadcaster.isFresh(frame)) {
+    return frame;
+  }
+  return frame_broadcaster.requestFrame(FRAME_WAIT_TIMEOUT);
+}
+
+// Image requests count against the client's budget. A client over it is told when to come back.
+static bool reject_over_limit(httpd_req_t *req, uint32_t peer) {
+  uint32_t retry_ms = 0;
+  if (rate_limiter.admit(peer, &retry_ms)) {
+    return false;
+  }
+  char retry[12];
+  snprintf(retry, sizeof(retry), "%lu", (unsigned long)((retry_ms + 999) / 1000));
+  httpd_resp_set_status(req, "429 Too Many Requests");
+  httpd_resp_set_hdr(req, "Retry-After", retry);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_send(req, NULL, 0);
+  return true;
+}
+
 static esp_err_t bmp_handler(httpd_req_t *req) {
-  camera_fb_t *fb = NULL;
   esp_err_t res = ESP_OK;
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   uint64_t fr_start = esp_timer_get_time();
 #endif
-  fb = esp_camera_fb_get();
-  if (!fb) {
+  uint32_t peer = rate_peer_address(httpd_req_to_sockfd(req));
+  if (reject_over_limit(req, peer)) {
+    return ESP_OK;
+  }
+  // Encode from a pooled frame so the driver buffer is not held for the whole transfer.
+  FrameHandle frame = snapshot_frame();
+  if (!frame) {
     log_e("Camera capture failed");
     httpd_resp_send_500(req);
     return ESP_FAIL;
@@ -122,136 +178,357 @@ static esp_err_t bmp_handler(httpd_req_t *req) {
   httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.bmp");
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
 
+  const struct timeval &timestamp = frame.timestamp();
   char ts[32];
-  snprintf(ts, 32, "%lld.%06ld", fb->timestamp.tv_sec, fb->timestamp.tv_usec);
+  snprintf(ts, 32, "%lld.%06ld", (long long)timestamp.tv_sec, (long)timestamp.tv_usec);
   httpd_resp_set_hdr(req, "X-Timestamp", (const char *)ts);
 
-  uint8_t *buf = NULL;
-  size_t buf_len = 0;
-  bool converted = frame2bmp(fb, &buf, &buf_len);
-  esp_camera_fb_return(fb);
+  // Rows are converted and sent a chunk at a time instead of building the whole bitmap first.
+  jpg_chunking_t jchunk = {req, 0};
+  bool converted = fmt2bmp_cb(frame.buf(), frame.len(), frame.width(), frame.height(), frame.format(), jpg_encode_stream, &jchunk);
+  frame.reset();
   if (!converted) {
     log_e("BMP Conversion failed");
-    httpd_resp_send_500(req);
+    // Once part of the body is out the only option left is to drop the connection.
+    if (!jchunk.len) {
+      httpd_resp_send_500(req);
+    }
     return ESP_FAIL;
   }
-  res = httpd_resp_send(req, (const char *)buf, buf_len);
-  free(buf);
+  res = httpd_resp_send_chunk(req, NULL, 0);
+  rate_limiter.charge(peer, jchunk.len);
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   uint64_t fr_end = esp_timer_get_time();
 #endif
-  log_i("BMP: %llums, %uB", (uint64_t)((fr_end - fr_start) / 1000), buf_len);
+  log_i("BMP: %lums, %luB", (unsigned long)((fr_end - fr_start) / 1000), (unsigned long)jchunk.len);
   return res;
 }
 
-static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_t len) {
-  jpg_chunking_t *j = (jpg_chunking_t *)arg;
-  if (!index) {
-    j->len = 0;
+// JPEG frames go out straight from the pool. Raw frames are encoded into the slot's reusable buffer.
+static bool stream_jpeg(StreamSender *sender, FrameHandle &fb, const uint8_t **buf, size_t *len) {
+  if (fb.format() == PIXFORMAT_JPEG) {
+    *buf = fb.buf();
+    *len = fb.len();
+    return true;
   }
-  if (httpd_resp_send_chunk(j->req, (const char *)data, len) != ESP_OK) {
-    return 0;
+  bool converted = conversion_pool.encode(sender->id, fb, buf, len);
+  fb.reset();
+  if (!converted) {
+    log_e("JPEG compression failed");
   }
-  j->len += len;
-  return len;
+  return converted;
 }
 
-static esp_err_t stream_handler(httpd_req_t *req) {
-  camera_fb_t *fb = NULL;
+// Hold a stream back while its client pays off the frame just sent. Frames published meanwhile are
+// skipped, so the client comes back to the newest one at a lower rate instead of to a backlog.
+static void throttle_stream(StreamSender *sender, size_t len) {
+  uint32_t wait = rate_limiter.charge(sender->peer, len);
+  while (wait && sender->fd >= 0) {
+    wait = min(wait, RATE_MAX_WAIT_MS);
+    rate_limiter.throttled(sender->peer, wait);
+    vTaskDelay(pdMS_TO_TICKS(wait));
+    wait = rate_limiter.charge(sender->peer, 0);
+  }
+}
+
+static esp_err_t stream_frames(StreamSender *sender) {
+  MjpegPacketizer packetizer;
+  FrameHandle fb;
   struct timeval _timestamp;
   esp_err_t res = ESP_OK;
   size_t _jpg_buf_len = 0;
-  uint8_t *_jpg_buf = NULL;
-  char *part_buf[128];
+  const uint8_t *_jpg_buf = NULL;
 
-  static int64_t last_frame = 0;
-  if (!last_frame) {
-    last_frame = esp_timer_get_time();
-  }
+  int64_t last_frame = esp_timer_get_time();
 
-  res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
+  // Frames bypass chunked encoding, so the response head goes out raw.
+  res = (stream_senders.beginWrite(sender) >= 0) ? MjpegPacketizer::beginResponse(sender->req) : ESP_FAIL;
+  stream_senders.endWrite(sender);
   if (res != ESP_OK) {
     return res;
   }
 
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  httpd_resp_set_hdr(req, "X-Framerate", "60");
-
-#if CONFIG_LED_ILLUMINATOR_ENABLED
-  isStreaming = true;
-  enable_led(true);
-#endif
-
   int count = 0;
-  int64_t my_start, my_end;
+  int64_t my_start;
   while (true) {
-    fb = esp_camera_fb_get();
+    // Share the capture task's frames instead of pulling our own from the driver.
+    fb = frame_broadcaster.acquire(sender->id, FRAME_WAIT_TIMEOUT);
     my_start = esp_timer_get_time();
+    uint32_t seq = 0;
     if (!fb) {
       log_e("Camera capture failed");
       res = ESP_FAIL;
+    } else if (stream_senders.isUnchanged(sender, fb)) {
+      // MJPEG has no way to say "same as before", so a static scene just goes quiet until the keep-alive.
+      stream_senders.recordUnchanged(sender, fb);
+      fb.reset();
+      continue;
     } else {
-      _timestamp.tv_sec = fb->timestamp.tv_sec;
-      _timestamp.tv_usec = fb->timestamp.tv_usec;
-      if (fb->format != PIXFORMAT_JPEG) {
-        bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-        esp_camera_fb_return(fb);
-        fb = NULL;
-        if (!jpeg_converted) {
-          log_e("JPEG compression failed");
-          res = ESP_FAIL;
-        }
-      } else {
-        _jpg_buf_len = fb->len;
-        _jpg_buf = fb->buf;
+      seq = fb.seq();
+      _timestamp.tv_sec = fb.timestamp().tv_sec;
+      _timestamp.tv_usec = fb.timestamp().tv_usec;
+      if (!stream_jpeg(sender, fb, &_jpg_buf, &_jpg_buf_len)) {
+        res = ESP_FAIL;
       }
     }
     if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
-    }
-    if (res == ESP_OK) {
-      size_t hlen = snprintf((char *)part_buf, 128, _STREAM_PART, _jpg_buf_len, _timestamp.tv_sec, _timestamp.tv_usec);
-      res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
+      int fd = stream_senders.beginWrite(sender);
+      res = (fd >= 0) ? packetizer.sendFrame(fd, _jpg_buf, _jpg_buf_len, _timestamp) : ESP_FAIL;
+      stream_senders.endWrite(sender);
     }
     if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
-    }
-    if (fb) {
-      esp_camera_fb_return(fb);
-
-      my_end = esp_timer_get_time();
-
-
-      fb = NULL;
-      _jpg_buf = NULL;
-    } else if (_jpg_buf) {
-      free(_jpg_buf);
-      _jpg_buf = NULL;
+      stream_senders.recordFrame(sender, seq, _jpg_buf_len, my_start, _timestamp, packetizer.getWriteCount());
+      adaptive_quality.observe(sender->id, sender->sendMs, sender->lag, !rate_limiter.isLimited(sender->peer));
     }
+    fb.reset();
+    _jpg_buf = NULL;
     if (res != ESP_OK) {
       log_e("Send frame failed");
       break;
     }
+    throttle_stream(sender, _jpg_buf_len);
     int64_t fr_end = esp_timer_get_time();
     count++;
 
     int64_t frame_time = fr_end - last_frame;
+    last_frame = fr_end;
     frame_time /= 1000;
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
     uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
 #endif
     log_i(
-      "MJPG: %uB %ums (%.1ffps), AVG: %ums (%.1ffps)", (uint32_t)(_jpg_buf_len), (uint32_t)frame_time, 1000.0 / (uint32_t)frame_time, avg_frame_time,
+      "MJPG: %luB %lums (%.1ffps), AVG: %lums (%.1ffps)", (unsigned long)(_jpg_buf_len), (unsigned long)frame_time, 1000.0 / (uint32_t)frame_time, (unsigned long)avg_frame_time,
       1000.0 / avg_frame_time
     );
   }
 
+  return res;
+}
+
+static esp_err_t stream_ws_frames(StreamSender *sender) {
+  WebSocketPacketizer packetizer;
+  FrameHandle fb;
+  struct timeval _timestamp;
+  esp_err_t res = ESP_OK;
+  size_t _jpg_buf_len = 0;
+  const uint8_t *_jpg_buf = NULL;
+
+  while (res == ESP_OK) {
+    // One frame per credit, so a slow viewer sets its own rate instead of building a backlog.
+    if (!stream_senders.takeCredit(sender, FRAME_WAIT_TIMEOUT)) {
+      if (sender->fd < 0) {
+        break;
+      }
+      continue;
+    }
+    if (sender->fd < 0) {
+      break;
+    }
+
+    // Answer the client's PINGs and CLOSE here, between frames.
+    WsControl reply;
+    bool wake = false;
+    if (stream_senders.takeReply(sender, &reply, &wake)) {
+      int fd = stream_senders.beginWrite(sender);
+      res = (fd >= 0) ? packetizer.sendControl(fd, reply) : ESP_FAIL;
+      stream_senders.endWrite(sender);
+      if (reply.opcode == HTTPD_WS_TYPE_CLOSE) {
+        break;
+      }
+    }
+    if (wake || res != ESP_OK) {
+      continue;
+    }
+
+    fb = frame_broadcaster.acquire(sender->id, FRAME_WAIT_TIMEOUT);
+    int64_t my_start = esp_timer_get_time();
+    if (!fb) {
+      log_e("Camera capture failed");
+      res = ESP_FAIL;
+      break;
+    }
+    uint32_t seq = fb.seq();
+    _timestamp.tv_sec = fb.timestamp().tv_sec;
+    _timestamp.tv_usec = fb.timestamp().tv_usec;
+    if (stream_senders.isUnchanged(sender, fb)) {
+      // A header with no JPEG tells the client to keep showing what it has. It still uses up the credit.
+      int fd = stream_senders.beginWrite(sender);
+      res = (fd >= 0) ? packetizer.sendFrame(fd, NULL, 0, seq, _timestamp) : ESP_FAIL;
+      stream_senders.endWrite(sender);
+      if (res == ESP_OK) {
+        stream_senders.recordUnchanged(sender, fb);
+      }
+      fb.reset();
+      continue;
+    }
+    if (!stream_jpeg(sender, fb, &_jpg_buf, &_jpg_buf_len)) {
+      res = ESP_FAIL;
+      break;
+    }
+
+    int fd = stream_senders.beginWrite(sender);
+    res = (fd >= 0) ? packetizer.sendFrame(fd, _jpg_buf, _jpg_buf_len, seq, _timestamp) : ESP_FAIL;
+    stream_senders.endWrite(sender);
+    if (res == ESP_OK) {
+      stream_senders.recordFrame(sender, seq, _jpg_buf_len, my_start, _timestamp, packetizer.getWriteCount());
+      adaptive_quality.observe(sender->id, sender->sendMs, sender->lag, !rate_limiter.isLimited(sender->peer));
+    }
+    fb.reset();
+    _jpg_buf = NULL;
+    if (res == ESP_OK) {
+      throttle_stream(sender, _jpg_buf_len);
+    }
+  }
+
+  return res;
+}
+
+static void stream_sender_task(void *pvParams) {
+  StreamSender *sender = (StreamSender *)pvParams;
+
+  if (sender->webSocket) {
+    stream_ws_frames(sender);
+  } else {
+    stream_frames(sender);
+  }
+  adaptive_quality.forget(sender->id);
+  stream_senders.close(sender);
+
 #if CONFIG_LED_ILLUMINATOR_ENABLED
-  isStreaming = false;
-  enable_led(false);
+  isStreaming = (stream_senders.getActiveCount() > 0);
+  enable_led(isStreaming);
 #endif
 
-  return res;
+  vTaskDelete(NULL);
+}
+
+// Streams hold back unchanged frames unless the client asks for every frame with ?dedup=0.
+static bool stream_dedup(httpd_req_t *req) {
+  char query[32];
+  char value[4];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+    return true;
+  }
+  if (httpd_query_key_value(query, "dedup", value, sizeof(value)) != ESP_OK) {
+    return true;
+  }
+  return atoi(value) != 0;
+}
+
+static esp_err_t stream_handler(httpd_req_t *req) {
+  // Opening a stream is a request like any other. Its frames are charged as they go out.
+  if (reject_over_limit(req, rate_peer_address(httpd_req_to_sockfd(req)))) {
+    return ESP_OK;
+  }
+
+  // Hand the connection to its own sender task so this worker stays free for /capture and /status.
+  StreamSender *sender = stream_senders.open(req, stream_sender_task, stream_dedup(req));
+  if (!sender) {
+    log_e("Too many stream clients");
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+#if CONFIG_LED_ILLUMINATOR_ENABLED
+  isStreaming = true;
+  enable_led(true);
+#endif
+
+  return ESP_OK;
+}
+
+static esp_err_t ws_handler(httpd_req_t *req) {
+  // Handshake done. Start pushing frames.
+  if (req->method == HTTP_GET) {
+    // The handshake has already been answered, so a client over budget can only be dropped.
+    uint32_t retry_ms;
+    if (!rate_limiter.admit(rate_peer_address(httpd_req_to_sockfd(req)), &retry_ms)) {
+      log_e("Stream client over its request budget");
+      return ESP_FAIL;
+    }
+    StreamSender *sender = stream_senders.openWebSocket(req, stream_sender_task, stream_dedup(req));
+    if (!sender) {
+      log_e("Too many stream clients");
+      return ESP_FAIL;
+    }
+#if CONFIG_LED_ILLUMINATOR_ENABLED
+    isStreaming = true;
+    enable_led(true);
+#endif
+    return ESP_OK;
+  }
+
+  uint8_t buf[WS_MAX_CONTROL_PAYLOAD + 1];
+  httpd_ws_frame_t frame;
+  memset(&frame, 0, sizeof(frame));
+  esp_err_t res = httpd_ws_recv_frame(req, &frame, 0);
+  bool control = frame.type & 0x08;
+  if (res != ESP_OK || frame.len > (control ? WS_MAX_CONTROL_PAYLOAD : WS_MAX_CLIENT_MESSAGE)) {
+    return ESP_FAIL;
+  }
+  frame.payload = buf;
+  res = httpd_ws_recv_frame(req, &frame, WS_MAX_CONTROL_PAYLOAD);
+  if (res != ESP_OK) {
+    return res;
+  }
+
+  // Control frames come here rather than being answered by httpd, whose reply could land in the
+  // middle of a frame the sender task is writing. The sender answers them between frames.
+  StreamSender *sender = stream_senders.findBySocket(httpd_req_to_sockfd(req));
+  if (frame.type == HTTPD_WS_TYPE_PING || frame.type == HTTPD_WS_TYPE_CLOSE) {
+    if (!sender) {
+      return ESP_FAIL;
+    }
+    bool closing = frame.type == HTTPD_WS_TYPE_CLOSE;
+    stream_senders.queueReply(sender, closing ? HTTPD_WS_TYPE_CLOSE : HTTPD_WS_TYPE_PONG, buf, closing ? min(frame.len, (size_t)2) : frame.len);
+    return ESP_OK;
+  }
+
+  // Anything else the client sends is a credit grant.
+  uint32_t credits = 0;
+  if (frame.type == HTTPD_WS_TYPE_TEXT) {
+    buf[frame.len] = 0;
+    credits = strtoul((const char *)buf, NULL, 10);
+  } else if (frame.type == HTTPD_WS_TYPE_BINARY && frame.len == sizeof(credits)) {
+    memcpy(&credits, buf, sizeof(credits));
+  }
+
+  if (sender && credits) {
+    stream_senders.addCredits(sender, credits);
+  }
+  return ESP_OK;
+}
+
+static void stream_sess_close(httpd_handle_t hd, int sockfd) {
+  // Stop any sender on this socket before the descriptor can be reused. One caught mid-write closes it itself.
+  if (stream_senders.socketClosed(sockfd)) {
+    close(sockfd);
+  }
+}
+
+static esp_err_t streams_handler(httpd_req_t *req) {
+  static char json_response[384 * MAX_STREAM_CLIENTS];
+
+  size_t len = stream_senders.printJson(json_response, sizeof(json_response));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json_response, len);
+}
+
+static esp_err_t metrics_handler(httpd_req_t *req) {
+  static char metrics_response[8192];
+
+  // Gauges that are cheaper to sample at scrape time than to keep current.
+  metric_stream_clients.set(stream_senders.getActiveCount());
+  metric_pool_free.set(frame_pool.getFreeCount());
+  metric_heap_free.set(ESP.getFreeHeap());
+  metric_heap_min_free.set(ESP.getMinFreeHeap());
+  metric_psram_min_free.set(ESP.getMinFreePsram());
+
+  size_t len = metrics.printPrometheus(metrics_response, sizeof(metrics_response));
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  return httpd_resp_send(req, metrics_response, len);
 }
 
 static esp_err_t parse_get(httpd_req_t *req, char **obuf) {
@@ -275,6 +552,139 @@ static esp_err_t parse_get(httpd_req_t *req, char **obuf) {
   return ESP_FAIL;
 }
 
+// Every setter that changes sensor state marks the cached /status document stale.
+static volatile bool status_dirty = true;
+
+static void invalidate_status() {
+  status_dirty = true;
+}
+
+#define CONTROL_UNKNOWN -2
+
+typedef int (*control_setter_t)(sensor_t *s, int val);
+
+typedef struct {
+  const char *name;
+  control_setter_t set;
+} control_entry_t;
+
+static int control_framesize(sensor_t *s, int val) {
+  if (s->pixformat != PIXFORMAT_JPEG) {
+    return 0;
+  }
+  // A size the sensor refused leaves the buffers and the adaptive ceiling as they were.
+  int res = s->set_framesize(s, (framesize_t)val);
+  if (res == 0) {
+    conversion_pool.reset((framesize_t)val);
+    adaptive_quality.setCeiling(s->status.quality, (framesize_t)val);
+  }
+  return res;
+}
+
+static int control_quality(sensor_t *s, int val) {
+  int res = s->set_quality(s, val);
+  if (res == 0) {
+    adaptive_quality.setCeiling(val, s->status.framesize);
+  }
+  return res;
+}
+
+#if CONFIG_LED_ILLUMINATOR_ENABLED
+static int control_led_intensity(sensor_t *, int val) {
+  led_duty = val;
+  if (isStreaming) {
+    enable_led(true);
+  }
+  return 0;
+}
+#endif
+
+// Sorted by name for binary search. Keep it sorted; the static_assert below checks.
+static constexpr control_entry_t control_table[] = {
+  {"adaptive", [](sensor_t *, int val) { adaptive_quality.setEnabled(val); return 0; }},
+  {"ae_level", [](sensor_t *s, int val) { return s->set_ae_level(s, val); }},
+  {"aec", [](sensor_t *s, int val) { return s->set_exposure_ctrl(s, val); }},
+  {"aec2", [](sensor_t *s, int val) { return s->set_aec2(s, val); }},
+  {"aec_value", [](sensor_t *s, int val) { return s->set_aec_value(s, val); }},
+  {"agc", [](sensor_t *s, int val) { return s->set_gain_ctrl(s, val); }},
+  {"agc_gain", [](sensor_t *s, int val) { return s->set_agc_gain(s, val); }},
+  {"awb", [](sensor_t *s, int val) { return s->set_whitebal(s, val); }},
+  {"awb_gain", [](sensor_t *s, int val) { return s->set_awb_gain(s, val); }},
+  {"bpc", [](sensor_t *s, int val) { return s->set_bpc(s, val); }},
+  {"brightness", [](sensor_t *s, int val) { return s->set_brightness(s, val); }},
+  {"colorbar", [](sensor_t *s, int val) { return s->set_colorbar(s, val); }},
+  {"contrast", [](sensor_t *s, int val) { return s->set_contrast(s, val); }},
+  {"dcw", [](sensor_t *s, int val) { return s->set_dcw(s, val); }},
+  {"framesize", control_framesize},
+  {"gainceiling", [](sensor_t *s, int val) { return s->set_gainceiling(s, (gainceiling_t)val); }},
+  {"hmirror", [](sensor_t *s, int val) { return s->set_hmirror(s, val); }},
+#if CONFIG_LED_ILLUMINATOR_ENABLED
+  {"led_intensity", control_led_intensity},
+#endif
+  {"lenc", [](sensor_t *s, int val) { return s->set_lenc(s, val); }},
+  {"quality", control_quality},
+  {"raw_gma", [](sensor_t *s, int val) { return s->set_raw_gma(s, val); }},
+  {"saturation", [](sensor_t *s, int val) { return s->set_saturation(s, val); }},
+  {"special_effect", [](sensor_t *s, int val) { return s->set_special_effect(s, val); }},
+  {"vflip", [](sensor_t *s, int val) { return s->set_vflip(s, val); }},
+  {"wb_mode", [](sensor_t *s, int val) { return s->set_wb_mode(s, val); }},
+  {"wpc", [](sensor_t *s, int val) { return s->set_wpc(s, val); }},
+};
+static constexpr size_t control_table_len = sizeof(control_table) / sizeof(control_table[0]);
+
+static constexpr int control_name_cmp(const char *a, const char *b) {
+  return (*a != *b || !*a) ? (int)(unsigned char)*a - (int)(unsigned char)*b : control_name_cmp(a + 1, b + 1);
+}
+
+static constexpr bool control_table_sorted(size_t i = 1) {
+  return i >= control_table_len || (control_name_cmp(control_table[i - 1].name, control_table[i].name) < 0 && control_table_sorted(i + 1));
+}
+
+static_assert(control_table_sorted(), "control_table must be sorted by name");
+
+static const control_entry_t *find_control(const char *variable) {
+  size_t lo = 0;
+  size_t hi = control_table_len;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    int cmp = strcmp(variable, control_table[mid].name);
+    if (cmp == 0) {
+      return &control_table[mid];
+    }
+    if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return NULL;
+}
+
+static int apply_control(sensor_t *s, const char *variable, int val) {
+  const control_entry_t *control = find_control(variable);
+  if (!control) {
+    log_i("Unknown command: %s", variable);
+    return CONTROL_UNKNOWN;
+  }
+  invalidate_status();
+  return control->set(s, val);
+}
+
+// Decode %XX escapes and '+' in place.
+static void url_decode(char *str) {
+  char *out = str;
+  for (char *in = str; *in; in++) {
+    if (*in == '%' && isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2])) {
+      char hex[3] = {in[1], in[2], 0};
+      *out++ = (char)strtoul(hex, NULL, 16);
+      in += 2;
+    } else {
+      *out++ = (*in == '+') ? ' ' : *in;
+    }
+  }
+  *out = 0;
+}
+
 static esp_err_t cmd_handler(httpd_req_t *req) {
   char *buf = NULL;
   char variable[32];
@@ -293,71 +703,7 @@ static esp_err_t cmd_handler(httpd_req_t *req) {
   int val = atoi(value);
   log_i("%s = %d", variable, val);
   sensor_t *s = esp_camera_sensor_get();
-  int res = 0;
-
-  if (!strcmp(variable, "framesize")) {
-    if (s->pixformat == PIXFORMAT_JPEG) {
-      res = s->set_framesize(s, (framesize_t)val);
-    }
-  } else if (!strcmp(variable, "quality")) {
-    res = s->set_quality(s, val);
-  } else if (!strcmp(variable, "contrast")) {
-    res = s->set_contrast(s, val);
-  } else if (!strcmp(variable, "brightness")) {
-    res = s->set_brightness(s, val);
-  } else if (!strcmp(variable, "saturation")) {
-    res = s->set_saturation(s, val);
-  } else if (!strcmp(variable, "gainceiling")) {
-    res = s->set_gainceiling(s, (gainceiling_t)val);
-  } else if (!strcmp(variable, "colorbar")) {
-    res = s->set_colorbar(s, val);
-  } else if (!strcmp(variable, "awb")) {
-    res = s->set_whitebal(s, val);
-  } else if (!strcmp(variable, "agc")) {
-    res = s->set_gain_ctrl(s, val);
-  } else if (!strcmp(variable, "aec")) {
-    res = s->set_exposure_ctrl(s, val);
-  } else if (!strcmp(variable, "hmirror")) {
-    res = s->set_hmirror(s, val);
-  } else if (!strcmp(variable, "vflip")) {
-    res = s->set_vflip(s, val);
-  } else if (!strcmp(variable, "awb_gain")) {
-    res = s->set_awb_gain(s, val);
-  } else if (!strcmp(variable, "agc_gain")) {
-    res = s->set_agc_gain(s, val);
-  } else if (!strcmp(variable, "aec_value")) {
-    res = s->set_aec_value(s, val);
-  } else if (!strcmp(variable, "aec2")) {
-    res = s->set_aec2(s, val);
-  } else if (!strcmp(variable, "dcw")) {
-    res = s->set_dcw(s, val);
-  } else if (!strcmp(variable, "bpc")) {
-    res = s->set_bpc(s, val);
-  } else if (!strcmp(variable, "wpc")) {
-    res = s->set_wpc(s, val);
-  } else if (!strcmp(variable, "raw_gma")) {
-    res = s->set_raw_gma(s, val);
-  } else if (!strcmp(variable, "lenc")) {
-    res = s->set_lenc(s, val);
-  } else if (!strcmp(variable, "special_effect")) {
-    res = s->set_special_effect(s, val);
-  } else if (!strcmp(variable, "wb_mode")) {
-    res = s->set_wb_mode(s, val);
-  } else if (!strcmp(variable, "ae_level")) {
-    res = s->set_ae_level(s, val);
-  }
-#if CONFIG_LED_ILLUMINATOR_ENABLED
-  else if (!strcmp(variable, "led_intensity")) {
-    led_duty = val;
-    if (isStreaming) {
-      enable_led(true);
-    }
-  }
-#endif
-  else {
-    log_i("Unknown command: %s", variable);
-    res = -1;
-  }
+  int res = apply_control(s, variable, val);
 
   if (res < 0) {
     return httpd_resp_send_500(req);
@@ -367,82 +713,166 @@ static esp_err_t cmd_handler(httpd_req_t *req) {
   return httpd_resp_send(req, NULL, 0);
 }
 
-static int print_reg(char *p, sensor_t *s, uint16_t reg, uint32_t mask) {
-  return sprintf(p, "\"0x%x\":%u,", reg, s->get_reg(s, reg, mask));
-}
-
-static esp_err_t status_handler(httpd_req_t *req) {
+static esp_err_t batch_handler(httpd_req_t *req) {
   static char json_response[1024];
+  char *buf = NULL;
+
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+
+  // Check every key before applying any, so a typo cannot leave the sensor half configured.
+  struct {
+    const control_entry_t *control;
+    int val;
+  } batch[control_table_len];
+  size_t count = 0;
+  bool valid = true;
+  char *save = NULL;
+  for (char *pair = strtok_r(buf, "&", &save); pair && valid; pair = strtok_r(NULL, "&", &save)) {
+    char *eq = strchr(pair, '=');
+    if (!eq) {
+      continue;
+    }
+    *eq = 0;
+    url_decode(pair);
+    const control_entry_t *control = find_control(pair);
+    valid = control && count < control_table_len;
+    if (valid) {
+      batch[count].control = control;
+      batch[count].val = atoi(eq + 1);
+      count++;
+    }
+  }
+  free(buf);
+  if (!valid) {
+    httpd_resp_set_status(req, "400 Bad Request");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, NULL, 0);
+  }
 
+  // Apply them in request order, e.g. /batch?framesize=8&quality=12&aec=1. Keys are echoed as the
+  // table spells them, so nothing from the query ends up in the JSON.
   sensor_t *s = esp_camera_sensor_get();
+  invalidate_status();
   char *p = json_response;
+  char *end = json_response + sizeof(json_response) - 2;
   *p++ = '{';
+  for (size_t i = 0; i < count; i++) {
+    int res = batch[i].control->set(s, batch[i].val);
+    log_i("%s = %d -> %d", batch[i].control->name, batch[i].val, res);
+
+    int n = snprintf(p, end - p, "%s\"%s\":\"%s\"", i ? "," : "", batch[i].control->name, (res < 0) ? "failed" : "ok");
+    if (n > 0 && n < end - p) {
+      p += n;
+    }
+  }
+  *p++ = '}';
+  *p = 0;
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json_response, p - json_response);
+}
+
+static void print_reg(JsonWriter &json, sensor_t *s, uint16_t reg, uint32_t mask) {
+  json.addRegister(reg, s->get_reg(s, reg, mask));
+}
+
+static void build_status(JsonWriter &json) {
+  sensor_t *s = esp_camera_sensor_get();
+  json.beginObject();
 
   if (s->id.PID == OV5640_PID || s->id.PID == OV3660_PID) {
     for (int reg = 0x3400; reg < 0x3406; reg += 2) {
-      p += print_reg(p, s, reg, 0xFFF);  //12 bit
+      print_reg(json, s, reg, 0xFFF);  //12 bit
     }
-    p += print_reg(p, s, 0x3406, 0xFF);
+    print_reg(json, s, 0x3406, 0xFF);
 
-    p += print_reg(p, s, 0x3500, 0xFFFF0);  //16 bit
-    p += print_reg(p, s, 0x3503, 0xFF);
-    p += print_reg(p, s, 0x350a, 0x3FF);   //10 bit
-    p += print_reg(p, s, 0x350c, 0xFFFF);  //16 bit
+    print_reg(json, s, 0x3500, 0xFFFF0);  //16 bit
+    print_reg(json, s, 0x3503, 0xFF);
+    print_reg(json, s, 0x350a, 0x3FF);   //10 bit
+    print_reg(json, s, 0x350c, 0xFFFF);  //16 bit
 
     for (int reg = 0x5480; reg <= 0x5490; reg++) {
-      p += print_reg(p, s, reg, 0xFF);
+      print_reg(json, s, reg, 0xFF);
     }
 
     for (int reg = 0x5380; reg <= 0x538b; reg++) {
-      p += print_reg(p, s, reg, 0xFF);
+      print_reg(json, s, reg, 0xFF);
     }
 
     for (int reg = 0x5580; reg < 0x558a; reg++) {
-      p += print_reg(p, s, reg, 0xFF);
+      print_reg(json, s, reg, 0xFF);
     }
-    p += print_reg(p, s, 0x558a, 0x1FF);  //9 bit
+    print_reg(json, s, 0x558a, 0x1FF);  //9 bit
   } else if (s->id.PID == OV2640_PID) {
-    p += print_reg(p, s, 0xd3, 0xFF);
-    p += print_reg(p, s, 0x111, 0xFF);
-    p += print_reg(p, s, 0x132, 0xFF);
-  }
-
-  p += sprintf(p, "\"xclk\":%u,", s->xclk_freq_hz / 1000000);
-  p += sprintf(p, "\"pixformat\":%u,", s->pixformat);
-  p += sprintf(p, "\"framesize\":%u,", s->status.framesize);
-  p += sprintf(p, "\"quality\":%u,", s->status.quality);
-  p += sprintf(p, "\"brightness\":%d,", s->status.brightness);
-  p += sprintf(p, "\"contrast\":%d,", s->status.contrast);
-  p += sprintf(p, "\"saturation\":%d,", s->status.saturation);
-  p += sprintf(p, "\"sharpness\":%d,", s->status.sharpness);
-  p += sprintf(p, "\"special_effect\":%u,", s->status.special_effect);
-  p += sprintf(p, "\"wb_mode\":%u,", s->status.wb_mode);
-  p += sprintf(p, "\"awb\":%u,", s->status.awb);
-  p += sprintf(p, "\"awb_gain\":%u,", s->status.awb_gain);
-  p += sprintf(p, "\"aec\":%u,", s->status.aec);
-  p += sprintf(p, "\"aec2\":%u,", s->status.aec2);
-  p += sprintf(p, "\"ae_level\":%d,", s->status.ae_level);
-  p += sprintf(p, "\"aec_value\":%u,", s->status.aec_value);
-  p += sprintf(p, "\"agc\":%u,", s->status.agc);
-  p += sprintf(p, "\"agc_gain\":%u,", s->status.agc_gain);
-  p += sprintf(p, "\"gainceiling\":%u,", s->status.gainceiling);
-  p += sprintf(p, "\"bpc\":%u,", s->status.bpc);
-  p += sprintf(p, "\"wpc\":%u,", s->status.wpc);
-  p += sprintf(p, "\"raw_gma\":%u,", s->status.raw_gma);
-  p += sprintf(p, "\"lenc\":%u,", s->status.lenc);
-  p += sprintf(p, "\"hmirror\":%u,", s->status.hmirror);
-  p += sprintf(p, "\"dcw\":%u,", s->status.dcw);
-  p += sprintf(p, "\"colorbar\":%u", s->status.colorbar);
+    print_reg(json, s, 0xd3, 0xFF);
+    print_reg(json, s, 0x111, 0xFF);
+    print_reg(json, s, 0x132, 0xFF);
+  }
+
+  json.addUInt("xclk", s->xclk_freq_hz / 1000000);
+  json.addUInt("pixformat", s->pixformat);
+  json.addUInt("framesize", s->status.framesize);
+  json.addUInt("quality", s->status.quality);
+  json.addInt("brightness", s->status.brightness);
+  json.addInt("contrast", s->status.contrast);
+  json.addInt("saturation", s->status.saturation);
+  json.addInt("sharpness", s->status.sharpness);
+  json.addUInt("special_effect", s->status.special_effect);
+  json.addUInt("wb_mode", s->status.wb_mode);
+  json.addUInt("awb", s->status.awb);
+  json.addUInt("awb_gain", s->status.awb_gain);
+  json.addUInt("aec", s->status.aec);
+  json.addUInt("aec2", s->status.aec2);
+  json.addInt("ae_level", s->status.ae_level);
+  json.addUInt("aec_value", s->status.aec_value);
+  json.addUInt("agc", s->status.agc);
+  json.addUInt("agc_gain", s->status.agc_gain);
+  json.addUInt("gainceiling", s->status.gainceiling);
+  json.addUInt("bpc", s->status.bpc);
+  json.addUInt("wpc", s->status.wpc);
+  json.addUInt("raw_gma", s->status.raw_gma);
+  json.addUInt("lenc", s->status.lenc);
+  json.addUInt("hmirror", s->status.hmirror);
+  json.addUInt("dcw", s->status.dcw);
+  json.addUInt("colorbar", s->status.colorbar);
 #if CONFIG_LED_ILLUMINATOR_ENABLED
-  p += sprintf(p, ",\"led_intensity\":%u", led_duty);
+  json.addUInt("led_intensity", led_duty);
 #else
-  p += sprintf(p, ",\"led_intensity\":%d", -1);
+  json.addInt("led_intensity", -1);
 #endif
-  *p++ = '}';
-  *p++ = 0;
+  json.endObject();
+}
+
+static esp_err_t status_handler(httpd_req_t *req) {
+  static char json_response[2048];
+  static size_t json_len = 0;
+
+  // Registers are only read over SCCB when something changed them, or on ?refresh=1 for
+  // registers the sensor's own auto loops move.
+  char query[16];
+  char refresh[4];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && httpd_query_key_value(query, "refresh", refresh, sizeof(refresh)) == ESP_OK) {
+    status_dirty = true;
+  }
+
+  if (status_dirty || json_len == 0) {
+    status_dirty = false;
+    JsonWriter json(json_response, sizeof(json_response));
+    build_status(json);
+    if (json.overflowed()) {
+      log_e("Status JSON truncated at %luB", (unsigned long)json.length());
+      json_len = 0;
+      return httpd_resp_send_500(req);
+    }
+    json_len = json.length();
+  }
+
   httpd_resp_set_type(req, "application/json");
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, json_response, strlen(json_response));
+  return httpd_resp_send(req, json_response, json_len);
 }
 
 static esp_err_t xclk_handler(httpd_req_t *req) {
@@ -463,6 +893,7 @@ static esp_err_t xclk_handler(httpd_req_t *req) {
   log_i("Set XCLK: %d MHz", xclk);
 
   sensor_t *s = esp_camera_sensor_get();
+  invalidate_status();
   int res = s->set_xclk(s, LEDC_TIMER_0, xclk);
   if (res) {
     return httpd_resp_send_500(req);
@@ -495,6 +926,7 @@ static esp_err_t reg_handler(httpd_req_t *req) {
   log_i("Set Register: reg: 0x%02x, mask: 0x%02x, value: 0x%02x", reg, mask, val);
 
   sensor_t *s = esp_camera_sensor_get();
+  invalidate_status();
   int res = s->set_reg(s, reg, mask, val);
   if (res) {
     return httpd_resp_send_500(req);
@@ -561,6 +993,7 @@ static esp_err_t pll_handler(httpd_req_t *req) {
 
   log_i("Set Pll: bypass: %d, mul: %d, sys: %d, root: %d, pre: %d, seld5: %d, pclken: %d, pclk: %d", bypass, mul, sys, root, pre, seld5, pclken, pclk);
   sensor_t *s = esp_camera_sensor_get();
+  invalidate_status();
   int res = s->set_pll(s, bypass, mul, sys, root, pre, seld5, pclken, pclk);
   if (res) {
     return httpd_resp_send_500(req);
@@ -596,6 +1029,7 @@ static esp_err_t win_handler(httpd_req_t *req) {
     totalX, totalY, outputX, outputY, scale, binning  // codespell:ignore totaly
   );
   sensor_t *s = esp_camera_sensor_get();
+  invalidate_status();
   int res = s->set_res_raw(s, startX, startY, endX, endY, offsetX, offsetY, totalX, totalY, outputX, outputY, scale, binning);  // codespell:ignore totaly
   if (res) {
     return httpd_resp_send_500(req);
@@ -605,53 +1039,709 @@ static esp_err_t win_handler(httpd_req_t *req) {
   return httpd_resp_send(req, NULL, 0);
 }
 
-static uint8_t *last_good_frame = NULL;
-static size_t last_good_len = 0;
+static FrameHandle last_good_frame;
 
-static esp_err_t capture_handler(httpd_req_t *req) {
-  camera_fb_t *fb = esp_camera_fb_get();
-  if (!fb) {
-    Serial.println("Capture failed");
+static void frame_etag(const FrameHandle &frame, char *etag, size_t len) {
+  // Sequence numbers restart at boot, so tag them with a per-boot id.
+  static uint32_t boot_id = 0;
+  if (!boot_id) {
+    boot_id = esp_random();
+  }
+  snprintf(etag, len, "\"%08lx-%lu\"", (unsigned long)boot_id, (unsigned long)frame.seq());
+}
 
-    // If we have a backup frame, serve it
-    if (last_good_frame && last_good_len > 0) {
-      httpd_resp_set_type(req, "image/jpeg");
-      httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-      return httpd_resp_send(req, (const char *)last_good_frame, last_good_len);
-    }
+static esp_err_t send_frame(httpd_req_t *req, uint32_t peer, const FrameHandle &frame) {
+  char etag[24];
+  char seq[12];
+  frame_etag(frame, etag, sizeof(etag));
+  snprintf(seq, sizeof(seq), "%lu", (unsigned long)frame.seq());
 
-    return httpd_resp_send_500(req);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "X-Frame-Seq", seq);
+
+  // Pollers that already have this frame get a 304 without the body.
+  char match[64];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK && strstr(match, etag)) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
   }
 
-  // Store backup of this frame
-  last_good_frame = fb->buf;
-  last_good_len = fb->len;
-
   httpd_resp_set_type(req, "image/jpeg");
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  esp_err_t res = httpd_resp_send(req, (const char *)fb->buf, fb->len);
-  esp_camera_fb_return(fb);
+  esp_err_t res = httpd_resp_send(req, (const char *)frame.buf(), frame.len());
+  rate_limiter.charge(peer, frame.len());
   return res;
 }
 
-void startCameraServer(){
-  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-  config.server_port = 80;
-/*
-httpd_uri_t index_uri = {
-    .uri = "/",
-    .method = HTTP_GET,
-    .handler = index_handler,
-    .user_ctx = NULL
-};
-*//*
-  httpd_uri_t stream_uri = {
-    .uri       = "/",
-    .method    = HTTP_GET,
+// A /capture?after= request parked until a newer frame is published.
+typedef struct {
+  httpd_req_t *req;   // Detached request, completed once answered.
+  uint32_t peer;      // Client the frame is charged to.
+  uint32_t after;     // Sequence number of the frame the client already has.
+  TickType_t since;   // Tick count when it was parked.
+} long_poll_t;
+
+static QueueHandle_t long_poll_queue = NULL;
+static SemaphoreHandle_t long_poll_slots = NULL;  // Counts the requests that can still be parked.
+
+static void finish_long_poll(long_poll_t *poll, const FrameHandle &frame) {
+  if (frame) {
+    send_frame(poll->req, poll->peer, frame);
+  } else {
+    httpd_resp_set_status(poll->req, "504 Gateway Timeout");
+    httpd_resp_set_hdr(poll->req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_send(poll->req, NULL, 0);
+  }
+  httpd_req_async_handler_complete(poll->req);
+  xSemaphoreGive(long_poll_slots);
+}
+
+// One task waits out every parked long-poll, so the httpd worker never sits on a frame that is not there yet.
+static void long_poll_task(void *pvParams) {
+  long_poll_t waiting[LONG_POLL_MAX_WAITERS];
+  int count = 0;
+
+  for (;;) {
+    // Sleep on the queue while nothing is parked.
+    long_poll_t poll;
+    while (count < LONG_POLL_MAX_WAITERS && xQueueReceive(long_poll_queue, &poll, count ? 0 : portMAX_DELAY) == pdTRUE) {
+      waiting[count++] = poll;
+    }
+
+    // Answer everyone the newest frame is news to, and time out the rest.
+    FrameHandle latest = frame_broadcaster.getLatest();
+    TickType_t now = xTaskGetTickCount();
+    uint32_t oldest = UINT32_MAX;
+    for (int i = 0; i < count;) {
+      bool fresh = latest && latest.seq() > waiting[i].after;
+      if (fresh || now - waiting[i].since >= LONG_POLL_TIMEOUT) {
+        finish_long_poll(&waiting[i], fresh ? latest : FrameHandle());
+        waiting[i] = waiting[--count];
+        continue;
+      }
+      oldest = min(oldest, waiting[i].after);
+      i++;
+    }
+    latest.reset();
+
+    if (count) {
+      frame_broadcaster.waitForFrameAfter(oldest, LONG_POLL_SLICE);
+    }
+  }
+}
+
+static esp_err_t park_long_poll(httpd_req_t *req, uint32_t peer, uint32_t after) {
+  if (long_poll_slots == NULL || xSemaphoreTake(long_poll_slots, 0) != pdTRUE) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  long_poll_t poll = {NULL, peer, after, xTaskGetTickCount()};
+  if (httpd_req_async_handler_begin(req, &poll.req) != ESP_OK) {
+    xSemaphoreGive(long_poll_slots);
+    return httpd_resp_send_500(req);
+  }
+  // The queue holds as many as there are slots, so this never waits.
+  xQueueSend(long_poll_queue, &poll, portMAX_DELAY);
+  return ESP_OK;
+}
+
+static esp_err_t capture_handler(httpd_req_t *req) {
+  uint32_t peer = rate_peer_address(httpd_req_to_sockfd(req));
+  if (reject_over_limit(req, peer)) {
+    return ESP_OK;
+  }
+
+  // ?after=<seq> long-polls until a newer frame than the one the client has is published.
+  char query[32];
+  char after[16];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && httpd_query_key_value(query, "after", after, sizeof(after)) == ESP_OK) {
+    uint32_t seq = strtoul(after, NULL, 10);
+    FrameHandle latest = frame_broadcaster.getLatest();
+    if (latest && latest.seq() > seq) {
+      return send_frame(req, peer, latest);
+    }
+    return park_long_poll(req, peer, seq);
+  }
+
+  // The capture task keeps the latest frame current, so answer from memory.
+  FrameHandle latest = frame_broadcaster.getLatest();
+  if (frame_broadcaster.isFresh(latest)) {
+    return send_frame(req, peer, latest);
+  }
+
+  // Only the capture task talks to the driver. Ask it for a frame rather than grabbing one here.
+  FrameHandle frame = frame_broadcaster.requestFrame(FRAME_WAIT_TIMEOUT);
+  if (!frame) {
+    Serial.println("Capture failed");
+
+    // If we have a backup frame, serve it
+    if (last_good_frame) {
+      return send_frame(req, peer, last_good_frame);
+    }
+
+    return httpd_resp_send_500(req);
+  }
+
+  // Store backup of this frame. The pool keeps it alive after the driver buffer is recycled.
+  last_good_frame = frame;
+
+  return send_frame(req, peer, frame);
+}
+
+static esp_err_t crop_handler(httpd_req_t *req) {
+  uint32_t peer = rate_peer_address(httpd_req_to_sockfd(req));
+  if (reject_over_limit(req, peer)) {
+    return ESP_OK;
+  }
+  char *buf = NULL;
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  JpegRect requested;
+  requested.x = max(parse_get_var(buf, "x", 0), 0);
+  requested.y = max(parse_get_var(buf, "y", 0), 0);
+  requested.w = max(parse_get_var(buf, "w", 0), 0);
+  requested.h = max(parse_get_var(buf, "h", 0), 0);
+  free(buf);
+
+  FrameHandle frame = snapshot_frame();
+  if (!frame) {
+    log_e("Camera capture failed");
+    return httpd_resp_send_500(req);
+  }
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  if (frame.format() != PIXFORMAT_JPEG) {
+    httpd_resp_set_status(req, "415 Unsupported Media Type");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  // Huffman tables are too big for the httpd stack. Only the httpd worker uses this, so one is enough.
+  static JpegCrop *cropper = NULL;
+  if (!cropper) {
+    void *mem = heap_caps_malloc(sizeof(JpegCrop), MALLOC_CAP_SPIRAM);
+    cropper = mem ? new (mem) JpegCrop() : NULL;
+  }
+  size_t cap = frame.len() + JPEG_CROP_HEADROOM;
+  uint8_t *out = (uint8_t *)heap_caps_malloc(cap, MALLOC_CAP_SPIRAM);
+  if (!cropper || !out) {
+    free(out);
+    return httpd_resp_send_500(req);
+  }
+
+  JpegRect actual;
+  size_t len = 0;
+  if (cropper->parse(frame.buf(), frame.len())) {
+    len = cropper->crop(requested, out, cap, &actual);
+  }
+  if (!len) {
+    free(out);
+    httpd_resp_set_status(req, "400 Bad Request");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  // Report the MCU-aligned region actually returned, which covers the requested one.
+  char region[32];
+  char seq[12];
+  snprintf(region, sizeof(region), "%u,%u,%u,%u", actual.x, actual.y, actual.w, actual.h);
+  snprintf(seq, sizeof(seq), "%lu", (unsigned long)frame.seq());
+  httpd_resp_set_type(req, "image/jpeg");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  httpd_resp_set_hdr(req, "X-Crop", region);
+  httpd_resp_set_hdr(req, "X-Frame-Seq", seq);
+  esp_err_t res = httpd_resp_send(req, (const char *)out, len);
+  free(out);
+  rate_limiter.charge(peer, len);
+  return res;
+}
+
+static esp_err_t thumb_handler(httpd_req_t *req) {
+  uint32_t peer = rate_peer_address(httpd_req_to_sockfd(req));
+  if (reject_over_limit(req, peer)) {
+    return ESP_OK;
+  }
+  int scale = 8;
+  int quality = THUMB_DEFAULT_QUALITY;
+  char *buf = NULL;
+  if (httpd_req_get_url_query_len(req) && parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  if (buf) {
+    scale = parse_get_var(buf, "scale", scale);
+    quality = constrain(parse_get_var(buf, "quality", quality), 1, 100);
+    free(buf);
+  }
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  if (scale != 2 && scale != 4 && scale != 8) {
+    httpd_resp_set_status(req, "400 Bad Request");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  FrameHandle frame = snapshot_frame();
+  if (!frame) {
+    log_e("Camera capture failed");
+    return httpd_resp_send_500(req);
+  }
+  if (frame.format() != PIXFORMAT_JPEG) {
+    httpd_resp_set_status(req, "415 Unsupported Media Type");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+  // The frame tag plus the scale and quality, so a wall polling the same frame gets a 304.
+  char etag[48];
+  frame_etag(frame, etag, sizeof(etag));
+  size_t n = strlen(etag);
+  snprintf(etag + n - 1, sizeof(etag) - n + 1, "-%dx%d\"", scale, quality);
+  httpd_resp_set_hdr(req, "ETag", etag);
+  char match[64];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK && strstr(match, etag)) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  const Thumbnail *thumb = NULL;
+  bool hit = false;
+  if (!thumbnail_cache.acquire(frame, scale, quality, &thumb, &hit)) {
+    log_e("Thumbnail failed");
+    return httpd_resp_send_500(req);
+  }
+
+  char seq[12];
+  char timing[32];
+  snprintf(seq, sizeof(seq), "%lu", (unsigned long)thumb->seq);
+  snprintf(timing, sizeof(timing), "%lu,%lu", (unsigned long)thumb->decodeUs, (unsigned long)thumb->encodeUs);
+  httpd_resp_set_type(req, "image/jpeg");
+  httpd_resp_set_hdr(req, "X-Frame-Seq", seq);
+  httpd_resp_set_hdr(req, "X-Thumb-Cache", hit ? "hit" : "miss");
+  httpd_resp_set_hdr(req, "X-Thumb-Us", timing);
+  esp_err_t res = httpd_resp_send(req, (const char *)thumb->buf, thumb->len);
+  rate_limiter.charge(peer, thumb->len);
+  thumbnail_cache.release(thumb);
+  return res;
+}
+
+static esp_err_t motion_handler(httpd_req_t *req) {
+  static char json_response[256 + 256 * MOTION_EVENT_HISTORY];
+
+  // Pollers pass the last id they saw and only get what is new.
+  uint32_t since = 0;
+  char *buf = NULL;
+  if (httpd_req_get_url_query_len(req) && parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  if (buf) {
+    since = max(parse_get_var(buf, "since", 0), 0);
+    free(buf);
+  }
+
+  size_t len = motion_detector.printJson(json_response, sizeof(json_response), since);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  return httpd_resp_send(req, json_response, len);
+}
+
+// Admin endpoints only take POSTs from a trusted address or carrying the admin key. Sends the refusal if not.
+static bool require_admin(httpd_req_t *req) {
+  char key[ADMIN_KEY_MAX + 1] = "";
+  httpd_req_get_hdr_value_str(req, "X-Admin-Key", key, sizeof(key));
+  if (req->method == HTTP_POST && rate_limiter.isAdmin(rate_peer_address(httpd_req_to_sockfd(req)), key)) {
+    return true;
+  }
+  httpd_resp_set_status(req, (req->method == HTTP_POST) ? "403 Forbidden" : "405 Method Not Allowed");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_send(req, NULL, 0);
+  return false;
+}
+
+static esp_err_t send_limits(httpd_req_t *req) {
+  static char json_response[256 + 192 * RATE_MAX_CLIENTS];
+
+  size_t len = rate_limiter.printJson(json_response, sizeof(json_response));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  return httpd_resp_send(req, json_response, len);
+}
+
+static esp_err_t limits_handler(httpd_req_t *req) {
+  // Changes go through POST. Refuse a GET that tries one rather than quietly ignoring it.
+  if (httpd_req_get_url_query_len(req)) {
+    httpd_resp_set_status(req, "405 Method Not Allowed");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  return send_limits(req);
+}
+
+static esp_err_t limits_update_handler(httpd_req_t *req) {
+  if (!require_admin(req)) {
+    return ESP_OK;
+  }
+  char *buf = NULL;
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+
+  // ?trust=<ip> exempts an address, such as the NVR's, from every budget, and ?untrust=<ip> puts it back.
+  // ?requests=, ?kbytes= and ?shared_kb= set the policy's budgets, 0 for none.
+  char value[16];
+  struct in_addr addr;
+  bool bad = false;
+  bool failed = false;
+  if (httpd_query_key_value(buf, "trust", value, sizeof(value)) == ESP_OK) {
+    bad |= inet_pton(AF_INET, value, &addr) != 1;
+    failed |= !bad && !rate_limiter.trust(addr.s_addr);
+  }
+  if (httpd_query_key_value(buf, "untrust", value, sizeof(value)) == ESP_OK) {
+    bad |= inet_pton(AF_INET, value, &addr) != 1;
+    failed |= !bad && !rate_limiter.untrust(addr.s_addr);
+  }
+  if (httpd_query_key_value(buf, "requests", value, sizeof(value)) == ESP_OK) {
+    failed |= !rate_limiter.setRequestRate(constrain(atoi(value), 0, UINT16_MAX));
+  }
+  if (httpd_query_key_value(buf, "kbytes", value, sizeof(value)) == ESP_OK) {
+    failed |= !rate_limiter.setByteRate(max(atoi(value), 0));
+  }
+  if (httpd_query_key_value(buf, "shared_kb", value, sizeof(value)) == ESP_OK) {
+    failed |= !rate_limiter.setSharedByteRate(max(atoi(value), 0));
+  }
+  free(buf);
+
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  if (bad) {
+    httpd_resp_set_status(req, "400 Bad Request");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  if (failed) {
+    return httpd_resp_send_500(req);
+  }
+  return send_limits(req);
+}
+
+static esp_err_t send_tune(httpd_req_t *req) {
+  // Sized for the whole sweep table on the boot that ran one.
+  size_t cap = camera_tuner.jsonSize();
+  char *json = (char *)heap_caps_malloc(cap, MALLOC_CAP_SPIRAM);
+  if (!json) {
+    return httpd_resp_send_500(req);
+  }
+  size_t len = camera_tuner.printJson(json, cap);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  esp_err_t res = httpd_resp_send(req, json, len);
+  heap_caps_free(json);
+  return res;
+}
+
+static esp_err_t tune_handler(httpd_req_t *req) {
+  // Sweeps and clearing go through POST. Refuse a GET that tries one rather than quietly ignoring it.
+  if (httpd_req_get_url_query_len(req)) {
+    httpd_resp_set_status(req, "405 Method Not Allowed");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  return send_tune(req);
+}
+
+static esp_err_t tune_update_handler(httpd_req_t *req) {
+  if (!require_admin(req)) {
+    return ESP_OK;
+  }
+  char *buf = NULL;
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+
+  // ?sweep=<framesize>,<framesize> schedules a sweep of up to TUNER_MAX_SWEEP_SIZES frame sizes for the
+  // next boot and restarts into it. An empty list sweeps the current frame size. ?clear=1 forgets
+  // everything tuned so far.
+  char value[32];
+  if (httpd_query_key_value(buf, "sweep", value, sizeof(value)) == ESP_OK) {
+    free(buf);
+    uint8_t sizes[TUNER_MAX_SWEEP_SIZES];
+    uint8_t count = 0;
+    for (char *p = value; *p;) {
+      char *end;
+      int size = strtol(p, &end, 10);
+      if (end == p || size < 0 || size >= FRAMESIZE_INVALID || count == TUNER_MAX_SWEEP_SIZES) {
+        httpd_resp_set_status(req, "400 Bad Request");
+        return httpd_resp_send(req, NULL, 0);
+      }
+      sizes[count++] = size;
+      p = end;
+      while (*p == ',') {
+        p++;
+      }
+    }
+    if (count == 0) {
+      sizes[count++] = esp_camera_sensor_get()->status.framesize;
+    }
+    if (!camera_tuner.requestSweep(sizes, count)) {
+      return httpd_resp_send_500(req);
+    }
+    httpd_resp_set_status(req, "202 Accepted");
+    httpd_resp_set_type(req, "application/json");
+    static const char scheduled[] = "{\"sweep\":\"scheduled\",\"restarting\":true}";
+    httpd_resp_send(req, scheduled, sizeof(scheduled) - 1);
+
+    // Give the response time to leave before the radio goes down.
+    vTaskDelay(pdMS_TO_TICKS(500));
+    ESP.restart();
+    return ESP_OK;
+  }
+  bool clear = parse_get_var(buf, "clear", 0);
+  free(buf);
+  if (clear && !camera_tuner.clear()) {
+    return httpd_resp_send_500(req);
+  }
+  return send_tune(req);
+}
+
+static void clip_mjpeg(ClipReader *reader) {
+  MjpegPacketizer packetizer;
+  if (MjpegPacketizer::beginResponse(reader->req) != ESP_OK) {
+    return;
+  }
+
+  // Frames go out of the ring as they are, and each one is released to the recorder once sent.
+  uint32_t seq = 0;
+  ClipFrame frame;
+  for (;;) {
+    if (!clip_ring.next(reader, seq, &frame)) {
+      if (esp_timer_get_time() > reader->untilUs + CLIP_SETTLE_US) {
+        return;
+      }
+      clip_ring.waitForFrameAfter(seq, CLIP_FRAME_INTERVAL);
+      continue;
+    }
+    if ((int64_t)frame.timestamp.tv_sec * 1000000 + frame.timestamp.tv_usec > reader->untilUs) {
+      return;
+    }
+    if (packetizer.sendFrame(reader->fd, clip_ring.data(frame), frame.len, frame.timestamp) != ESP_OK) {
+      log_e("Send clip frame failed");
+      return;
+    }
+    seq = frame.seq;
+    clip_ring.advance(reader, seq + 1);
+  }
+}
+
+static void clip_avi(ClipReader *reader) {
+  // The header holds the frame count and sizes, so wait for the window to close before sending anything.
+  int64_t wait = reader->untilUs + CLIP_SETTLE_US - esp_timer_get_time();
+  if (wait > 0) {
+    vTaskDelay(pdMS_TO_TICKS(wait / 1000) + 1);
+  }
+
+  // The reader pins the whole window, so three passes over it see the same frames.
+  AviPacketizer packetizer;
+  ClipFrame frame, first;
+  uint32_t frames = 0, moviBytes = 0, maxFrameBytes = 0;
+  int64_t firstUs = 0, lastUs = 0;
+  for (uint32_t seq = 0; clip_ring.next(reader, seq, &frame); seq = frame.seq) {
+    lastUs = (int64_t)frame.timestamp.tv_sec * 1000000 + frame.timestamp.tv_usec;
+    if (lastUs > reader->untilUs) {
+      break;
+    }
+    if (!frames++) {
+      first = frame;
+      firstUs = lastUs;
+    }
+    moviBytes += AviPacketizer::chunkBytes(frame.len);
+    maxFrameBytes = max(maxFrameBytes, frame.len);
+  }
+  if (!frames) {
+    httpd_resp_send_404(reader->req);
+    return;
+  }
+  uint32_t usPerFrame = (frames > 1) ? (uint32_t)((lastUs - firstUs) / (frames - 1)) : 100000;
+
+  if (AviPacketizer::beginResponse(reader->req, frames, moviBytes, reader->name) != ESP_OK) {
+    return;
+  }
+  if (packetizer.sendHeader(reader->fd, first.width, first.height, frames, usPerFrame, moviBytes, maxFrameBytes) != ESP_OK) {
+    return;
+  }
+  uint32_t sent = 0;
+  for (uint32_t seq = 0; sent < frames && clip_ring.next(reader, seq, &frame); seq = frame.seq, sent++) {
+    if (packetizer.sendFrame(reader->fd, clip_ring.data(frame), frame.len) != ESP_OK) {
+      log_e("Send clip frame failed");
+      return;
+    }
+  }
+  if (packetizer.beginIndex(reader->fd, frames) != ESP_OK) {
+    return;
+  }
+  sent = 0;
+  for (uint32_t seq = 0; sent < frames && clip_ring.next(reader, seq, &frame); seq = frame.seq, sent++) {
+    if (packetizer.addIndex(reader->fd, frame.len) != ESP_OK) {
+      return;
+    }
+  }
+  packetizer.endIndex(reader->fd);
+}
+
+static void clip_sender_task(void *pvParams) {
+  ClipReader *reader = (ClipReader *)pvParams;
+
+  if (reader->format == CLIP_AVI) {
+    clip_avi(reader);
+  } else {
+    clip_mjpeg(reader);
+  }
+
+  // Both formats end mid-connection, so give the request back and close the socket.
+  httpd_handle_t handle = reader->req->handle;
+  httpd_req_async_handler_complete(reader->req);
+  httpd_sess_trigger_close(handle, reader->fd);
+  clip_ring.close(reader);
+  vTaskDelete(NULL);
+}
+
+static esp_err_t clip_handler(httpd_req_t *req) {
+  if (reject_over_limit(req, rate_peer_address(httpd_req_to_sockfd(req)))) {
+    return ESP_OK;
+  }
+  int event = 0;
+  int pre = CLIP_DEFAULT_PRE_S;
+  int post = CLIP_DEFAULT_POST_S;
+  char format[8] = "mjpeg";
+  char *buf = NULL;
+  if (httpd_req_get_url_query_len(req) && parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  if (buf) {
+    event = parse_get_var(buf, "event", 0);
+    pre = parse_get_var(buf, "pre", pre);
+    post = parse_get_var(buf, "post", post);
+    httpd_query_key_value(buf, "format", format, sizeof(format));
+    free(buf);
+  }
+  pre = constrain(pre, 0, CLIP_MAX_WINDOW_S);
+  post = constrain(post, 0, CLIP_MAX_WINDOW_S - pre);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+
+  // Around a motion event, or around now for an external trigger.
+  int64_t now = esp_timer_get_time();
+  int64_t from = now;
+  int64_t until = now;
+  uint32_t name = now / 1000000;
+  if (event > 0) {
+    MotionEvent e;
+    if (!motion_detector.getEvent(event, &e)) {
+      return httpd_resp_send_404(req);
+    }
+    from = (int64_t)e.started.tv_sec * 1000000 + e.started.tv_usec;
+    until = e.open ? now : (int64_t)e.ended.tv_sec * 1000000 + e.ended.tv_usec;
+    name = event;
+  }
+  from -= (int64_t)pre * 1000000;
+  until += (int64_t)post * 1000000;
+
+  ClipReader *reader = clip_ring.open(from, until, strcmp(format, "avi") ? CLIP_MJPEG : CLIP_AVI, name);
+  if (!reader) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  // Post-trigger frames take seconds to arrive, so the export runs on its own task like a stream.
+  if (httpd_req_async_handler_begin(req, &reader->req) != ESP_OK) {
+    clip_ring.close(reader);
+    return httpd_resp_send_500(req);
+  }
+  reader->fd = httpd_req_to_sockfd(req);
+  struct timeval timeout = { .tv_sec = CLIP_SEND_TIMEOUT_S, .tv_usec = 0 };
+  setsockopt(reader->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  BaseType_t res = xTaskCreatePinnedToCore(
+    &clip_sender_task,        // Pointer to task function.
+    "clip_sender_task",       // Task name.
+    CLIP_SENDER_TASK_DEPTH,   // Size of stack allocated to the task (in bytes).
+    reader,                   // Pointer to parameters used for task creation.
+    1,                        // Task priority level.
+    &reader->task,            // Pointer to task handle.
+    1                         // Core that the task will run on.
+  );
+  if (res != pdPASS) {
+    log_e("Failed to create Clip Sender Task.");
+    httpd_req_async_handler_complete(reader->req);
+    httpd_sess_trigger_close(req->handle, reader->fd);
+    clip_ring.close(reader);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t index_handler(httpd_req_t *req) {
+  // Pick the page written for this sensor, falling back to the first one.
+  sensor_t *s = esp_camera_sensor_get();
+  const web_asset_t *asset = &web_assets[0];
+  for (size_t i = 0; s && i < web_assets_len; i++) {
+    if (web_assets[i].pid == s->id.PID) {
+      asset = &web_assets[i];
+      break;
+    }
+  }
+
+  httpd_resp_set_hdr(req, "ETag", asset->etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=86400");
+  httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+
+  // Repeat visits revalidate for the cost of a header exchange.
+  char match[64];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK && strstr(match, asset->etag)) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  // Sent straight from flash, already compressed.
+  httpd_resp_set_type(req, "text/html");
+  httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  return httpd_resp_send(req, (const char *)asset->data, asset->len);
+}
+
+static int apply_stream_settings(int quality, framesize_t framesize) {
+  sensor_t *s = esp_camera_sensor_get();
+  invalidate_status();
+  int res = s->set_quality(s, quality);
+  if (s->pixformat == PIXFORMAT_JPEG && s->status.framesize != framesize) {
+    int sized = s->set_framesize(s, framesize);
+    if (sized == 0) {
+      conversion_pool.reset(framesize);
+    }
+    res |= sized;
+  }
+  return res;
+}
+
+void startCameraServer(){
+  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.server_port = 80;
+  // Streams run on their own sender tasks and keep their sockets open alongside control requests.
+  config.max_open_sockets = MAX_STREAM_CLIENTS + 4;
+  config.max_uri_handlers = 24;
+  config.close_fn = stream_sess_close;
+
+httpd_uri_t index_uri = {
+    .uri = "/",
+    .method = HTTP_GET,
+    .handler = index_handler,
+    .user_ctx = NULL
+};
+
+  httpd_uri_t stream_uri = {
+    .uri       = "/stream",
+    .method    = HTTP_GET,
     .handler   = stream_handler,
     .user_ctx  = NULL
   };
-
+/*
   httpd_uri_t fps_uri = {
     .uri = "/fps",
     .method = HTTP_GET,
@@ -665,12 +1755,203 @@ httpd_uri_t index_uri = {
   .handler   = capture_handler,
   .user_ctx  = NULL
 };
+
+  httpd_uri_t cmd_uri = {
+    .uri       = "/control",
+    .method    = HTTP_GET,
+    .handler   = cmd_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t batch_uri = {
+    .uri       = "/batch",
+    .method    = HTTP_GET,
+    .handler   = batch_handler,
+    .user_ctx  = NULL
+  };
+
+#if CONFIG_HTTPD_WS_SUPPORT
+  httpd_uri_t ws_uri = {
+    .uri       = "/ws",
+    .method    = HTTP_GET,
+    .handler   = ws_handler,
+    .user_ctx  = NULL,
+    .is_websocket = true,
+    .handle_ws_control_frames = true,
+    .supported_subprotocol = NULL
+  };
+#endif
+
+  httpd_uri_t crop_uri = {
+    .uri       = "/crop",
+    .method    = HTTP_GET,
+    .handler   = crop_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t thumb_uri = {
+    .uri       = "/thumb",
+    .method    = HTTP_GET,
+    .handler   = thumb_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t motion_uri = {
+    .uri       = "/motion",
+    .method    = HTTP_GET,
+    .handler   = motion_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t tune_uri = {
+    .uri       = "/tune",
+    .method    = HTTP_GET,
+    .handler   = tune_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t tune_update_uri = {
+    .uri       = "/tune",
+    .method    = HTTP_POST,
+    .handler   = tune_update_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t clip_uri = {
+    .uri       = "/clip",
+    .method    = HTTP_GET,
+    .handler   = clip_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t metrics_uri = {
+    .uri       = "/metrics",
+    .method    = HTTP_GET,
+    .handler   = metrics_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t bmp_uri = {
+    .uri       = "/bmp",
+    .method    = HTTP_GET,
+    .handler   = bmp_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t xclk_uri = {
+    .uri       = "/xclk",
+    .method    = HTTP_GET,
+    .handler   = xclk_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t reg_uri = {
+    .uri       = "/reg",
+    .method    = HTTP_GET,
+    .handler   = reg_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t greg_uri = {
+    .uri       = "/greg",
+    .method    = HTTP_GET,
+    .handler   = greg_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t pll_uri = {
+    .uri       = "/pll",
+    .method    = HTTP_GET,
+    .handler   = pll_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t win_uri = {
+    .uri       = "/resolution",
+    .method    = HTTP_GET,
+    .handler   = win_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t status_uri = {
+    .uri       = "/status",
+    .method    = HTTP_GET,
+    .handler   = status_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t streams_uri = {
+    .uri       = "/streams",
+    .method    = HTTP_GET,
+    .handler   = streams_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t limits_uri = {
+    .uri       = "/limits",
+    .method    = HTTP_GET,
+    .handler   = limits_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t limits_update_uri = {
+    .uri       = "/limits",
+    .method    = HTTP_POST,
+    .handler   = limits_update_handler,
+    .user_ctx  = NULL
+  };
   
+  // Let stream backpressure step quality and frame size down from what the sensor starts with.
+  sensor_t *s = esp_camera_sensor_get();
+  adaptive_quality.registerApplyCallBack(apply_stream_settings);
+  if (s) {
+    adaptive_quality.setCeiling(s->status.quality, s->status.framesize);
+  }
+
+  // Per-client budgets for image requests and bytes, as the policy and trusted addresses in NVS set them.
+  rate_limiter.begin();
+  thumbnail_cache.begin();
+
+  // Long-polls wait for their frame off the httpd worker.
+  long_poll_queue = xQueueCreate(LONG_POLL_MAX_WAITERS, sizeof(long_poll_t));
+  long_poll_slots = xSemaphoreCreateCounting(LONG_POLL_MAX_WAITERS, LONG_POLL_MAX_WAITERS);
+  if (long_poll_queue == NULL || long_poll_slots == NULL ||
+      xTaskCreatePinnedToCore(&long_poll_task, "long_poll_task", LONG_POLL_TASK_DEPTH, NULL, 1, NULL, 1) != pdPASS) {
+    log_e("Failed to create Long Poll Task.");
+    long_poll_slots = NULL;
+  }
+
+  // Measure what a metrics sample costs on this board. Exported as sentrycam_metrics_record_cycles.
+  metrics.benchmark();
+
   //Serial.printf("Starting web server on port: '%d'\n", config.server_port);
   if (httpd_start(&stream_httpd, &config) == ESP_OK) {
-   // httpd_register_uri_handler(stream_httpd, &stream_uri);
+    httpd_register_uri_handler(stream_httpd, &index_uri);
+    httpd_register_uri_handler(stream_httpd, &stream_uri);
+#if CONFIG_HTTPD_WS_SUPPORT
+    httpd_register_uri_handler(stream_httpd, &ws_uri);
+#endif
    // httpd_register_uri_handler(stream_httpd, &fps_uri);
     httpd_register_uri_handler(stream_httpd, &capture_uri); 
+    httpd_register_uri_handler(stream_httpd, &cmd_uri);
+    httpd_register_uri_handler(stream_httpd, &batch_uri);
+    httpd_register_uri_handler(stream_httpd, &status_uri);
+    httpd_register_uri_handler(stream_httpd, &crop_uri);
+    httpd_register_uri_handler(stream_httpd, &thumb_uri);
+    httpd_register_uri_handler(stream_httpd, &motion_uri);
+    httpd_register_uri_handler(stream_httpd, &tune_uri);
+    httpd_register_uri_handler(stream_httpd, &tune_update_uri);
+    httpd_register_uri_handler(stream_httpd, &clip_uri);
+    httpd_register_uri_handler(stream_httpd, &metrics_uri);
+    httpd_register_uri_handler(stream_httpd, &bmp_uri);
+    httpd_register_uri_handler(stream_httpd, &xclk_uri);
+    httpd_register_uri_handler(stream_httpd, &reg_uri);
+    httpd_register_uri_handler(stream_httpd, &greg_uri);
+    httpd_register_uri_handler(stream_httpd, &pll_uri);
+    httpd_register_uri_handler(stream_httpd, &win_uri);
+    httpd_register_uri_handler(stream_httpd, &streams_uri);
+    httpd_register_uri_handler(stream_httpd, &limits_uri);
+    httpd_register_uri_handler(stream_httpd, &limits_update_uri);
   }
 }
 
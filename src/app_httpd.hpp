@@ -19,6 +19,7 @@
 #include "esp32-hal-ledc.h"
 #include "sdkconfig.h"
 #include "camera_index.h"
+#include "JsonWriter.h"
 #include <Arduino.h>
 
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
@@ -44,11 +45,6 @@ typedef struct {
   size_t len;
 } jpg_chunking_t;
 
-#define PART_BOUNDARY "123456789000000000000987654321"
-static const char *_STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
-static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\n\r\n";
-
 extern httpd_handle_t stream_httpd;
 extern httpd_handle_t camera_httpd;
 
@@ -104,7 +100,7 @@ static esp_err_t parse_get(httpd_req_t *req, char **obuf);
 
 static esp_err_t cmd_handler(httpd_req_t *req);
 
-static int print_reg(char *p, sensor_t *s, uint16_t reg, uint32_t mask);
+static void print_reg(JsonWriter &json, sensor_t *s, uint16_t reg, uint32_t mask);
 
 static esp_err_t status_handler(httpd_req_t *req);
 
@@ -120,9 +116,6 @@ static esp_err_t pll_handler(httpd_req_t *req);
 
 static esp_err_t win_handler(httpd_req_t *req);
 
-static uint8_t *last_good_frame = NULL;
-static size_t last_good_len = 0;
-
 static esp_err_t capture_handler(httpd_req_t *req);
 
 void startCameraServer();
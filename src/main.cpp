@@ -3,6 +3,9 @@
 #include <WiFi.h>
 #include "EspNowNode.h"
 #include "app_httpd.hpp"
+#include "FrameBroadcaster.h"
+#include "MotionDetector.h"
+#include "ClipRing.h"
 
 // Struct to control camera and esp now together;
 struct _cam_module {
@@ -92,6 +95,13 @@ void camera_watchdog_task(void *pvParams) {
     // Initialize Sentry Camera Module and connect to Wi-Fi.
     camera->initCamera();
     log_e("init camera.");
+    frame_broadcaster.start();
+    frame_broadcaster.setContinuous(true);
+    log_e("start capture task.");
+    motion_detector.start();
+    log_e("start motion task.");
+    clip_ring.begin(CLIP_RING_BYTES);
+    log_e("start clip recorder.");
     camera->setupWifi();
     log_e("start up wifi.");
     startCameraServer();
@@ -0,0 +1,21 @@
+// Generated by scripts/generate_web_assets.py from camera_index.h. Do not edit.
+#ifndef WEB_ASSETS
+#define WEB_ASSETS
+
+// camera_index.h has no include guard, so include this after it and esp_camera.h.
+
+typedef struct {
+  uint16_t pid;              // Sensor the page is written for.
+  const unsigned char *data; // Gzip-compressed page, in flash.
+  size_t len;                // Compressed length.
+  const char *etag;          // Content hash of data.
+} web_asset_t;
+
+static const web_asset_t web_assets[] = {
+  {OV2640_PID, index_ov2640_html_gz, 6578, "\"72f32e30\""},
+  {OV3660_PID, index_ov3660_html_gz, 8636, "\"63753829\""},
+  {OV5640_PID, index_ov5640_html_gz, 8880, "\"26ff2853\""},
+};
+static const size_t web_assets_len = sizeof(web_assets) / sizeof(web_assets[0]);
+
+#endif /* web_assets.h */
@@ -0,0 +1,183 @@
+// Hysteresis and step order of the backpressure-driven quality and frame size controller.
+//
+//   pio test -e native -f test_adaptive_quality
+#include <unity.h>
+#include "AdaptiveQuality.h"
+
+static int applied_quality = -1;
+static framesize_t applied_framesize = FRAMESIZE_INVALID;
+static uint32_t applied_count = 0;
+
+static int record_apply(int quality, framesize_t framesize) {
+    applied_quality = quality;
+    applied_framesize = framesize;
+    applied_count++;
+    return 0;
+}
+
+// A sender report that is over budget, one in the dead band between the thresholds, and one well inside.
+static void congested(AdaptiveQuality &aq, int n, bool trusted = true, int stream = 0) {
+    for(int i = 0; i < n; i++) aq.observe(stream, 10, AQ_LAG_FRAMES, trusted);
+}
+
+static void between(AdaptiveQuality &aq, int n, bool trusted = true, int stream = 0) {
+    for(int i = 0; i < n; i++) aq.observe(stream, 10, 1, trusted);
+}
+
+static void clear(AdaptiveQuality &aq, int n, bool trusted = true, int stream = 0) {
+    for(int i = 0; i < n; i++) aq.observe(stream, 10, 0, trusted);
+}
+
+// Start from the operator's VGA at quality 10, past the settling samples that follow setCeiling().
+static void start(AdaptiveQuality &aq) {
+    TEST_ASSERT_TRUE(aq.registerApplyCallBack(&record_apply));
+    aq.setCeiling(10, FRAMESIZE_VGA);
+    clear(aq, AQ_SETTLE_SAMPLES);
+}
+
+void setUp() {
+    applied_quality = -1;
+    applied_framesize = FRAMESIZE_INVALID;
+    applied_count = 0;
+}
+
+void tearDown() {}
+
+static void test_short_congestion_runs_change_nothing() {
+    AdaptiveQuality aq;
+    start(aq);
+
+    // Any sample that is not congested breaks the run.
+    for(int i = 0; i < 5; i++) {
+        congested(aq, AQ_DEGRADE_AFTER - 1);
+        between(aq, 1);
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, aq.getStepCount());
+    TEST_ASSERT_EQUAL_INT(10, aq.getQuality());
+
+    congested(aq, AQ_DEGRADE_AFTER);
+    TEST_ASSERT_EQUAL_UINT32(1, aq.getStepCount());
+    TEST_ASSERT_EQUAL_INT(10 + AQ_QUALITY_STEP, aq.getQuality());
+    TEST_ASSERT_EQUAL_INT(10 + AQ_QUALITY_STEP, applied_quality);
+    TEST_ASSERT_EQUAL_INT(FRAMESIZE_VGA, applied_framesize);
+}
+
+static void test_samples_after_a_change_are_ignored() {
+    AdaptiveQuality aq;
+    start(aq);
+    congested(aq, AQ_DEGRADE_AFTER);
+    TEST_ASSERT_EQUAL_UINT32(1, aq.getStepCount());
+
+    // The sensor needs a few frames to settle, so the next run only starts counting after them.
+    congested(aq, AQ_SETTLE_SAMPLES + AQ_DEGRADE_AFTER - 1);
+    TEST_ASSERT_EQUAL_UINT32(1, aq.getStepCount());
+    congested(aq, 1);
+    TEST_ASSERT_EQUAL_UINT32(2, aq.getStepCount());
+}
+
+static void test_quality_drops_before_frame_size() {
+    AdaptiveQuality aq;
+    start(aq);
+
+    int quality = 10;
+    while(quality < AQ_QUALITY_WORST) {
+        congested(aq, AQ_SETTLE_SAMPLES + AQ_DEGRADE_AFTER);
+        quality += AQ_QUALITY_STEP;
+        TEST_ASSERT_EQUAL_INT(quality, aq.getQuality());
+        TEST_ASSERT_EQUAL_INT(FRAMESIZE_VGA, aq.getFramesize());
+    }
+
+    // At the worst quality the frame shrinks one rung and quality goes back to the operator's.
+    congested(aq, AQ_SETTLE_SAMPLES + AQ_DEGRADE_AFTER);
+    TEST_ASSERT_EQUAL_INT(FRAMESIZE_CIF, aq.getFramesize());
+    TEST_ASSERT_EQUAL_INT(10, aq.getQuality());
+    TEST_ASSERT_EQUAL_INT(FRAMESIZE_CIF, applied_framesize);
+}
+
+static void test_recovery_needs_a_long_clear_run() {
+    AdaptiveQuality aq;
+    start(aq);
+    congested(aq, AQ_DEGRADE_AFTER);
+    TEST_ASSERT_EQUAL_INT(10 + AQ_QUALITY_STEP, aq.getQuality());
+
+    clear(aq, AQ_SETTLE_SAMPLES + AQ_UPGRADE_AFTER - 1);
+    between(aq, 1);
+    clear(aq, AQ_UPGRADE_AFTER - 1);
+    TEST_ASSERT_EQUAL_INT(10 + AQ_QUALITY_STEP, aq.getQuality());
+    clear(aq, 1);
+    TEST_ASSERT_EQUAL_INT(10, aq.getQuality());
+
+    // Never past what the operator asked for.
+    uint32_t steps = aq.getStepCount();
+    clear(aq, AQ_SETTLE_SAMPLES + 3 * AQ_UPGRADE_AFTER);
+    TEST_ASSERT_EQUAL_UINT32(steps, aq.getStepCount());
+    TEST_ASSERT_EQUAL_INT(10, aq.getQuality());
+}
+
+static void test_recovery_restores_frame_size_first() {
+    AdaptiveQuality aq;
+    start(aq);
+    while(aq.getFramesize() == FRAMESIZE_VGA) congested(aq, AQ_SETTLE_SAMPLES + AQ_DEGRADE_AFTER);
+    TEST_ASSERT_EQUAL_INT(FRAMESIZE_CIF, aq.getFramesize());
+
+    // Back to VGA at the worst quality, then quality climbs back a step at a time.
+    clear(aq, AQ_SETTLE_SAMPLES + AQ_UPGRADE_AFTER);
+    TEST_ASSERT_EQUAL_INT(FRAMESIZE_VGA, aq.getFramesize());
+    TEST_ASSERT_EQUAL_INT(AQ_QUALITY_WORST, aq.getQuality());
+    clear(aq, AQ_SETTLE_SAMPLES + AQ_UPGRADE_AFTER);
+    TEST_ASSERT_EQUAL_INT(AQ_QUALITY_WORST - AQ_QUALITY_STEP, aq.getQuality());
+}
+
+static void test_untrusted_stream_alone_only_costs_some_quality() {
+    AdaptiveQuality aq;
+    start(aq);
+    clear(aq, 1, true, 1);
+
+    for(int i = 0; i < 10; i++) congested(aq, AQ_SETTLE_SAMPLES + AQ_DEGRADE_AFTER, false, 0);
+    TEST_ASSERT_EQUAL_INT(AQ_UNTRUSTED_QUALITY_WORST, aq.getQuality());
+    TEST_ASSERT_EQUAL_INT(FRAMESIZE_VGA, aq.getFramesize());
+
+    // A congested trusted stream still lets it go all the way.
+    for(int i = 0; i < 10; i++) {
+        congested(aq, 1, false, 0);
+        congested(aq, AQ_SETTLE_SAMPLES + AQ_DEGRADE_AFTER, true, 1);
+    }
+    TEST_ASSERT_EQUAL_INT(FRAMESIZE_CIF, aq.getFramesize());
+}
+
+static void test_forgotten_stream_no_longer_counts() {
+    AdaptiveQuality aq;
+    start(aq);
+    congested(aq, 1, true, 2);
+    aq.forget(2);
+
+    // Only stream 0 is left and it is clear, so nothing is held back.
+    clear(aq, AQ_DEGRADE_AFTER * 4);
+    TEST_ASSERT_EQUAL_UINT32(0, aq.getStepCount());
+}
+
+static void test_disabling_restores_the_ceiling() {
+    AdaptiveQuality aq;
+    start(aq);
+    congested(aq, AQ_DEGRADE_AFTER);
+    TEST_ASSERT_EQUAL_INT(10 + AQ_QUALITY_STEP, aq.getQuality());
+
+    aq.setEnabled(false);
+    TEST_ASSERT_EQUAL_INT(10, aq.getQuality());
+    TEST_ASSERT_EQUAL_INT(10, applied_quality);
+    congested(aq, AQ_SETTLE_SAMPLES + AQ_DEGRADE_AFTER * 4);
+    TEST_ASSERT_EQUAL_INT(10, aq.getQuality());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_short_congestion_runs_change_nothing);
+    RUN_TEST(test_samples_after_a_change_are_ignored);
+    RUN_TEST(test_quality_drops_before_frame_size);
+    RUN_TEST(test_recovery_needs_a_long_clear_run);
+    RUN_TEST(test_recovery_restores_frame_size_first);
+    RUN_TEST(test_untrusted_stream_alone_only_costs_some_quality);
+    RUN_TEST(test_forgotten_stream_no_longer_counts);
+    RUN_TEST(test_disabling_restores_the_ceiling);
+    return UNITY_END();
+}
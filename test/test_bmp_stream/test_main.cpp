@@ -0,0 +1,175 @@
+// The streaming BMP encoder against a whole bitmap built the way the driver's fmt2bmp() builds it:
+// a 54 byte header, the grayscale palette if any, then every pixel through fmt2rgb888().
+//
+//   pio test -e native -f test_bmp_stream
+#include <unity.h>
+#include "BmpStream.h"
+#include <vector>
+
+struct collected {
+    std::vector<uint8_t> data;
+    size_t calls;
+    size_t largest;
+    size_t failAt;      // Call that reports a short write, or 0 for none.
+    bool inOrder;
+};
+
+static size_t collect(void *arg, size_t index, const void *data, size_t len) {
+    collected *out = (collected *)arg;
+    out->calls++;
+    if(out->calls == out->failAt) return 0;
+    if(index != out->data.size()) out->inOrder = false;
+    out->largest = max(out->largest, len);
+    out->data.insert(out->data.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+    return len;
+}
+
+static collected stream(const uint8_t *src, size_t len, uint16_t width, uint16_t height, pixformat_t format, bool *ok, size_t failAt = 0) {
+    collected out = { {}, 0, 0, failAt, true };
+    *ok = fmt2bmp_cb(src, len, width, height, format, collect, &out);
+    return out;
+}
+
+static void put_u32(std::vector<uint8_t> &bmp, size_t at, uint32_t v) {
+    for(int i = 0; i < 4; i++) bmp[at + i] = v >> (8 * i);
+}
+
+static std::vector<uint8_t> reference_bmp(const uint8_t *src, size_t len, uint16_t width, uint16_t height, pixformat_t format) {
+    bool gray = (format == PIXFORMAT_GRAYSCALE);
+    size_t palette = gray ? 1024 : 0;
+    size_t image = (size_t)width * height * (gray ? 1 : 3);
+    std::vector<uint8_t> bmp(54 + palette + image, 0);
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    put_u32(bmp, 2, bmp.size());
+    put_u32(bmp, 10, 54 + palette);
+    put_u32(bmp, 14, 40);
+    put_u32(bmp, 18, width);
+    put_u32(bmp, 22, -(int32_t)height);
+    bmp[26] = 1;
+    bmp[28] = gray ? 8 : 24;
+    put_u32(bmp, 34, image);
+    put_u32(bmp, 38, 2835);
+    put_u32(bmp, 42, 2835);
+    put_u32(bmp, 46, gray ? 256 : 0);
+    put_u32(bmp, 50, gray ? 256 : 0);
+    if(gray) {
+        for(int i = 0; i < 256; i++) bmp[54 + i * 4] = bmp[55 + i * 4] = bmp[56 + i * 4] = i;
+        memcpy(bmp.data() + 54 + palette, src, image);
+    } else {
+        TEST_ASSERT_TRUE(fmt2rgb888(src, len, format, bmp.data() + 54));
+    }
+    return bmp;
+}
+
+// A raw frame with a different value in every byte of a row and in every row.
+static std::vector<uint8_t> pattern(uint16_t width, uint16_t height, uint8_t bytesPerPixel) {
+    std::vector<uint8_t> data((size_t)width * height * bytesPerPixel);
+    for(size_t i = 0; i < data.size(); i++) data[i] = (uint8_t)(i * 7 + i / (width * bytesPerPixel) * 13);
+    return data;
+}
+
+static void check_identical(const std::vector<uint8_t> &src, uint16_t width, uint16_t height, pixformat_t format) {
+    bool ok = false;
+    collected out = stream(src.data(), src.size(), width, height, format, &ok);
+    TEST_ASSERT_TRUE(ok);
+    TEST_ASSERT_TRUE(out.inOrder);
+    std::vector<uint8_t> expected = reference_bmp(src.data(), src.size(), width, height, format);
+    TEST_ASSERT_EQUAL_size_t(expected.size(), out.data.size());
+    TEST_ASSERT_EQUAL_MEMORY(expected.data(), out.data.data(), expected.size());
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_grayscale_matches_fmt2bmp() {
+    check_identical(pattern(96, 96, 1), 96, 96, PIXFORMAT_GRAYSCALE);
+}
+
+static void test_rgb565_matches_fmt2bmp() {
+    // 960 byte BMP rows, so a chunk holds four and the last chunk is a partial one.
+    check_identical(pattern(320, 43, 2), 320, 43, PIXFORMAT_RGB565);
+}
+
+static void test_wide_rows_go_out_one_at_a_time() {
+    // A row wider than a chunk still goes out whole.
+    std::vector<uint8_t> src = pattern(1600, 3, 2);
+    check_identical(src, 1600, 3, PIXFORMAT_RGB565);
+    bool ok = false;
+    collected out = stream(src.data(), src.size(), 1600, 3, PIXFORMAT_RGB565, &ok);
+    TEST_ASSERT_EQUAL_size_t(1600 * 3, out.largest);
+}
+
+static void test_jpeg_matches_fmt2bmp() {
+    // Odd sizes leave a partial MCU at the right and at the bottom.
+    const uint16_t width = 171;
+    const uint16_t height = 53;
+    std::vector<uint8_t> raw = pattern(width, height, 2);
+    uint8_t *jpg = NULL;
+    size_t len = 0;
+    TEST_ASSERT_TRUE(fmt2jpg(raw.data(), raw.size(), width, height, PIXFORMAT_RGB565, 80, &jpg, &len));
+    std::vector<uint8_t> src(jpg, jpg + len);
+    free(jpg);
+
+    check_identical(src, width, height, PIXFORMAT_JPEG);
+}
+
+static void test_frame_uses_its_own_geometry() {
+    std::vector<uint8_t> src = pattern(64, 48, 2);
+    camera_fb_t fb = {};
+    fb.buf = src.data();
+    fb.len = src.size();
+    fb.width = 64;
+    fb.height = 48;
+    fb.format = PIXFORMAT_RGB565;
+    collected out = { {}, 0, 0, 0, true };
+    TEST_ASSERT_TRUE(frame2bmp_cb(&fb, collect, &out));
+    std::vector<uint8_t> expected = reference_bmp(src.data(), src.size(), 64, 48, PIXFORMAT_RGB565);
+    TEST_ASSERT_EQUAL_size_t(expected.size(), out.data.size());
+    TEST_ASSERT_EQUAL_MEMORY(expected.data(), out.data.data(), expected.size());
+}
+
+static void test_short_write_stops_the_stream() {
+    std::vector<uint8_t> src = pattern(320, 43, 2);
+    bool ok = true;
+    collected out = stream(src.data(), src.size(), 320, 43, PIXFORMAT_RGB565, &ok, 3);
+    TEST_ASSERT_FALSE(ok);
+    TEST_ASSERT_EQUAL_size_t(3, out.calls);
+
+    uint8_t *jpg = NULL;
+    size_t len = 0;
+    TEST_ASSERT_TRUE(fmt2jpg(src.data(), src.size(), 320, 43, PIXFORMAT_RGB565, 80, &jpg, &len));
+    out = stream(jpg, len, 320, 43, PIXFORMAT_JPEG, &ok, 2);
+    free(jpg);
+    TEST_ASSERT_FALSE(ok);
+    TEST_ASSERT_EQUAL_size_t(2, out.calls);
+}
+
+static void test_bad_sources_are_refused() {
+    std::vector<uint8_t> src = pattern(32, 32, 2);
+    bool ok = true;
+    // One row short.
+    collected out = stream(src.data(), src.size() - 64, 32, 32, PIXFORMAT_RGB565, &ok);
+    TEST_ASSERT_FALSE(ok);
+    TEST_ASSERT_EQUAL_size_t(0, out.calls);
+
+    out = stream(src.data(), src.size(), 32, 32, PIXFORMAT_RAW, &ok);
+    TEST_ASSERT_FALSE(ok);
+    TEST_ASSERT_EQUAL_size_t(0, out.calls);
+
+    out = stream(src.data(), src.size(), 32, 32, PIXFORMAT_JPEG, &ok);
+    TEST_ASSERT_FALSE(ok);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_grayscale_matches_fmt2bmp);
+    RUN_TEST(test_rgb565_matches_fmt2bmp);
+    RUN_TEST(test_wide_rows_go_out_one_at_a_time);
+    RUN_TEST(test_jpeg_matches_fmt2bmp);
+    RUN_TEST(test_frame_uses_its_own_geometry);
+    RUN_TEST(test_short_write_stops_the_stream);
+    RUN_TEST(test_bad_sources_are_refused);
+    return UNITY_END();
+}
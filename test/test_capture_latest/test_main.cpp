@@ -0,0 +1,185 @@
+// /capture answered from the continuously refreshed latest frame, and ?after= long polls, against the
+// simulated camera running slower than a request takes.
+//
+//   pio test -e native -f test_capture_latest
+#include <unity.h>
+#include "esp_camera.h"
+#include "esp_timer.h"
+#include "SentryCamera.h"
+#include "FrameBroadcaster.h"
+#include "MotionDetector.h"
+#include "ClipRing.h"
+#include "SimCamera.h"
+#include "Sim.h"
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+
+const uint16_t TEST_PORT = 18932;
+const float TEST_FPS = 4;
+const int64_t TEST_FRAME_US = 250000;
+
+// From app_httpd.cpp.
+void startCameraServer();
+
+// Reads from fd until the response holds what is wanted, the peer closes or the read times out.
+static bool receive(int fd, std::string *response, size_t want) {
+    char buf[4096];
+    while(response->size() < want) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n <= 0) return false;
+        response->append(buf, n);
+    }
+    return true;
+}
+
+// One GET on its own connection. Returns the status code and the X-Frame-Seq it carried, or 0.
+static int get(const char *path, uint32_t *seq = NULL) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return 0;
+    struct timeval timeout = { 5, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TEST_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    char head[256];
+    int len = snprintf(head, sizeof(head), "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", path);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || send(fd, head, len, 0) != len) {
+        close(fd);
+        return 0;
+    }
+
+    std::string response;
+    size_t end;
+    while((end = response.find("\r\n\r\n")) == std::string::npos) {
+        if(!receive(fd, &response, response.size() + 1)) {
+            close(fd);
+            return 0;
+        }
+    }
+    size_t field = response.find("Content-Length: ");
+    bool ok = field < end && receive(fd, &response, end + 4 + strtoul(response.c_str() + field + 16, NULL, 10));
+    close(fd);
+
+    int status = 0;
+    if(!ok || sscanf(response.c_str(), "HTTP/1.1 %d", &status) != 1) return 0;
+    field = response.find("X-Frame-Seq: ");
+    if(seq) *seq = (field < end) ? strtoul(response.c_str() + field + 13, NULL, 10) : 0;
+    return status;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_capture_does_not_wait_for_the_sensor() {
+    // A frame every 250 ms, yet each request is answered from memory well inside that.
+    for(int i = 0; i < 10; i++) {
+        int64_t start = esp_timer_get_time();
+        uint32_t seq = 0;
+        TEST_ASSERT_EQUAL_INT(200, get("/capture", &seq));
+        TEST_ASSERT_LESS_THAN(TEST_FRAME_US / 2, esp_timer_get_time() - start);
+        TEST_ASSERT_GREATER_THAN(0, seq);
+    }
+}
+
+static void test_back_to_back_captures_share_the_latest_frame() {
+    // A frame can land between two requests now and then, but mostly they get the same one.
+    int same = 0;
+    for(int i = 0; i < 10; i++) {
+        uint32_t first = 0;
+        uint32_t second = 0;
+        TEST_ASSERT_EQUAL_INT(200, get("/capture", &first));
+        TEST_ASSERT_EQUAL_INT(200, get("/capture", &second));
+        TEST_ASSERT_GREATER_OR_EQUAL(first, second);
+        if(second == first) same++;
+    }
+    TEST_ASSERT_GREATER_THAN(5, same);
+}
+
+static void test_after_an_older_frame_answers_at_once() {
+    uint32_t seq = 0;
+    TEST_ASSERT_EQUAL_INT(200, get("/capture", &seq));
+    char path[48];
+    snprintf(path, sizeof(path), "/capture?after=%lu", (unsigned long)(seq - 1));
+
+    int64_t start = esp_timer_get_time();
+    uint32_t got = 0;
+    TEST_ASSERT_EQUAL_INT(200, get(path, &got));
+    TEST_ASSERT_LESS_THAN(TEST_FRAME_US / 2, esp_timer_get_time() - start);
+    TEST_ASSERT_GREATER_OR_EQUAL(seq, got);
+}
+
+static void test_after_the_latest_frame_waits_for_the_next() {
+    uint32_t seq = 0;
+    TEST_ASSERT_EQUAL_INT(200, get("/capture", &seq));
+    char path[48];
+    snprintf(path, sizeof(path), "/capture?after=%lu", (unsigned long)seq);
+
+    int64_t start = esp_timer_get_time();
+    uint32_t got = 0;
+    TEST_ASSERT_EQUAL_INT(200, get(path, &got));
+    TEST_ASSERT_GREATER_THAN(seq, got);
+    // Answered when the next frame is published, not at the end of the long-poll timeout.
+    TEST_ASSERT_LESS_THAN(2 * TEST_FRAME_US, esp_timer_get_time() - start);
+}
+
+static void test_long_polls_past_the_limit_are_refused() {
+    // Frames this far ahead never arrive, so every parked request runs into the timeout.
+    const int extra = 2;
+    int status[LONG_POLL_MAX_WAITERS + extra];
+    std::thread pollers[LONG_POLL_MAX_WAITERS + extra];
+    for(int i = 0; i < LONG_POLL_MAX_WAITERS + extra; i++) {
+        pollers[i] = std::thread([&status, i]() { status[i] = get("/capture?after=4000000000"); });
+        usleep(20000);
+    }
+
+    // The httpd worker stays free for everyone else meanwhile. Checked once the pollers are joined.
+    int64_t start = esp_timer_get_time();
+    int other = get("/status");
+    int64_t otherUs = esp_timer_get_time() - start;
+
+    int refused = 0;
+    int timedOut = 0;
+    for(int i = 0; i < LONG_POLL_MAX_WAITERS + extra; i++) {
+        pollers[i].join();
+        if(status[i] == 503) refused++;
+        if(status[i] == 504) timedOut++;
+    }
+    TEST_ASSERT_EQUAL_INT(200, other);
+    TEST_ASSERT_LESS_THAN(TEST_FRAME_US, otherUs);
+    TEST_ASSERT_EQUAL_INT(extra, refused);
+    TEST_ASSERT_EQUAL_INT(LONG_POLL_MAX_WAITERS, timedOut);
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    sim_camera.setScene(SIM_SCENE_WALK, 2);
+    sim_camera.setFrameRate(TEST_FPS, 0);
+    SentryCamera sc;
+    sc.initCamera();
+    frame_broadcaster.start();
+    frame_broadcaster.setContinuous(true);
+    motion_detector.start();
+    clip_ring.begin(CLIP_RING_BYTES);
+    sim_httpd_port = TEST_PORT;
+    startCameraServer();
+    // Enough frames for the broadcaster to learn the frame interval.
+    delay(1500);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_capture_does_not_wait_for_the_sensor);
+    RUN_TEST(test_back_to_back_captures_share_the_latest_frame);
+    RUN_TEST(test_after_an_older_frame_answers_at_once);
+    RUN_TEST(test_after_the_latest_frame_waits_for_the_next);
+    RUN_TEST(test_long_polls_past_the_limit_are_refused);
+    int failures = UNITY_END();
+
+    // Tasks are still running, so leave without destroying the globals they use.
+    fflush(stdout);
+    _exit(failures);
+}
@@ -0,0 +1,124 @@
+// The capture stage feeding the publish stage through the bounded queue, against the simulated
+// camera: frames arrive in order and none are dropped while publishing keeps up, capture keeps going
+// however many frames readers hold, and the jitter histogram follows the sensor.
+//
+//   pio test -e native -f test_capture_pipeline
+#include <unity.h>
+#include "esp_camera.h"
+#include "SentryCamera.h"
+#include "FrameBroadcaster.h"
+#include "Metrics.h"
+#include "SimCamera.h"
+#include <unistd.h>
+#include <vector>
+
+const float TEST_FPS = 20;
+const TickType_t TEST_TIMEOUT = pdMS_TO_TICKS(2000);
+
+// Count and sum of the jitter histogram, from the Prometheus text.
+static void jitter_totals(uint32_t *count, uint32_t *sum) {
+    static char text[16384];
+    metrics.printPrometheus(text, sizeof(text));
+    const char *field = strstr(text, "sentrycam_capture_jitter_ms_sum ");
+    *sum = field ? strtoul(field + 32, NULL, 10) : 0;
+    field = strstr(text, "sentrycam_capture_jitter_ms_count ");
+    *count = field ? strtoul(field + 34, NULL, 10) : 0;
+}
+
+// Mean jitter in ms over the next seconds of capture.
+static uint32_t mean_jitter_over(int seconds) {
+    uint32_t count0, sum0, count1, sum1;
+    jitter_totals(&count0, &sum0);
+    sleep(seconds);
+    jitter_totals(&count1, &sum1);
+    TEST_ASSERT_GREATER_THAN(TEST_FPS * seconds / 2, count1 - count0);
+    return (sum1 - sum0) / (count1 - count0);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_queue_keeps_order_and_drops_nothing() {
+    uint32_t dropped = metric_capture_queue_dropped.get();
+    FrameHandle frame = frame_broadcaster.waitForFrameAfter(0, TEST_TIMEOUT);
+    TEST_ASSERT_TRUE(frame);
+
+    // A waiter that wakes late skips to the newest frame, but the queue itself never drops one
+    // while publishing keeps up.
+    uint32_t seq = frame.seq();
+    for(int i = 0; i < 20; i++) {
+        FrameHandle next = frame_broadcaster.waitForFrameAfter(seq, TEST_TIMEOUT);
+        TEST_ASSERT_TRUE(next);
+        TEST_ASSERT_GREATER_THAN(seq, next.seq());
+        seq = next.seq();
+    }
+    TEST_ASSERT_EQUAL_UINT32(dropped, metric_capture_queue_dropped.get());
+}
+
+static void test_older_frame_never_replaces_the_latest() {
+    FrameHandle old = frame_broadcaster.getLatest();
+    FrameHandle newer = frame_broadcaster.waitForFrameAfter(old.seq(), TEST_TIMEOUT);
+    TEST_ASSERT_TRUE(newer);
+    frame_broadcaster.publish(old);
+    TEST_ASSERT_GREATER_OR_EQUAL(newer.seq(), frame_broadcaster.getLatest().seq());
+}
+
+static void test_held_frames_do_not_stall_capture() {
+    // Every stream holding a frame of its own, plus the handler and the background workers.
+    uint32_t exhausted = frame_pool.getExhaustedCount();
+    int ids[MAX_STREAM_CLIENTS];
+    std::vector<FrameHandle> held;
+    for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        ids[i] = frame_broadcaster.subscribe();
+        TEST_ASSERT_TRUE(ids[i] >= 0);
+        held.push_back(frame_broadcaster.acquire(ids[i], TEST_TIMEOUT));
+        TEST_ASSERT_TRUE(held.back());
+    }
+    for(int i = 0; i < HANDLER_HELD_FRAMES + WORKER_HELD_FRAMES; i++) {
+        held.push_back(frame_broadcaster.waitForFrameAfter(frame_broadcaster.getSequence(), TEST_TIMEOUT));
+        TEST_ASSERT_TRUE(held.back());
+    }
+
+    // The pool has room for all of them and the pipeline, so capture carries on at sensor rate.
+    uint32_t seq = frame_broadcaster.getSequence();
+    sleep(1);
+    TEST_ASSERT_GREATER_THAN(seq + TEST_FPS / 2, frame_broadcaster.getSequence());
+    TEST_ASSERT_EQUAL_UINT32(exhausted, frame_pool.getExhaustedCount());
+
+    held.clear();
+    for(int i = 0; i < MAX_STREAM_CLIENTS; i++) frame_broadcaster.unsubscribe(ids[i]);
+}
+
+static void test_jitter_histogram_follows_the_sensor() {
+    // The host's own scheduling adds a few ms even to a steady sensor, so compare it with one
+    // whose frames land up to 25 ms either side of their slot.
+    uint32_t steady = mean_jitter_over(2);
+    sim_camera.setFrameRate(TEST_FPS, 25);
+    uint32_t jittery = mean_jitter_over(2);
+    sim_camera.setFrameRate(TEST_FPS, 0);
+    TEST_ASSERT_LESS_THAN(10, steady);
+    TEST_ASSERT_GREATER_THAN(steady + 5, jittery);
+}
+
+int main() {
+    sim_camera.setScene(SIM_SCENE_WALK, 2);
+    sim_camera.setFrameRate(TEST_FPS, 0);
+    SentryCamera sc;
+    sc.initCamera();
+    frame_broadcaster.start();
+    frame_broadcaster.setContinuous(true);
+    // Enough frames for the broadcaster to learn the frame interval.
+    delay(1000);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_queue_keeps_order_and_drops_nothing);
+    RUN_TEST(test_older_frame_never_replaces_the_latest);
+    RUN_TEST(test_held_frames_do_not_stall_capture);
+    RUN_TEST(test_jitter_histogram_follows_the_sensor);
+    int failures = UNITY_END();
+
+    // Tasks are still running, so leave without destroying the globals they use.
+    fflush(stdout);
+    _exit(failures);
+}
@@ -0,0 +1,221 @@
+// Oldest-first eviction in the clip ring's arena, readers pinning what they still need, and where
+// a reader's window starts. The ring only starts once, so each test begins by flushing out what the
+// ones before it stored.
+//
+//   pio test -e native -f test_clip_ring
+#include <unity.h>
+#include "ClipRing.h"
+#include "FrameBroadcaster.h"
+#include <unistd.h>
+#include <vector>
+
+const size_t TEST_BUDGET = 10000;       // Ten 1000 byte frames exactly.
+const size_t TEST_FRAME = 1000;
+
+static ClipRing ring;
+static FramePool pool;
+static uint32_t last_seq = 0;
+
+// A frame of len bytes whose content is derived from its sequence number, captured at seconds.
+static FrameHandle frame_of(size_t len, time_t seconds) {
+    static std::vector<uint8_t> data;
+    data.resize(len);
+    for(size_t i = 0; i < len; i++) data[i] = (uint8_t)(i + last_seq + 1);
+    camera_fb_t fb = {};
+    fb.buf = data.data();
+    fb.len = len;
+    fb.width = 96;
+    fb.height = 96;
+    fb.format = PIXFORMAT_JPEG;
+    fb.timestamp.tv_sec = seconds;
+    FrameHandle frame = pool.ingest(&fb);
+    last_seq = frame.seq();
+    return frame;
+}
+
+static bool append(size_t len, time_t seconds = 0) {
+    return ring.append(frame_of(len, seconds));
+}
+
+// Every stored frame from the oldest, as a reader sees them.
+static std::vector<ClipFrame> stored() {
+    std::vector<ClipFrame> frames;
+    ClipReader *reader = ring.open(0, INT64_MAX, CLIP_MJPEG, 0);
+    TEST_ASSERT_NOT_NULL(reader);
+    ClipFrame frame;
+    uint32_t seq = 0;
+    while(ring.next(reader, seq, &frame)) {
+        frames.push_back(frame);
+        seq = frame.seq;
+    }
+    ring.close(reader);
+    return frames;
+}
+
+static bool intact(const ClipFrame &frame) {
+    const uint8_t *data = ring.data(frame);
+    for(size_t i = 0; i < frame.len; i++) {
+        if(data[i] != (uint8_t)(i + frame.seq)) return false;
+    }
+    return true;
+}
+
+// Replace whatever is stored with frames of the standard size.
+static void refill() {
+    for(int i = 0; i < 12; i++) TEST_ASSERT_TRUE(append(TEST_FRAME));
+}
+
+void setUp() {
+    refill();
+}
+
+void tearDown() {}
+
+static void test_oldest_frames_go_first() {
+    uint32_t before = last_seq;
+    for(int i = 0; i < 15; i++) TEST_ASSERT_TRUE(append(TEST_FRAME));
+
+    std::vector<ClipFrame> frames = stored();
+    TEST_ASSERT_EQUAL_size_t(TEST_BUDGET / TEST_FRAME, frames.size());
+    for(size_t i = 0; i < frames.size(); i++) {
+        TEST_ASSERT_EQUAL_UINT32(before + 6 + i, frames[i].seq);
+        TEST_ASSERT_TRUE(intact(frames[i]));
+    }
+}
+
+static void test_mixed_sizes_wrap_without_overlap() {
+    const size_t sizes[] = { 700, 1300, 2500, 90, 3999, 1001, 4 };
+    for(int i = 0; i < 100; i++) {
+        TEST_ASSERT_TRUE(append(sizes[i % 7]));
+
+        // The newest frames, in order and untouched, and never more than the budget.
+        std::vector<ClipFrame> frames = stored();
+        TEST_ASSERT_GREATER_THAN(0, frames.size());
+        TEST_ASSERT_EQUAL_UINT32(last_seq, frames.back().seq);
+        size_t bytes = 0;
+        for(size_t f = 0; f < frames.size(); f++) {
+            if(f) TEST_ASSERT_EQUAL_UINT32(frames[f - 1].seq + 1, frames[f].seq);
+            TEST_ASSERT_TRUE(intact(frames[f]));
+            TEST_ASSERT_LESS_OR_EQUAL(TEST_BUDGET, frames[f].offset + frames[f].len);
+            bytes += frames[f].len;
+        }
+        TEST_ASSERT_LESS_OR_EQUAL(TEST_BUDGET, bytes);
+    }
+}
+
+static void test_pinned_frames_are_kept_and_new_ones_dropped() {
+    std::vector<ClipFrame> before = stored();
+    ClipReader *reader = ring.open(0, INT64_MAX, CLIP_MJPEG, 1);
+    TEST_ASSERT_NOT_NULL(reader);
+
+    // The arena is full and the oldest frame is pinned, so there is nowhere to put another.
+    TEST_ASSERT_FALSE(append(TEST_FRAME));
+    TEST_ASSERT_FALSE(append(TEST_FRAME));
+    ClipFrame oldest;
+    TEST_ASSERT_TRUE(ring.next(reader, 0, &oldest));
+    TEST_ASSERT_EQUAL_UINT32(before[0].seq, oldest.seq);
+    TEST_ASSERT_TRUE(intact(oldest));
+
+    // Once the reader has moved past the first two frames, those two can go.
+    ring.advance(reader, before[2].seq);
+    TEST_ASSERT_TRUE(append(TEST_FRAME));
+    TEST_ASSERT_TRUE(append(TEST_FRAME));
+    TEST_ASSERT_FALSE(append(TEST_FRAME));
+    TEST_ASSERT_TRUE(ring.next(reader, 0, &oldest));
+    TEST_ASSERT_EQUAL_UINT32(before[2].seq, oldest.seq);
+    TEST_ASSERT_TRUE(intact(oldest));
+
+    ring.close(reader);
+    TEST_ASSERT_TRUE(append(TEST_FRAME));
+}
+
+static void test_window_starts_at_its_first_frame() {
+    for(int i = 0; i < 10; i++) TEST_ASSERT_TRUE(append(TEST_FRAME, 100 + i));
+    uint32_t first = last_seq - 9;
+
+    ClipReader *reader = ring.open(104 * 1000000LL, 106 * 1000000LL, CLIP_AVI, 2);
+    TEST_ASSERT_NOT_NULL(reader);
+    ClipFrame frame;
+    TEST_ASSERT_TRUE(ring.next(reader, 0, &frame));
+    TEST_ASSERT_EQUAL_UINT32(first + 4, frame.seq);
+    TEST_ASSERT_EQUAL_INT(104, frame.timestamp.tv_sec);
+
+    // Frames before the window are not pinned, so they can go while the window is kept.
+    for(int i = 0; i < 4; i++) TEST_ASSERT_TRUE(append(TEST_FRAME, 110 + i));
+    TEST_ASSERT_FALSE(append(TEST_FRAME, 114));
+    TEST_ASSERT_TRUE(ring.next(reader, 0, &frame));
+    TEST_ASSERT_EQUAL_UINT32(first + 4, frame.seq);
+    ring.close(reader);
+}
+
+static void test_window_yet_to_start_pins_what_comes_next() {
+    // Everything stored was captured at 0 s. After a trigger with no pre-roll, the window only starts
+    // with the next frame, so that is the one pinned.
+    ClipReader *reader = ring.open(200 * 1000000LL, 210 * 1000000LL, CLIP_MJPEG, 3);
+    TEST_ASSERT_NOT_NULL(reader);
+    ClipFrame frame;
+    TEST_ASSERT_FALSE(ring.next(reader, 0, &frame));
+
+    TEST_ASSERT_TRUE(append(TEST_FRAME, 200));
+    uint32_t first = last_seq;
+    for(int i = 1; i < 10; i++) TEST_ASSERT_TRUE(append(TEST_FRAME, 200 + i));
+    TEST_ASSERT_FALSE(append(TEST_FRAME, 210));
+    TEST_ASSERT_TRUE(ring.next(reader, 0, &frame));
+    TEST_ASSERT_EQUAL_UINT32(first, frame.seq);
+    ring.close(reader);
+}
+
+static void test_readers_are_limited() {
+    ClipReader *readers[CLIP_MAX_READERS];
+    for(int i = 0; i < CLIP_MAX_READERS; i++) {
+        readers[i] = ring.open(0, INT64_MAX, CLIP_MJPEG, i);
+        TEST_ASSERT_NOT_NULL(readers[i]);
+    }
+    TEST_ASSERT_NULL(ring.open(0, INT64_MAX, CLIP_MJPEG, 9));
+    ring.close(readers[0]);
+    readers[0] = ring.open(0, INT64_MAX, CLIP_MJPEG, 9);
+    TEST_ASSERT_NOT_NULL(readers[0]);
+    for(int i = 0; i < CLIP_MAX_READERS; i++) ring.close(readers[i]);
+}
+
+static void test_frame_over_the_budget_is_dropped() {
+    std::vector<ClipFrame> before = stored();
+    TEST_ASSERT_FALSE(append(TEST_BUDGET + 1));
+    std::vector<ClipFrame> after = stored();
+    TEST_ASSERT_EQUAL_size_t(before.size(), after.size());
+    TEST_ASSERT_EQUAL_UINT32(before.back().seq, after.back().seq);
+
+    // A frame of exactly the budget replaces everything.
+    TEST_ASSERT_TRUE(append(TEST_BUDGET));
+    after = stored();
+    TEST_ASSERT_EQUAL_size_t(1, after.size());
+    TEST_ASSERT_TRUE(intact(after[0]));
+}
+
+static void test_wait_sees_a_newer_frame() {
+    TEST_ASSERT_TRUE(ring.waitForFrameAfter(last_seq - 1, 0));
+    TEST_ASSERT_FALSE(ring.waitForFrameAfter(last_seq, pdMS_TO_TICKS(50)));
+}
+
+int main() {
+    pool.begin(4, FRAMESIZE_96X96, PIXFORMAT_JPEG);
+    // The broadcaster only captures on demand and nothing asks, so the recording task stays idle
+    // and every frame in the ring comes from these tests.
+    frame_broadcaster.start();
+    ring.begin(TEST_BUDGET);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_oldest_frames_go_first);
+    RUN_TEST(test_mixed_sizes_wrap_without_overlap);
+    RUN_TEST(test_pinned_frames_are_kept_and_new_ones_dropped);
+    RUN_TEST(test_window_starts_at_its_first_frame);
+    RUN_TEST(test_window_yet_to_start_pins_what_comes_next);
+    RUN_TEST(test_readers_are_limited);
+    RUN_TEST(test_frame_over_the_budget_is_dropped);
+    RUN_TEST(test_wait_sees_a_newer_frame);
+    int failures = UNITY_END();
+
+    // Tasks are still running, so leave without destroying the globals they use.
+    fflush(stdout);
+    _exit(failures);
+}
@@ -0,0 +1,167 @@
+// Raw frames encoded into each stream slot's reusable buffer: the output is the frame, a steady
+// stream allocates nothing after its first frame, and the counters exported through /metrics agree.
+//
+//   pio test -e native -f test_conversion_pool
+#include <unity.h>
+#include "ConversionPool.h"
+#include "Metrics.h"
+#include "SimJpeg.h"
+#include <stdlib.h>
+#include <vector>
+
+const uint16_t TEST_WIDTH = 320;
+const uint16_t TEST_HEIGHT = 240;
+
+static FramePool pool;
+
+// A grey frame where pixel (x, y) is shade(x, y).
+template<typename Shade>
+static FrameHandle gray_frame(uint16_t width, uint16_t height, Shade shade) {
+    static std::vector<uint8_t> pixels;
+    pixels.resize((size_t)width * height);
+    for(uint16_t y = 0; y < height; y++) {
+        for(uint16_t x = 0; x < width; x++) pixels[(size_t)y * width + x] = shade(x, y);
+    }
+    camera_fb_t fb = {};
+    fb.buf = pixels.data();
+    fb.len = pixels.size();
+    fb.width = width;
+    fb.height = height;
+    fb.format = PIXFORMAT_GRAYSCALE;
+    return pool.ingest(&fb);
+}
+
+static FrameHandle gradient(uint16_t width, uint16_t height) {
+    return gray_frame(width, height, [&](uint16_t x, uint16_t y) { return (x * 200 / width + y * 50 / height) & 0xff; });
+}
+
+static FrameHandle noise(uint16_t width, uint16_t height) {
+    srand(3);
+    return gray_frame(width, height, [](uint16_t x, uint16_t y) { return rand() & 0xff; });
+}
+
+// Mean difference between the encoded output and the frame it came from.
+static long mean_error(const FrameHandle &frame, const uint8_t *jpg, size_t len) {
+    std::vector<uint8_t> rgb;
+    uint16_t w, h;
+    TEST_ASSERT_TRUE(sim_jpeg_decode(jpg, len, &rgb, &w, &h));
+    TEST_ASSERT_EQUAL_INT(frame.width(), w);
+    TEST_ASSERT_EQUAL_INT(frame.height(), h);
+    long error = 0;
+    for(size_t i = 0; i < (size_t)w * h; i++) error += abs(frame.buf()[i] - rgb[i * 3]);
+    return error / ((long)w * h);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_output_is_the_frame() {
+    ConversionPool conversions;
+    conversions.reset(FRAMESIZE_QVGA);
+    FrameHandle frame = gradient(TEST_WIDTH, TEST_HEIGHT);
+    const uint8_t *jpg = NULL;
+    size_t len = 0;
+    TEST_ASSERT_TRUE(conversions.encode(0, frame, &jpg, &len));
+    TEST_ASSERT_EQUAL_HEX8(0xFF, jpg[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xD8, jpg[1]);
+    TEST_ASSERT_LESS_THAN(3, mean_error(frame, jpg, len));
+}
+
+static void test_steady_stream_allocates_once_per_slot() {
+    ConversionPool conversions;
+    conversions.reset(FRAMESIZE_QVGA);
+    uint32_t converted = metric_frames_converted.get();
+    uint32_t allocated = metric_conversion_allocations.get();
+
+    const uint8_t *jpg;
+    size_t len;
+    for(int i = 0; i < 30; i++) {
+        TEST_ASSERT_TRUE(conversions.encode(0, gradient(TEST_WIDTH, TEST_HEIGHT), &jpg, &len));
+        TEST_ASSERT_TRUE(conversions.encode(3, gradient(TEST_WIDTH, TEST_HEIGHT), &jpg, &len));
+    }
+    TEST_ASSERT_EQUAL_UINT32(60, conversions.getConversionCount());
+    TEST_ASSERT_EQUAL_UINT32(2, conversions.getAllocationCount());
+    TEST_ASSERT_EQUAL_UINT32(converted + 60, metric_frames_converted.get());
+    TEST_ASSERT_EQUAL_UINT32(allocated + 2, metric_conversion_allocations.get());
+}
+
+static void test_frame_size_change_resizes_once() {
+    ConversionPool conversions;
+    conversions.reset(FRAMESIZE_QVGA);
+    const uint8_t *jpg;
+    size_t len;
+    TEST_ASSERT_TRUE(conversions.encode(0, gradient(TEST_WIDTH, TEST_HEIGHT), &jpg, &len));
+    TEST_ASSERT_EQUAL_UINT32(1, conversions.getAllocationCount());
+
+    // The same size again keeps the buffer.
+    conversions.reset(FRAMESIZE_QVGA);
+    TEST_ASSERT_TRUE(conversions.encode(0, gradient(TEST_WIDTH, TEST_HEIGHT), &jpg, &len));
+    TEST_ASSERT_EQUAL_UINT32(1, conversions.getAllocationCount());
+
+    conversions.reset(FRAMESIZE_QQVGA);
+    for(int i = 0; i < 10; i++) {
+        FrameHandle frame = gradient(160, 120);
+        TEST_ASSERT_TRUE(conversions.encode(0, frame, &jpg, &len));
+        TEST_ASSERT_LESS_THAN(3, mean_error(frame, jpg, len));
+    }
+    TEST_ASSERT_EQUAL_UINT32(2, conversions.getAllocationCount());
+}
+
+static void test_short_estimate_grows_then_stays() {
+    // Sized for 96x96, then handed noise that encodes far bigger than any estimate.
+    ConversionPool conversions;
+    conversions.reset(FRAMESIZE_96X96);
+    const uint8_t *jpg;
+    size_t len;
+    FrameHandle frame = noise(TEST_WIDTH, TEST_HEIGHT);
+    TEST_ASSERT_TRUE(conversions.encode(0, frame, &jpg, &len));
+    TEST_ASSERT_GREATER_THAN(CONVERSION_MIN_BYTES, len);
+    TEST_ASSERT_GREATER_THAN(1, conversions.getAllocationCount());
+    TEST_ASSERT_LESS_THAN(8, mean_error(frame, jpg, len));
+
+    uint32_t allocated = conversions.getAllocationCount();
+    for(int i = 0; i < 10; i++) TEST_ASSERT_TRUE(conversions.encode(0, noise(TEST_WIDTH, TEST_HEIGHT), &jpg, &len));
+    TEST_ASSERT_EQUAL_UINT32(allocated, conversions.getAllocationCount());
+}
+
+static void test_slots_keep_their_own_output() {
+    ConversionPool conversions;
+    conversions.reset(FRAMESIZE_QVGA);
+    FrameHandle first = gradient(TEST_WIDTH, TEST_HEIGHT);
+    FrameHandle second = gray_frame(TEST_WIDTH, TEST_HEIGHT, [](uint16_t x, uint16_t y) { return 200 - x / 2; });
+    const uint8_t *firstJpg, *secondJpg;
+    size_t firstLen, secondLen;
+    TEST_ASSERT_TRUE(conversions.encode(1, first, &firstJpg, &firstLen));
+    TEST_ASSERT_TRUE(conversions.encode(2, second, &secondJpg, &secondLen));
+    TEST_ASSERT_TRUE(firstJpg != secondJpg);
+    TEST_ASSERT_LESS_THAN(3, mean_error(first, firstJpg, firstLen));
+    TEST_ASSERT_LESS_THAN(3, mean_error(second, secondJpg, secondLen));
+}
+
+static void test_bad_requests_are_refused() {
+    ConversionPool conversions;
+    conversions.reset(FRAMESIZE_QVGA);
+    FrameHandle frame = gradient(TEST_WIDTH, TEST_HEIGHT);
+    const uint8_t *jpg = NULL;
+    size_t len = 0;
+    TEST_ASSERT_FALSE(conversions.encode(-1, frame, &jpg, &len));
+    TEST_ASSERT_FALSE(conversions.encode(MAX_STREAM_CLIENTS, frame, &jpg, &len));
+    TEST_ASSERT_FALSE(conversions.encode(0, FrameHandle(), &jpg, &len));
+    TEST_ASSERT_EQUAL_UINT32(0, conversions.getConversionCount());
+    TEST_ASSERT_EQUAL_UINT32(0, conversions.getAllocationCount());
+    TEST_ASSERT_NULL(jpg);
+}
+
+int main() {
+    pool.begin(4, FRAMESIZE_QVGA, PIXFORMAT_GRAYSCALE);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_output_is_the_frame);
+    RUN_TEST(test_steady_stream_allocates_once_per_slot);
+    RUN_TEST(test_frame_size_change_resizes_once);
+    RUN_TEST(test_short_estimate_grows_then_stays);
+    RUN_TEST(test_slots_keep_their_own_output);
+    RUN_TEST(test_bad_requests_are_refused);
+    return UNITY_END();
+}
@@ -0,0 +1,104 @@
+// One capture fanned out to every stream subscriber, against the simulated camera.
+//
+//   pio test -e native -f test_frame_broadcaster
+#include <unity.h>
+#include "esp_camera.h"
+#include "SentryCamera.h"
+#include "FrameBroadcaster.h"
+#include "SimCamera.h"
+#include <unistd.h>
+
+const TickType_t TEST_TIMEOUT = pdMS_TO_TICKS(2000);
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_subscribers_share_one_pooled_frame() {
+    int a = frame_broadcaster.subscribe();
+    int b = frame_broadcaster.subscribe();
+    TEST_ASSERT_TRUE(a >= 0 && b >= 0 && a != b);
+
+    // A frame can land between the two acquires, so look for a publish both saw.
+    uint8_t shared = 0;
+    for(int i = 0; i < 10; i++) {
+        FrameHandle fa = frame_broadcaster.acquire(a, TEST_TIMEOUT);
+        FrameHandle fb = frame_broadcaster.acquire(b, TEST_TIMEOUT);
+        TEST_ASSERT_TRUE(fa && fb);
+        if(fa.seq() != fb.seq()) continue;
+        // The same capture, not a copy per subscriber.
+        TEST_ASSERT_EQUAL_PTR(fa.buf(), fb.buf());
+        shared++;
+    }
+    TEST_ASSERT_GREATER_THAN(0, shared);
+
+    frame_broadcaster.unsubscribe(a);
+    frame_broadcaster.unsubscribe(b);
+}
+
+static void test_each_acquire_is_newer_than_the_last() {
+    int id = frame_broadcaster.subscribe();
+    TEST_ASSERT_TRUE(id >= 0);
+
+    uint32_t last = 0;
+    for(int i = 0; i < 5; i++) {
+        FrameHandle frame = frame_broadcaster.acquire(id, TEST_TIMEOUT);
+        TEST_ASSERT_TRUE(frame);
+        TEST_ASSERT_GREATER_THAN(last, frame.seq());
+        last = frame.seq();
+    }
+    frame_broadcaster.unsubscribe(id);
+}
+
+static void test_slow_subscriber_skips_to_the_newest_frame() {
+    int id = frame_broadcaster.subscribe();
+    TEST_ASSERT_TRUE(id >= 0);
+
+    FrameHandle first = frame_broadcaster.acquire(id, TEST_TIMEOUT);
+    TEST_ASSERT_TRUE(first);
+    // Several frames are published meanwhile. Only the newest is handed over, the rest are counted.
+    delay(400);
+    FrameHandle next = frame_broadcaster.acquire(id, TEST_TIMEOUT);
+    TEST_ASSERT_TRUE(next);
+    TEST_ASSERT_GREATER_THAN(first.seq() + 1, next.seq());
+    TEST_ASSERT_GREATER_THAN(0, frame_broadcaster.getDroppedCount(id));
+    TEST_ASSERT_LESS_THAN(next.seq() - first.seq(), frame_broadcaster.getDroppedCount(id));
+    TEST_ASSERT_EQUAL_UINT32(frame_broadcaster.getSequence(), next.seq());
+
+    frame_broadcaster.unsubscribe(id);
+}
+
+static void test_subscriber_slots_are_bounded_and_reused() {
+    int ids[MAX_STREAM_CLIENTS];
+    for(int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        ids[i] = frame_broadcaster.subscribe();
+        TEST_ASSERT_TRUE(ids[i] >= 0);
+    }
+    TEST_ASSERT_EQUAL_UINT8(MAX_STREAM_CLIENTS, frame_broadcaster.getSubscriberCount());
+    TEST_ASSERT_EQUAL_INT(-1, frame_broadcaster.subscribe());
+
+    frame_broadcaster.unsubscribe(ids[3]);
+    TEST_ASSERT_EQUAL_INT(ids[3], frame_broadcaster.subscribe());
+
+    for(int i = 0; i < MAX_STREAM_CLIENTS; i++) frame_broadcaster.unsubscribe(ids[i]);
+    TEST_ASSERT_EQUAL_UINT8(0, frame_broadcaster.getSubscriberCount());
+}
+
+int main() {
+    sim_camera.setScene(SIM_SCENE_WALK, 2);
+    sim_camera.setFrameRate(25, 0);
+    SentryCamera sc;
+    sc.initCamera();
+    frame_broadcaster.start();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_subscribers_share_one_pooled_frame);
+    RUN_TEST(test_each_acquire_is_newer_than_the_last);
+    RUN_TEST(test_slow_subscriber_skips_to_the_newest_frame);
+    RUN_TEST(test_subscriber_slots_are_bounded_and_reused);
+    int failures = UNITY_END();
+
+    // Tasks are still running, so leave without destroying the globals they use.
+    fflush(stdout);
+    _exit(failures);
+}
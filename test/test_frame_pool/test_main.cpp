@@ -0,0 +1,132 @@
+// Reference counting and slot reuse in the PSRAM frame pool.
+//
+//   pio test -e native -f test_frame_pool
+#include <unity.h>
+#include "FramePool.h"
+#include <utility>
+
+const uint8_t TEST_SLOTS = 3;
+
+static uint8_t source[8192];
+static camera_fb_t fb;
+
+// A driver frame of len bytes, each byte its offset plus fill.
+static camera_fb_t *frame_of(size_t len, uint8_t fill) {
+    for(size_t i = 0; i < len; i++) source[i] = (uint8_t)(i + fill);
+    fb.buf = source;
+    fb.len = len;
+    fb.width = 96;
+    fb.height = 96;
+    fb.format = PIXFORMAT_JPEG;
+    fb.timestamp.tv_sec = fill;
+    fb.timestamp.tv_usec = 0;
+    return &fb;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_ingest_copies_the_driver_frame() {
+    FramePool pool;
+    TEST_ASSERT_TRUE(pool.begin(TEST_SLOTS, FRAMESIZE_96X96, PIXFORMAT_JPEG));
+
+    FrameHandle frame = pool.ingest(frame_of(1000, 7));
+    TEST_ASSERT_TRUE(frame);
+    // The pool owns a copy, so the driver buffer can be reused at once.
+    frame_of(1000, 99);
+    TEST_ASSERT_EQUAL_size_t(1000, frame.len());
+    TEST_ASSERT_EQUAL_UINT8(7, frame.buf()[0]);
+    TEST_ASSERT_EQUAL_UINT8((uint8_t)(999 + 7), frame.buf()[999]);
+    TEST_ASSERT_EQUAL_INT(7, frame.timestamp().tv_sec);
+    TEST_ASSERT_EQUAL_UINT8(TEST_SLOTS - 1, pool.getFreeCount());
+}
+
+static void test_sequence_numbers_increase() {
+    FramePool pool;
+    TEST_ASSERT_TRUE(pool.begin(TEST_SLOTS, FRAMESIZE_96X96, PIXFORMAT_JPEG));
+
+    uint32_t first = pool.ingest(frame_of(10, 0)).seq();
+    uint32_t second = pool.ingest(frame_of(10, 0)).seq();
+    TEST_ASSERT_EQUAL_UINT32(1, first);
+    TEST_ASSERT_EQUAL_UINT32(2, second);
+}
+
+static void test_slot_is_freed_by_the_last_handle() {
+    FramePool pool;
+    TEST_ASSERT_TRUE(pool.begin(TEST_SLOTS, FRAMESIZE_96X96, PIXFORMAT_JPEG));
+
+    FrameHandle frame = pool.ingest(frame_of(10, 0));
+    FrameHandle copy = frame;
+    FrameHandle assigned;
+    assigned = copy;
+    TEST_ASSERT_EQUAL_UINT8(TEST_SLOTS - 1, pool.getFreeCount());
+
+    frame.reset();
+    copy.reset();
+    TEST_ASSERT_EQUAL_UINT8(TEST_SLOTS - 1, pool.getFreeCount());
+    assigned.reset();
+    TEST_ASSERT_EQUAL_UINT8(TEST_SLOTS, pool.getFreeCount());
+}
+
+static void test_moves_and_detach_keep_the_reference() {
+    FramePool pool;
+    TEST_ASSERT_TRUE(pool.begin(TEST_SLOTS, FRAMESIZE_96X96, PIXFORMAT_JPEG));
+
+    FrameHandle frame = pool.ingest(frame_of(10, 0));
+    FrameHandle moved(std::move(frame));
+    TEST_ASSERT_FALSE(frame);
+    TEST_ASSERT_TRUE(moved);
+
+    // As through a queue: the raw pointer carries the reference until a handle adopts it.
+    PooledFrame *queued = moved.detach();
+    TEST_ASSERT_FALSE(moved);
+    TEST_ASSERT_EQUAL_UINT8(TEST_SLOTS - 1, pool.getFreeCount());
+    {
+        FrameHandle adopted(queued);
+        TEST_ASSERT_EQUAL_UINT8(TEST_SLOTS - 1, pool.getFreeCount());
+    }
+    TEST_ASSERT_EQUAL_UINT8(TEST_SLOTS, pool.getFreeCount());
+}
+
+static void test_full_pool_drops_without_waiting() {
+    FramePool pool;
+    TEST_ASSERT_TRUE(pool.begin(TEST_SLOTS, FRAMESIZE_96X96, PIXFORMAT_JPEG));
+
+    FrameHandle held[TEST_SLOTS];
+    for(uint8_t i = 0; i < TEST_SLOTS; i++) held[i] = pool.ingest(frame_of(10, i));
+    TEST_ASSERT_EQUAL_UINT8(0, pool.getFreeCount());
+
+    TEST_ASSERT_FALSE(pool.ingest(frame_of(10, 0)));
+    TEST_ASSERT_EQUAL_UINT32(1, pool.getExhaustedCount());
+
+    // The slot given back is the one reused, and what the other readers hold is untouched.
+    held[1].reset();
+    FrameHandle next = pool.ingest(frame_of(10, 50));
+    TEST_ASSERT_TRUE(next);
+    TEST_ASSERT_EQUAL_UINT8(50, next.buf()[0]);
+    TEST_ASSERT_EQUAL_UINT8(0, held[0].buf()[0]);
+    TEST_ASSERT_EQUAL_UINT8(2, held[2].buf()[0]);
+}
+
+static void test_slot_grows_for_a_larger_frame() {
+    FramePool pool;
+    // A 96x96 JPEG slot starts at under 2 KB.
+    TEST_ASSERT_TRUE(pool.begin(1, FRAMESIZE_96X96, PIXFORMAT_JPEG));
+
+    FrameHandle frame = pool.ingest(frame_of(sizeof(source), 3));
+    TEST_ASSERT_TRUE(frame);
+    TEST_ASSERT_EQUAL_size_t(sizeof(source), frame.len());
+    TEST_ASSERT_EQUAL_UINT8((uint8_t)(sizeof(source) - 1 + 3), frame.buf()[sizeof(source) - 1]);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_ingest_copies_the_driver_frame);
+    RUN_TEST(test_sequence_numbers_increase);
+    RUN_TEST(test_slot_is_freed_by_the_last_handle);
+    RUN_TEST(test_moves_and_detach_keep_the_reference);
+    RUN_TEST(test_full_pool_drops_without_waiting);
+    RUN_TEST(test_slot_grows_for_a_larger_frame);
+    return UNITY_END();
+}
@@ -0,0 +1,188 @@
+// Coarse luma signatures of grayscale and JPEG frames, the per-frame cache shared by streams, and
+// the tolerance that decides whether two frames show the same scene.
+//
+//   pio test -e native -f test_frame_signature
+#include <unity.h>
+#include "FrameSignature.h"
+#include "SimJpeg.h"
+#include <vector>
+
+static FramePool pool;
+
+// Grey frame of size width x height where pixel (x, y) is shade(x, y), plus up to noise levels of noise.
+template<typename Shade>
+static FrameHandle gray_frame(uint16_t width, uint16_t height, Shade shade, int noise = 0) {
+    static std::vector<uint8_t> pixels;
+    pixels.resize((size_t)width * height);
+    uint32_t seed = 7;
+    for(uint16_t y = 0; y < height; y++) {
+        for(uint16_t x = 0; x < width; x++) {
+            seed = seed * 1103515245 + 12345;
+            int n = noise ? (int)((seed >> 16) % (2 * noise + 1)) - noise : 0;
+            pixels[(size_t)y * width + x] = constrain(shade(x, y) + n, 0, 255);
+        }
+    }
+    camera_fb_t fb = {};
+    fb.buf = pixels.data();
+    fb.len = pixels.size();
+    fb.width = width;
+    fb.height = height;
+    fb.format = PIXFORMAT_GRAYSCALE;
+    return pool.ingest(&fb);
+}
+
+// Each signature cell of a width x height frame gets its own shade.
+static int cell_shade(uint16_t x, uint16_t y, uint16_t width, uint16_t height) {
+    int sx = x * SIGNATURE_WIDTH / width;
+    int sy = y * SIGNATURE_HEIGHT / height;
+    return 20 + sx * 12 + sy * 3;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_each_cell_is_the_mean_of_its_area() {
+    FrameSignatureCache signatures;
+    TEST_ASSERT_TRUE(signatures.begin());
+    uint8_t cells[SIGNATURE_BYTES];
+
+    // One 8x8 grid cell per signature cell, then 5x5 of them.
+    const uint16_t sizes[][2] = { { 128, 96 }, { 640, 480 } };
+    for(auto &size : sizes) {
+        uint16_t w = size[0];
+        uint16_t h = size[1];
+        TEST_ASSERT_TRUE(signatures.get(gray_frame(w, h, [&](uint16_t x, uint16_t y) { return cell_shade(x, y, w, h); }), cells));
+        for(uint8_t sy = 0; sy < SIGNATURE_HEIGHT; sy++) {
+            for(uint8_t sx = 0; sx < SIGNATURE_WIDTH; sx++) TEST_ASSERT_EQUAL_UINT8(20 + sx * 12 + sy * 3, cells[sy * SIGNATURE_WIDTH + sx]);
+        }
+    }
+}
+
+static void test_tiny_frame_fills_every_cell() {
+    FrameSignatureCache signatures;
+    TEST_ASSERT_TRUE(signatures.begin());
+    // A 4x3 grid, so each grid cell is spread over 4x4 signature cells.
+    uint8_t cells[SIGNATURE_BYTES];
+    TEST_ASSERT_TRUE(signatures.get(gray_frame(32, 24, [](uint16_t x, uint16_t y) { return (x / 8) * 50 + (y / 8) * 10; }), cells));
+    for(uint8_t sy = 0; sy < SIGNATURE_HEIGHT; sy++) {
+        for(uint8_t sx = 0; sx < SIGNATURE_WIDTH; sx++) TEST_ASSERT_EQUAL_UINT8((sx / 4) * 50 + (sy / 4) * 10, cells[sy * SIGNATURE_WIDTH + sx]);
+    }
+}
+
+static void test_jpeg_signature_follows_the_picture() {
+    FrameSignatureCache signatures;
+    TEST_ASSERT_TRUE(signatures.begin());
+    const uint16_t w = 320;
+    const uint16_t h = 240;
+    std::vector<uint8_t> pixels((size_t)w * h);
+    for(uint16_t y = 0; y < h; y++) {
+        for(uint16_t x = 0; x < w; x++) pixels[(size_t)y * w + x] = cell_shade(x, y, w, h);
+    }
+    std::vector<uint8_t> jpg;
+    TEST_ASSERT_TRUE(sim_jpeg_encode(pixels.data(), w, h, true, 80,
+        [](void *arg, size_t index, const void *data, size_t len) {
+            std::vector<uint8_t> *out = (std::vector<uint8_t> *)arg;
+            out->insert(out->end(), (const uint8_t *)data, (const uint8_t *)data + len);
+            return len;
+        }, &jpg));
+    camera_fb_t fb = {};
+    fb.buf = jpg.data();
+    fb.len = jpg.size();
+    fb.width = w;
+    fb.height = h;
+    fb.format = PIXFORMAT_JPEG;
+
+    // From the DC terms alone, within a level or two of the raw frame's.
+    uint8_t fromJpeg[SIGNATURE_BYTES];
+    uint8_t fromRaw[SIGNATURE_BYTES];
+    TEST_ASSERT_TRUE(signatures.get(pool.ingest(&fb), fromJpeg));
+    TEST_ASSERT_TRUE(signatures.get(gray_frame(w, h, [&](uint16_t x, uint16_t y) { return cell_shade(x, y, w, h); }), fromRaw));
+    for(size_t i = 0; i < SIGNATURE_BYTES; i++) TEST_ASSERT_INT_WITHIN(2, fromRaw[i], fromJpeg[i]);
+    TEST_ASSERT_TRUE(FrameSignatureCache::matches(fromRaw, fromJpeg));
+}
+
+static void test_each_frame_is_worked_out_once() {
+    FrameSignatureCache signatures;
+    TEST_ASSERT_TRUE(signatures.begin());
+    uint8_t cells[SIGNATURE_BYTES];
+    auto flat = [](uint16_t x, uint16_t y) { return 100; };
+
+    FrameHandle frames[SIGNATURE_CACHE + 1];
+    for(int i = 0; i <= SIGNATURE_CACHE; i++) frames[i] = gray_frame(64, 48, flat);
+    for(int i = 0; i < SIGNATURE_CACHE; i++) {
+        TEST_ASSERT_TRUE(signatures.get(frames[i], cells));
+        TEST_ASSERT_TRUE(signatures.get(frames[i], cells));
+    }
+    TEST_ASSERT_EQUAL_UINT32(SIGNATURE_CACHE, signatures.getComputedCount());
+
+    // Every stream asks about the newest frame, so one more pushes out the oldest.
+    TEST_ASSERT_TRUE(signatures.get(frames[SIGNATURE_CACHE], cells));
+    TEST_ASSERT_TRUE(signatures.get(frames[1], cells));
+    TEST_ASSERT_EQUAL_UINT32(SIGNATURE_CACHE + 1, signatures.getComputedCount());
+    TEST_ASSERT_TRUE(signatures.get(frames[0], cells));
+    TEST_ASSERT_EQUAL_UINT32(SIGNATURE_CACHE + 2, signatures.getComputedCount());
+}
+
+static void test_noise_matches_and_a_change_does_not() {
+    FrameSignatureCache signatures;
+    TEST_ASSERT_TRUE(signatures.begin());
+    uint8_t clean[SIGNATURE_BYTES];
+    uint8_t noisy[SIGNATURE_BYTES];
+    uint8_t changed[SIGNATURE_BYTES];
+    auto scene = [](uint16_t x, uint16_t y) { return 60 + (x + y) % 100; };
+    TEST_ASSERT_TRUE(signatures.get(gray_frame(320, 240, scene), clean));
+    TEST_ASSERT_TRUE(signatures.get(gray_frame(320, 240, scene, 10), noisy));
+    TEST_ASSERT_TRUE(FrameSignatureCache::matches(clean, noisy));
+
+    // A 20x20 object covers one cell of 20x20 pixels.
+    TEST_ASSERT_TRUE(signatures.get(gray_frame(320, 240, [&](uint16_t x, uint16_t y) {
+        return (x >= 100 && x < 120 && y >= 100 && y < 120) ? 250 : scene(x, y);
+    }), changed));
+    TEST_ASSERT_FALSE(FrameSignatureCache::matches(clean, changed));
+}
+
+static void test_tolerance_is_per_cell() {
+    uint8_t a[SIGNATURE_BYTES];
+    uint8_t b[SIGNATURE_BYTES];
+    memset(a, 100, sizeof(a));
+    memset(b, 100 + SIGNATURE_TOLERANCE, sizeof(b));
+    TEST_ASSERT_TRUE(FrameSignatureCache::matches(a, b));
+    memset(b, 100 - SIGNATURE_TOLERANCE, sizeof(b));
+    TEST_ASSERT_TRUE(FrameSignatureCache::matches(a, b));
+    b[SIGNATURE_BYTES - 1] = 100 - SIGNATURE_TOLERANCE - 1;
+    TEST_ASSERT_FALSE(FrameSignatureCache::matches(a, b));
+}
+
+static void test_formats_without_cheap_luma_are_refused() {
+    FrameSignatureCache signatures;
+    uint8_t cells[SIGNATURE_BYTES];
+    FrameHandle gray = gray_frame(64, 48, [](uint16_t x, uint16_t y) { return 0; });
+    // Not started yet.
+    TEST_ASSERT_FALSE(signatures.get(gray, cells));
+
+    TEST_ASSERT_TRUE(signatures.begin());
+    std::vector<uint8_t> rgb(64 * 48 * 2, 0);
+    camera_fb_t fb = {};
+    fb.buf = rgb.data();
+    fb.len = rgb.size();
+    fb.width = 64;
+    fb.height = 48;
+    fb.format = PIXFORMAT_RGB565;
+    TEST_ASSERT_FALSE(signatures.get(pool.ingest(&fb), cells));
+    TEST_ASSERT_EQUAL_UINT32(0, signatures.getComputedCount());
+}
+
+int main() {
+    pool.begin(SIGNATURE_CACHE + 3, FRAMESIZE_QVGA, PIXFORMAT_GRAYSCALE);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_each_cell_is_the_mean_of_its_area);
+    RUN_TEST(test_tiny_frame_fills_every_cell);
+    RUN_TEST(test_jpeg_signature_follows_the_picture);
+    RUN_TEST(test_each_frame_is_worked_out_once);
+    RUN_TEST(test_noise_matches_and_a_change_does_not);
+    RUN_TEST(test_tolerance_is_per_cell);
+    RUN_TEST(test_formats_without_cheap_luma_are_refused);
+    return UNITY_END();
+}
@@ -0,0 +1,230 @@
+// HTTP handlers against the simulated camera, over a real socket.
+//
+//   pio test -e native -f test_httpd
+#include <unity.h>
+#include "esp_camera.h"
+#include "SentryCamera.h"
+#include "FrameBroadcaster.h"
+#include "MotionDetector.h"
+#include "ClipRing.h"
+#include "SimCamera.h"
+#include "Sim.h"
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+
+const uint16_t TEST_PORT = 18931;
+
+// From app_httpd.cpp.
+void startCameraServer();
+
+// Reads from fd until the response holds what is wanted, the peer closes or the read times out.
+static bool receive(int fd, std::string *response, size_t want) {
+    char buf[4096];
+    while(response->size() < want) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n <= 0) return false;
+        response->append(buf, n);
+    }
+    return true;
+}
+
+// A new connection with the request head sent. -1 if that failed.
+static int send_request(const char *method, const char *path, const char *headers) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    struct timeval timeout = { 5, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TEST_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    char head[512];
+    int len = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: 127.0.0.1\r\n%s\r\n", method, path, headers);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || send(fd, head, len, 0) != len) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// One request on its own connection. Returns the status code, or 0 if the exchange failed. The server
+// keeps connections alive, so the body ends where Content-Length or the last chunk says.
+static int request(const char *method, const char *path, const char *headers = "", std::string *body = NULL) {
+    int fd = send_request(method, path, headers);
+    if(fd < 0) return 0;
+
+    std::string response;
+    size_t end;
+    while((end = response.find("\r\n\r\n")) == std::string::npos) {
+        if(!receive(fd, &response, response.size() + 1)) {
+            close(fd);
+            return 0;
+        }
+    }
+    end += 4;
+    std::string header = response.substr(0, end);
+    std::string content;
+    size_t field = header.find("Content-Length: ");
+    if(field != std::string::npos) {
+        size_t length = strtoul(header.c_str() + field + 16, NULL, 10);
+        bool ok = receive(fd, &response, end + length);
+        content = response.substr(end, length);
+        if(!ok) end = 0;
+    }
+    else if(header.find("Transfer-Encoding: chunked") != std::string::npos) {
+        // Each chunk is its size in hex, CRLF, the data and CRLF. A zero size ends the body.
+        for(size_t at = end;;) {
+            size_t line;
+            while((line = response.find("\r\n", at)) == std::string::npos) {
+                if(!receive(fd, &response, response.size() + 1)) break;
+            }
+            if(line == std::string::npos) {
+                end = 0;
+                break;
+            }
+            size_t size = strtoul(response.c_str() + at, NULL, 16);
+            if(!receive(fd, &response, line + 2 + size + 2)) {
+                end = 0;
+                break;
+            }
+            if(size == 0) break;
+            content.append(response, line + 2, size);
+            at = line + 2 + size + 2;
+        }
+    }
+    close(fd);
+
+    int status = 0;
+    if(end == 0 || sscanf(header.c_str(), "HTTP/1.1 %d", &status) != 1) return 0;
+    if(body) *body = content;
+    return status;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_status_is_json() {
+    std::string body;
+    TEST_ASSERT_EQUAL_INT(200, request("GET", "/status", "", &body));
+    TEST_ASSERT_TRUE(body.size() > 2);
+    TEST_ASSERT_EQUAL_CHAR('{', body.front());
+    TEST_ASSERT_EQUAL_CHAR('}', body.back());
+}
+
+static void test_capture_is_a_jpeg() {
+    std::string body;
+    TEST_ASSERT_EQUAL_INT(200, request("GET", "/capture", "", &body));
+    TEST_ASSERT_TRUE(body.size() > 4);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, (uint8_t)body[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xD8, (uint8_t)body[1]);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, (uint8_t)body[body.size() - 2]);
+    TEST_ASSERT_EQUAL_HEX8(0xD9, (uint8_t)body[body.size() - 1]);
+}
+
+static void test_unknown_uri_is_404() {
+    TEST_ASSERT_EQUAL_INT(404, request("GET", "/nothing-here"));
+}
+
+static void test_control_sets_quality() {
+    std::string body;
+    TEST_ASSERT_EQUAL_INT(200, request("GET", "/control?var=quality&val=20"));
+    TEST_ASSERT_EQUAL_INT(200, request("GET", "/status", "", &body));
+    TEST_ASSERT_TRUE(body.find("\"quality\":20,") != std::string::npos);
+}
+
+static void test_batch_with_unknown_key_applies_nothing() {
+    std::string body;
+    TEST_ASSERT_EQUAL_INT(200, request("GET", "/control?var=quality&val=20"));
+    TEST_ASSERT_EQUAL_INT(400, request("GET", "/batch?quality=30&no_such_control=1"));
+    TEST_ASSERT_EQUAL_INT(200, request("GET", "/status", "", &body));
+    TEST_ASSERT_TRUE(body.find("\"quality\":20,") != std::string::npos);
+
+    TEST_ASSERT_EQUAL_INT(200, request("GET", "/batch?quality=30"));
+    TEST_ASSERT_EQUAL_INT(200, request("GET", "/status", "", &body));
+    TEST_ASSERT_TRUE(body.find("\"quality\":30,") != std::string::npos);
+}
+
+static void test_limits_changes_need_an_admin_post() {
+    std::string body;
+    TEST_ASSERT_EQUAL_INT(405, request("GET", "/limits?requests=5"));
+    TEST_ASSERT_EQUAL_INT(403, request("POST", "/limits?requests=5"));
+    TEST_ASSERT_EQUAL_INT(403, request("POST", "/limits?requests=5", "X-Admin-Key: wrong\r\n"));
+    TEST_ASSERT_EQUAL_INT(200, request("GET", "/limits", "", &body));
+    TEST_ASSERT_TRUE(body.find("\"requests_per_s\":0,") != std::string::npos);
+
+    TEST_ASSERT_EQUAL_INT(200, request("POST", "/limits?requests=5", "X-Admin-Key: " ADMIN_KEY "\r\n", &body));
+    TEST_ASSERT_TRUE(body.find("\"requests_per_s\":5,") != std::string::npos);
+    TEST_ASSERT_EQUAL_INT(200, request("POST", "/limits?requests=0", "X-Admin-Key: " ADMIN_KEY "\r\n"));
+}
+
+static void test_tune_changes_need_an_admin_post() {
+    TEST_ASSERT_EQUAL_INT(200, request("GET", "/tune"));
+    TEST_ASSERT_EQUAL_INT(405, request("GET", "/tune?sweep=8"));
+    TEST_ASSERT_EQUAL_INT(403, request("POST", "/tune?sweep=8"));
+    // More frame sizes than one sweep covers is refused before anything is scheduled.
+    TEST_ASSERT_EQUAL_INT(400, request("POST", "/tune?sweep=5,6,8", "X-Admin-Key: " ADMIN_KEY "\r\n"));
+}
+
+static void test_dropped_streams_leave_new_connections_alone() {
+    // Each stream is reset by the client mid-frame, and the status request that follows may get the
+    // same descriptor on the server. It must only ever see its own response.
+    for(int i = 0; i < 10; i++) {
+        int fd = send_request("GET", "/stream?dedup=0", "");
+        TEST_ASSERT_TRUE(fd >= 0);
+        std::string response;
+        TEST_ASSERT_TRUE(receive(fd, &response, 2000));
+        TEST_ASSERT_EQUAL_INT(0, response.find("HTTP/1.1 200"));
+        struct linger reset = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        close(fd);
+
+        std::string body;
+        TEST_ASSERT_EQUAL_INT(200, request("GET", "/status", "", &body));
+        TEST_ASSERT_EQUAL_CHAR('{', body.front());
+        TEST_ASSERT_EQUAL_CHAR('}', body.back());
+    }
+
+    // And every sender gives its slot back.
+    std::string body;
+    for(int i = 0; i < 50; i++) {
+        TEST_ASSERT_EQUAL_INT(200, request("GET", "/streams", "", &body));
+        if(body.find("\"active\":0,") != std::string::npos) break;
+        delay(100);
+    }
+    TEST_ASSERT_TRUE(body.find("\"active\":0,") != std::string::npos);
+}
+
+int main() {
+    // The same start-up as the simulator's, on a fixed port and a still scene.
+    signal(SIGPIPE, SIG_IGN);
+    sim_camera.setScene(SIM_SCENE_STATIC, 0);
+    SentryCamera sc;
+    sc.initCamera();
+    frame_broadcaster.start();
+    frame_broadcaster.setContinuous(true);
+    motion_detector.start();
+    clip_ring.begin(CLIP_RING_BYTES);
+    sim_httpd_port = TEST_PORT;
+    startCameraServer();
+    // Let the capture stage publish a first frame.
+    delay(500);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_status_is_json);
+    RUN_TEST(test_capture_is_a_jpeg);
+    RUN_TEST(test_unknown_uri_is_404);
+    RUN_TEST(test_control_sets_quality);
+    RUN_TEST(test_batch_with_unknown_key_applies_nothing);
+    RUN_TEST(test_limits_changes_need_an_admin_post);
+    RUN_TEST(test_tune_changes_need_an_admin_post);
+    RUN_TEST(test_dropped_streams_leave_new_connections_alone);
+    int failures = UNITY_END();
+
+    // Tasks are still running, so leave without destroying the globals they use.
+    fflush(stdout);
+    _exit(failures);
+}
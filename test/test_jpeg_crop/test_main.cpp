@@ -0,0 +1,233 @@
+// MCU-aligned crops and the DC-only luma image, checked by decoding the results and comparing them
+// with the same region of the decoded source.
+//
+//   pio test -e native -f test_jpeg_crop
+#include <unity.h>
+#include "JpegCrop.h"
+#include "SimJpeg.h"
+#include <stdio.h>
+#include <math.h>
+#include <jpeglib.h>
+#include <vector>
+
+const uint16_t TEST_WIDTH = 200;        // Not a whole number of 16 pixel MCUs.
+const uint16_t TEST_HEIGHT = 120;
+
+static std::vector<uint8_t> jpeg;
+static std::vector<uint8_t> decoded;    // The source JPEG decoded, RGB with red first.
+
+// Smooth enough to stay clear of clipping, busy enough that every block has AC terms.
+static std::vector<uint8_t> scene(uint16_t width, uint16_t height, uint8_t channels) {
+    std::vector<uint8_t> pixels((size_t)width * height * channels);
+    for(uint16_t y = 0; y < height; y++) {
+        for(uint16_t x = 0; x < width; x++) {
+            for(uint8_t c = 0; c < channels; c++) {
+                double v = 128 + 50 * sin(x / (4.0 + c)) + 40 * cos(y / (6.0 + c)) + ((x * 7 + y * 3) % 11);
+                pixels[((size_t)y * width + x) * channels + c] = (uint8_t)v;
+            }
+        }
+    }
+    return pixels;
+}
+
+static size_t append(void *arg, size_t index, const void *data, size_t len) {
+    std::vector<uint8_t> *out = (std::vector<uint8_t> *)arg;
+    out->insert(out->end(), (const uint8_t *)data, (const uint8_t *)data + len);
+    return len;
+}
+
+static std::vector<uint8_t> encode(uint16_t width, uint16_t height, bool gray) {
+    std::vector<uint8_t> pixels = scene(width, height, gray ? 1 : 3);
+    std::vector<uint8_t> out;
+    TEST_ASSERT_TRUE(sim_jpeg_encode(pixels.data(), width, height, gray, 80, append, &out));
+    return out;
+}
+
+// The camera never sets a restart interval, but other sources of a JPEG may.
+static std::vector<uint8_t> encode_with_restarts(uint16_t width, uint16_t height, uint16_t interval) {
+    std::vector<uint8_t> pixels = scene(width, height, 3);
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr err;
+    unsigned char *mem = NULL;
+    unsigned long len = 0;
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &mem, &len);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 80, TRUE);
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 1;
+    cinfo.restart_interval = interval;
+    jpeg_start_compress(&cinfo, TRUE);
+    while(cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = pixels.data() + (size_t)cinfo.next_scanline * width * 3;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    std::vector<uint8_t> out(mem, mem + len);
+    free(mem);
+    return out;
+}
+
+static std::vector<uint8_t> decode(const std::vector<uint8_t> &jpg, uint16_t *width, uint16_t *height) {
+    std::vector<uint8_t> rgb;
+    TEST_ASSERT_TRUE(sim_jpeg_decode(jpg.data(), jpg.size(), &rgb, width, height));
+    return rgb;
+}
+
+// Crops src to requested, decodes the result and compares it with the same region of the decoded source.
+// Chroma upsampling blends in the neighbouring column, so the two edge columns of a colour crop may differ.
+static void check_crop(const std::vector<uint8_t> &src, const JpegRect &requested, bool color, JpegRect *actual) {
+    uint16_t srcW, srcH;
+    std::vector<uint8_t> whole = decode(src, &srcW, &srcH);
+    JpegCrop cropper;
+    TEST_ASSERT_TRUE(cropper.parse(src.data(), src.size()));
+    std::vector<uint8_t> out(src.size() + JPEG_CROP_HEADROOM);
+    size_t len = cropper.crop(requested, out.data(), out.size(), actual);
+    TEST_ASSERT_GREATER_THAN(0, len);
+    out.resize(len);
+
+    uint16_t w, h;
+    std::vector<uint8_t> part = decode(out, &w, &h);
+    TEST_ASSERT_EQUAL_INT(actual->w, w);
+    TEST_ASSERT_EQUAL_INT(actual->h, h);
+    uint16_t edge = color ? 1 : 0;
+    for(uint16_t y = 0; y < h; y++) {
+        const uint8_t *got = part.data() + (size_t)y * w * 3;
+        const uint8_t *want = whole.data() + ((size_t)(actual->y + y) * srcW + actual->x) * 3;
+        for(uint16_t x = edge; x + edge < w; x++) {
+            if(got[x * 3] != want[x * 3] || got[x * 3 + 1] != want[x * 3 + 1] || got[x * 3 + 2] != want[x * 3 + 2]) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "pixel %u,%u of the crop", x, y);
+                TEST_FAIL_MESSAGE(msg);
+            }
+        }
+    }
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_parse_reads_geometry() {
+    JpegCrop cropper;
+    TEST_ASSERT_TRUE(cropper.parse(jpeg.data(), jpeg.size()));
+    TEST_ASSERT_EQUAL_INT(TEST_WIDTH, cropper.getWidth());
+    TEST_ASSERT_EQUAL_INT(TEST_HEIGHT, cropper.getHeight());
+    // The OV2640's 4:2:2.
+    TEST_ASSERT_EQUAL_INT(16, cropper.getMcuWidth());
+    TEST_ASSERT_EQUAL_INT(8, cropper.getMcuHeight());
+    TEST_ASSERT_EQUAL_INT(25, cropper.getDcWidth());
+    TEST_ASSERT_EQUAL_INT(15, cropper.getDcHeight());
+}
+
+static void test_request_rounds_out_to_whole_mcus() {
+    JpegRect requested = { 21, 13, 30, 10 };
+    JpegRect actual;
+    check_crop(jpeg, requested, true, &actual);
+    TEST_ASSERT_EQUAL_INT(16, actual.x);
+    TEST_ASSERT_EQUAL_INT(8, actual.y);
+    TEST_ASSERT_EQUAL_INT(48, actual.w);
+    TEST_ASSERT_EQUAL_INT(16, actual.h);
+}
+
+static void test_crop_at_the_image_edge_is_clipped() {
+    // The last MCU column is only 8 pixels wide.
+    JpegRect requested = { 180, 100, 500, 500 };
+    JpegRect actual;
+    check_crop(jpeg, requested, true, &actual);
+    TEST_ASSERT_EQUAL_INT(176, actual.x);
+    TEST_ASSERT_EQUAL_INT(96, actual.y);
+    TEST_ASSERT_EQUAL_INT(TEST_WIDTH - 176, actual.w);
+    TEST_ASSERT_EQUAL_INT(TEST_HEIGHT - 96, actual.h);
+}
+
+static void test_whole_image_crop_decodes_the_same() {
+    JpegRect requested = { 0, 0, TEST_WIDTH, TEST_HEIGHT };
+    JpegRect actual;
+    check_crop(jpeg, requested, true, &actual);
+    TEST_ASSERT_EQUAL_INT(TEST_WIDTH, actual.w);
+    TEST_ASSERT_EQUAL_INT(TEST_HEIGHT, actual.h);
+}
+
+static void test_grayscale_crop_is_exact() {
+    std::vector<uint8_t> gray = encode(100, 60, true);
+    JpegRect requested = { 10, 10, 33, 21 };
+    JpegRect actual;
+    check_crop(gray, requested, false, &actual);
+    TEST_ASSERT_EQUAL_INT(8, actual.x);
+    TEST_ASSERT_EQUAL_INT(40, actual.w);
+}
+
+static void test_restart_markers_are_followed() {
+    std::vector<uint8_t> src = encode_with_restarts(TEST_WIDTH, TEST_HEIGHT, 3);
+    JpegRect requested = { 40, 30, 70, 50 };
+    JpegRect actual;
+    check_crop(src, requested, true, &actual);
+}
+
+static void test_bad_requests_are_refused() {
+    JpegCrop cropper;
+    TEST_ASSERT_TRUE(cropper.parse(jpeg.data(), jpeg.size()));
+    std::vector<uint8_t> out(jpeg.size() + JPEG_CROP_HEADROOM);
+    JpegRect actual;
+    JpegRect outside = { TEST_WIDTH, 0, 16, 16 };
+    TEST_ASSERT_EQUAL_size_t(0, cropper.crop(outside, out.data(), out.size(), &actual));
+    JpegRect empty = { 0, 0, 0, 16 };
+    TEST_ASSERT_EQUAL_size_t(0, cropper.crop(empty, out.data(), out.size(), &actual));
+
+    // Too little room for the result.
+    JpegRect whole = { 0, 0, TEST_WIDTH, TEST_HEIGHT };
+    TEST_ASSERT_EQUAL_size_t(0, cropper.crop(whole, out.data(), 256, &actual));
+
+    // Not a JPEG, and a JPEG cut off before its scan.
+    std::vector<uint8_t> raw = scene(16, 16, 1);
+    TEST_ASSERT_FALSE(cropper.parse(raw.data(), raw.size()));
+    TEST_ASSERT_FALSE(cropper.parse(jpeg.data(), 100));
+}
+
+static void test_dc_luma_is_the_block_mean() {
+    std::vector<uint8_t> gray = encode(96, 64, true);
+    JpegCrop cropper;
+    TEST_ASSERT_TRUE(cropper.parse(gray.data(), gray.size()));
+    uint16_t dcW = cropper.getDcWidth();
+    uint16_t dcH = cropper.getDcHeight();
+    TEST_ASSERT_EQUAL_INT(12, dcW);
+    TEST_ASSERT_EQUAL_INT(8, dcH);
+    std::vector<uint8_t> luma(dcW * dcH);
+    TEST_ASSERT_TRUE(cropper.dcLuma(luma.data(), luma.size()));
+    TEST_ASSERT_FALSE(cropper.dcLuma(luma.data(), luma.size() - 1));
+
+    // The decoder rounds each pixel, so the mean of the decoded block may be off by a little.
+    uint16_t w, h;
+    std::vector<uint8_t> pixels = decode(gray, &w, &h);
+    for(uint16_t by = 0; by < dcH; by++) {
+        for(uint16_t bx = 0; bx < dcW; bx++) {
+            int sum = 0;
+            for(int y = 0; y < 8; y++) {
+                for(int x = 0; x < 8; x++) sum += pixels[((size_t)(by * 8 + y) * w + bx * 8 + x) * 3];
+            }
+            TEST_ASSERT_INT_WITHIN(2, (sum + 32) / 64, luma[by * dcW + bx]);
+        }
+    }
+}
+
+int main() {
+    jpeg = encode(TEST_WIDTH, TEST_HEIGHT, false);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_parse_reads_geometry);
+    RUN_TEST(test_request_rounds_out_to_whole_mcus);
+    RUN_TEST(test_crop_at_the_image_edge_is_clipped);
+    RUN_TEST(test_whole_image_crop_decodes_the_same);
+    RUN_TEST(test_grayscale_crop_is_exact);
+    RUN_TEST(test_restart_markers_are_followed);
+    RUN_TEST(test_bad_requests_are_refused);
+    RUN_TEST(test_dc_luma_is_the_block_mean);
+    return UNITY_END();
+}
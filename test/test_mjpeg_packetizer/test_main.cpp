@@ -0,0 +1,145 @@
+// MJPEG part framing and vectored writes, read back from the other end of a socket pair.
+//
+//   pio test -e native -f test_mjpeg_packetizer
+#include <unity.h>
+#include "MjpegPacketizer.h"
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int fds[2];
+
+// Everything the peer receives until want bytes have arrived or it closes.
+static std::string drain(int fd, size_t want) {
+    std::string got;
+    char buf[4096];
+    while(got.size() < want) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n <= 0) break;
+        got.append(buf, n);
+    }
+    return got;
+}
+
+static std::vector<uint8_t> payload(size_t len) {
+    std::vector<uint8_t> data(len);
+    for(size_t i = 0; i < len; i++) data[i] = (uint8_t)(i * 31 + 7);
+    return data;
+}
+
+// Splits one received part into its headers and the payload that follows them.
+static bool parse_part(const std::string &part, std::string *headers, std::string *body) {
+    size_t end = part.find("\r\n\r\n", 2);
+    if(end == std::string::npos) return false;
+    *headers = part.substr(0, end + 4);
+    *body = part.substr(end + 4);
+    return true;
+}
+
+void setUp() {
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+}
+
+void tearDown() {
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_part_carries_boundary_length_and_timestamp() {
+    MjpegPacketizer packetizer;
+    std::vector<uint8_t> data = payload(1234);
+    struct timeval timestamp = { 1700000000, 4321 };
+    TEST_ASSERT_EQUAL_INT(ESP_OK, packetizer.sendFrame(fds[0], data.data(), data.size(), timestamp));
+
+    std::string headers, body;
+    TEST_ASSERT_TRUE(parse_part(drain(fds[1], packetizer.getHeaderLength() + data.size()), &headers, &body));
+    TEST_ASSERT_EQUAL_size_t(packetizer.getHeaderLength(), headers.size());
+    TEST_ASSERT_EQUAL_INT(0, headers.find("\r\n--" MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\n"));
+
+    // Fields are padded to a fixed width with whitespace, which HTTP allows around header values.
+    size_t length = headers.find("Content-Length:");
+    TEST_ASSERT_TRUE(length != std::string::npos);
+    TEST_ASSERT_EQUAL_INT(1234, atoi(headers.c_str() + length + 15));
+    size_t stamp = headers.find("X-Timestamp:");
+    TEST_ASSERT_TRUE(stamp != std::string::npos);
+    TEST_ASSERT_TRUE(headers.find("1700000000.004321\r\n") != std::string::npos);
+
+    TEST_ASSERT_EQUAL_size_t(data.size(), body.size());
+    TEST_ASSERT_EQUAL_MEMORY(data.data(), body.data(), data.size());
+}
+
+static void test_header_length_is_fixed() {
+    MjpegPacketizer packetizer;
+    size_t len = packetizer.getHeaderLength();
+    std::vector<uint8_t> data = payload(200000);
+
+    size_t sizes[] = { 1, 99999, 200000 };
+    for(size_t size : sizes) {
+        struct timeval timestamp = { (time_t)size, (suseconds_t)size % 1000000 };
+        std::thread reader([&]() { drain(fds[1], len + size); });
+        TEST_ASSERT_EQUAL_INT(ESP_OK, packetizer.sendFrame(fds[0], data.data(), size, timestamp));
+        reader.join();
+        TEST_ASSERT_EQUAL_size_t(len, packetizer.getHeaderLength());
+    }
+}
+
+static void test_frame_leaves_in_one_write() {
+    MjpegPacketizer packetizer;
+    std::vector<uint8_t> data = payload(2000);
+    struct timeval timestamp = { 1, 2 };
+    TEST_ASSERT_EQUAL_INT(ESP_OK, packetizer.sendFrame(fds[0], data.data(), data.size(), timestamp));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, packetizer.sendFrame(fds[0], data.data(), data.size(), timestamp));
+    TEST_ASSERT_EQUAL_UINT32(2, packetizer.getWriteCount());
+}
+
+static void test_short_writes_resume_where_they_stopped() {
+    // As with httpd's send timeout on the board: when the reader stalls for longer than the timeout,
+    // writev returns what it managed so far and the rest has to follow in another write.
+    int small = 4096;
+    struct timeval timeout = { 0, 50000 };
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    MjpegPacketizer packetizer;
+    std::vector<uint8_t> data = payload(300000);
+    struct timeval timestamp = { 5, 6 };
+
+    std::string got;
+    std::thread reader([&]() {
+        got = drain(fds[1], data.size() / 2);
+        usleep(80000);
+        got += drain(fds[1], packetizer.getHeaderLength() + data.size() - got.size());
+    });
+    TEST_ASSERT_EQUAL_INT(ESP_OK, packetizer.sendFrame(fds[0], data.data(), data.size(), timestamp));
+    reader.join();
+
+    TEST_ASSERT_GREATER_THAN(1, packetizer.getWriteCount());
+    std::string headers, body;
+    TEST_ASSERT_TRUE(parse_part(got, &headers, &body));
+    TEST_ASSERT_EQUAL_size_t(data.size(), body.size());
+    TEST_ASSERT_EQUAL_MEMORY(data.data(), body.data(), data.size());
+}
+
+static void test_closed_peer_fails_the_send() {
+    MjpegPacketizer packetizer;
+    std::vector<uint8_t> data = payload(100);
+    struct timeval timestamp = { 0, 0 };
+    close(fds[1]);
+    fds[1] = socket(AF_UNIX, SOCK_STREAM, 0);
+    TEST_ASSERT_EQUAL_INT(ESP_FAIL, packetizer.sendFrame(fds[0], data.data(), data.size(), timestamp));
+}
+
+int main() {
+    // A write to the closed peer must fail, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_part_carries_boundary_length_and_timestamp);
+    RUN_TEST(test_header_length_is_fixed);
+    RUN_TEST(test_frame_leaves_in_one_write);
+    RUN_TEST(test_short_writes_resume_where_they_stopped);
+    RUN_TEST(test_closed_peer_fails_the_send);
+    return UNITY_END();
+}
@@ -0,0 +1,250 @@
+// The word-at-a-time SAD against its byte-at-a-time reference, the other grid kernels, and the
+// detector fed grayscale frames directly. Each detector test uses its own frame size, which resets
+// the background.
+//
+//   pio test -e native -f test_motion
+#include <unity.h>
+#include "MotionKernels.h"
+#include "MotionDetector.h"
+#include "FrameBroadcaster.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+static FramePool pool;
+static uint32_t noise_seed = 1;
+
+// Small deterministic pixel noise, as the sensor adds.
+static int noise() {
+    noise_seed = noise_seed * 1103515245 + 12345;
+    return (int)((noise_seed >> 16) % 5) - 2;
+}
+
+// A grey frame with sensor noise, and a square of side size at x, y that is brighter by lift.
+static FrameHandle frame_with_square(uint16_t width, uint16_t height, uint16_t x, uint16_t y, uint16_t size, uint8_t lift) {
+    static std::vector<uint8_t> pixels;
+    static uint32_t captured = 0;
+    pixels.resize((size_t)width * height);
+    for(uint16_t py = 0; py < height; py++) {
+        for(uint16_t px = 0; px < width; px++) {
+            int v = 90 + (px + py) % 40 + noise();
+            if(px >= x && px < x + size && py >= y && py < y + size) v += lift;
+            pixels[(size_t)py * width + px] = v;
+        }
+    }
+    camera_fb_t fb = {};
+    fb.buf = pixels.data();
+    fb.len = pixels.size();
+    fb.width = width;
+    fb.height = height;
+    fb.format = PIXFORMAT_GRAYSCALE;
+    fb.timestamp.tv_sec = ++captured;
+    return pool.ingest(&fb);
+}
+
+static FrameHandle quiet_frame(uint16_t width, uint16_t height) {
+    return frame_with_square(width, height, 0, 0, 0, 0);
+}
+
+// The newest event id and the active block count of the last frame, from the JSON state.
+static uint32_t last_id() {
+    char buf[4096];
+    motion_detector.printJson(buf, sizeof(buf), UINT32_MAX);
+    const char *field = strstr(buf, "\"last_id\":");
+    return field ? strtoul(field + 10, NULL, 10) : 0;
+}
+
+static unsigned active_blocks() {
+    char buf[4096];
+    motion_detector.printJson(buf, sizeof(buf), UINT32_MAX);
+    const char *field = strstr(buf, "\"active_blocks\":");
+    return field ? strtoul(field + 16, NULL, 10) : 0;
+}
+
+static void learn(uint16_t width, uint16_t height) {
+    for(int i = 0; i < MOTION_WARMUP_FRAMES + 4; i++) motion_detector.process(quiet_frame(width, height));
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_sad_matches_the_scalar_reference() {
+    // Widths around every word and fold boundary, unaligned starts, and the extremes that would
+    // borrow across lanes if the bias were wrong.
+    std::vector<uint8_t> a(4096), b(4096);
+    for(size_t i = 0; i < a.size(); i++) {
+        a[i] = rand();
+        b[i] = (i % 7 == 0) ? 0 : (i % 11 == 0) ? 255 : rand();
+    }
+    a[5] = 255;
+    b[5] = 0;
+    a[6] = 0;
+    b[6] = 255;
+
+    for(uint16_t w = 0; w <= 40; w++) {
+        for(uint8_t offset = 0; offset < 8; offset++) {
+            uint32_t expected = motion_sad_scalar(a.data() + offset, b.data() + offset, 41, w, 5);
+            TEST_ASSERT_EQUAL_UINT32(expected, motion_sad(a.data() + offset, b.data() + offset, 41, w, 5));
+        }
+    }
+    // Rows long enough that the 16-bit lanes are folded more than once.
+    TEST_ASSERT_EQUAL_UINT32(motion_sad_scalar(a.data() + 1, b.data() + 3, 1300, 1299, 3), motion_sad(a.data() + 1, b.data() + 3, 1300, 1299, 3));
+}
+
+static void test_sad_of_opposite_extremes() {
+    // Every lane at its largest difference, in both directions.
+    std::vector<uint8_t> a(64 * 64), b(64 * 64);
+    for(size_t i = 0; i < a.size(); i++) {
+        a[i] = (i % 2) ? 255 : 0;
+        b[i] = (i % 2) ? 0 : 255;
+    }
+    TEST_ASSERT_EQUAL_UINT32(64 * 64 * 255, motion_sad(a.data(), b.data(), 64, 64, 64));
+    TEST_ASSERT_EQUAL_UINT32(0, motion_sad(a.data(), a.data(), 64, 64, 64));
+}
+
+static void test_downscale_averages_each_cell() {
+    // 20x12 leaves part cells at the right and bottom.
+    const uint16_t width = 20;
+    const uint16_t height = 12;
+    uint8_t gray[width * height];
+    uint8_t yuv[width * height * 2];
+    for(int i = 0; i < width * height; i++) {
+        gray[i] = (i % width < 8) ? 10 : (i % width < 16) ? 100 : 200;
+        if(i / width >= 8) gray[i] += 30;
+        yuv[i * 2] = gray[i];
+        yuv[i * 2 + 1] = 128 + (i % 3);
+    }
+    uint8_t expected[] = { 10, 100, 200, 40, 130, 230 };
+    uint8_t cells[6];
+    motion_downscale(gray, width, 1, width, height, cells);
+    TEST_ASSERT_EQUAL_MEMORY(expected, cells, sizeof(cells));
+    // Chroma is skipped.
+    motion_downscale(yuv, width * 2, 2, width, height, cells);
+    TEST_ASSERT_EQUAL_MEMORY(expected, cells, sizeof(cells));
+}
+
+static void test_blend_moves_by_a_fraction_and_keeps_the_remainder() {
+    uint16_t acc[1] = { 100 << 8 };
+    uint8_t bg[1] = { 100 };
+    uint8_t cur[1] = { 108 };
+    motion_blend(acc, bg, cur, 1, 3);
+    TEST_ASSERT_EQUAL_UINT8(101, bg[0]);
+
+    // A difference of 1 would be lost to rounding in 8 bits, but the fixed point background creeps towards it.
+    uint8_t near[1] = { 102 };
+    for(int i = 0; i < 60; i++) motion_blend(acc, bg, near, 1, 3);
+    TEST_ASSERT_EQUAL_UINT8(101, bg[0]);
+    TEST_ASSERT_GREATER_THAN((101 << 8) + 240, acc[0]);
+}
+
+static void test_quiet_scene_raises_nothing() {
+    uint32_t before = last_id();
+    for(int i = 0; i < MOTION_WARMUP_FRAMES + 40; i++) motion_detector.process(quiet_frame(160, 120));
+    TEST_ASSERT_EQUAL_UINT32(before, last_id());
+    TEST_ASSERT_EQUAL_UINT(0, active_blocks());
+}
+
+static void test_moving_square_opens_and_closes_an_event() {
+    learn(176, 144);
+    uint32_t before = last_id();
+
+    // Cells 5 to 8 both ways, so blocks 1 and 2 both ways.
+    for(int i = 0; i < 3; i++) motion_detector.process(frame_with_square(176, 144, 40, 40, 32, 100));
+    TEST_ASSERT_EQUAL_UINT32(before + 1, last_id());
+    TEST_ASSERT_EQUAL_UINT(4, active_blocks());
+
+    MotionEvent event;
+    TEST_ASSERT_TRUE(motion_detector.getEvent(before + 1, &event));
+    TEST_ASSERT_TRUE(event.open);
+    TEST_ASSERT_EQUAL_INT(32, event.x);
+    TEST_ASSERT_EQUAL_INT(32, event.y);
+    TEST_ASSERT_EQUAL_INT(64, event.w);
+    TEST_ASSERT_EQUAL_INT(64, event.h);
+    TEST_ASSERT_EQUAL_INT(3, event.frames);
+    TEST_ASSERT_GREATER_THAN(MOTION_MIN_CHANGE, event.score);
+    TEST_ASSERT_EQUAL_INT(event.endSeq - 2, event.startSeq);
+
+    // Still open until it has been quiet for long enough.
+    for(int i = 0; i < MOTION_EVENT_HOLD - 1; i++) motion_detector.process(quiet_frame(176, 144));
+    TEST_ASSERT_TRUE(motion_detector.getEvent(before + 1, &event));
+    TEST_ASSERT_TRUE(event.open);
+    motion_detector.process(quiet_frame(176, 144));
+    TEST_ASSERT_TRUE(motion_detector.getEvent(before + 1, &event));
+    TEST_ASSERT_FALSE(event.open);
+    TEST_ASSERT_EQUAL_UINT32(before + 1, last_id());
+}
+
+static void test_event_box_grows_with_the_motion() {
+    learn(192, 144);
+    uint32_t before = last_id();
+    motion_detector.process(frame_with_square(192, 144, 0, 0, 40, 100));
+    motion_detector.process(frame_with_square(192, 144, 128, 96, 40, 100));
+
+    MotionEvent event;
+    TEST_ASSERT_TRUE(motion_detector.getEvent(before + 1, &event));
+    TEST_ASSERT_EQUAL_INT(0, event.x);
+    TEST_ASSERT_EQUAL_INT(0, event.y);
+    TEST_ASSERT_EQUAL_INT(192, event.w);
+    TEST_ASSERT_EQUAL_INT(144, event.h);
+    TEST_ASSERT_EQUAL_INT(2, event.frames);
+}
+
+static void test_one_block_is_not_motion() {
+    learn(208, 144);
+    uint32_t before = last_id();
+    // Only block 1,1 changes.
+    for(int i = 0; i < 5; i++) motion_detector.process(frame_with_square(208, 144, 40, 40, 16, 100));
+    TEST_ASSERT_EQUAL_UINT32(before, last_id());
+}
+
+static void test_nothing_is_reported_while_learning() {
+    uint32_t before = last_id();
+    motion_detector.process(quiet_frame(224, 144));
+    for(int i = 0; i < MOTION_WARMUP_FRAMES - 2; i++) motion_detector.process(frame_with_square(224, 144, 40, 40, 64, 100));
+    TEST_ASSERT_EQUAL_UINT32(before, last_id());
+}
+
+static void test_something_left_behind_becomes_scenery() {
+    learn(240, 144);
+    uint32_t before = last_id();
+    int frames = 0;
+    do {
+        motion_detector.process(frame_with_square(240, 144, 64, 64, 64, 100));
+        frames++;
+    } while(active_blocks() && frames < 200);
+
+    // Held out of the background while it might still be passing through, then taken in.
+    TEST_ASSERT_GREATER_THAN(MOTION_ABSORB_FRAMES, frames);
+    TEST_ASSERT_LESS_THAN(200, frames);
+    for(int i = 0; i < MOTION_EVENT_HOLD; i++) motion_detector.process(frame_with_square(240, 144, 64, 64, 64, 100));
+    MotionEvent event;
+    TEST_ASSERT_TRUE(motion_detector.getEvent(before + 1, &event));
+    TEST_ASSERT_FALSE(event.open);
+    TEST_ASSERT_EQUAL_UINT32(before + 1, last_id());
+}
+
+int main() {
+    pool.begin(4, FRAMESIZE_QVGA, PIXFORMAT_GRAYSCALE);
+    // The broadcaster only captures on demand and nothing asks, so the detector task stays idle
+    // and every frame it sees comes from these tests.
+    frame_broadcaster.start();
+    motion_detector.start();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_sad_matches_the_scalar_reference);
+    RUN_TEST(test_sad_of_opposite_extremes);
+    RUN_TEST(test_downscale_averages_each_cell);
+    RUN_TEST(test_blend_moves_by_a_fraction_and_keeps_the_remainder);
+    RUN_TEST(test_quiet_scene_raises_nothing);
+    RUN_TEST(test_moving_square_opens_and_closes_an_event);
+    RUN_TEST(test_event_box_grows_with_the_motion);
+    RUN_TEST(test_one_block_is_not_motion);
+    RUN_TEST(test_nothing_is_reported_while_learning);
+    RUN_TEST(test_something_left_behind_becomes_scenery);
+    int failures = UNITY_END();
+
+    // Tasks are still running, so leave without destroying the globals they use.
+    fflush(stdout);
+    _exit(failures);
+}
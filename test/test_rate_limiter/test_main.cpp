@@ -0,0 +1,279 @@
+// Per-client request and byte buckets, the byte budget untrusted clients share, the carry that keeps
+// slow callers from being shortchanged, trusted addresses and admins, and which slot makes way for a
+// new client. Each test starts from an empty policy in NVS.
+//
+//   pio test -e native -f test_rate_limiter
+#include <unity.h>
+#include "RateLimiter.h"
+#include <Preferences.h>
+#include "lwip/sockets.h"
+#include <unistd.h>
+
+// An IPv4 address in network order, as rate_peer_address gives it.
+static uint32_t ip(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    return htonl((uint32_t)a << 24 | (uint32_t)b << 16 | (uint32_t)c << 8 | d);
+}
+
+static void policy(RateLimiter &limiter, uint16_t requestsPerS, uint32_t kbPerS, uint32_t sharedKbPerS) {
+    TEST_ASSERT_TRUE(limiter.setRequestRate(requestsPerS));
+    TEST_ASSERT_TRUE(limiter.setByteRate(kbPerS));
+    TEST_ASSERT_TRUE(limiter.setSharedByteRate(sharedKbPerS));
+}
+
+static bool admit(RateLimiter &limiter, uint32_t addr) {
+    uint32_t retryMs;
+    return limiter.admit(addr, &retryMs);
+}
+
+void setUp() {
+    Preferences prefs;
+    prefs.begin(RATE_NAMESPACE, false);
+    prefs.clear();
+    prefs.end();
+}
+
+void tearDown() {}
+
+static void test_everything_is_admitted_without_a_policy() {
+    RateLimiter limiter;
+    uint32_t retryMs = 1;
+    // Not started yet.
+    TEST_ASSERT_TRUE(limiter.admit(ip(192, 168, 1, 20), &retryMs));
+    TEST_ASSERT_EQUAL_UINT32(0, retryMs);
+    TEST_ASSERT_EQUAL_UINT32(0, limiter.charge(ip(192, 168, 1, 20), 1000000));
+
+    TEST_ASSERT_TRUE(limiter.begin());
+    for(int i = 0; i < 100; i++) TEST_ASSERT_TRUE(admit(limiter, ip(192, 168, 1, 20)));
+    TEST_ASSERT_EQUAL_UINT32(0, limiter.charge(ip(192, 168, 1, 20), 1000000));
+
+    // Nor is a socket whose peer is unknown held to a policy.
+    policy(limiter, 1, 1, 1);
+    for(int i = 0; i < 10; i++) TEST_ASSERT_TRUE(admit(limiter, 0));
+    TEST_ASSERT_EQUAL_UINT32(0, limiter.charge(0, 1000000));
+}
+
+static void test_requests_burst_then_follow_the_rate() {
+    RateLimiter limiter;
+    TEST_ASSERT_TRUE(limiter.begin());
+    policy(limiter, 5, 0, 0);
+    uint32_t client = ip(192, 168, 1, 20);
+
+    // Two seconds' worth saved up, then one every 200 ms.
+    for(int i = 0; i < 5 * RATE_REQUEST_BURST_S; i++) TEST_ASSERT_TRUE(admit(limiter, client));
+    uint32_t retryMs = 0;
+    TEST_ASSERT_FALSE(limiter.admit(client, &retryMs));
+    TEST_ASSERT_UINT32_WITHIN(10, 195, retryMs);
+
+    // Other clients have buckets of their own.
+    TEST_ASSERT_TRUE(admit(limiter, ip(192, 168, 1, 21)));
+
+    delay(retryMs + 10);
+    TEST_ASSERT_TRUE(admit(limiter, client));
+    TEST_ASSERT_FALSE(admit(limiter, client));
+}
+
+static void test_slow_callers_are_not_shortchanged() {
+    RateLimiter limiter;
+    TEST_ASSERT_TRUE(limiter.begin());
+    policy(limiter, 1, 0, 0);
+    uint32_t client = ip(192, 168, 1, 20);
+    for(int i = 0; i < RATE_REQUEST_BURST_S; i++) TEST_ASSERT_TRUE(admit(limiter, client));
+
+    // At one request a second, a caller every half a millisecond earns half a thousandth of a token
+    // each time. Only the carry adds those up to a whole one.
+    int admitted = 0;
+    int64_t start = esp_timer_get_time();
+    while(esp_timer_get_time() - start < 1500000) {
+        if(admit(limiter, client)) admitted++;
+        usleep(500);
+    }
+    TEST_ASSERT_EQUAL_INT(1, admitted);
+}
+
+static void test_byte_debt_holds_off_the_client() {
+    RateLimiter limiter;
+    TEST_ASSERT_TRUE(limiter.begin());
+    policy(limiter, 0, 100, 0);
+    uint32_t client = ip(192, 168, 1, 20);
+
+    // Half a second of bytes up front, then a frame sent on credit is paid off at 100 kB/s.
+    TEST_ASSERT_EQUAL_UINT32(0, limiter.charge(client, 100 * 1024 * RATE_BYTE_BURST_MS / 1000));
+    uint32_t wait = limiter.charge(client, 10 * 1024);
+    TEST_ASSERT_UINT32_WITHIN(5, 96, wait);
+    uint32_t retryMs = 0;
+    TEST_ASSERT_FALSE(limiter.admit(client, &retryMs));
+    TEST_ASSERT_LESS_OR_EQUAL(wait, retryMs);
+    TEST_ASSERT_GREATER_THAN(wait / 2, retryMs);
+    TEST_ASSERT_EQUAL_UINT32(0, limiter.charge(ip(192, 168, 1, 21), 1024));
+
+    delay(retryMs + 10);
+    TEST_ASSERT_TRUE(admit(limiter, client));
+}
+
+static void test_shared_budget_binds_untrusted_clients_together() {
+    RateLimiter limiter;
+    TEST_ASSERT_TRUE(limiter.begin());
+    policy(limiter, 0, 0, 100);
+    uint32_t nvr = ip(10, 0, 0, 9);
+    TEST_ASSERT_TRUE(limiter.trust(nvr));
+
+    // Neither viewer is over a budget of its own, but together they are over the shared one.
+    TEST_ASSERT_EQUAL_UINT32(0, limiter.charge(ip(192, 168, 1, 20), 30000));
+    uint32_t wait = limiter.charge(ip(192, 168, 1, 21), 30000);
+    TEST_ASSERT_UINT32_WITHIN(5, 86, wait);
+    uint32_t retryMs = 0;
+    TEST_ASSERT_FALSE(limiter.admit(ip(192, 168, 1, 22), &retryMs));
+    TEST_ASSERT_GREATER_THAN(0, retryMs);
+
+    // The trusted NVR takes what the viewers leave, and is not charged to them.
+    for(int i = 0; i < 10; i++) TEST_ASSERT_TRUE(admit(limiter, nvr));
+    TEST_ASSERT_EQUAL_UINT32(0, limiter.charge(nvr, 1000000));
+    delay(wait + 10);
+    TEST_ASSERT_TRUE(admit(limiter, ip(192, 168, 1, 22)));
+}
+
+static void test_trusted_addresses_skip_every_bucket() {
+    RateLimiter limiter;
+    TEST_ASSERT_TRUE(limiter.begin());
+    policy(limiter, 1, 1, 1);
+    uint32_t nvr = ip(10, 0, 0, 9);
+    TEST_ASSERT_TRUE(limiter.trust(nvr));
+    TEST_ASSERT_TRUE(limiter.isTrusted(nvr));
+    for(int i = 0; i < 50; i++) TEST_ASSERT_TRUE(admit(limiter, nvr));
+    TEST_ASSERT_EQUAL_UINT32(0, limiter.charge(nvr, 1000000));
+
+    // Trusting an address twice takes one place, and there are only so many.
+    TEST_ASSERT_TRUE(limiter.trust(nvr));
+    for(int i = 1; i < RATE_MAX_TRUSTED; i++) TEST_ASSERT_TRUE(limiter.trust(ip(10, 0, 0, 10 + i)));
+    TEST_ASSERT_FALSE(limiter.trust(ip(10, 0, 0, 20)));
+    TEST_ASSERT_FALSE(limiter.isTrusted(ip(10, 0, 0, 20)));
+    TEST_ASSERT_FALSE(limiter.trust(0));
+
+    // Once untrusted, it starts from a full bucket like anyone else.
+    TEST_ASSERT_TRUE(limiter.untrust(nvr));
+    TEST_ASSERT_FALSE(limiter.isTrusted(nvr));
+    for(int i = 0; i < RATE_REQUEST_BURST_S; i++) TEST_ASSERT_TRUE(admit(limiter, nvr));
+    TEST_ASSERT_FALSE(admit(limiter, nvr));
+    TEST_ASSERT_TRUE(limiter.trust(ip(10, 0, 0, 20)));
+}
+
+static void test_nobody_is_limited_until_a_policy_is_set() {
+    RateLimiter limiter;
+    uint32_t nvr = ip(10, 0, 0, 9);
+    uint32_t viewer = ip(192, 168, 1, 20);
+    TEST_ASSERT_FALSE(limiter.isLimited(viewer));
+    TEST_ASSERT_TRUE(limiter.begin());
+    TEST_ASSERT_FALSE(limiter.isLimited(viewer));
+
+    // A budget of any kind, or a trusted list, marks out everyone else.
+    TEST_ASSERT_TRUE(limiter.setSharedByteRate(100));
+    TEST_ASSERT_TRUE(limiter.isLimited(viewer));
+    TEST_ASSERT_TRUE(limiter.setSharedByteRate(0));
+    TEST_ASSERT_FALSE(limiter.isLimited(viewer));
+    TEST_ASSERT_TRUE(limiter.trust(nvr));
+    TEST_ASSERT_TRUE(limiter.isLimited(viewer));
+    TEST_ASSERT_FALSE(limiter.isLimited(nvr));
+    TEST_ASSERT_FALSE(limiter.isLimited(0));
+}
+
+static void test_admins_are_trusted_or_know_the_key() {
+    RateLimiter limiter;
+    TEST_ASSERT_TRUE(limiter.begin());
+    uint32_t nvr = ip(10, 0, 0, 9);
+    uint32_t viewer = ip(192, 168, 1, 20);
+    TEST_ASSERT_TRUE(limiter.trust(nvr));
+
+    TEST_ASSERT_TRUE(limiter.isAdmin(nvr, NULL));
+    TEST_ASSERT_TRUE(limiter.isAdmin(viewer, "sim"));
+    TEST_ASSERT_FALSE(limiter.isAdmin(viewer, "Sim"));
+    TEST_ASSERT_FALSE(limiter.isAdmin(viewer, "si"));
+    TEST_ASSERT_FALSE(limiter.isAdmin(viewer, "simulator"));
+    TEST_ASSERT_FALSE(limiter.isAdmin(viewer, ""));
+    TEST_ASSERT_FALSE(limiter.isAdmin(viewer, NULL));
+}
+
+static void test_idle_client_makes_way_unless_streaming() {
+    RateLimiter limiter;
+    TEST_ASSERT_TRUE(limiter.begin());
+    policy(limiter, 1, 0, 0);
+
+    // The first client has used its bucket and keeps a stream open, so it is never forgotten,
+    // though it has been idle longest.
+    for(int c = 1; c <= RATE_MAX_CLIENTS; c++) {
+        for(int i = 0; i < RATE_REQUEST_BURST_S; i++) TEST_ASSERT_TRUE(admit(limiter, ip(192, 168, 1, c)));
+        TEST_ASSERT_FALSE(admit(limiter, ip(192, 168, 1, c)));
+        if(c == 1) limiter.streamOpened(ip(192, 168, 1, c));
+        delay(2);
+    }
+    TEST_ASSERT_TRUE(admit(limiter, ip(192, 168, 1, 100)));
+    TEST_ASSERT_FALSE(admit(limiter, ip(192, 168, 1, 1)));
+
+    // The second one made way, so it comes back with a full bucket, and the third makes way for it.
+    // The most recent is still remembered.
+    TEST_ASSERT_TRUE(admit(limiter, ip(192, 168, 1, 2)));
+    TEST_ASSERT_FALSE(admit(limiter, ip(192, 168, 1, RATE_MAX_CLIENTS)));
+    TEST_ASSERT_TRUE(admit(limiter, ip(192, 168, 1, 3)));
+    limiter.streamClosed(ip(192, 168, 1, 1));
+}
+
+static void test_every_slot_streaming_admits_the_rest() {
+    RateLimiter limiter;
+    TEST_ASSERT_TRUE(limiter.begin());
+    policy(limiter, 1, 1, 0);
+    for(int c = 1; c <= RATE_MAX_CLIENTS; c++) limiter.streamOpened(ip(192, 168, 1, c));
+
+    // Nowhere to keep another client's buckets, so it is not held to them.
+    for(int i = 0; i < 10; i++) TEST_ASSERT_TRUE(admit(limiter, ip(192, 168, 2, 1)));
+    TEST_ASSERT_EQUAL_UINT32(0, limiter.charge(ip(192, 168, 2, 1), 1000000));
+
+    // A closed stream frees its slot.
+    limiter.streamClosed(ip(192, 168, 1, 5));
+    TEST_ASSERT_TRUE(admit(limiter, ip(192, 168, 2, 1)));
+    TEST_ASSERT_TRUE(admit(limiter, ip(192, 168, 2, 1)));
+    TEST_ASSERT_FALSE(admit(limiter, ip(192, 168, 2, 1)));
+}
+
+static void test_policy_and_trusted_list_are_kept() {
+    uint32_t nvr = ip(10, 0, 0, 9);
+    {
+        RateLimiter limiter;
+        TEST_ASSERT_TRUE(limiter.begin());
+        policy(limiter, 10, 768, 1024);
+        TEST_ASSERT_TRUE(limiter.trust(nvr));
+    }
+
+    // As after a reboot.
+    RateLimiter limiter;
+    TEST_ASSERT_TRUE(limiter.begin());
+    TEST_ASSERT_TRUE(limiter.isTrusted(nvr));
+    uint32_t viewer = ip(192, 168, 1, 20);
+    TEST_ASSERT_TRUE(admit(limiter, viewer));
+    limiter.charge(viewer, 1234);
+    limiter.throttled(viewer, 40);
+
+    char json[2048];
+    limiter.printJson(json, sizeof(json));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"requests_per_s\":10,\"bytes_per_s\":786432,\"shared_bytes_per_s\":1048576"));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"trusted\":[\"10.0.0.9\"]"));
+    TEST_ASSERT_NOT_NULL(strstr(json, "{\"addr\":\"192.168.1.20\",\"trusted\":false,\"streams\":0,\"requests\":1,\"rejected\":0,\"bytes\":1234,\"throttled_ms\":40,\"idle_s\":0}"));
+
+    // Cut short, it is still terminated.
+    TEST_ASSERT_EQUAL_size_t(31, limiter.printJson(json, 32));
+    TEST_ASSERT_EQUAL_size_t(31, strlen(json));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_everything_is_admitted_without_a_policy);
+    RUN_TEST(test_requests_burst_then_follow_the_rate);
+    RUN_TEST(test_slow_callers_are_not_shortchanged);
+    RUN_TEST(test_byte_debt_holds_off_the_client);
+    RUN_TEST(test_shared_budget_binds_untrusted_clients_together);
+    RUN_TEST(test_trusted_addresses_skip_every_bucket);
+    RUN_TEST(test_nobody_is_limited_until_a_policy_is_set);
+    RUN_TEST(test_admins_are_trusted_or_know_the_key);
+    RUN_TEST(test_idle_client_makes_way_unless_streaming);
+    RUN_TEST(test_every_slot_streaming_admits_the_rest);
+    RUN_TEST(test_policy_and_trusted_list_are_kept);
+    return UNITY_END();
+}
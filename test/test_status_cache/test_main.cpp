@@ -0,0 +1,194 @@
+// The bounded JSON writer, and the cached /status document that only reads sensor registers after a
+// change. Register reads are counted by wrapping the simulated sensor's get_reg.
+//
+//   pio test -e native -f test_status_cache
+#include <unity.h>
+#include "esp_camera.h"
+#include "JsonWriter.h"
+#include "SentryCamera.h"
+#include "FrameBroadcaster.h"
+#include "MotionDetector.h"
+#include "ClipRing.h"
+#include "SimCamera.h"
+#include "Sim.h"
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+
+const uint16_t TEST_PORT = 18933;
+
+// From app_httpd.cpp.
+void startCameraServer();
+
+static int (*sim_get_reg)(sensor_t *s, int reg, int mask) = NULL;
+static std::atomic<uint32_t> register_reads{0};
+
+static int counting_get_reg(sensor_t *s, int reg, int mask) {
+    register_reads++;
+    return sim_get_reg(s, reg, mask);
+}
+
+// Reads from fd until the response holds what is wanted, the peer closes or the read times out.
+static bool receive(int fd, std::string *response, size_t want) {
+    char buf[4096];
+    while(response->size() < want) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n <= 0) return false;
+        response->append(buf, n);
+    }
+    return true;
+}
+
+// One GET on its own connection. Returns the status code, or 0 if the exchange failed.
+static int get(const char *path, std::string *body = NULL) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return 0;
+    struct timeval timeout = { 5, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TEST_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    char head[256];
+    int len = snprintf(head, sizeof(head), "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", path);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || send(fd, head, len, 0) != len) {
+        close(fd);
+        return 0;
+    }
+
+    std::string response;
+    size_t end;
+    while((end = response.find("\r\n\r\n")) == std::string::npos) {
+        if(!receive(fd, &response, response.size() + 1)) {
+            close(fd);
+            return 0;
+        }
+    }
+    size_t field = response.find("Content-Length: ");
+    size_t length = (field < end) ? strtoul(response.c_str() + field + 16, NULL, 10) : 0;
+    bool ok = field < end && receive(fd, &response, end + 4 + length);
+    close(fd);
+
+    int status = 0;
+    if(!ok || sscanf(response.c_str(), "HTTP/1.1 %d", &status) != 1) return 0;
+    if(body) *body = response.substr(end + 4, length);
+    return status;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_writer_separates_members() {
+    char buf[128];
+    JsonWriter json(buf, sizeof(buf));
+    json.beginObject();
+    json.addInt("a", -5);
+    json.addUInt("b", 4000000000u);
+    json.addString("c", "x");
+    json.addRegister(0xd3, 7);
+    json.endObject();
+    TEST_ASSERT_FALSE(json.overflowed());
+    TEST_ASSERT_EQUAL_STRING("{\"a\":-5,\"b\":4000000000,\"c\":\"x\",\"0xd3\":7}", json.c_str());
+    TEST_ASSERT_EQUAL_size_t(strlen(buf), json.length());
+}
+
+static void test_writer_stops_on_a_complete_member() {
+    // Room for the first member and part of the second, followed by a guard byte.
+    char buf[16 + 1];
+    buf[16] = 0x5A;
+    JsonWriter json(buf, 16);
+    json.beginObject();
+    json.addInt("first", 1);
+    json.addInt("second", 2);
+    json.addInt("x", 3);
+    json.endObject();
+    TEST_ASSERT_TRUE(json.overflowed());
+    TEST_ASSERT_EQUAL_STRING("{\"first\":1", json.c_str());
+    TEST_ASSERT_EQUAL_size_t(10, json.length());
+    TEST_ASSERT_EQUAL_HEX8(0x5A, (uint8_t)buf[16]);
+}
+
+static void test_writer_fills_exactly() {
+    // "{"a":1}" is 7 bytes and the terminator makes 8.
+    char buf[8];
+    JsonWriter json(buf, sizeof(buf));
+    json.beginObject();
+    json.addInt("a", 1);
+    json.endObject();
+    TEST_ASSERT_FALSE(json.overflowed());
+    TEST_ASSERT_EQUAL_STRING("{\"a\":1}", json.c_str());
+}
+
+static void test_repeated_status_reads_no_registers() {
+    std::string first, again;
+    TEST_ASSERT_EQUAL_INT(200, get("/status", &first));
+    register_reads = 0;
+    for(int i = 0; i < 5; i++) {
+        TEST_ASSERT_EQUAL_INT(200, get("/status", &again));
+        TEST_ASSERT_TRUE(again == first);
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, register_reads.load());
+}
+
+static void test_setter_rebuilds_status() {
+    std::string body;
+    TEST_ASSERT_EQUAL_INT(200, get("/status"));
+    register_reads = 0;
+    TEST_ASSERT_EQUAL_INT(200, get("/control?var=brightness&val=1"));
+    TEST_ASSERT_EQUAL_INT(200, get("/status", &body));
+    TEST_ASSERT_GREATER_THAN(0, register_reads.load());
+    TEST_ASSERT_TRUE(body.find("\"brightness\":1,") != std::string::npos);
+
+    TEST_ASSERT_EQUAL_INT(200, get("/control?var=brightness&val=-1"));
+    TEST_ASSERT_EQUAL_INT(200, get("/status", &body));
+    TEST_ASSERT_TRUE(body.find("\"brightness\":-1,") != std::string::npos);
+}
+
+static void test_register_write_shows_up() {
+    std::string body;
+    TEST_ASSERT_EQUAL_INT(200, get("/status"));
+    // Register 0xd3, full mask, value 5.
+    TEST_ASSERT_EQUAL_INT(200, get("/reg?reg=211&mask=255&val=5"));
+    TEST_ASSERT_EQUAL_INT(200, get("/status", &body));
+    TEST_ASSERT_TRUE(body.find("\"0xd3\":5,") != std::string::npos);
+}
+
+static void test_refresh_reads_registers_again() {
+    TEST_ASSERT_EQUAL_INT(200, get("/status"));
+    register_reads = 0;
+    TEST_ASSERT_EQUAL_INT(200, get("/status?refresh=1"));
+    TEST_ASSERT_GREATER_THAN(0, register_reads.load());
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    sim_camera.setScene(SIM_SCENE_STATIC, 0);
+    SentryCamera sc;
+    sc.initCamera();
+    sensor_t *s = esp_camera_sensor_get();
+    sim_get_reg = s->get_reg;
+    s->get_reg = counting_get_reg;
+    frame_broadcaster.start();
+    motion_detector.start();
+    clip_ring.begin(CLIP_RING_BYTES);
+    sim_httpd_port = TEST_PORT;
+    startCameraServer();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_writer_separates_members);
+    RUN_TEST(test_writer_stops_on_a_complete_member);
+    RUN_TEST(test_writer_fills_exactly);
+    RUN_TEST(test_repeated_status_reads_no_registers);
+    RUN_TEST(test_setter_rebuilds_status);
+    RUN_TEST(test_register_write_shows_up);
+    RUN_TEST(test_refresh_reads_registers_again);
+    int failures = UNITY_END();
+
+    // Tasks are still running, so leave without destroying the globals they use.
+    fflush(stdout);
+    _exit(failures);
+}
@@ -0,0 +1,164 @@
+// Stream dedup replayed over synthetic 10 fps traces: what a stream holds back of a still scene,
+// that drift is still sent once it adds up, and that every frame with something moving goes out.
+// The keep-alive is timed in trace time, not in how long the replay takes.
+//
+//   pio test -e native -f test_stream_dedup
+#include <unity.h>
+#include "StreamSender.h"
+#include "FrameSignature.h"
+#include "SimJpeg.h"
+#include <stdlib.h>
+#include <vector>
+
+const uint16_t TEST_WIDTH = 320;
+const uint16_t TEST_HEIGHT = 240;
+const int64_t TEST_FRAME_US = 100000;   // 10 fps.
+const int TEST_FRAMES = 300;            // 30 s of trace.
+
+static FramePool pool;
+
+struct _replay {
+    uint32_t sent;                      // Frames sent in full.
+    uint64_t bytes;                     // Bytes every frame would have taken.
+    uint64_t saved;                     // Bytes held back.
+    std::vector<int> sentFrames;        // Trace index of each frame sent.
+};
+typedef struct _replay Replay;
+
+// The trace's frame i as a q80 JPEG, where pixel (x, y) is scene(i, x, y) plus sensor noise of a few levels.
+template<typename Scene>
+static FrameHandle trace_frame(int i, Scene scene) {
+    static std::vector<uint8_t> pixels((size_t)TEST_WIDTH * TEST_HEIGHT);
+    static std::vector<uint8_t> jpg;
+    for(uint16_t y = 0; y < TEST_HEIGHT; y++) {
+        for(uint16_t x = 0; x < TEST_WIDTH; x++) pixels[(size_t)y * TEST_WIDTH + x] = constrain(scene(i, x, y) + rand() % 9 - 4, 0, 255);
+    }
+    jpg.clear();
+    TEST_ASSERT_TRUE(sim_jpeg_encode(pixels.data(), TEST_WIDTH, TEST_HEIGHT, true, 80,
+        [](void *arg, size_t index, const void *data, size_t len) {
+            jpg.insert(jpg.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+            return len;
+        }, NULL));
+    camera_fb_t fb = {};
+    fb.buf = jpg.data();
+    fb.len = jpg.size();
+    fb.width = TEST_WIDTH;
+    fb.height = TEST_HEIGHT;
+    fb.format = PIXFORMAT_JPEG;
+    fb.timestamp.tv_sec = i / 10;
+    fb.timestamp.tv_usec = (i % 10) * TEST_FRAME_US;
+    return pool.ingest(&fb);
+}
+
+// Feed the trace through one stream's dedup the way the MJPEG sender does.
+template<typename Scene>
+static Replay replay(Scene scene) {
+    srand(5);
+    StreamSender sender = {};
+    sender.dedup = true;
+    StreamSenderTable table;
+    Replay result = {};
+    int64_t lastFull = 0;
+    for(int i = 0; i < TEST_FRAMES; i++) {
+        FrameHandle frame = trace_frame(i, scene);
+        result.bytes += frame.len();
+        // The keep-alive is measured from lastFullUs, so put the last full frame as far back as it is in the trace.
+        if(sender.framesSent) sender.lastFullUs = esp_timer_get_time() - (i * TEST_FRAME_US - lastFull);
+        if(table.isUnchanged(&sender, frame)) {
+            table.recordUnchanged(&sender, frame);
+            continue;
+        }
+        table.recordFrame(&sender, frame.seq(), frame.len(), esp_timer_get_time(), frame.timestamp(), 1);
+        lastFull = i * TEST_FRAME_US;
+        result.sentFrames.push_back(i);
+    }
+    result.sent = sender.framesSent;
+    result.saved = sender.bytesSaved;
+    TEST_ASSERT_EQUAL_UINT64(result.bytes, (uint64_t)sender.bytesSent + sender.bytesSaved);
+    return result;
+}
+
+// A corridor: lit walls either side of a darker floor.
+static int corridor(uint16_t x, uint16_t y) {
+    return (x < 80 || x >= 240) ? 150 - y / 8 : 70 + y / 6;
+}
+
+// The longest run of frames between two sent, in frames.
+static int longest_gap(const Replay &r) {
+    int gap = 0;
+    for(size_t i = 1; i < r.sentFrames.size(); i++) gap = max(gap, r.sentFrames[i] - r.sentFrames[i - 1]);
+    return gap;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_still_scene_sends_only_keep_alives() {
+    Replay r = replay([](int i, uint16_t x, uint16_t y) { return corridor(x, y); });
+
+    // One frame every DEDUP_KEEPALIVE_US, so 15 in 30 s, and the first.
+    TEST_ASSERT_INT_WITHIN(1, TEST_FRAMES * TEST_FRAME_US / DEDUP_KEEPALIVE_US + 1, r.sent);
+    TEST_ASSERT_EQUAL_INT(DEDUP_KEEPALIVE_US / TEST_FRAME_US, longest_gap(r));
+    TEST_ASSERT_GREATER_THAN(r.bytes * 9 / 10, r.saved);
+}
+
+static void test_drift_within_the_tolerance_rides_on_the_keep_alives() {
+    // 4 levels over the whole trace never takes a cell past SIGNATURE_TOLERANCE from the last frame
+    // sent, so it saves as much as a still scene. The keep-alives carry it.
+    Replay still = replay([](int i, uint16_t x, uint16_t y) { return corridor(x, y); });
+    Replay drift = replay([](int i, uint16_t x, uint16_t y) { return corridor(x, y) + i * SIGNATURE_TOLERANCE / TEST_FRAMES; });
+    TEST_ASSERT_EQUAL_UINT32(still.sent, drift.sent);
+}
+
+static void test_faster_drift_gets_through_before_the_keep_alive() {
+    // Half a level a frame. Against the previous frame that would never look like a change, but against
+    // the last frame sent it does every ten frames or so, well before the keep-alive.
+    Replay still = replay([](int i, uint16_t x, uint16_t y) { return corridor(x, y); });
+    Replay drift = replay([](int i, uint16_t x, uint16_t y) { return corridor(x, y) / 2 + i / 2; });
+    TEST_ASSERT_GREATER_THAN(still.sent + 10, drift.sent);
+    TEST_ASSERT_LESS_THAN(2 * (SIGNATURE_TOLERANCE + 2), longest_gap(drift));
+    TEST_ASSERT_GREATER_THAN(drift.bytes / 2, drift.saved);
+}
+
+static void test_someone_walking_through_is_sent_in_full() {
+    // A 40x100 figure crosses the corridor between frames 100 and 180, 4 pixels a frame.
+    auto walking = [](int i, uint16_t x, uint16_t y) {
+        int left = (i - 100) * 4;
+        bool inView = i >= 100 && i < 180;
+        return (inView && x >= left && x < left + 40 && y >= 100 && y < 200) ? 220 : corridor(x, y);
+    };
+    Replay r = replay(walking);
+    for(int i = 100; i < 180; i++) {
+        bool sent = false;
+        for(int s : r.sentFrames) sent = sent || s == i;
+        TEST_ASSERT_TRUE_MESSAGE(sent, "a frame with the figure moving was held back");
+    }
+    // The empty corridor before and after is still held back.
+    TEST_ASSERT_LESS_THAN(100, r.sent);
+    TEST_ASSERT_GREATER_THAN(r.bytes / 2, r.saved);
+}
+
+static void test_dedup_off_sends_everything() {
+    srand(5);
+    StreamSender sender = {};
+    StreamSenderTable table;
+    for(int i = 0; i < 20; i++) {
+        FrameHandle frame = trace_frame(i, [](int i, uint16_t x, uint16_t y) { return corridor(x, y); });
+        TEST_ASSERT_FALSE(table.isUnchanged(&sender, frame));
+    }
+}
+
+int main() {
+    // Slots sized for VGA, so noisy QVGA JPEGs always fit.
+    pool.begin(4, FRAMESIZE_VGA, PIXFORMAT_JPEG);
+    frame_signatures.begin();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_still_scene_sends_only_keep_alives);
+    RUN_TEST(test_drift_within_the_tolerance_rides_on_the_keep_alives);
+    RUN_TEST(test_faster_drift_gets_through_before_the_keep_alive);
+    RUN_TEST(test_someone_walking_through_is_sent_in_full);
+    RUN_TEST(test_dedup_off_sends_everything);
+    return UNITY_END();
+}
@@ -0,0 +1,223 @@
+// Thumbnails of pooled frames: their size and content, hits and misses, least recently used
+// eviction, and entries held by a sender never being rebuilt under it.
+//
+//   pio test -e native -f test_thumbnail_cache
+#include <unity.h>
+#include "ThumbnailCache.h"
+#include "SimJpeg.h"
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+const uint16_t TEST_WIDTH = 320;
+const uint16_t TEST_HEIGHT = 240;
+
+static FramePool pool;
+static std::vector<uint8_t> scene;      // RGB with red first.
+static std::vector<uint8_t> jpeg;
+
+// A pooled copy of the test JPEG, with the next sequence number.
+static FrameHandle next_frame() {
+    camera_fb_t fb = {};
+    fb.buf = jpeg.data();
+    fb.len = jpeg.size();
+    fb.width = TEST_WIDTH;
+    fb.height = TEST_HEIGHT;
+    fb.format = PIXFORMAT_JPEG;
+    return pool.ingest(&fb);
+}
+
+// Takes the thumbnail and lets it go again, as a request does. Returns whether it was a hit.
+static bool fetch(ThumbnailCache &cache, const FrameHandle &frame, uint8_t scale, uint8_t quality) {
+    const Thumbnail *thumb = NULL;
+    bool hit = false;
+    TEST_ASSERT_TRUE(cache.acquire(frame, scale, quality, &thumb, &hit));
+    cache.release(thumb);
+    return hit;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_thumbnail_is_the_frame_scaled_down() {
+    ThumbnailCache cache;
+    TEST_ASSERT_TRUE(cache.begin());
+    FrameHandle frame = next_frame();
+
+    const uint8_t scales[] = { 2, 4, 8 };
+    for(uint8_t scale : scales) {
+        const Thumbnail *thumb = NULL;
+        bool hit = true;
+        TEST_ASSERT_TRUE(cache.acquire(frame, scale, 80, &thumb, &hit));
+        TEST_ASSERT_FALSE(hit);
+        TEST_ASSERT_EQUAL_UINT32(frame.seq(), thumb->seq);
+        TEST_ASSERT_EQUAL_INT(TEST_WIDTH / scale, thumb->width);
+        TEST_ASSERT_EQUAL_INT(TEST_HEIGHT / scale, thumb->height);
+
+        // Each thumbnail pixel is near the mean of the source block it stands for. The re-encode blurs the
+        // checkerboard edges more the smaller it gets, but a swapped channel would be off by far more.
+        std::vector<uint8_t> rgb;
+        uint16_t w, h;
+        TEST_ASSERT_TRUE(sim_jpeg_decode(thumb->buf, thumb->len, &rgb, &w, &h));
+        TEST_ASSERT_EQUAL_INT(thumb->width, w);
+        TEST_ASSERT_EQUAL_INT(thumb->height, h);
+        long error = 0;
+        for(uint16_t y = 0; y < h; y++) {
+            for(uint16_t x = 0; x < w; x++) {
+                for(int c = 0; c < 3; c++) {
+                    int sum = 0;
+                    for(int sy = 0; sy < scale; sy++) {
+                        for(int sx = 0; sx < scale; sx++) sum += scene[((size_t)(y * scale + sy) * TEST_WIDTH + x * scale + sx) * 3 + c];
+                    }
+                    error += abs(sum / (scale * scale) - rgb[((size_t)y * w + x) * 3 + c]);
+                }
+            }
+        }
+        TEST_ASSERT_LESS_THAN(12, error / ((long)w * h * 3));
+        cache.release(thumb);
+    }
+}
+
+static void test_second_request_is_a_hit() {
+    ThumbnailCache cache;
+    TEST_ASSERT_TRUE(cache.begin());
+    FrameHandle frame = next_frame();
+
+    TEST_ASSERT_FALSE(fetch(cache, frame, 4, 40));
+    TEST_ASSERT_TRUE(fetch(cache, frame, 4, 40));
+    TEST_ASSERT_TRUE(fetch(cache, frame, 4, 40));
+    TEST_ASSERT_EQUAL_UINT32(1, cache.getMissCount());
+    TEST_ASSERT_EQUAL_UINT32(2, cache.getHitCount());
+
+    // Scale, quality and frame are all part of the key.
+    TEST_ASSERT_FALSE(fetch(cache, frame, 8, 40));
+    TEST_ASSERT_FALSE(fetch(cache, frame, 4, 60));
+    FrameHandle later = next_frame();
+    TEST_ASSERT_FALSE(fetch(cache, later, 4, 40));
+    TEST_ASSERT_EQUAL_UINT32(4, cache.getMissCount());
+}
+
+static void test_least_recently_used_goes_first() {
+    ThumbnailCache cache;
+    TEST_ASSERT_TRUE(cache.begin());
+    FrameHandle frame = next_frame();
+
+    // Fill every entry with a different quality, then use the first again.
+    for(int i = 0; i < THUMB_CACHE_ENTRIES; i++) TEST_ASSERT_FALSE(fetch(cache, frame, 8, 10 + i));
+    TEST_ASSERT_TRUE(fetch(cache, frame, 8, 10));
+
+    // A new key takes the place of the second, which is now the oldest.
+    TEST_ASSERT_FALSE(fetch(cache, frame, 8, 90));
+    TEST_ASSERT_TRUE(fetch(cache, frame, 8, 10));
+    TEST_ASSERT_FALSE(fetch(cache, frame, 8, 11));
+    for(int i = 3; i < THUMB_CACHE_ENTRIES; i++) TEST_ASSERT_TRUE(fetch(cache, frame, 8, 10 + i));
+}
+
+static void test_held_entries_are_not_rebuilt() {
+    ThumbnailCache cache;
+    TEST_ASSERT_TRUE(cache.begin());
+    FrameHandle frame = next_frame();
+
+    const Thumbnail *held[THUMB_CACHE_ENTRIES];
+    bool hit;
+    for(int i = 0; i < THUMB_CACHE_ENTRIES; i++) TEST_ASSERT_TRUE(cache.acquire(frame, 8, 10 + i, &held[i], &hit));
+    uint8_t *first = (uint8_t *)malloc(held[0]->len);
+    size_t firstLen = held[0]->len;
+    memcpy(first, held[0]->buf, firstLen);
+
+    // Every entry is still being sent, so there is nowhere to build another.
+    const Thumbnail *thumb = NULL;
+    TEST_ASSERT_FALSE(cache.acquire(frame, 8, 90, &thumb, &hit));
+    TEST_ASSERT_EQUAL_size_t(firstLen, held[0]->len);
+    TEST_ASSERT_EQUAL_MEMORY(first, held[0]->buf, firstLen);
+
+    // Once one is released, that one is reused.
+    cache.release(held[2]);
+    TEST_ASSERT_TRUE(cache.acquire(frame, 8, 90, &thumb, &hit));
+    TEST_ASSERT_FALSE(hit);
+    TEST_ASSERT_EQUAL_PTR(held[2], thumb);
+    cache.release(thumb);
+    for(int i = 0; i < THUMB_CACHE_ENTRIES; i++) {
+        if(i != 2) cache.release(held[i]);
+    }
+    free(first);
+}
+
+static void test_concurrent_misses_build_once() {
+    ThumbnailCache cache;
+    TEST_ASSERT_TRUE(cache.begin());
+    FrameHandle frame = next_frame();
+
+    const int readers = 4;
+    const Thumbnail *thumbs[readers];
+    bool ok[readers];
+    std::thread threads[readers];
+    for(int i = 0; i < readers; i++) {
+        threads[i] = std::thread([&, i]() {
+            bool hit;
+            ok[i] = cache.acquire(frame, 2, 40, &thumbs[i], &hit);
+        });
+    }
+    for(int i = 0; i < readers; i++) threads[i].join();
+
+    for(int i = 0; i < readers; i++) {
+        TEST_ASSERT_TRUE(ok[i]);
+        TEST_ASSERT_EQUAL_PTR(thumbs[0], thumbs[i]);
+        cache.release(thumbs[i]);
+    }
+    TEST_ASSERT_EQUAL_UINT32(1, cache.getMissCount());
+    TEST_ASSERT_EQUAL_UINT32(readers - 1, cache.getHitCount());
+}
+
+static void test_bad_requests_are_refused() {
+    ThumbnailCache cache;
+    const Thumbnail *thumb = NULL;
+    bool hit;
+    FrameHandle frame = next_frame();
+    // Not started yet.
+    TEST_ASSERT_FALSE(cache.acquire(frame, 4, 40, &thumb, &hit));
+
+    TEST_ASSERT_TRUE(cache.begin());
+    TEST_ASSERT_FALSE(cache.acquire(frame, 3, 40, &thumb, &hit));
+    TEST_ASSERT_FALSE(cache.acquire(FrameHandle(), 4, 40, &thumb, &hit));
+
+    FramePool raw;
+    TEST_ASSERT_TRUE(raw.begin(1, FRAMESIZE_QQVGA, PIXFORMAT_GRAYSCALE));
+    std::vector<uint8_t> gray(160 * 120, 128);
+    camera_fb_t fb = {};
+    fb.buf = gray.data();
+    fb.len = gray.size();
+    fb.width = 160;
+    fb.height = 120;
+    fb.format = PIXFORMAT_GRAYSCALE;
+    TEST_ASSERT_FALSE(cache.acquire(raw.ingest(&fb), 4, 40, &thumb, &hit));
+    TEST_ASSERT_EQUAL_UINT32(0, cache.getMissCount());
+}
+
+int main() {
+    scene.resize((size_t)TEST_WIDTH * TEST_HEIGHT * 3);
+    for(uint16_t y = 0; y < TEST_HEIGHT; y++) {
+        for(uint16_t x = 0; x < TEST_WIDTH; x++) {
+            uint8_t *p = &scene[((size_t)y * TEST_WIDTH + x) * 3];
+            p[0] = x * 255 / TEST_WIDTH;
+            p[1] = y * 255 / TEST_HEIGHT;
+            p[2] = ((x / 40 + y / 40) % 2) ? 200 : 60;
+        }
+    }
+    sim_jpeg_encode(scene.data(), TEST_WIDTH, TEST_HEIGHT, false, 90,
+        [](void *arg, size_t index, const void *data, size_t len) {
+            jpeg.insert(jpeg.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+            return len;
+        }, NULL);
+    pool.begin(4, FRAMESIZE_QVGA, PIXFORMAT_JPEG);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_thumbnail_is_the_frame_scaled_down);
+    RUN_TEST(test_second_request_is_a_hit);
+    RUN_TEST(test_least_recently_used_goes_first);
+    RUN_TEST(test_held_entries_are_not_rebuilt);
+    RUN_TEST(test_concurrent_misses_build_once);
+    RUN_TEST(test_bad_requests_are_refused);
+    return UNITY_END();
+}
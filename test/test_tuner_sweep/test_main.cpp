@@ -0,0 +1,279 @@
+// Frame buffer tuner: which result wins, how a sweep builds its second pass on the first, and
+// that the store read back from NVS is the one written, with anything damaged refused.
+//
+//   pio test -e native -f test_tuner_sweep
+#include <unity.h>
+#include "TunerSweep.h"
+#include <string.h>
+
+const uint8_t TEST_CIF = 6;
+const uint8_t TEST_VGA = 8;
+
+static TunerResult result(uint8_t frameSize, uint16_t fpsX10, uint16_t p50, uint16_t p95, uint32_t heapFree) {
+    TunerResult r = {};
+    r.config = { 2, false, true, 20 };
+    r.frameSize = frameSize;
+    r.valid = true;
+    r.frames = fpsX10 / 5;
+    r.fpsX10 = fpsX10;
+    r.latencyP50Ms = p50;
+    r.latencyP95Ms = p95;
+    r.heapFree = heapFree;
+    r.psramFree = 4000000;
+    return r;
+}
+
+// A camera where more buffers and a faster clock both help, PSRAM buffers lag, and DRAM ones
+// do not fit with four buffers. Records every configuration it was asked to run.
+struct _fake_camera {
+    TunerConfig runs[TUNER_MAX_RESULTS];
+    uint8_t frameSizes[TUNER_MAX_RESULTS];
+    size_t count;
+};
+typedef struct _fake_camera FakeCamera;
+
+static bool fake_measure(void *ctx, const TunerConfig &config, uint8_t frameSize, TunerResult *r) {
+    FakeCamera *camera = (FakeCamera *)ctx;
+    camera->runs[camera->count] = config;
+    camera->frameSizes[camera->count++] = frameSize;
+    if(!config.fbInPsram && config.fbCount == 4) return false;
+
+    r->frames = 40;
+    r->fpsX10 = config.fbCount * 50 + config.xclkMhz * 5 + (config.grabLatest ? 30 : 0);
+    r->latencyP50Ms = config.fbInPsram ? 30 : 20;
+    r->latencyP95Ms = r->latencyP50Ms + 10;
+    r->heapFree = config.fbInPsram ? 190000 : 120000;
+    return true;
+}
+
+static bool same_config(const TunerConfig &a, const TunerConfig &b) {
+    return a.fbCount == b.fbCount && a.grabLatest == b.grabLatest && a.fbInPsram == b.fbInPsram && a.xclkMhz == b.xclkMhz;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_percentile() {
+    uint16_t samples[] = { 50, 10, 40, 20, 30 };
+    TEST_ASSERT_EQUAL_UINT16(30, tuner_percentile(samples, 5, 50));
+    TEST_ASSERT_EQUAL_UINT16(10, tuner_percentile(samples, 5, 0));
+    TEST_ASSERT_EQUAL_UINT16(50, tuner_percentile(samples, 5, 100));
+    TEST_ASSERT_EQUAL_UINT16(0, tuner_percentile(samples, 0, 50));
+}
+
+static void test_most_fps_wins() {
+    TunerResult results[] = {
+        result(TEST_CIF, 200, 20, 30, 150000),
+        result(TEST_CIF, 250, 60, 90, 150000),
+        result(TEST_CIF, 220, 10, 10, 150000),
+    };
+    TEST_ASSERT_EQUAL_PTR(&results[1], tuner_best(results, 3, TEST_CIF));
+}
+
+static void test_latency_decides_within_the_fps_margin() {
+    // 4% faster is within TUNER_FPS_MARGIN, so the lower latency wins.
+    TunerResult results[] = {
+        result(TEST_CIF, 260, 40, 50, 150000),
+        result(TEST_CIF, 250, 25, 50, 150000),
+    };
+    TEST_ASSERT_EQUAL_PTR(&results[1], tuner_best(results, 2, TEST_CIF));
+
+    // Then p95, then heap.
+    TunerResult p95[] = {
+        result(TEST_CIF, 250, 25, 50, 150000),
+        result(TEST_CIF, 250, 25, 35, 150000),
+    };
+    TEST_ASSERT_EQUAL_PTR(&p95[1], tuner_best(p95, 2, TEST_CIF));
+    TunerResult heap[] = {
+        result(TEST_CIF, 250, 25, 35, 120000),
+        result(TEST_CIF, 250, 25, 35, 180000),
+    };
+    TEST_ASSERT_EQUAL_PTR(&heap[1], tuner_best(heap, 2, TEST_CIF));
+
+    // Beyond the margin fps wins even against much lower latency.
+    TunerResult faster[] = {
+        result(TEST_CIF, 280, 40, 50, 150000),
+        result(TEST_CIF, 250, 10, 20, 150000),
+    };
+    TEST_ASSERT_EQUAL_PTR(&faster[0], tuner_best(faster, 2, TEST_CIF));
+}
+
+static void test_unusable_results_never_win() {
+    TunerResult results[] = {
+        result(TEST_CIF, 400, 10, 10, TUNER_MIN_FREE_HEAP - 1),
+        result(TEST_VGA, 400, 10, 10, 150000),
+        result(TEST_CIF, 400, 10, 10, 150000),
+        result(TEST_CIF, 150, 30, 40, TUNER_MIN_FREE_HEAP),
+    };
+    results[2].valid = false;
+    TEST_ASSERT_EQUAL_PTR(&results[3], tuner_best(results, 4, TEST_CIF));
+    TEST_ASSERT_NULL(tuner_best(results, 3, TEST_CIF));
+    TEST_ASSERT_EQUAL_PTR(&results[1], tuner_best(results, 4, TEST_VGA));
+}
+
+static void test_sweep_builds_on_the_first_pass() {
+    static FakeCamera camera = {};
+    static TunerResult results[TUNER_MAX_RESULTS];
+    const uint8_t sizes[] = { TEST_CIF };
+    const TunerConfig start = { 3, true, true, 24 };
+    size_t n = tuner_sweep(sizes, 1, start, fake_measure, &camera, results, TUNER_MAX_RESULTS);
+    TEST_ASSERT_EQUAL(tuner_sweep_runs(1), n);
+    TEST_ASSERT_EQUAL(n, camera.count);
+
+    // The first pass tries every buffer count and grab mode at the starting location and clock.
+    for(size_t i = 0; i < 7; i++) {
+        TEST_ASSERT_TRUE(camera.runs[i].fbInPsram);
+        TEST_ASSERT_EQUAL_UINT8(24, camera.runs[i].xclkMhz);
+    }
+    // Its best, four buffers in latest mode, is what the second pass varies location and clock around.
+    for(size_t i = 7; i < n; i++) {
+        TEST_ASSERT_EQUAL_UINT8(4, camera.runs[i].fbCount);
+        TEST_ASSERT_TRUE(camera.runs[i].grabLatest);
+        // The first pass already ran PSRAM at 24 MHz.
+        TEST_ASSERT_FALSE(camera.runs[i].fbInPsram && camera.runs[i].xclkMhz == 24);
+    }
+
+    // DRAM with four buffers did not start. Those runs are kept, marked invalid.
+    size_t invalid = 0;
+    for(size_t i = 0; i < n; i++) {
+        TEST_ASSERT_EQUAL_UINT8(TEST_CIF, results[i].frameSize);
+        TEST_ASSERT_TRUE(same_config(camera.runs[i], results[i].config));
+        if(!results[i].valid) {
+            invalid++;
+            TEST_ASSERT_FALSE(results[i].config.fbInPsram);
+        }
+    }
+    TEST_ASSERT_EQUAL(4, invalid);
+
+    const TunerResult *best = tuner_best(results, n, TEST_CIF);
+    TEST_ASSERT_NOT_NULL(best);
+    TunerConfig expected = { 4, true, true, 24 };
+    TEST_ASSERT_TRUE(same_config(expected, best->config));
+}
+
+static void test_sweep_stops_at_the_results_it_has_room_for() {
+    static FakeCamera camera = {};
+    static TunerResult results[TUNER_MAX_RESULTS];
+    const uint8_t sizes[] = { TEST_CIF, TEST_VGA, 5 };
+    const TunerConfig start = { 1, false, true, 10 };
+    size_t n = tuner_sweep(sizes, 3, start, fake_measure, &camera, results, TUNER_MAX_RESULTS);
+    // No more than TUNER_MAX_SWEEP_SIZES frame sizes in one sweep.
+    TEST_ASSERT_EQUAL(tuner_sweep_runs(TUNER_MAX_SWEEP_SIZES), n);
+    TEST_ASSERT_EQUAL_UINT8(TEST_VGA, camera.frameSizes[n - 1]);
+
+    camera.count = 0;
+    n = tuner_sweep(sizes, 1, start, fake_measure, &camera, results, 5);
+    TEST_ASSERT_EQUAL(5, n);
+    TEST_ASSERT_EQUAL(5, camera.count);
+}
+
+static void test_store_round_trip() {
+    TunerStore store;
+    TunerResult cif = result(TEST_CIF, 365, 20, 21, 193616);
+    cif.config = { 4, true, false, 24 };
+    TunerResult vga = result(TEST_VGA, 205, 40, 68, 70736);
+    vga.psramFree = 3900000;
+    TEST_ASSERT_TRUE(store.set(cif));
+    TEST_ASSERT_TRUE(store.set(vga));
+
+    uint8_t blob[TUNER_STORE_BYTES];
+    size_t len = store.pack(blob, sizeof(blob));
+    TEST_ASSERT_EQUAL(store.packedSize(), len);
+    TEST_ASSERT_EQUAL(4 + 2 * TUNER_STORE_ENTRY_BYTES, len);
+
+    TunerStore reloaded;
+    TEST_ASSERT_TRUE(reloaded.unpack(blob, len));
+    TEST_ASSERT_EQUAL_UINT8(2, reloaded.getCount());
+    const TunerResult *r = reloaded.find(TEST_CIF);
+    TEST_ASSERT_NOT_NULL(r);
+    TEST_ASSERT_TRUE(r->valid);
+    TEST_ASSERT_TRUE(same_config(cif.config, r->config));
+    TEST_ASSERT_EQUAL_UINT16(cif.frames, r->frames);
+    TEST_ASSERT_EQUAL_UINT16(365, r->fpsX10);
+    TEST_ASSERT_EQUAL_UINT16(20, r->latencyP50Ms);
+    TEST_ASSERT_EQUAL_UINT16(21, r->latencyP95Ms);
+    TEST_ASSERT_EQUAL_UINT32(193616, r->heapFree);
+    TEST_ASSERT_EQUAL_UINT32(4000000, r->psramFree);
+    r = reloaded.find(TEST_VGA);
+    TEST_ASSERT_NOT_NULL(r);
+    TEST_ASSERT_TRUE(same_config(vga.config, r->config));
+    TEST_ASSERT_EQUAL_UINT32(70736, r->heapFree);
+    TEST_ASSERT_EQUAL_UINT32(3900000, r->psramFree);
+    TEST_ASSERT_NULL(reloaded.find(5));
+
+    // Too small a buffer packs nothing.
+    TEST_ASSERT_EQUAL(0, store.pack(blob, len - 1));
+}
+
+static void test_store_replaces_and_fills() {
+    TunerStore store;
+    TEST_ASSERT_TRUE(store.set(result(TEST_CIF, 200, 20, 20, 150000)));
+    TEST_ASSERT_TRUE(store.set(result(TEST_CIF, 300, 20, 20, 150000)));
+    TEST_ASSERT_EQUAL_UINT8(1, store.getCount());
+    TEST_ASSERT_EQUAL_UINT16(300, store.find(TEST_CIF)->fpsX10);
+
+    for(uint8_t s = 0; s < TUNER_MAX_FRAME_SIZES - 1; s++) TEST_ASSERT_TRUE(store.set(result(s, 100, 20, 20, 150000)));
+    TEST_ASSERT_FALSE(store.set(result(13, 100, 20, 20, 150000)));
+    // A frame size it already has can still be updated when full.
+    TEST_ASSERT_TRUE(store.set(result(TEST_CIF, 310, 20, 20, 150000)));
+
+    uint8_t blob[TUNER_STORE_BYTES];
+    TEST_ASSERT_EQUAL(TUNER_STORE_BYTES, store.pack(blob, sizeof(blob)));
+    store.clear();
+    TEST_ASSERT_EQUAL_UINT8(0, store.getCount());
+    TEST_ASSERT_NULL(store.at(0));
+}
+
+static void test_damaged_store_is_refused() {
+    TunerStore store;
+    store.set(result(TEST_CIF, 365, 20, 21, 193616));
+    store.set(result(TEST_VGA, 205, 40, 68, 70736));
+    uint8_t blob[TUNER_STORE_BYTES];
+    size_t len = store.pack(blob, sizeof(blob));
+
+    // Whatever was loaded before stays when a blob is refused.
+    TunerStore loaded;
+    loaded.set(result(5, 450, 20, 23, 132176));
+
+    // Any single flipped bit, in the entries or the checksum itself.
+    for(size_t i = 2; i < len; i++) {
+        for(uint8_t bit = 0; bit < 8; bit++) {
+            uint8_t damaged[TUNER_STORE_BYTES];
+            memcpy(damaged, blob, len);
+            damaged[i] ^= 1 << bit;
+            TEST_ASSERT_FALSE(loaded.unpack(damaged, len));
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT8(1, loaded.getCount());
+    TEST_ASSERT_EQUAL_UINT16(450, loaded.find(5)->fpsX10);
+
+    // Cut short, from another version, or claiming more entries than fit.
+    TEST_ASSERT_FALSE(loaded.unpack(blob, len - 1));
+    TEST_ASSERT_FALSE(loaded.unpack(blob, 3));
+    uint8_t other[TUNER_STORE_BYTES];
+    memcpy(other, blob, len);
+    other[0] = TUNER_STORE_VERSION + 1;
+    TEST_ASSERT_FALSE(loaded.unpack(other, len));
+    memcpy(other, blob, len);
+    other[1] = TUNER_MAX_FRAME_SIZES + 1;
+    TEST_ASSERT_FALSE(loaded.unpack(other, len));
+    TEST_ASSERT_EQUAL_UINT8(1, loaded.getCount());
+
+    TEST_ASSERT_TRUE(loaded.unpack(blob, len));
+    TEST_ASSERT_EQUAL_UINT8(2, loaded.getCount());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_percentile);
+    RUN_TEST(test_most_fps_wins);
+    RUN_TEST(test_latency_decides_within_the_fps_margin);
+    RUN_TEST(test_unusable_results_never_win);
+    RUN_TEST(test_sweep_builds_on_the_first_pass);
+    RUN_TEST(test_sweep_stops_at_the_results_it_has_room_for);
+    RUN_TEST(test_store_round_trip);
+    RUN_TEST(test_store_replaces_and_fills);
+    RUN_TEST(test_damaged_store_is_refused);
+    return UNITY_END();
+}